@@ -0,0 +1,258 @@
+// CdbDecodeTest.cpp : unit test of the driver's CDB decoding, off Windows.
+//
+// Checks CdbDecode.h against the layouts of SBC, written out here command
+// by command rather than taken from its table: the LBA and the transfer
+// length come from the right bytes, big-endian, at their widest, the FUA
+// and DPO bits are read where the command has them and only there, each
+// command is of the right class, and a CDB too short for its fields or of
+// a command without them decodes to none. Every operation code is tried.
+//
+// POSIX only, not part of the Visual Studio solution:
+//
+//   g++ -O2 -I Wdk -o cdbdecodetest CdbDecodeTest.cpp
+//
+//   cdbdecodetest              run the tests, exit status 1 if any fails
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "Wdk/driver.h"
+
+static ULONG Failures = 0;
+
+#define CHECK(e) \
+    do { if (!(e)) { printf("%s(%d): %s, opcode 0x%02x\n", __FILE__, __LINE__, #e, Opcode); Failures++; } } while (0)
+
+//
+// Where a command has its fields
+//
+enum SPEC_LAYOUT { NONE, CDB6, CDB10, CDB12, CDB16, CDB16_BYTE_13 };
+
+typedef struct _SPEC {
+    UCHAR       Opcode;
+    const char  *Name;
+    SPEC_LAYOUT Layout;
+    UCHAR       Class;
+    UCHAR       Flags;          // CDB_FLAG_* that byte 1 has, FUA in bit 3, DPO in bit 4
+} SPEC;
+
+static const SPEC Specs[] = {
+    { 0x08, "READ(6)",                  CDB6,           CDB_CLASS_READ,     0 },
+    { 0x0A, "WRITE(6)",                 CDB6,           CDB_CLASS_WRITE,    0 },
+    { 0x28, "READ(10)",                 CDB10,          CDB_CLASS_READ,     CDB_FLAG_FUA | CDB_FLAG_DPO },
+    { 0x2A, "WRITE(10)",                CDB10,          CDB_CLASS_WRITE,    CDB_FLAG_FUA | CDB_FLAG_DPO },
+    { 0x2E, "WRITE AND VERIFY(10)",     CDB10,          CDB_CLASS_WRITE,    CDB_FLAG_DPO },
+    { 0x2F, "VERIFY(10)",               CDB10,          CDB_CLASS_OTHER,    CDB_FLAG_DPO },
+    { 0x34, "PRE-FETCH(10)",            CDB10,          CDB_CLASS_OTHER,    0 },
+    { 0x35, "SYNCHRONIZE CACHE(10)",    CDB10,          CDB_CLASS_FLUSH,    0 },
+    { 0x41, "WRITE SAME(10)",           CDB10,          CDB_CLASS_WRITE,    0 },
+    { 0x88, "READ(16)",                 CDB16,          CDB_CLASS_READ,     CDB_FLAG_FUA | CDB_FLAG_DPO },
+    { 0x89, "COMPARE AND WRITE",        CDB16_BYTE_13,  CDB_CLASS_WRITE,    CDB_FLAG_FUA | CDB_FLAG_DPO },
+    { 0x8A, "WRITE(16)",                CDB16,          CDB_CLASS_WRITE,    CDB_FLAG_FUA | CDB_FLAG_DPO },
+    { 0x8E, "WRITE AND VERIFY(16)",     CDB16,          CDB_CLASS_WRITE,    CDB_FLAG_DPO },
+    { 0x8F, "VERIFY(16)",               CDB16,          CDB_CLASS_OTHER,    CDB_FLAG_DPO },
+    { 0x90, "PRE-FETCH(16)",            CDB16,          CDB_CLASS_OTHER,    0 },
+    { 0x91, "SYNCHRONIZE CACHE(16)",    CDB16,          CDB_CLASS_FLUSH,    0 },
+    { 0x93, "WRITE SAME(16)",           CDB16,          CDB_CLASS_WRITE,    0 },
+    { 0xA8, "READ(12)",                 CDB12,          CDB_CLASS_READ,     CDB_FLAG_FUA | CDB_FLAG_DPO },
+    { 0xAA, "WRITE(12)",                CDB12,          CDB_CLASS_WRITE,    CDB_FLAG_FUA | CDB_FLAG_DPO },
+    { 0xAE, "WRITE AND VERIFY(12)",     CDB12,          CDB_CLASS_WRITE,    CDB_FLAG_DPO },
+    { 0xAF, "VERIFY(12)",               CDB12,          CDB_CLASS_OTHER,    CDB_FLAG_DPO },
+};
+
+static const SPEC *FindSpec(UCHAR Opcode)
+{
+    for (size_t i = 0; i < sizeof(Specs) / sizeof(Specs[0]); i++)
+    {
+        if (Specs[i].Opcode == Opcode) {
+            return &Specs[i];
+        }
+    }
+    return NULL;
+}
+
+static UCHAR LayoutLength(SPEC_LAYOUT Layout)
+{
+    static const UCHAR lengths[] = { 0, 6, 10, 12, 16, 16 };
+    return lengths[Layout];
+}
+
+static void PutBe(PUCHAR Bytes, ULONG64 Value, ULONG Length)
+{
+    for (ULONG i = 0; i < Length; i++) {
+        Bytes[i] = (UCHAR)(Value >> (8 * (Length - 1 - i)));
+    }
+}
+
+//
+// A CDB of the command, with Lba and Blocks where SBC has them, and
+// every other byte set, so a field read from the wrong bytes shows
+//
+static void MakeCdb(PUCHAR Cdb, const SPEC *Spec, ULONG64 Lba, ULONG Blocks, UCHAR Byte1)
+{
+    memset(Cdb, 0xA5, 16);
+    Cdb[0] = Spec->Opcode;
+    Cdb[1] = Byte1;
+
+    switch (Spec->Layout) {
+    case CDB6:
+        Cdb[1] = (UCHAR)((Byte1 & 0xE0) | ((Lba >> 16) & 0x1F));
+        PutBe(Cdb + 2, Lba, 2);
+        Cdb[4] = (UCHAR)Blocks;
+        break;
+    case CDB10:
+        PutBe(Cdb + 2, Lba, 4);
+        PutBe(Cdb + 7, Blocks, 2);
+        break;
+    case CDB12:
+        PutBe(Cdb + 2, Lba, 4);
+        PutBe(Cdb + 6, Blocks, 4);
+        break;
+    case CDB16:
+        PutBe(Cdb + 2, Lba, 8);
+        PutBe(Cdb + 10, Blocks, 4);
+        break;
+    case CDB16_BYTE_13:
+        PutBe(Cdb + 2, Lba, 8);
+        Cdb[13] = (UCHAR)Blocks;
+        break;
+    default:
+        break;
+    }
+}
+
+//
+// LBAs and lengths at the ends of each field, and in between
+//
+static void TestFields(const SPEC *Spec)
+{
+    const UCHAR Opcode = Spec->Opcode;
+    static const ULONG64 lbas[] = { 0, 1, 0x1234, 0x1FFFFF, 0x12345678, 0xFFFFFFFF, 0x123456789ABCDEF0ULL, MAXULONG64 };
+    static const ULONG blocks[] = { 0, 1, 8, 0xFF, 0x100, 0xFFFF, 0x12345678, 0xFFFFFFFF };
+    ULONG64 lbaMask;
+    ULONG blocksMask;
+
+    switch (Spec->Layout) {
+    case CDB6:          lbaMask = 0x1FFFFF;     blocksMask = 0xFF;          break;
+    case CDB10:         lbaMask = 0xFFFFFFFF;   blocksMask = 0xFFFF;        break;
+    case CDB12:         lbaMask = 0xFFFFFFFF;   blocksMask = 0xFFFFFFFF;    break;
+    case CDB16_BYTE_13: lbaMask = MAXULONG64;   blocksMask = 0xFF;          break;
+    default:            lbaMask = MAXULONG64;   blocksMask = 0xFFFFFFFF;    break;
+    }
+
+    for (size_t l = 0; l < sizeof(lbas) / sizeof(lbas[0]); l++)
+    {
+        for (size_t b = 0; b < sizeof(blocks) / sizeof(blocks[0]); b++)
+        {
+            ULONG64 lba = lbas[l] & lbaMask;
+            ULONG length = blocks[b] & blocksMask;
+            UCHAR cdb[16];
+            CDB_FIELDS fields;
+
+            MakeCdb(cdb, Spec, lba, length, 0);
+
+            CHECK(CdbDecode(cdb, LayoutLength(Spec->Layout), &fields));
+            CHECK(fields.Lba == lba);
+            CHECK(fields.Blocks == (Spec->Layout == CDB6 && length == 0 ? 256 : length));
+            CHECK(fields.Opcode == Opcode);
+            CHECK(fields.Class == Spec->Class);
+            CHECK(fields.Reserved == 0);
+
+            // Longer CDBs than needed decode the same
+            CHECK(CdbDecode(cdb, 16, &fields) && fields.Lba == lba);
+        }
+    }
+}
+
+//
+// FUA and DPO, where the command has them
+//
+static void TestFlags(const SPEC *Spec)
+{
+    const UCHAR Opcode = Spec->Opcode;
+    static const UCHAR bytes1[] = { 0x00, 0x08, 0x10, 0x18, 0xE7 };
+    static const UCHAR flags[] = { 0, CDB_FLAG_FUA, CDB_FLAG_DPO, CDB_FLAG_FUA | CDB_FLAG_DPO, 0 };
+
+    for (size_t i = 0; i < sizeof(bytes1); i++)
+    {
+        UCHAR cdb[16];
+        CDB_FIELDS fields;
+
+        MakeCdb(cdb, Spec, 0x1000, 8, bytes1[i]);
+        CHECK(CdbDecode(cdb, LayoutLength(Spec->Layout), &fields));
+        CHECK(fields.Flags == (flags[i] & Spec->Flags));
+    }
+}
+
+//
+// Too short for its fields: none, the rest still decoded
+//
+static void TestShort(const SPEC *Spec)
+{
+    const UCHAR Opcode = Spec->Opcode;
+    UCHAR cdb[16];
+    CDB_FIELDS fields;
+
+    MakeCdb(cdb, Spec, 0x1000, 8, 0x18);
+
+    for (UCHAR length = 1; length < LayoutLength(Spec->Layout); length++)
+    {
+        CHECK(!CdbDecode(cdb, length, &fields));
+        CHECK(fields.Lba == 0 && fields.Blocks == 0 && fields.Flags == 0);
+        CHECK(fields.Opcode == Opcode && fields.Class == Spec->Class);
+    }
+}
+
+//
+// Commands without an LBA and length, and no CDB at all
+//
+static void TestOthers()
+{
+    UCHAR cdb[16];
+    CDB_FIELDS fields;
+
+    for (ULONG op = 0; op < 256; op++)
+    {
+        const UCHAR Opcode = (UCHAR)op;
+        const SPEC *spec = FindSpec(Opcode);
+
+        // The class, whether or not there is anything else
+        CHECK(CdbDecodeClass(Opcode) == (spec ? spec->Class : CDB_CLASS_OTHER));
+
+        if (spec != NULL) {
+            continue;
+        }
+
+        memset(cdb, 0xFF, sizeof(cdb));
+        cdb[0] = Opcode;
+
+        CHECK(!CdbDecode(cdb, sizeof(cdb), &fields));
+        CHECK(fields.Lba == 0 && fields.Blocks == 0 && fields.Flags == 0);
+        CHECK(fields.Opcode == Opcode && fields.Class == CDB_CLASS_OTHER);
+    }
+
+    {
+        const UCHAR Opcode = 0;
+
+        memset(&fields, 0xFF, sizeof(fields));
+        CHECK(!CdbDecode(cdb, 0, &fields));
+        CHECK(fields.Lba == 0 && fields.Blocks == 0 && fields.Opcode == 0 && fields.Flags == 0);
+    }
+}
+
+int main()
+{
+    for (size_t i = 0; i < sizeof(Specs) / sizeof(Specs[0]); i++)
+    {
+        TestFields(&Specs[i]);
+        TestFlags(&Specs[i]);
+        TestShort(&Specs[i]);
+    }
+
+    TestOthers();
+
+    printf("%zu commands, %s, %u failures\n", sizeof(Specs) / sizeof(Specs[0]), Failures ? "FAILED" : "passed", Failures);
+    return Failures ? 1 : 0;
+}
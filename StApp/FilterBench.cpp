@@ -0,0 +1,311 @@
+// FilterBench.cpp : cost of the capture filter on the completion path, off
+// Windows.
+//
+// Builds StorTrace's CaptureFilter.c as it is, on the kernel shim in Wdk,
+// and times what SaveCdbToRingBufEx does with a completed command before
+// it builds a record: match it against the device's filter, which decodes
+// the CDB once past the checks that do not need it and hands the fields
+// back for the record. Against how it was done before, the filter
+// decoding the CDB for itself and the record decoding it again
+// (OldCaptureFilterMatch, as it was).
+//
+// The commands are a mix of what a disk sees: reads and writes of 10 and
+// 16 byte CDBs over a large LBA range, cache flushes, a few commands with
+// no LBA, and a failed command now and then. Each filter is timed over
+// the same commands.
+//
+// POSIX only, not part of the Visual Studio solution:
+//
+//   g++ -O2 -I Wdk -o filterbench FilterBench.cpp -x c ../StorTrace/CaptureFilter.c
+//
+//   filterbench [-n Completions]
+//                              -n completions per filter (default 20000000)
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <vector>
+
+#include "Wdk/driver.h"
+
+extern "C" {
+#include "../StorTrace/CaptureFilter.h"
+}
+
+//
+// Commands cycled through, enough not to be learnt by the branch predictor
+//
+#define BENCH_COMMANDS      4096
+#define BENCH_LBA_SPACE     (1ULL << 31)
+
+typedef struct _BENCH_COMMAND {
+    UCHAR       Cdb[16];
+    UCHAR       CdbLength;
+    UCHAR       ScsiStatus;
+    NTSTATUS    NtStatus;
+} BENCH_COMMAND;
+
+static double Now()
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static void PutBe(PUCHAR Bytes, ULONG64 Value, ULONG Length)
+{
+    for (ULONG i = 0; i < Length; i++) {
+        Bytes[i] = (UCHAR)(Value >> (8 * (Length - 1 - i)));
+    }
+}
+
+static void MakeCommands(std::vector<BENCH_COMMAND> &Commands)
+{
+    srand(1);
+
+    for (size_t i = 0; i < Commands.size(); i++)
+    {
+        BENCH_COMMAND *command = &Commands[i];
+        ULONG kind = rand() % 100;
+        ULONG64 lba = ((ULONG64)rand() << 16 ^ rand()) % BENCH_LBA_SPACE;
+        ULONG blocks = 1 + rand() % 256;
+
+        memset(command, 0, sizeof(*command));
+
+        if (kind < 80)
+        {
+            // READ(10), WRITE(10)
+            command->Cdb[0] = kind < 45 ? 0x28 : 0x2A;
+            command->CdbLength = 10;
+            PutBe(command->Cdb + 2, lba, 4);
+            PutBe(command->Cdb + 7, blocks, 2);
+        }
+        else if (kind < 90)
+        {
+            // READ(16), WRITE(16)
+            command->Cdb[0] = kind < 85 ? 0x88 : 0x8A;
+            command->CdbLength = 16;
+            PutBe(command->Cdb + 2, lba, 8);
+            PutBe(command->Cdb + 10, blocks, 4);
+        }
+        else if (kind < 95)
+        {
+            // SYNCHRONIZE CACHE(10), all of it
+            command->Cdb[0] = 0x35;
+            command->CdbLength = 10;
+        }
+        else
+        {
+            // TEST UNIT READY, INQUIRY
+            command->Cdb[0] = kind < 98 ? 0x00 : 0x12;
+            command->CdbLength = 6;
+        }
+
+        if (rand() % 100 == 0)
+        {
+            command->NtStatus = (NTSTATUS)0xC000009CL;
+            command->ScsiStatus = 0x02;
+        }
+    }
+}
+
+//
+// CaptureFilterMatch before it handed the decoded fields back, a call away
+// as the one in CaptureFilter.c is
+//
+static __attribute__((noinline)) BOOLEAN
+OldCaptureFilterMatch(PCAPTURE_FILTER Filter, PUCHAR Cdb, UCHAR CdbLength, NTSTATUS NtStatus, UCHAR ScsiStatus)
+{
+    LONG flags = ReadAcquire(&Filter->Flags);
+    CDB_FIELDS fields;
+    ULONG64 lba;
+    ULONG blocks;
+
+    if (flags == 0) {
+        return TRUE;
+    }
+
+    if ((flags & STORTRACE_FILTER_ERRORS_ONLY) && NtStatus == 0 && ScsiStatus == 0) {
+        return FALSE;
+    }
+
+    if (flags & STORTRACE_FILTER_OPCODES) {
+        if (CdbLength == 0 || (Filter->Opcodes[Cdb[0] >> 3] & (1 << (Cdb[0] & 7))) == 0) {
+            return FALSE;
+        }
+    }
+
+    if ((flags & (STORTRACE_FILTER_LBA | STORTRACE_FILTER_BLOCKS)) == 0) {
+        return TRUE;
+    }
+
+    if (!CdbDecode(Cdb, CdbLength, &fields)) {
+        return FALSE;
+    }
+
+    lba = fields.Lba;
+    blocks = fields.Blocks;
+
+    if (flags & STORTRACE_FILTER_BLOCKS) {
+        if (blocks < Filter->MinBlocks || blocks > Filter->MaxBlocks) {
+            return FALSE;
+        }
+    }
+
+    if (flags & STORTRACE_FILTER_LBA) {
+        if (lba > Filter->LbaLast ||
+            (lba < Filter->LbaFirst && Filter->LbaFirst - lba >= (blocks ? blocks : 1))) {
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+//
+// What goes on into the record of a traced command, so neither way's
+// decoding can be left out by the compiler
+//
+static volatile ULONG64 Sink;
+
+static double TimeOld(PCAPTURE_FILTER Filter, std::vector<BENCH_COMMAND> &Commands, ULONG64 Completions, ULONG64 *Traced)
+{
+    double start = Now();
+    ULONG64 traced = 0;
+    ULONG64 sum = 0;
+
+    for (ULONG64 n = 0; n < Completions; n++)
+    {
+        BENCH_COMMAND *command = &Commands[n % BENCH_COMMANDS];
+        CDB_FIELDS fields;
+
+        if (!OldCaptureFilterMatch(Filter, command->Cdb, command->CdbLength, command->NtStatus, command->ScsiStatus)) {
+            continue;
+        }
+
+        sum += CdbDecode(command->Cdb, command->CdbLength, &fields) + fields.Lba + fields.Blocks;
+        traced++;
+    }
+
+    Sink = sum;
+    *Traced = traced;
+    return Now() - start;
+}
+
+static double TimeNew(PCAPTURE_FILTER Filter, std::vector<BENCH_COMMAND> &Commands, ULONG64 Completions, ULONG64 *Traced)
+{
+    double start = Now();
+    ULONG64 traced = 0;
+    ULONG64 sum = 0;
+
+    for (ULONG64 n = 0; n < Completions; n++)
+    {
+        BENCH_COMMAND *command = &Commands[n % BENCH_COMMANDS];
+        CDB_FIELDS fields;
+        BOOLEAN decoded;
+
+        if (!CaptureFilterMatch(Filter, command->Cdb, command->CdbLength, command->NtStatus, command->ScsiStatus,
+                &fields, &decoded)) {
+            continue;
+        }
+
+        sum += decoded + fields.Lba + fields.Blocks;
+        traced++;
+    }
+
+    Sink = sum;
+    *Traced = traced;
+    return Now() - start;
+}
+
+int main(int argc, char *argv[])
+{
+    ULONG64 completions = 20000000;
+    std::vector<BENCH_COMMAND> commands(BENCH_COMMANDS);
+    STORTRACE_CAPTURE_FILTER configs[5];
+    const char *names[5] = { "none", "writes", "lba", "lba+blocks", "errors" };
+    static const UCHAR writes[] = { 0x0A, 0x2A, 0x8A, 0xAA };
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            completions = strtoull(argv[++i], NULL, 0);
+        }
+        else
+        {
+            fprintf(stderr, "usage: %s [-n Completions]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (completions == 0)
+    {
+        fprintf(stderr, "usage: %s [-n Completions]\n", argv[0]);
+        return 1;
+    }
+
+    MakeCommands(commands);
+
+    memset(configs, 0, sizeof(configs));
+    for (int i = 0; i < 5; i++)
+    {
+        memset(configs[i].Opcodes, 0xFF, sizeof(configs[i].Opcodes));
+        configs[i].LbaLast = MAXULONG64;
+        configs[i].MaxBlocks = MAXULONG;
+    }
+
+    configs[1].Flags = STORTRACE_FILTER_OPCODES;
+    memset(configs[1].Opcodes, 0, sizeof(configs[1].Opcodes));
+    for (size_t i = 0; i < sizeof(writes); i++) {
+        configs[1].Opcodes[writes[i] >> 3] |= (UCHAR)(1 << (writes[i] & 7));
+    }
+
+    configs[2].Flags = STORTRACE_FILTER_LBA;
+    configs[2].LbaFirst = BENCH_LBA_SPACE / 4;
+    configs[2].LbaLast = BENCH_LBA_SPACE / 4 + BENCH_LBA_SPACE / 8;
+
+    configs[3].Flags = STORTRACE_FILTER_LBA | STORTRACE_FILTER_BLOCKS;
+    configs[3].LbaFirst = configs[2].LbaFirst;
+    configs[3].LbaLast = configs[2].LbaLast;
+    configs[3].MinBlocks = 8;
+    configs[3].MaxBlocks = 64;
+
+    configs[4].Flags = STORTRACE_FILTER_ERRORS_ONLY;
+
+    printf("%-10s %8s %12s %12s\n", "filter", "traced", "before", "now");
+
+    for (int i = 0; i < 5; i++)
+    {
+        CAPTURE_FILTER filter;
+        ULONG64 oldTraced;
+        ULONG64 newTraced;
+        double oldSeconds;
+        double newSeconds;
+
+        CaptureFilterInit(&filter);
+        if (!CaptureFilterSet(&filter, &configs[i]))
+        {
+            fprintf(stderr, "filter %s not valid\n", names[i]);
+            return 1;
+        }
+
+        oldSeconds = TimeOld(&filter, commands, completions, &oldTraced);
+        newSeconds = TimeNew(&filter, commands, completions, &newTraced);
+
+        if (oldTraced != newTraced)
+        {
+            fprintf(stderr, "filter %s: %llu traced before, %llu now\n", names[i],
+                (unsigned long long)oldTraced, (unsigned long long)newTraced);
+            return 1;
+        }
+
+        printf("%-10s %7.1f%% %9.2f ns %9.2f ns\n", names[i], 100.0 * newTraced / completions,
+            oldSeconds * 1e9 / completions, newSeconds * 1e9 / completions);
+    }
+
+    return 0;
+}
@@ -0,0 +1,260 @@
+// HistogramTest.cpp : accuracy of the latency histograms, off Windows.
+//
+// Checks Histogram.h over every latency a histogram can take, all of the
+// ULONG range: each falls in the bucket whose bounds hold it, the buckets
+// follow each other without a gap or an overlap from 0 to MAXULONG, and
+// the highest latency of its bucket, what HistogramPercentile reports, is
+// never more than 1/16 over it. Then percentiles of a few distributions
+// against the exact ones.
+//
+// Also builds StorTrace's LatencyStats.c as it is, on the kernel shim in
+// Wdk, and checks that snapshots of per-processor histograms return what
+// was added since the last one, summed over processors and devices.
+//
+// POSIX only, not part of the Visual Studio solution:
+//
+//   g++ -O2 -I Wdk -o histogramtest HistogramTest.cpp -x c ../StorTrace/LatencyStats.c
+//
+//   histogramtest              run the tests, exit status 1 if any fails;
+//                              going over the ULONG range takes some 30 s
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "Wdk/driver.h"
+
+extern "C" {
+#include "../StorTrace/LatencyStats.h"
+}
+
+static ULONG Failures = 0;
+
+#define CHECK(e) \
+    do { if (!(e)) { printf("%s(%d): %s\n", __FILE__, __LINE__, #e); Failures++; } } while (0)
+
+//
+// Failures of a check in a loop over billions of values: the first few
+// are printed, the rest only counted
+//
+#define CHECK_QUIET(e, v) \
+    do { if (!(e)) { if (Failures++ < 10) printf("%s(%d): %s, %u\n", __FILE__, __LINE__, #e, (ULONG)(v)); } } while (0)
+
+//
+// The buckets tile 0 to MAXULONG, in order
+//
+static void TestBuckets()
+{
+    CHECK(HistogramBucketLow(0) == 0);
+    CHECK(HistogramBucketHigh(HISTOGRAM_BUCKETS - 1) == MAXULONG);
+
+    for (ULONG b = 0; b < HISTOGRAM_BUCKETS; b++)
+    {
+        ULONG low = HistogramBucketLow(b);
+        ULONG high = HistogramBucketHigh(b);
+
+        CHECK_QUIET(low <= high, b);
+        CHECK_QUIET(HistogramBucket(low) == b, b);
+        CHECK_QUIET(HistogramBucket(high) == b, b);
+
+        if (b + 1 < HISTOGRAM_BUCKETS) {
+            CHECK_QUIET(HistogramBucketLow(b + 1) == high + 1, b);
+        }
+
+        // Of one value each, then never wider than 1/16 of the lowest
+        if (b < HISTOGRAM_SUB_BUCKETS) {
+            CHECK_QUIET(low == b && high == b, b);
+        }
+        else {
+            CHECK_QUIET(high - low + 1 <= low / HISTOGRAM_SUB_BUCKETS, b);
+        }
+    }
+}
+
+//
+// Every latency, and how far the bucket it is reported as is above it
+//
+static void TestAccuracy()
+{
+    double worst = 0;
+    ULONG worstValue = 0;
+    ULONG v = 0;
+
+    do
+    {
+        ULONG b = HistogramBucket(v);
+        ULONG high;
+
+        if (b >= HISTOGRAM_BUCKETS)
+        {
+            CHECK_QUIET(b < HISTOGRAM_BUCKETS, v);
+            continue;
+        }
+
+        high = HistogramBucketHigh(b);
+        CHECK_QUIET(HistogramBucketLow(b) <= v && v <= high, v);
+
+        if (v != 0 && (double)(high - v) / v > worst)
+        {
+            worst = (double)(high - v) / v;
+            worstValue = v;
+        }
+    } while (++v != 0);
+
+    printf("accuracy: worst %.4f%% over, at %u us\n", worst * 100, worstValue);
+    CHECK(worst <= 1.0 / HISTOGRAM_SUB_BUCKETS);
+}
+
+//
+// Percentiles of latencies against the exact ones: never under, and at
+// most 1/16 over
+//
+static void CheckPercentiles(const char *Name, std::vector<ULONG> &Latencies)
+{
+    static const ULONG ppm[] = { 1, 500000, 900000, 990000, 999000, 999900, 1000000 };
+    STORTRACE_HISTOGRAM histogram;
+
+    memset(&histogram, 0, sizeof(histogram));
+    for (size_t i = 0; i < Latencies.size(); i++)
+    {
+        histogram.Count++;
+        histogram.Sum += Latencies[i];
+        histogram.Buckets[HistogramBucket(Latencies[i])]++;
+    }
+
+    std::sort(Latencies.begin(), Latencies.end());
+
+    printf("%-12s", Name);
+    for (size_t p = 0; p < sizeof(ppm) / sizeof(ppm[0]); p++)
+    {
+        ULONG64 rank = (Latencies.size() * ppm[p] + 999999) / 1000000;
+        ULONG exact = Latencies[(rank ? rank : 1) - 1];
+        ULONG reported = HistogramPercentile(&histogram, ppm[p]);
+
+        CHECK(reported >= exact);
+        CHECK(reported - exact <= exact / HISTOGRAM_SUB_BUCKETS);
+        printf(" p%g %u/%u", ppm[p] / 10000.0, reported, exact);
+    }
+    printf("\n");
+}
+
+static void TestPercentiles()
+{
+    std::vector<ULONG> latencies;
+    STORTRACE_HISTOGRAM empty;
+
+    memset(&empty, 0, sizeof(empty));
+    CHECK(HistogramPercentile(&empty, 500000) == 0);
+
+    srand(7);
+
+    // Uniform from 0 to a few milliseconds
+    for (ULONG i = 0; i < 100000; i++) {
+        latencies.push_back(rand() % 5000);
+    }
+    CheckPercentiles("uniform", latencies);
+
+    // Mostly fast, a long tail out to seconds
+    latencies.clear();
+    for (ULONG i = 0; i < 100000; i++)
+    {
+        ULONG base = 50 + rand() % 200;
+        latencies.push_back(rand() % 1000 ? base : base * (1 + rand() % 20000));
+    }
+    CheckPercentiles("tail", latencies);
+
+    // Spread over the whole range, log-uniform
+    latencies.clear();
+    for (ULONG i = 0; i < 100000; i++) {
+        latencies.push_back((ULONG)((((ULONG64)rand() << 31) | rand()) >> (rand() % 63)) & MAXULONG);
+    }
+    CheckPercentiles("log-uniform", latencies);
+}
+
+//
+// Snapshots of LatencyStats.c: what was added since the last one, over
+// processors, added onto what the snapshot holds already
+//
+static void TestSnapshots()
+{
+    const ULONG64 frequency = 1000000000;
+    STORTRACE_LATENCY snapshot;
+    PLATENCY_STATS stats;
+    PLATENCY_STATS other;
+    ULONG64 now = 1000;
+
+    WdkShimProcessorCount = 4;
+    stats = LatencyStatsCreate(frequency);
+    other = LatencyStatsCreate(frequency);
+    CHECK(stats != NULL && other != NULL);
+    if (stats == NULL || other == NULL) {
+        return;
+    }
+
+    // 100 us reads on each processor, a 3 ms write on one
+    for (ULONG i = 0; i < 4; i++)
+    {
+        WdkShimProcessor = i;
+        LatencyStatsAdd(stats, 0x28, now, now + 100 * 1000);
+    }
+    LatencyStatsAdd(stats, 0x2A, now, now + 3000 * 1000);
+
+    memset(&snapshot, 0, sizeof(snapshot));
+    LatencyStatsSnapshot(stats, &snapshot, now + 2 * frequency);
+
+    CHECK(snapshot.Classes[STORTRACE_LATENCY_READ].Count == 4);
+    CHECK(snapshot.Classes[STORTRACE_LATENCY_READ].Sum == 400);
+    CHECK(snapshot.Classes[STORTRACE_LATENCY_READ].Buckets[HistogramBucket(100)] == 4);
+    CHECK(snapshot.Classes[STORTRACE_LATENCY_WRITE].Count == 1);
+    CHECK(HistogramPercentile(&snapshot.Classes[STORTRACE_LATENCY_WRITE], 500000) == HistogramBucketHigh(HistogramBucket(3000)));
+    CHECK(snapshot.Classes[STORTRACE_LATENCY_FLUSH].Count == 0);
+
+    // Only what came since
+    WdkShimProcessor = 2;
+    LatencyStatsAdd(stats, 0x35, now, now + 20 * 1000);
+    LatencyStatsAdd(other, 0x28, now, now + 100 * 1000);
+
+    memset(&snapshot, 0, sizeof(snapshot));
+    LatencyStatsSnapshot(stats, &snapshot, now + 3 * frequency);
+    CHECK(snapshot.Classes[STORTRACE_LATENCY_READ].Count == 0);
+    CHECK(snapshot.Classes[STORTRACE_LATENCY_READ].Buckets[HistogramBucket(100)] == 0);
+    CHECK(snapshot.Classes[STORTRACE_LATENCY_WRITE].Count == 0);
+    CHECK(snapshot.Classes[STORTRACE_LATENCY_FLUSH].Count == 1);
+    CHECK(snapshot.Classes[STORTRACE_LATENCY_FLUSH].Sum == 20);
+    CHECK(snapshot.Microseconds == 1000000);
+
+    // Onto another device's, as for STORTRACE_ALL_DEVICES
+    LatencyStatsSnapshot(other, &snapshot, now + 3 * frequency);
+    CHECK(snapshot.Classes[STORTRACE_LATENCY_READ].Count == 1);
+    CHECK(snapshot.Classes[STORTRACE_LATENCY_READ].Buckets[HistogramBucket(100)] == 1);
+    CHECK(snapshot.Classes[STORTRACE_LATENCY_FLUSH].Count == 1);
+
+    // Nothing since
+    memset(&snapshot, 0, sizeof(snapshot));
+    LatencyStatsSnapshot(stats, &snapshot, now + 4 * frequency);
+    for (ULONG c = 0; c < STORTRACE_LATENCY_CLASSES; c++)
+    {
+        CHECK(snapshot.Classes[c].Count == 0 && snapshot.Classes[c].Sum == 0);
+        for (ULONG b = 0; b < HISTOGRAM_BUCKETS; b++) {
+            CHECK_QUIET(snapshot.Classes[c].Buckets[b] == 0, b);
+        }
+    }
+
+    LatencyStatsDelete(stats);
+    LatencyStatsDelete(other);
+}
+
+int main()
+{
+    TestBuckets();
+    TestAccuracy();
+    TestPercentiles();
+    TestSnapshots();
+
+    printf("%s, %u failures\n", Failures ? "FAILED" : "passed", Failures);
+    return Failures ? 1 : 0;
+}
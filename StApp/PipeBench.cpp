@@ -0,0 +1,438 @@
+// PipeBench.cpp : throughput of StApp's printing, off Windows.
+//
+// Feeds a recorded trace file through the same code StApp prints with,
+// first on one thread the way StApp used to (read, parse, format, write a
+// block at a time), then through the TracePipeline. The output goes
+// nowhere, after an optional delay per write standing in for a slow
+// console. What matters is the drain rate, how fast the source is read:
+// with -l, as on the control device, it must not depend on the output.
+//
+// POSIX only (fopencookie), not part of the Visual Studio solution:
+//
+//   g++ -O2 -pthread -o pipebench PipeBench.cpp TracePipeline.cpp TraceFormat.cpp TraceSource.cpp
+//
+//   pipebench -g File Records      write a trace of Records synthetic records
+//   pipebench -t File              time formatting alone, against printf
+//   pipebench [-f N] [-d us] [-l] File
+//                                  -f N formatter threads (default: one per
+//                                  spare processor), -d us delay of each
+//                                  write, -l drop blocks rather than wait
+//
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "TracePipeline.h"
+
+//
+// Delay of each write to the output, microseconds
+//
+static ULONG WriteDelay = 0;
+
+//
+// Of the synthetic records
+//
+#define BENCH_FREQUENCY     10000000
+
+static double Now()
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static ssize_t SlowWrite(void *Cookie, const char *Buffer, size_t Length)
+{
+    (void)Cookie;
+    (void)Buffer;
+
+    if (WriteDelay) {
+        usleep(WriteDelay);
+    }
+    return (ssize_t)Length;
+}
+
+//
+// A console that takes WriteDelay for every write, and shows nothing
+//
+static FILE *OpenSlowOutput()
+{
+    cookie_io_functions_t functions = { NULL, SlowWrite, NULL, NULL };
+    FILE *output = fopencookie(NULL, "w", functions);
+
+    // Written a block at a time, as StApp's stdout
+    setvbuf(output, NULL, _IOFBF, TRACE_READ_SIZE);
+    return output;
+}
+
+//
+// The file source, noting when it ran dry: the end of the drain
+//
+class TimedTraceSource : public TraceSource
+{
+public:
+    TimedTraceSource(FILE *File) : End(0), Source(File) {}
+
+    const UCHAR *Next(ULONG *Length)
+    {
+        const UCHAR *block = Source.Next(Length);
+
+        if (block == NULL && End == 0) {
+            End = Now();
+        }
+        return block;
+    }
+
+    double End;
+
+private:
+    FileTraceSource Source;
+};
+
+//
+// Records of two disks, mostly READ(10) and WRITE(10), one in a hundred
+// failing with sense data, one in a thousand lost
+//
+static int Generate(const char *Path, ULONG64 Records)
+{
+    ULONG64 buffer[TRACE_RECORD_MAX_SIZE / sizeof(ULONG64)];
+    PTRACE_RECORD_HEADER record = (PTRACE_RECORD_HEADER)buffer;
+    ULONG64 sequence[2] = { 0, 0 };
+    FILE *file = fopen(Path, "wb");
+
+    if (file == NULL)
+    {
+        perror(Path);
+        return 1;
+    }
+
+    srand(1);
+
+    for (ULONG64 i = 0; i < Records; i++)
+    {
+        ULONG device = rand() % 2;
+        BOOL failed = rand() % 100 == 0;
+        UCHAR senseLength = failed ? 18 : 0;
+        PUCHAR cdb = TRACE_RECORD_CDB(record);
+        PUCHAR sense;
+        ULONG64 lba = (ULONG64)rand() * 8;
+        ULONG blocks = 8 << (rand() % 5);
+
+        memset(buffer, 0, sizeof(buffer));
+
+        sequence[device] += rand() % 1000 == 0 ? 2 : 1;
+
+        record->Magic = TRACE_RECORD_MAGIC;
+        record->Version = TRACE_RECORD_VERSION;
+        record->Length = (ULONG)TRACE_RECORD_SIZE(10, senseLength);
+        record->Timestamp = i * 100 + 1000;
+        record->IssueTimestamp = record->Timestamp - 500 - rand() % 5000;
+        record->Latency = record->Timestamp - record->IssueTimestamp;
+        record->SequenceNumber = sequence[device];
+        record->DeviceId = device + 1;
+        record->NtStatus = failed ? (LONG)0xC000009C : 0;
+        record->ScsiStatus = failed ? 2 : 0;
+        record->CdbLength = 10;
+        record->SenseLength = senseLength;
+        record->SampleRate = 1;
+
+        cdb[0] = rand() % 3 ? 0x28 : 0x2A;
+        cdb[2] = (UCHAR)(lba >> 24);
+        cdb[3] = (UCHAR)(lba >> 16);
+        cdb[4] = (UCHAR)(lba >> 8);
+        cdb[5] = (UCHAR)lba;
+        cdb[7] = (UCHAR)(blocks >> 8);
+        cdb[8] = (UCHAR)blocks;
+
+        CDB_FIELDS fields;
+        if (CdbDecode(cdb, 10, &fields)) {
+            record->Flags = TRACE_RECORD_FLAG_DECODED;
+        }
+        record->Lba = fields.Lba;
+        record->Blocks = fields.Blocks;
+        record->Opcode = fields.Opcode;
+        record->CdbFlags = fields.Flags;
+
+        if (failed)
+        {
+            sense = TRACE_RECORD_SENSE(record);
+            sense[0] = 0x70;
+            sense[2] = 0x03;    // MEDIUM ERROR
+            sense[7] = 10;
+            sense[12] = 0x11;   // UNRECOVERED READ ERROR
+        }
+
+        fwrite(record, 1, record->Length, file);
+    }
+
+    fclose(file);
+    return 0;
+}
+
+//
+// StApp before the pipeline: each block printed before the next is read
+//
+static void PrintSerial(TraceSource *Source, FILE *Output, ULONG64 *Records)
+{
+    TraceSequence sequence;
+    std::string text;
+    const UCHAR *block;
+    ULONG length;
+
+    while ((block = Source->Next(&length)) != NULL)
+    {
+        ULONG offset = 0;
+
+        text.clear();
+
+        while (offset + sizeof(TRACE_RECORD_HEADER) <= length)
+        {
+            const TRACE_RECORD_HEADER *record = (const TRACE_RECORD_HEADER *)(block + offset);
+
+            if (record->Magic != TRACE_RECORD_MAGIC || record->Length < sizeof(TRACE_RECORD_HEADER) ||
+                record->Length > length - offset)
+            {
+                break;
+            }
+
+            offset += record->Length;
+            sequence.Check(record);
+            FormatTraceRecord(record, BENCH_FREQUENCY, &text);
+            (*Records)++;
+        }
+
+        fwrite(text.data(), 1, text.size(), Output);
+        fflush(Output);
+    }
+}
+
+//
+// How StApp formatted records before FormatTraceRecord: printf for every
+// field and byte. Fixed format sense only, as Generate writes.
+//
+static void AppendPrintf(std::string *Text, const char *Format, ...)
+{
+    char line[160];
+    va_list args;
+
+    va_start(args, Format);
+    vsnprintf(line, sizeof(line), Format, args);
+    va_end(args);
+
+    Text->append(line);
+}
+
+static void FormatPrintf(const TRACE_RECORD_HEADER *Record, ULONG64 Frequency, std::string *Text)
+{
+    const UCHAR *cdb = TRACE_RECORD_CDB(Record);
+    const UCHAR *sense = TRACE_RECORD_SENSE(Record);
+
+    AppendPrintf(Text, "CDB %2d Bytes: ", Record->CdbLength);
+    for (ULONG i = 0; i < Record->CdbLength; i++) {
+        AppendPrintf(Text, "%02X ", cdb[i]);
+    }
+
+    if (Record->Flags & TRACE_RECORD_FLAG_DECODED) {
+        AppendPrintf(Text, " LBA 0x%llX, %u blocks%s%s", (unsigned long long)Record->Lba, Record->Blocks,
+            (Record->CdbFlags & CDB_FLAG_FUA) ? " FUA" : "",
+            (Record->CdbFlags & CDB_FLAG_DPO) ? " DPO" : "");
+    }
+    if (Record->IssueTimestamp && Frequency) {
+        AppendPrintf(Text, " %llu us", (unsigned long long)(Record->Latency * 1000000 / Frequency));
+    }
+    if (Record->SampleRate > 1) {
+        AppendPrintf(Text, " (1 in %u)", Record->SampleRate);
+    }
+    AppendPrintf(Text, "\n");
+
+    if (Record->ScsiStatus || Record->NtStatus)
+    {
+        AppendPrintf(Text, "    NtStatus: %08X \n", (unsigned)Record->NtStatus);
+        AppendPrintf(Text, "    ScsiStatus: %08X \n", Record->ScsiStatus);
+    }
+
+    if (Record->SenseLength && Record->ScsiStatus)
+    {
+        AppendPrintf(Text, "    Sense Key: %02X \n", sense[2] & 0x0F);
+        AppendPrintf(Text, "    Sense Code: %02X %02X \n", sense[12], sense[13]);
+        AppendPrintf(Text, "    Sense Raw %d Bytes:", Record->SenseLength);
+        for (ULONG i = 0; i < Record->SenseLength; i++)
+        {
+            if (i % 16 == 0) {
+                AppendPrintf(Text, "\n        ");
+            }
+            AppendPrintf(Text, "%02X ", sense[i]);
+        }
+        AppendPrintf(Text, "\n");
+    }
+}
+
+//
+// Format every record of the file into one string reused a block at a
+// time, both ways, and check they agree
+//
+static int TimeFormatting(const char *Path)
+{
+    void (*formats[2])(const TRACE_RECORD_HEADER *, ULONG64, std::string *) = { FormatPrintf, FormatTraceRecord };
+    const char *names[2] = { "printf", "table" };
+    std::string text[2];
+    ULONG64 records = 0;
+    ULONG64 bytes[2] = { 0, 0 };
+    double seconds[2] = { 0, 0 };
+    const UCHAR *block;
+    ULONG length;
+    FILE *file = fopen(Path, "rb");
+
+    if (file == NULL)
+    {
+        perror(Path);
+        return 1;
+    }
+
+    FileTraceSource source(file);
+
+    while ((block = source.Next(&length)) != NULL)
+    {
+        for (int i = 0; i < 2; i++)
+        {
+            ULONG offset = 0;
+            double start = Now();
+
+            text[i].clear();
+
+            while (offset + sizeof(TRACE_RECORD_HEADER) <= length)
+            {
+                const TRACE_RECORD_HEADER *record = (const TRACE_RECORD_HEADER *)(block + offset);
+
+                if (record->Magic != TRACE_RECORD_MAGIC || record->Length < sizeof(TRACE_RECORD_HEADER) ||
+                    record->Length > length - offset)
+                {
+                    break;
+                }
+
+                offset += record->Length;
+                formats[i](record, BENCH_FREQUENCY, &text[i]);
+                records += i;
+            }
+
+            seconds[i] += Now() - start;
+            bytes[i] += text[i].size();
+        }
+
+        if (text[0] != text[1])
+        {
+            fprintf(stderr, "formatted text differs\n");
+            return 1;
+        }
+    }
+
+    fclose(file);
+
+    for (int i = 0; i < 2; i++)
+    {
+        printf("%-10s %6.1f ns/record, %8.1f MB/s of text, %llu records in %.2f s\n", names[i],
+            seconds[i] * 1e9 / records, bytes[i] / seconds[i] / 1e6, (unsigned long long)records, seconds[i]);
+    }
+
+    return 0;
+}
+
+static void Report(const char *Name, double Start, double Drained, double Printed, ULONG64 Records, ULONG64 Bytes)
+{
+    printf("%-10s drained %8.1f MB/s in %6.2f s, printed %10.0f records/s in %6.2f s\n", Name,
+        Bytes / (Drained - Start) / 1e6, Drained - Start, Records / (Printed - Start), Printed - Start);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *path = NULL;
+    ULONG formatters = 0;
+    BOOL lossless = TRUE;
+    TRACE_PIPELINE_STATS stats;
+    ULONG64 records = 0;
+    double start;
+    FILE *file;
+    FILE *output;
+    int i;
+
+    if (argc == 4 && strcmp(argv[1], "-g") == 0)
+    {
+        return Generate(argv[2], strtoull(argv[3], NULL, 0));
+    }
+
+    if (argc == 3 && strcmp(argv[1], "-t") == 0)
+    {
+        return TimeFormatting(argv[2]);
+    }
+
+    for (i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-f") == 0 && i + 1 < argc)
+        {
+            formatters = strtoul(argv[++i], NULL, 0);
+        }
+        else if (strcmp(argv[i], "-d") == 0 && i + 1 < argc)
+        {
+            WriteDelay = strtoul(argv[++i], NULL, 0);
+        }
+        else if (strcmp(argv[i], "-l") == 0)
+        {
+            lossless = FALSE;
+        }
+        else
+        {
+            path = argv[i];
+        }
+    }
+
+    if (path == NULL)
+    {
+        fprintf(stderr, "usage: %s -g File Records | -t File | [-f N] [-d us] [-l] File\n", argv[0]);
+        return 1;
+    }
+
+    output = OpenSlowOutput();
+
+    // One thread
+    file = fopen(path, "rb");
+    if (file == NULL)
+    {
+        perror(path);
+        return 1;
+    }
+
+    {
+        TimedTraceSource source(file);
+
+        start = Now();
+        PrintSerial(&source, output, &records);
+        Report("serial", start, source.End, Now(), records, (ULONG64)ftell(file));
+    }
+    fclose(file);
+
+    // Pipelined
+    file = fopen(path, "rb");
+    {
+        TimedTraceSource source(file);
+        TracePipeline pipeline(&source, BENCH_FREQUENCY, output, lossless, formatters);
+
+        start = Now();
+        pipeline.Run();
+        pipeline.GetStats(&stats);
+        Report("pipeline", start, source.End, Now(), stats.Records, stats.Bytes);
+
+        if (stats.DroppedBlocks) {
+            printf("           %llu of %llu blocks not printed\n",
+                (unsigned long long)stats.DroppedBlocks, (unsigned long long)stats.Blocks);
+        }
+    }
+    fclose(file);
+    fclose(output);
+
+    return 0;
+}
@@ -0,0 +1,870 @@
+// ReadTest.cpp : the control device's parked reads, simulated off Windows.
+//
+// The trace buffers (TraceBuf.c, RingBuf.c), the watermark policy and the
+// order parked reads are served in (ReadBatch.c, ReadBatchService) are
+// the driver's own, built on the kernel shim in Wdk. Only what Queue.c
+// does around them with WDF stands in here, over standard containers and
+// under the same names: the two manual queues of parked reads, which
+// refuse a read put back in the queue it was taken from as KMDF does,
+// ControlDeviceEvtIoRead, ReadTraceBufs and TakeTrace, PutTraceRecord on
+// the producers' side, and a worker thread for the work item and the
+// flush timer.
+//
+// Checks that reads too small for the largest record are refused, that a
+// read with nothing for it does not hold up the reads behind it, that the
+// read accounting of a ring is right again once it is unmapped, and then
+// runs producers and readers of several handles at once: every record
+// kept by a trace buffer is read once, whole, by a handle that selected
+// its device, and in its device's order.
+//
+// POSIX only, not part of the Visual Studio solution:
+//
+//   g++ -O2 -pthread -I Wdk -o readtest ReadTest.cpp -x c ../StorTrace/RingBuf.c -x c ../StorTrace/TraceBuf.c -x c ../StorTrace/ReadBatch.c
+//
+//   readtest [Seconds]         run the tests, the simulation for Seconds
+//                              (default 2), exit status 1 if any fails
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "Wdk/driver.h"
+
+extern "C" {
+#include "../StorTrace/TraceBuf.h"
+#include "../StorTrace/ReadBatch.h"
+}
+
+#define STATUS_BUFFER_TOO_SMALL     ((NTSTATUS)0xC0000023L)
+#define STATUS_CANCELLED            ((NTSTATUS)0xC0000120L)
+#define STATUS_INVALID_DEVICE_REQUEST ((NTSTATUS)0xC0000010L)
+
+static ULONG Failures = 0;
+
+#define CHECK(e) \
+    do { if (!(e)) { printf("%s(%d): %s\n", __FILE__, __LINE__, #e); Failures++; } } while (0)
+
+
+//-------------------------------------------------------
+// The driver, as Queue.c has it
+//-------------------------------------------------------
+
+//
+// DEVICE_CONTEXT, of what the reads use
+//
+typedef struct _SIM_DEVICE {
+    ULONG       DeviceId;
+    PTRACE_BUF  TraceBuf;
+    READ_BATCH  ReadBatch;
+} SIM_DEVICE;
+
+//
+// CONTROL_FILE_CONTEXT
+//
+typedef struct _SIM_FILE {
+    ULONG   DeviceId;
+    ULONG   NextDevice;
+} SIM_FILE;
+
+//
+// A read request and its buffered I/O buffer
+//
+#define SIM_DEFAULT_QUEUE   2   // the control device's, it arrives in
+
+typedef struct _SIM_READ {
+    SIM_FILE            *File;
+    std::vector<UCHAR>  Buffer;
+    NTSTATUS            Status;
+    size_t              Information;
+    BOOL                Completed;
+    ULONG               Queue;          // it was last delivered from
+} SIM_READ;
+
+static std::vector<SIM_DEVICE *>    DeviceCollection;
+static std::mutex                   DeviceCollectionLock;
+static std::deque<SIM_READ *>       PendingReadQueues[2];  // PendingReadQueue, AsideReadQueue
+static std::mutex                   PendingReadLock;
+static READ_BATCH_CONFIG            ReadBatchConfig;
+
+//
+// Completion, and the work item and flush timer requests
+//
+static std::mutex                   EventLock;
+static std::condition_variable      ReadCompleted;
+static std::condition_variable      WorkQueued;
+static BOOL                         WorkItemQueued = FALSE;
+static BOOL                         FlushTimerArmed = FALSE;
+
+static void CompleteRead(SIM_READ *Read, NTSTATUS Status, size_t Information)
+{
+    std::lock_guard<std::mutex> lock(EventLock);
+
+    Read->Status = Status;
+    Read->Information = Information;
+    Read->Completed = TRUE;
+    ReadCompleted.notify_all();
+}
+
+static void WorkItemEnqueue()
+{
+    std::lock_guard<std::mutex> lock(EventLock);
+
+    WorkItemQueued = TRUE;
+    WorkQueued.notify_all();
+}
+
+static size_t TakeTrace(SIM_DEVICE *DeviceContext, PUCHAR Buffer, size_t BufferLength)
+{
+    size_t got = TraceBufGet(DeviceContext->TraceBuf, Buffer, BufferLength);
+    ULONG64 records = 0;
+    RING_BUF_STATS stats;
+
+    TraceBufGetStats(DeviceContext->TraceBuf, &stats);
+    ReadBatchOverwritten(&DeviceContext->ReadBatch, stats.OverwrittenBytes, stats.OverwrittenRecords);
+
+    for (size_t offset = 0; offset < got; offset += ((PTRACE_RECORD_HEADER)(Buffer + offset))->Length) {
+        records++;
+    }
+
+    if (got) {
+        ReadBatchTaken(&DeviceContext->ReadBatch, got, records);
+    }
+
+    return got;
+}
+
+static size_t ReadTraceBufs(SIM_FILE *FileContext, PUCHAR Buffer, size_t BufferLength)
+{
+    std::lock_guard<std::mutex> lock(DeviceCollectionLock);
+    ULONG noItems = (ULONG)DeviceCollection.size();
+    size_t copied = 0;
+
+    for (ULONG n = 0; n < noItems; n++)
+    {
+        ULONG i = (FileContext->NextDevice + n) % noItems;
+        SIM_DEVICE *deviceContext = DeviceCollection[i];
+
+        if (deviceContext->TraceBuf == NULL) {
+            continue;
+        }
+
+        if (FileContext->DeviceId != STORTRACE_ALL_DEVICES)
+        {
+            if (deviceContext->DeviceId == FileContext->DeviceId)
+            {
+                copied = TakeTrace(deviceContext, Buffer, BufferLength);
+                break;
+            }
+            continue;
+        }
+
+        copied += TakeTrace(deviceContext, Buffer + copied, BufferLength - copied);
+    }
+
+    if (noItems) {
+        FileContext->NextDevice = (FileContext->NextDevice + 1) % noItems;
+    }
+
+    return copied;
+}
+
+static BOOLEAN AnyTraceReady(BOOLEAN Flush)
+{
+    std::lock_guard<std::mutex> lock(DeviceCollectionLock);
+    BOOLEAN ready = FALSE;
+
+    for (size_t i = 0; i < DeviceCollection.size() && !ready; i++)
+    {
+        SIM_DEVICE *deviceContext = DeviceCollection[i];
+
+        ready = (deviceContext->TraceBuf != NULL &&
+            !TraceBufIsMapped(deviceContext->TraceBuf) &&
+            ReadBatchIsReady(&deviceContext->ReadBatch, &ReadBatchConfig, Flush));
+    }
+
+    return ready;
+}
+
+//
+// The parked reads, as ReadBatchService gets at them
+//
+static ULONG ParkedReadCount(ULONG Queue)
+{
+    return (ULONG)PendingReadQueues[Queue].size();
+}
+
+static PVOID RetrieveParkedRead(ULONG Queue)
+{
+    SIM_READ *read;
+
+    if (PendingReadQueues[Queue].empty()) {
+        return NULL;
+    }
+
+    read = PendingReadQueues[Queue].front();
+    PendingReadQueues[Queue].pop_front();
+    return read;
+}
+
+//
+// WdfRequestForwardToIoQueue: not to the queue the request came from
+//
+static NTSTATUS ParkRead(PVOID Read, ULONG Queue)
+{
+    SIM_READ *read = (SIM_READ *)Read;
+
+    if (read->Queue == Queue) {
+        return STATUS_INVALID_DEVICE_REQUEST;
+    }
+
+    read->Queue = Queue;
+    PendingReadQueues[Queue].push_back(read);
+    return STATUS_SUCCESS;
+}
+
+static size_t FillRead(PVOID Read)
+{
+    SIM_READ *read = (SIM_READ *)Read;
+
+    return ReadTraceBufs(read->File, read->Buffer.data(), read->Buffer.size());
+}
+
+static VOID CompleteParkedRead(PVOID Read, NTSTATUS Status, size_t Information)
+{
+    CompleteRead((SIM_READ *)Read, Status, Information);
+}
+
+static const READ_BATCH_READS ParkedReads = {
+    ParkedReadCount,
+    RetrieveParkedRead,
+    ParkRead,
+    AnyTraceReady,
+    FillRead,
+    CompleteParkedRead
+};
+
+static void ServicePendingReads(BOOLEAN Flush)
+{
+    std::lock_guard<std::mutex> lock(PendingReadLock);
+
+    if (ReadBatchService(&ParkedReads, Flush) != 0)
+    {
+        std::lock_guard<std::mutex> events(EventLock);
+
+        if (!FlushTimerArmed)
+        {
+            FlushTimerArmed = TRUE;
+            WorkQueued.notify_all();
+        }
+    }
+}
+
+static void ControlDeviceEvtIoRead(SIM_READ *Request)
+{
+    if (Request->Buffer.size() < TRACE_RECORD_MAX_SIZE)
+    {
+        CompleteRead(Request, STATUS_BUFFER_TOO_SMALL, 0);
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(PendingReadLock);
+
+        Request->Queue = SIM_DEFAULT_QUEUE;
+        if (!NT_SUCCESS(ParkRead(Request, READ_BATCH_PARKED)))
+        {
+            CompleteRead(Request, STATUS_INVALID_DEVICE_REQUEST, 0);
+            return;
+        }
+    }
+
+    ServicePendingReads(FALSE);
+}
+
+//
+// ControlDeviceEvtFileCleanup, once the ring is unmapped: what it still
+// holds, with the producers held off
+//
+static void RestartReadBatch(SIM_DEVICE *DeviceContext)
+{
+    std::lock_guard<std::mutex> lock(PendingReadLock);
+    RING_BUF_STATS stats;
+    ULONG64 records;
+    ULONG64 bytes;
+
+    records = TraceBufCount(DeviceContext->TraceBuf, &bytes);
+    TraceBufGetStats(DeviceContext->TraceBuf, &stats);
+    ReadBatchRestart(&DeviceContext->ReadBatch, bytes, records, stats.OverwrittenBytes, stats.OverwrittenRecords);
+}
+
+static BOOLEAN PutTraceRecord(SIM_DEVICE *DeviceContext, PTRACE_RECORD_HEADER Record)
+{
+    BOOLEAN put = TraceBufPut(DeviceContext->TraceBuf, Record->Timestamp, (PUCHAR)Record, Record->Length);
+
+    if (put && ReadBatchAdd(&DeviceContext->ReadBatch, &ReadBatchConfig, Record->Length)) {
+        WorkItemEnqueue();
+    }
+
+    return put;
+}
+
+//
+// ReadWorkItemCallback, and FlushTimerCallback once FlushTimeoutMs have
+// passed since the timer was armed
+//
+static void Worker(volatile BOOL *Stop)
+{
+    std::unique_lock<std::mutex> lock(EventLock);
+
+    while (!*Stop)
+    {
+        BOOLEAN flush = FALSE;
+
+        if (FlushTimerArmed)
+        {
+            if (!WorkQueued.wait_for(lock, std::chrono::milliseconds(ReadBatchConfig.FlushTimeoutMs),
+                    [] { return WorkItemQueued; }))
+            {
+                FlushTimerArmed = FALSE;
+                flush = TRUE;
+            }
+        }
+        else
+        {
+            WorkQueued.wait_for(lock, std::chrono::milliseconds(10), [] { return WorkItemQueued || FlushTimerArmed; });
+            if (!WorkItemQueued) {
+                continue;
+            }
+        }
+
+        WorkItemQueued = FALSE;
+
+        lock.unlock();
+        ServicePendingReads(flush);
+        lock.lock();
+    }
+}
+
+
+//-------------------------------------------------------
+// Devices, records and readers
+//-------------------------------------------------------
+static SIM_DEVICE *AddDevice(ULONG DeviceId, size_t Size, ULONG Policy = RING_OVERFLOW_DROP_NEWEST)
+{
+    SIM_DEVICE *device = new SIM_DEVICE;
+
+    device->DeviceId = DeviceId;
+    device->TraceBuf = TraceBufCreate(Size, FALSE, Policy);
+    ReadBatchInit(&device->ReadBatch);
+
+    DeviceCollection.push_back(device);
+    return device;
+}
+
+static void RemoveDevices()
+{
+    for (size_t i = 0; i < DeviceCollection.size(); i++)
+    {
+        TraceBufDelete(DeviceCollection[i]->TraceBuf);
+        delete DeviceCollection[i];
+    }
+    DeviceCollection.clear();
+}
+
+//
+// A record of the device, its CDB and sense bytes telling it apart
+//
+static ULONG MakeRecord(PUCHAR Buffer, ULONG DeviceId, ULONG64 Sequence, UCHAR CdbLength, UCHAR SenseLength)
+{
+    PTRACE_RECORD_HEADER record = (PTRACE_RECORD_HEADER)Buffer;
+    PUCHAR bytes = TRACE_RECORD_CDB(record);
+
+    memset(record, 0, sizeof(TRACE_RECORD_HEADER));
+    record->Magic = TRACE_RECORD_MAGIC;
+    record->Version = TRACE_RECORD_VERSION;
+    record->Length = (ULONG)TRACE_RECORD_SIZE(CdbLength, SenseLength);
+    record->Timestamp = (ULONG64)KeQueryPerformanceCounter(NULL).QuadPart;
+    record->SequenceNumber = Sequence;
+    record->DeviceId = DeviceId;
+    record->CdbLength = CdbLength;
+    record->SenseLength = SenseLength;
+
+    for (ULONG i = 0; i < record->Length - sizeof(TRACE_RECORD_HEADER); i++) {
+        bytes[i] = (UCHAR)(Sequence * 3 + DeviceId + i);
+    }
+
+    return record->Length;
+}
+
+static BOOL CheckRecord(const TRACE_RECORD_HEADER *Record, size_t Available)
+{
+    const UCHAR *bytes = (const UCHAR *)Record + sizeof(TRACE_RECORD_HEADER);
+
+    if (Available < sizeof(TRACE_RECORD_HEADER) || Record->Magic != TRACE_RECORD_MAGIC ||
+        Record->Length > Available || Record->Length != TRACE_RECORD_SIZE(Record->CdbLength, Record->SenseLength))
+    {
+        return FALSE;
+    }
+
+    for (ULONG i = 0; i < Record->Length - sizeof(TRACE_RECORD_HEADER); i++)
+    {
+        if (bytes[i] != (UCHAR)(Record->SequenceNumber * 3 + Record->DeviceId + i)) {
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+static BOOL WaitRead(SIM_READ *Read, ULONG Milliseconds)
+{
+    std::unique_lock<std::mutex> lock(EventLock);
+
+    return ReadCompleted.wait_for(lock, std::chrono::milliseconds(Milliseconds), [Read] { return Read->Completed; });
+}
+
+static BOOL IsParked(SIM_READ *Read)
+{
+    std::lock_guard<std::mutex> lock(PendingReadLock);
+    std::deque<SIM_READ *> &parked = PendingReadQueues[READ_BATCH_PARKED];
+
+    for (size_t i = 0; i < parked.size(); i++)
+    {
+        if (parked[i] == Read) {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+//
+// ControlDeviceEvtFileCleanup, of the reads still parked
+//
+static void CancelReads()
+{
+    std::lock_guard<std::mutex> lock(PendingReadLock);
+    std::deque<SIM_READ *> &parked = PendingReadQueues[READ_BATCH_PARKED];
+
+    while (!parked.empty())
+    {
+        CompleteRead(parked.front(), STATUS_CANCELLED, 0);
+        parked.pop_front();
+    }
+}
+
+
+//-------------------------------------------------------
+// Tests
+//-------------------------------------------------------
+
+//
+// Reads that cannot hold the largest record are refused, not parked
+//
+static void TestTooSmall()
+{
+    SIM_DEVICE *device = AddDevice(1, TRACE_BUF_MIN_RING_SIZE);
+    SIM_FILE file = { STORTRACE_ALL_DEVICES, 0 };
+    ULONG64 buffer[TRACE_RECORD_MAX_SIZE / sizeof(ULONG64)];
+    size_t sizes[] = { 0, sizeof(TRACE_RECORD_HEADER), TRACE_RECORD_MAX_SIZE - 1 };
+
+    MakeRecord((PUCHAR)buffer, 1, 1, 255, 255);
+    CHECK(PutTraceRecord(device, (PTRACE_RECORD_HEADER)buffer));
+
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+    {
+        SIM_READ read = { &file, std::vector<UCHAR>(sizes[i]), 0, 0, FALSE, SIM_DEFAULT_QUEUE };
+
+        ControlDeviceEvtIoRead(&read);
+        CHECK(read.Completed && read.Status == STATUS_BUFFER_TOO_SMALL && read.Information == 0);
+        CHECK(!IsParked(&read));
+    }
+
+    // Just the size of the record there is, taken at the flush
+    SIM_READ read = { &file, std::vector<UCHAR>(TRACE_RECORD_MAX_SIZE), 0, 0, FALSE, SIM_DEFAULT_QUEUE };
+
+    ControlDeviceEvtIoRead(&read);
+    CHECK(!read.Completed);
+    ServicePendingReads(TRUE);
+    CHECK(read.Completed && read.Status == STATUS_SUCCESS && read.Information == TRACE_RECORD_MAX_SIZE);
+    CHECK(CheckRecord((PTRACE_RECORD_HEADER)read.Buffer.data(), read.Information));
+
+    RemoveDevices();
+}
+
+//
+// A read whose handle selected an idle device, parked first, and reads
+// for a busy one behind it: one pass completes those, and leaves it be
+//
+static void TestHeadOfLine()
+{
+    SIM_DEVICE *busy = AddDevice(1, 4 * TRACE_BUF_MIN_RING_SIZE);
+    SIM_DEVICE *idle = AddDevice(2, TRACE_BUF_MIN_RING_SIZE);
+    SIM_FILE busyFile = { busy->DeviceId, 0 };
+    SIM_FILE idleFile = { idle->DeviceId, 0 };
+    SIM_READ idleRead = { &idleFile, std::vector<UCHAR>(TRACE_RECORD_MAX_SIZE), 0, 0, FALSE, SIM_DEFAULT_QUEUE };
+    SIM_READ busyReads[2] = {
+        { &busyFile, std::vector<UCHAR>(ReadBatchConfig.ByteWatermark), 0, 0, FALSE, SIM_DEFAULT_QUEUE },
+        { &busyFile, std::vector<UCHAR>(ReadBatchConfig.ByteWatermark), 0, 0, FALSE, SIM_DEFAULT_QUEUE },
+    };
+    ULONG64 buffer[TRACE_RECORD_MAX_SIZE / sizeof(ULONG64)];
+    ULONG64 sequence = 0;
+    size_t bytes = 0;
+
+    {
+        std::lock_guard<std::mutex> lock(PendingReadLock);
+
+        CHECK(ParkRead(&idleRead, READ_BATCH_PARKED) == STATUS_SUCCESS);
+        CHECK(ParkRead(&busyReads[0], READ_BATCH_PARKED) == STATUS_SUCCESS);
+        CHECK(ParkRead(&busyReads[1], READ_BATCH_PARKED) == STATUS_SUCCESS);
+    }
+
+    // Over the watermark still once the first read is done
+    while (bytes < 2 * ReadBatchConfig.ByteWatermark + TRACE_RECORD_MAX_SIZE)
+    {
+        bytes += MakeRecord((PUCHAR)buffer, busy->DeviceId, ++sequence, 16, 0);
+        CHECK(PutTraceRecord(busy, (PTRACE_RECORD_HEADER)buffer));
+    }
+
+    ServicePendingReads(FALSE);
+
+    CHECK(busyReads[0].Completed && busyReads[0].Information != 0);
+    CHECK(busyReads[1].Completed && busyReads[1].Information != 0);
+    CHECK(!idleRead.Completed && IsParked(&idleRead));
+
+    // Trace ready for nobody parked: each read tried once, then the pass ends
+    MakeRecord((PUCHAR)buffer, busy->DeviceId, ++sequence, 16, 0);
+    CHECK(PutTraceRecord(busy, (PTRACE_RECORD_HEADER)buffer));
+
+    ServicePendingReads(TRUE);
+    CHECK(!idleRead.Completed && IsParked(&idleRead));
+
+    CancelReads();
+    CHECK(idleRead.Completed && idleRead.Status == STATUS_CANCELLED);
+
+    RemoveDevices();
+}
+
+//
+// Records of about Bytes, in sequence
+//
+static void PutRecords(SIM_DEVICE *Device, ULONG64 *Sequence, size_t Bytes)
+{
+    ULONG64 buffer[TRACE_RECORD_MAX_SIZE / sizeof(ULONG64)];
+    size_t put = 0;
+
+    while (put < Bytes)
+    {
+        ++*Sequence;
+        put += MakeRecord((PUCHAR)buffer, Device->DeviceId, *Sequence, (UCHAR)(10 + *Sequence % 7), 0);
+        PutTraceRecord(Device, (PTRACE_RECORD_HEADER)buffer);
+    }
+}
+
+//
+// Length of the entry at Offset of a mapped ring, which may wrap
+//
+static ULONG MappedEntryLength(PRING_HEADER Header, LONG64 Offset)
+{
+    PUCHAR data = (PUCHAR)Header + RING_HEADER_SIZE;
+    ULONG length;
+
+    for (ULONG i = 0; i < sizeof(length); i++) {
+        ((PUCHAR)&length)[i] = data[(Offset + FIELD_OFFSET(RING_ENTRY_HEADER, Length) + i) & (Header->Size - 1)];
+    }
+    return length;
+}
+
+//
+// A ring overwritten and partly read, then mapped and partly consumed in
+// place, then unmapped and overwritten again: the read batch counts
+// afresh from what it holds and from its overwrite counters, and is back
+// to nothing once the reads have drained it
+//
+static void TestUnmap()
+{
+    SIM_DEVICE *device = AddDevice(1, TRACE_BUF_MIN_RING_SIZE, RING_OVERFLOW_OVERWRITE_OLDEST);
+    PRING_BUF ring = TraceBufGetRing(device->TraceBuf);
+    SIM_FILE file = { device->DeviceId, 0 };
+    std::vector<UCHAR> buffer(4 * TRACE_RECORD_MAX_SIZE);
+    ULONG64 sequence = 0;
+    ULONG64 held;
+    ULONG64 bytes;
+    RING_BUF_STATS stats;
+    PRING_HEADER header;
+    LONG64 end;
+    PMDL mdl;
+
+    PutRecords(device, &sequence, 2 * TRACE_BUF_MIN_RING_SIZE);
+    CHECK(ReadTraceBufs(&file, buffer.data(), buffer.size()) != 0);
+    PutRecords(device, &sequence, TRACE_BUF_MIN_RING_SIZE);
+
+    header = (PRING_HEADER)RingBufMapUser(ring, &mdl);
+    CHECK(header != NULL);
+    if (header == NULL)
+    {
+        RemoveDevices();
+        return;
+    }
+
+    // Half of it consumed in place, then a few more records
+    held = TraceBufCount(device->TraceBuf, &bytes);
+    end = header->Tail;
+    for (ULONG64 i = 0; i < held / 2; i++) {
+        end += (LONG64)RING_ENTRY_SIZE(MappedEntryLength(header, end));
+    }
+    CHECK(RingBufRelease(ring, end));
+    PutRecords(device, &sequence, 1024);
+
+    RingBufUnmapUser(ring, header, mdl);
+    RestartReadBatch(device);
+
+    held = TraceBufCount(device->TraceBuf, &bytes);
+    TraceBufGetStats(device->TraceBuf, &stats);
+    CHECK(stats.OverwrittenRecords != 0);
+    CHECK(device->ReadBatch.Records == (LONG64)held && device->ReadBatch.Bytes == (LONG64)bytes);
+
+    PutRecords(device, &sequence, 2 * TRACE_BUF_MIN_RING_SIZE);
+    while (ReadTraceBufs(&file, buffer.data(), buffer.size()) != 0) {
+    }
+
+    CHECK(device->ReadBatch.Records == 0 && device->ReadBatch.Bytes == 0);
+    CHECK(!ReadBatchIsReady(&device->ReadBatch, &ReadBatchConfig, TRUE));
+
+    RemoveDevices();
+}
+
+//
+// What a handle reads, checked as it goes
+//
+typedef struct _SIM_READER {
+    SIM_FILE    File;
+    size_t      ReadSize;
+    ULONG64     Reads;
+    ULONG64     Records;
+    ULONG64     Torn;
+    ULONG64     Foreign;            // of a device it did not select
+    ULONG64     Unordered;
+} SIM_READER;
+
+#define SIM_DEVICES         3
+#define SIM_RECORDS_MAX     (1 << 22)
+
+static void TestSimulation(ULONG Seconds)
+{
+    SIM_READER readers[] = {
+        { { STORTRACE_ALL_DEVICES, 0 }, 1024 * 1024, 0, 0, 0, 0, 0 },
+        { { STORTRACE_ALL_DEVICES, 0 }, TRACE_RECORD_MAX_SIZE, 0, 0, 0, 0, 0 },
+        { { 1, 0 }, 4096, 0, 0, 0, 0, 0 },
+        { { 2, 0 }, 64 * 1024, 0, 0, 0, 0, 0 },
+        { { 3, 0 }, 64 * 1024, 0, 0, 0, 0, 0 },    // nothing is ever traced on 3
+    };
+    const ULONG readerCount = sizeof(readers) / sizeof(readers[0]);
+    std::vector<std::vector<BOOLEAN> > put(SIM_DEVICES + 1, std::vector<BOOLEAN>(SIM_RECORDS_MAX + 1));
+    std::vector<std::vector<ULONG> > got(SIM_DEVICES + 1, std::vector<ULONG>(SIM_RECORDS_MAX + 1));
+    std::vector<ULONG64> produced(SIM_DEVICES + 1, 0);
+    std::mutex gotLock;
+    std::vector<std::thread> threads;
+    volatile BOOL producing = TRUE;
+    volatile BOOL reading = TRUE;
+    volatile BOOL stopWorker = FALSE;
+    ULONG64 accepted = 0;
+    ULONG64 received = 0;
+    ULONG64 repeated = 0;
+    ULONG64 lost = 0;
+
+    for (ULONG d = 1; d <= SIM_DEVICES; d++) {
+        AddDevice(d, 256 * 1024);
+    }
+
+    std::thread worker(Worker, &stopWorker);
+
+    for (ULONG r = 0; r < readerCount; r++)
+    {
+        threads.push_back(std::thread([&, r]()
+        {
+            SIM_READER *reader = &readers[r];
+            std::vector<ULONG64> next(SIM_DEVICES + 1, 0);
+
+            while (reading)
+            {
+                SIM_READ read = { &reader->File, std::vector<UCHAR>(reader->ReadSize), 0, 0, FALSE, SIM_DEFAULT_QUEUE };
+                size_t offset = 0;
+
+                ControlDeviceEvtIoRead(&read);
+                while (!WaitRead(&read, 100))
+                {
+                    if (!reading)
+                    {
+                        // The handle is closed with the read parked
+                        CancelReads();
+                    }
+                }
+
+                if (read.Status != STATUS_SUCCESS) {
+                    break;
+                }
+                reader->Reads++;
+
+                while (offset < read.Information)
+                {
+                    const TRACE_RECORD_HEADER *record = (const TRACE_RECORD_HEADER *)&read.Buffer[offset];
+
+                    if (!CheckRecord(record, read.Information - offset) ||
+                        record->DeviceId == 0 || record->DeviceId > SIM_DEVICES ||
+                        record->SequenceNumber == 0 || record->SequenceNumber > SIM_RECORDS_MAX)
+                    {
+                        reader->Torn++;
+                        break;
+                    }
+
+                    if (reader->File.DeviceId != STORTRACE_ALL_DEVICES && record->DeviceId != reader->File.DeviceId) {
+                        reader->Foreign++;
+                    }
+                    if (record->SequenceNumber <= next[record->DeviceId]) {
+                        reader->Unordered++;
+                    }
+                    next[record->DeviceId] = record->SequenceNumber;
+
+                    {
+                        std::lock_guard<std::mutex> lock(gotLock);
+                        got[record->DeviceId][record->SequenceNumber]++;
+                    }
+
+                    reader->Records++;
+                    offset += record->Length;
+                }
+            }
+        }));
+    }
+
+    //
+    // Device 1 flat out, 2 a record now and then, 3 idle
+    //
+    for (ULONG d = 1; d <= 2; d++)
+    {
+        threads.push_back(std::thread([&, d]()
+        {
+            SIM_DEVICE *device = DeviceCollection[d - 1];
+            ULONG64 buffer[TRACE_RECORD_MAX_SIZE / sizeof(ULONG64)];
+            ULONG64 sequence = 0;
+
+            WdkShimProcessor = d;
+            srand(d);
+
+            while (producing && sequence < SIM_RECORDS_MAX)
+            {
+                BOOL failed = rand() % 50 == 0;
+
+                sequence++;
+                MakeRecord((PUCHAR)buffer, d, sequence, (UCHAR)(rand() % 2 ? 10 : 16 + rand() % 240),
+                    (UCHAR)(failed ? 18 + rand() % 238 : 0));
+                put[d][sequence] = PutTraceRecord(device, (PTRACE_RECORD_HEADER)buffer);
+
+                if (d == 1 && sequence % 64 == 0) {
+                    std::this_thread::yield();
+                }
+                if (d == 2) {
+                    std::this_thread::sleep_for(std::chrono::microseconds(200));
+                }
+            }
+
+            produced[d] = sequence;
+        }));
+    }
+
+    std::this_thread::sleep_for(std::chrono::seconds(Seconds));
+    producing = FALSE;
+
+    for (ULONG t = readerCount; t < threads.size(); t++) {
+        threads[t].join();
+    }
+
+    //
+    // What is left is read by the flush timeout at the latest
+    //
+    for (ULONG i = 0; i < 100; i++)
+    {
+        BOOL empty = TRUE;
+
+        for (ULONG d = 0; d < SIM_DEVICES; d++)
+        {
+            if (ReadNoFence64(&DeviceCollection[d]->ReadBatch.Records) != 0) {
+                empty = FALSE;
+            }
+        }
+        if (empty) {
+            break;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(ReadBatchConfig.FlushTimeoutMs));
+    }
+
+    reading = FALSE;
+    for (ULONG t = 0; t < readerCount; t++) {
+        threads[t].join();
+    }
+    stopWorker = TRUE;
+    worker.join();
+
+    for (ULONG d = 1; d <= SIM_DEVICES; d++)
+    {
+        for (ULONG64 s = 1; s <= produced[d]; s++)
+        {
+            accepted += put[d][s];
+            received += got[d][s] != 0;
+            repeated += got[d][s] > 1;
+            lost += put[d][s] && got[d][s] == 0;
+            CHECK(put[d][s] || got[d][s] == 0);
+        }
+    }
+
+    printf("simulation: %llu + %llu records traced, %llu kept, %llu read\n", (unsigned long long)produced[1],
+        (unsigned long long)produced[2], (unsigned long long)accepted, (unsigned long long)received);
+
+    for (ULONG r = 0; r < readerCount; r++)
+    {
+        printf("  handle %u, device %u, %7zu byte reads: %6llu reads, %8llu records\n", r, readers[r].File.DeviceId,
+            readers[r].ReadSize, (unsigned long long)readers[r].Reads, (unsigned long long)readers[r].Records);
+
+        CHECK(readers[r].Torn == 0);
+        CHECK(readers[r].Foreign == 0);
+        CHECK(readers[r].Unordered == 0);
+    }
+
+    CHECK(repeated == 0);
+    CHECK(lost == 0);
+    CHECK(received == accepted);
+    CHECK(readers[4].Reads == 0);
+
+    // Every handle with trace for it got some
+    for (ULONG r = 0; r < 4; r++) {
+        CHECK(readers[r].Reads != 0);
+    }
+
+    RemoveDevices();
+}
+
+int main(int argc, char *argv[])
+{
+    ULONG seconds = argc > 1 ? strtoul(argv[1], NULL, 0) : 2;
+
+    // Watermarks a small ring reaches, and a quick flush
+    ReadBatchInitConfig(&ReadBatchConfig);
+    ReadBatchConfig.ByteWatermark = 16 * 1024;
+    ReadBatchConfig.FlushTimeoutMs = 20;
+
+    TestTooSmall();
+    TestHeadOfLine();
+    TestUnmap();
+    TestSimulation(seconds);
+
+    printf("%s, %u failures\n", Failures ? "FAILED" : "passed", Failures);
+    return Failures ? 1 : 0;
+}
@@ -0,0 +1,369 @@
+// ResizeTest.cpp : resizing a device's trace buffer, off Windows.
+//
+// Builds StorTrace's TraceBuf.c, RingBuf.c and ReadBatch.c as they are, on
+// the kernel shim in Wdk, and does what ResizeTraceBuf in Queue.c does:
+// fills a trace buffer past full, moves its trace into a new one with
+// TraceBufMigrate, and restarts the device's read accounting from what
+// moved with ReadBatchRestart.
+//
+// Each case is checked against a model of the rings: the new trace buffer
+// must hold exactly the records the model says, oldest first, each whole
+// and in the ring of the processor it was put on, and once reads as
+// Queue.c's TakeTrace does have drained it, the accounting must be back
+// to nothing. Growing and shrinking, under both overflow policies, with
+// one ring and with one per processor.
+//
+// POSIX only, not part of the Visual Studio solution:
+//
+//   g++ -O2 -I Wdk -o resizetest ResizeTest.cpp -x c ../StorTrace/TraceBuf.c -x c ../StorTrace/RingBuf.c -x c ../StorTrace/ReadBatch.c
+//
+//   resizetest                 run the tests, exit status 1 if any fails
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <deque>
+#include <vector>
+
+#include "Wdk/driver.h"
+
+extern "C" {
+#include "../StorTrace/TraceBuf.h"
+#include "../StorTrace/ReadBatch.h"
+}
+
+//
+// Processors the per-processor trace buffers are made for
+//
+#define TEST_PROCESSORS     4
+
+static ULONG Failures = 0;
+
+#define CHECK(e) \
+    do { if (!(e)) { printf("%s(%d): %s\n", __FILE__, __LINE__, #e); Failures++; } } while (0)
+
+static READ_BATCH_CONFIG ReadBatchConfig;
+
+//
+// A trace record whose CDB and sense bytes depend on its sequence number,
+// which is also its timestamp
+//
+static ULONG MakeRecord(PUCHAR Buffer, ULONG64 Sequence, UCHAR CdbLength, UCHAR SenseLength)
+{
+    PTRACE_RECORD_HEADER record = (PTRACE_RECORD_HEADER)Buffer;
+    PUCHAR bytes = TRACE_RECORD_CDB(record);
+
+    memset(record, 0, sizeof(TRACE_RECORD_HEADER));
+    record->Magic = TRACE_RECORD_MAGIC;
+    record->Version = TRACE_RECORD_VERSION;
+    record->Length = (ULONG)TRACE_RECORD_SIZE(CdbLength, SenseLength);
+    record->Timestamp = Sequence;
+    record->SequenceNumber = Sequence;
+    record->CdbLength = CdbLength;
+    record->SenseLength = SenseLength;
+
+    for (ULONG i = 0; i < record->Length - sizeof(TRACE_RECORD_HEADER); i++) {
+        bytes[i] = (UCHAR)(Sequence * 5 + i);
+    }
+
+    return record->Length;
+}
+
+static BOOL CheckRecord(const TRACE_RECORD_HEADER *Record, size_t Available)
+{
+    const UCHAR *bytes = (const UCHAR *)Record + sizeof(TRACE_RECORD_HEADER);
+
+    if (Available < sizeof(TRACE_RECORD_HEADER) || Record->Magic != TRACE_RECORD_MAGIC ||
+        Record->Length > Available || Record->Length != TRACE_RECORD_SIZE(Record->CdbLength, Record->SenseLength) ||
+        Record->Timestamp != Record->SequenceNumber)
+    {
+        return FALSE;
+    }
+
+    for (ULONG i = 0; i < Record->Length - sizeof(TRACE_RECORD_HEADER); i++)
+    {
+        if (bytes[i] != (UCHAR)(Record->SequenceNumber * 5 + i)) {
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+//
+// What a ring holds, entry by entry, as RingBuf.c lays them out
+//
+typedef struct _MODEL_ENTRY {
+    ULONG64 Sequence;
+    ULONG   Length;
+    ULONG   Ring;               // of the trace buffer it was put into first
+} MODEL_ENTRY;
+
+typedef struct _MODEL_RING {
+    std::deque<MODEL_ENTRY> Entries;
+    size_t  Used;
+    size_t  Size;
+} MODEL_RING;
+
+typedef struct _MODEL {
+    std::vector<MODEL_RING> Rings;
+    ULONG   Policy;
+} MODEL;
+
+static void ModelInit(MODEL *Model, PTRACE_BUF TraceBuf)
+{
+    Model->Rings.assign(TraceBufGetRingCount(TraceBuf), MODEL_RING());
+    Model->Policy = TraceBufGetPolicy(TraceBuf);
+
+    for (size_t i = 0; i < Model->Rings.size(); i++)
+    {
+        Model->Rings[i].Used = 0;
+        Model->Rings[i].Size = TraceBufGetRingSize(TraceBuf);
+    }
+}
+
+static BOOL ModelPut(MODEL *Model, ULONG Ring, MODEL_ENTRY Entry)
+{
+    MODEL_RING *ring = &Model->Rings[Ring];
+    size_t entrySize = RING_ENTRY_SIZE(Entry.Length);
+
+    while (ring->Used + entrySize > ring->Size)
+    {
+        if (Model->Policy != RING_OVERFLOW_OVERWRITE_OLDEST || ring->Entries.empty()) {
+            return FALSE;
+        }
+
+        ring->Used -= RING_ENTRY_SIZE(ring->Entries.front().Length);
+        ring->Entries.pop_front();
+    }
+
+    ring->Entries.push_back(Entry);
+    ring->Used += entrySize;
+    return TRUE;
+}
+
+//
+// All of it, oldest first, as TraceBufGet merges it
+//
+static std::vector<MODEL_ENTRY> ModelAll(const MODEL *Model)
+{
+    std::vector<MODEL_ENTRY> all;
+
+    for (size_t i = 0; i < Model->Rings.size(); i++) {
+        all.insert(all.end(), Model->Rings[i].Entries.begin(), Model->Rings[i].Entries.end());
+    }
+
+    std::sort(all.begin(), all.end(), [](const MODEL_ENTRY &a, const MODEL_ENTRY &b) { return a.Sequence < b.Sequence; });
+    return all;
+}
+
+//
+// Queue.c's PutTraceRecord and TakeTrace, of what the accounting sees
+//
+static BOOLEAN PutTraceRecord(PTRACE_BUF TraceBuf, PREAD_BATCH ReadBatch, PTRACE_RECORD_HEADER Record)
+{
+    BOOLEAN put = TraceBufPut(TraceBuf, Record->Timestamp, (PUCHAR)Record, Record->Length);
+
+    if (put) {
+        ReadBatchAdd(ReadBatch, &ReadBatchConfig, Record->Length);
+    }
+
+    return put;
+}
+
+static size_t TakeTrace(PTRACE_BUF TraceBuf, PREAD_BATCH ReadBatch, PUCHAR Buffer, size_t BufferLength)
+{
+    size_t got = TraceBufGet(TraceBuf, Buffer, BufferLength);
+    ULONG64 records = 0;
+    RING_BUF_STATS stats;
+
+    TraceBufGetStats(TraceBuf, &stats);
+    ReadBatchOverwritten(ReadBatch, stats.OverwrittenBytes, stats.OverwrittenRecords);
+
+    for (size_t offset = 0; offset < got; offset += ((PTRACE_RECORD_HEADER)(Buffer + offset))->Length) {
+        records++;
+    }
+
+    if (got) {
+        ReadBatchTaken(ReadBatch, got, records);
+    }
+
+    return got;
+}
+
+//
+// Fill a trace buffer of FromSize bytes to about twice what it holds, on
+// each processor in turn, then resize it to ToSize as ResizeTraceBuf does
+//
+static void TestResize(BOOLEAN FromPerCpu, BOOLEAN ToPerCpu, ULONG Policy, size_t FromSize, size_t ToSize)
+{
+    PTRACE_BUF from = TraceBufCreate(FromSize, FromPerCpu, Policy);
+    PTRACE_BUF to = TraceBufCreate(ToSize, ToPerCpu, Policy);
+    ULONG64 scratch[TRACE_RECORD_MAX_SIZE / sizeof(ULONG64)];
+    std::vector<UCHAR> buffer(64 * 1024);
+    std::vector<MODEL_ENTRY> expected;
+    std::vector<MODEL_ENTRY> held;
+    READ_BATCH readBatch;
+    MODEL fromModel;
+    MODEL toModel;
+    ULONG64 records;
+    ULONG64 bytes = 0;
+    ULONG64 expectedBytes = 0;
+    ULONG64 expectedRecords = 0;
+    ULONG64 sequence = 0;
+    size_t put = 0;
+    size_t taken = 0;
+    size_t got;
+    RING_BUF_STATS stats;
+
+    CHECK(from != NULL && to != NULL);
+    if (from == NULL || to == NULL) {
+        return;
+    }
+
+    ModelInit(&fromModel, from);
+    ModelInit(&toModel, to);
+    ReadBatchInit(&readBatch);
+    srand((unsigned)(FromSize + ToSize + Policy + FromPerCpu * 2 + ToPerCpu));
+
+    while (put < 2 * TraceBufGetSize(from))
+    {
+        BOOL failed = rand() % 8 == 0;
+        MODEL_ENTRY entry;
+
+        WdkShimProcessor = (ULONG)(rand() % TEST_PROCESSORS);
+        entry.Sequence = ++sequence;
+        entry.Length = MakeRecord((PUCHAR)scratch, sequence, (UCHAR)(6 + rand() % 11),
+            (UCHAR)(failed ? 18 + rand() % 238 : 0));
+        entry.Ring = FromPerCpu ? WdkShimProcessor % TraceBufGetRingCount(from) : 0;
+
+        CHECK(PutTraceRecord(from, &readBatch, (PTRACE_RECORD_HEADER)scratch) == ModelPut(&fromModel, entry.Ring, entry));
+        put += entry.Length;
+    }
+
+    //
+    // What TraceBufMigrate has to do: oldest first, into the ring of the
+    // same index
+    //
+    held = ModelAll(&fromModel);
+    for (size_t i = 0; i < held.size(); i++)
+    {
+        if (ModelPut(&toModel, held[i].Ring % (ULONG)toModel.Rings.size(), held[i]))
+        {
+            expectedRecords++;
+            expectedBytes += held[i].Length;
+        }
+    }
+    expected = ModelAll(&toModel);
+
+    records = TraceBufMigrate(to, from, (PUCHAR)scratch, sizeof(scratch), &bytes);
+    ReadBatchRestart(&readBatch, bytes, records, 0, 0);
+    TraceBufDelete(from);
+
+    CHECK(records == expectedRecords);
+    CHECK(bytes == expectedBytes);
+    if (ToPerCpu == FromPerCpu && ToSize >= FromSize)
+    {
+        // Growing loses nothing
+        CHECK(records == held.size());
+    }
+
+    CHECK(ReadBatchIsReady(&readBatch, &ReadBatchConfig, TRUE) == (records != 0));
+
+    //
+    // Drain it as a read does: the records the model has, whole and in
+    // order, and the accounting back to nothing
+    //
+    while ((got = TakeTrace(to, &readBatch, buffer.data(), buffer.size())) != 0)
+    {
+        for (size_t offset = 0; offset < got;)
+        {
+            const TRACE_RECORD_HEADER *record = (const TRACE_RECORD_HEADER *)&buffer[offset];
+
+            if (!CheckRecord(record, got - offset))
+            {
+                CHECK(!"torn record");
+                break;
+            }
+
+            CHECK(taken < expected.size() && record->SequenceNumber == expected[taken].Sequence);
+            taken++;
+            offset += record->Length;
+        }
+    }
+
+    TraceBufGetStats(to, &stats);
+
+    CHECK(taken == expected.size());
+    CHECK(readBatch.Records == 0);
+    CHECK(readBatch.Bytes == 0);
+    CHECK(!ReadBatchIsReady(&readBatch, &ReadBatchConfig, TRUE));
+    CHECK(records - stats.OverwrittenRecords == expected.size());
+
+    printf("%-6s %-11s %-9s: %6zu records held, %6llu moved, %6llu overwritten, %6zu read\n",
+        ToSize > FromSize ? "grow" : ToSize < FromSize ? "shrink" : "same",
+        FromPerCpu == ToPerCpu ? (FromPerCpu ? "per-cpu" : "single") : (FromPerCpu ? "per-cpu>one" : "one>per-cpu"),
+        Policy == RING_OVERFLOW_OVERWRITE_OLDEST ? "overwrite" : "drop",
+        held.size(), (unsigned long long)records, (unsigned long long)stats.OverwrittenRecords, taken);
+
+    TraceBufDelete(to);
+}
+
+//
+// Nothing to move: nothing to read
+//
+static void TestEmpty()
+{
+    PTRACE_BUF from = TraceBufCreate(TRACE_BUF_MIN_RING_SIZE, FALSE, RING_OVERFLOW_DROP_NEWEST);
+    PTRACE_BUF to = TraceBufCreate(2 * TRACE_BUF_MIN_RING_SIZE, FALSE, RING_OVERFLOW_DROP_NEWEST);
+    ULONG64 scratch[TRACE_RECORD_MAX_SIZE / sizeof(ULONG64)];
+    READ_BATCH readBatch;
+    ULONG64 records;
+    ULONG64 bytes = 1;
+
+    ReadBatchInit(&readBatch);
+    records = TraceBufMigrate(to, from, (PUCHAR)scratch, sizeof(scratch), &bytes);
+    ReadBatchRestart(&readBatch, bytes, records, 0, 0);
+
+    CHECK(bytes == 0);
+    CHECK(readBatch.Records == 0 && readBatch.Bytes == 0);
+    CHECK(!ReadBatchIsReady(&readBatch, &ReadBatchConfig, TRUE));
+    CHECK(TraceBufGet(to, (PUCHAR)scratch, sizeof(scratch)) == 0);
+
+    TraceBufDelete(from);
+    TraceBufDelete(to);
+}
+
+int main()
+{
+    const size_t small = TRACE_BUF_MIN_RING_SIZE * TEST_PROCESSORS;
+    const size_t large = 4 * small;
+    const ULONG policies[] = { RING_OVERFLOW_DROP_NEWEST, RING_OVERFLOW_OVERWRITE_OLDEST };
+
+    WdkShimProcessorCount = TEST_PROCESSORS;
+    ReadBatchInitConfig(&ReadBatchConfig);
+
+    TestEmpty();
+
+    for (ULONG perCpu = 0; perCpu < 2; perCpu++)
+    {
+        for (ULONG p = 0; p < 2; p++)
+        {
+            TestResize((BOOLEAN)perCpu, (BOOLEAN)perCpu, policies[p], small, large);
+            TestResize((BOOLEAN)perCpu, (BOOLEAN)perCpu, policies[p], large, small);
+        }
+    }
+
+    // PerCpuTraceBuffer changed since the trace buffer was made
+    for (ULONG p = 0; p < 2; p++)
+    {
+        TestResize(TRUE, FALSE, policies[p], large, large);
+        TestResize(FALSE, TRUE, policies[p], large, large);
+    }
+
+    printf("%s, %u failures\n", Failures ? "FAILED" : "passed", Failures);
+    return Failures ? 1 : 0;
+}
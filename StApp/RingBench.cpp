@@ -0,0 +1,767 @@
+// RingBench.cpp : throughput of the driver's trace ring, off Windows.
+//
+// Builds StorTrace's RingBuf.c as it is, on the kernel shim in Wdk, and
+// times RingBufPutEx and RingBufGetEx with records the size of a traced
+// command: first on one thread, the ring filled halfway then drained in
+// reads the size StApp makes, then with a producer and a reader thread
+// going at once, the reader draining while the producer puts.
+//
+// With -d, it times a control device read draining the ring, against how
+// the read path drained it before RingBufGetEx: a byte at a time. With -o,
+// it times putting and getting against the ring of before it went to a
+// power of two size with free-running cursors, positions by modulo, and
+// the single-threaded ring of just after. With -p, it times 1 to N
+// producer threads putting through a trace buffer (TraceBuf.c) of one
+// shared ring, then of one ring per processor, each thread its own
+// processor, while a reader drains it.
+//
+// POSIX only, not part of the Visual Studio solution:
+//
+//   g++ -O2 -pthread -I Wdk -o ringbench RingBench.cpp -x c ../StorTrace/RingBuf.c -x c ../StorTrace/TraceBuf.c
+//
+//   ringbench [-s MB] [-r Bytes] [-n Records]
+//                              -s size of the ring (default 16), -r of the
+//                              records (default a 10-byte CDB's), -n records
+//                              put (default 20000000)
+//   ringbench -d [-r Bytes]    drain 10 MB of records, both ways
+//   ringbench -o [-r Bytes] [-n Records]
+//                              put and get records, the three rings
+//   ringbench -p N [-s MB] [-r Bytes] [-n Records]
+//                              1 to N producers, Records each (default
+//                              2000000)
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <thread>
+#include <vector>
+
+#include "Wdk/driver.h"
+
+extern "C" {
+#include "../StorTrace/RingBuf.h"
+#include "../StorTrace/TraceBuf.h"
+}
+
+//
+// What StApp reads at a time
+//
+#define BENCH_READ_SIZE     (1024 * 1024)
+
+//
+// Trace drained with -d, as much as the ring held before it was sized by
+// a power of two
+//
+#define BENCH_DRAIN_SIZE    (10 * 1024 * 1024)
+
+static double Now()
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static void Report(const char *Name, double Seconds, ULONG64 Records, ULONG RecordSize)
+{
+    printf("%-10s %6.1f ns/record, %8.1f MB/s, %llu records in %.2f s\n", Name,
+        Seconds * 1e9 / Records, Records * RecordSize / Seconds / 1e6, (unsigned long long)Records, Seconds);
+}
+
+//
+// Put, then get, the ring half full at most, so no put fails
+//
+static int TimeAlone(size_t RingSize, ULONG RecordSize, ULONG64 Records)
+{
+    PRING_BUF ring = RingBufCreate(RingSize, RING_OVERFLOW_DROP_NEWEST);
+    std::vector<UCHAR> record(RecordSize, 0x5A);
+    std::vector<UCHAR> data(BENCH_READ_SIZE);
+    ULONG64 batch = RingSize / 2 / RING_ENTRY_SIZE(RecordSize);
+    ULONG64 put = 0;
+    ULONG64 got = 0;
+    double putSeconds = 0;
+    double getSeconds = 0;
+
+    if (ring == NULL)
+    {
+        fprintf(stderr, "ring size must be a power of two, at least %d\n", PAGE_SIZE);
+        return 1;
+    }
+
+    while (put < Records)
+    {
+        ULONG64 count = Records - put < batch ? Records - put : batch;
+        double start = Now();
+        size_t bytes;
+
+        for (ULONG64 i = 0; i < count; i++) {
+            RingBufPutEx(ring, put + i, record.data(), RecordSize);
+        }
+        put += count;
+
+        putSeconds += Now() - start;
+        start = Now();
+
+        while ((bytes = RingBufGetEx(ring, data.data(), data.size(), NULL)) != 0) {
+            got += bytes;
+        }
+
+        getSeconds += Now() - start;
+    }
+
+    if (got != put * RecordSize)
+    {
+        fprintf(stderr, "put %llu bytes, got %llu\n", (unsigned long long)(put * RecordSize), (unsigned long long)got);
+        return 1;
+    }
+
+    Report("put", putSeconds, put, RecordSize);
+    Report("get", getSeconds, put, RecordSize);
+
+    RingBufDelete(ring);
+    return 0;
+}
+
+//
+// A producer putting as fast as it can, a reader draining as fast as it
+// can; what did not fit is dropped
+//
+static int TimeTogether(size_t RingSize, ULONG RecordSize, ULONG64 Records)
+{
+    PRING_BUF ring = RingBufCreate(RingSize, RING_OVERFLOW_DROP_NEWEST);
+    volatile BOOL done = FALSE;
+    ULONG64 got = 0;
+    RING_BUF_STATS stats;
+    double start;
+    double seconds;
+
+    if (ring == NULL) {
+        return 1;
+    }
+
+    start = Now();
+
+    std::thread reader([&]()
+    {
+        std::vector<UCHAR> data(BENCH_READ_SIZE);
+        size_t bytes;
+
+        while (!done || !RingBufIsEmpty(ring))
+        {
+            while ((bytes = RingBufGetEx(ring, data.data(), data.size(), NULL)) != 0) {
+                got += bytes;
+            }
+        }
+    });
+
+    std::vector<UCHAR> record(RecordSize, 0x5A);
+
+    for (ULONG64 i = 0; i < Records; i++) {
+        RingBufPutEx(ring, i, record.data(), RecordSize);
+    }
+    done = TRUE;
+
+    reader.join();
+    seconds = Now() - start;
+
+    RingBufGetStats(ring, &stats);
+
+    if (got + stats.DroppedBytes != Records * RecordSize)
+    {
+        fprintf(stderr, "put %llu bytes, got %llu, dropped %llu\n", (unsigned long long)(Records * RecordSize),
+            (unsigned long long)got, (unsigned long long)stats.DroppedBytes);
+        return 1;
+    }
+
+    Report("together", seconds, Records, RecordSize);
+    printf("           %llu records dropped, the ring held %llu bytes at most\n",
+        (unsigned long long)stats.DroppedRecords, (unsigned long long)stats.HighWater);
+
+    RingBufDelete(ring);
+    return 0;
+}
+
+//
+// The ring before RingBufGetEx, and its reads: the spin lock taken for
+// every byte (GetByteFromRingBuf), each byte copied into the request on
+// its own (WdfMemoryCopyFromBuffer)
+//
+typedef struct _OLD_RING {
+    UCHAR   Buffer[BENCH_DRAIN_SIZE];
+    size_t  Head;
+    size_t  Tail;
+    size_t  Size;
+} OLD_RING;
+
+static pthread_spinlock_t OldRingLock;
+
+static BOOLEAN OldRingGet(OLD_RING *Ring, PUCHAR Data)
+{
+    BOOLEAN r = FALSE;
+
+    pthread_spin_lock(&OldRingLock);
+
+    if (Ring->Head != Ring->Tail)
+    {
+        *Data = Ring->Buffer[Ring->Tail];
+        Ring->Tail = (Ring->Tail + 1) % Ring->Size;
+        r = TRUE;
+    }
+
+    pthread_spin_unlock(&OldRingLock);
+
+    return r;
+}
+
+static __attribute__((noinline)) BOOL CopyFromBuffer(PUCHAR Memory, size_t MemoryLength, size_t Offset, const UCHAR *Data, size_t Length)
+{
+    if (Offset + Length > MemoryLength) {
+        return FALSE;
+    }
+    memcpy(Memory + Offset, Data, Length);
+    return TRUE;
+}
+
+static size_t OldRead(OLD_RING *Ring, PUCHAR Buffer, size_t Length)
+{
+    size_t copied;
+
+    for (copied = 0; copied < Length; copied++)
+    {
+        UCHAR data;
+
+        if (!OldRingGet(Ring, &data)) {
+            break;
+        }
+        if (!CopyFromBuffer(Buffer, Length, copied, &data, 1)) {
+            break;
+        }
+    }
+
+    return copied;
+}
+
+//
+// The same trace in both rings, drained in reads of BENCH_READ_SIZE
+//
+static int TimeDrain(ULONG RecordSize)
+{
+    OLD_RING *oldRing = (OLD_RING *)calloc(1, sizeof(OLD_RING));
+    PRING_BUF ring = RingBufCreate(16 * 1024 * 1024, RING_OVERFLOW_DROP_NEWEST);   // and the entry headers
+    std::vector<UCHAR> record(RecordSize, 0x5A);
+    std::vector<UCHAR> data(BENCH_READ_SIZE);
+    ULONG64 records = (BENCH_DRAIN_SIZE - 1) / RecordSize;
+    ULONG64 bytes[2] = { 0, 0 };
+    ULONG reads[2] = { 0, 0 };
+    double seconds[2];
+    double start;
+    size_t got;
+
+    if (oldRing == NULL || ring == NULL) {
+        return 1;
+    }
+
+    pthread_spin_init(&OldRingLock, PTHREAD_PROCESS_PRIVATE);
+    oldRing->Size = BENCH_DRAIN_SIZE;
+
+    for (ULONG64 i = 0; i < records; i++)
+    {
+        memcpy(&oldRing->Buffer[oldRing->Head], record.data(), RecordSize);
+        oldRing->Head += RecordSize;
+        RingBufPutEx(ring, i, record.data(), RecordSize);
+    }
+
+    start = Now();
+    while ((got = OldRead(oldRing, data.data(), data.size())) != 0)
+    {
+        bytes[0] += got;
+        reads[0]++;
+    }
+    seconds[0] = Now() - start;
+
+    start = Now();
+    while ((got = RingBufGetEx(ring, data.data(), data.size(), NULL)) != 0)
+    {
+        bytes[1] += got;
+        reads[1]++;
+    }
+    seconds[1] = Now() - start;
+
+    if (bytes[0] != records * RecordSize || bytes[1] != bytes[0])
+    {
+        fprintf(stderr, "drained %llu and %llu bytes of %llu\n", (unsigned long long)bytes[0],
+            (unsigned long long)bytes[1], (unsigned long long)(records * RecordSize));
+        return 1;
+    }
+
+    printf("%llu records of %u bytes, %.1f MB\n", (unsigned long long)records, RecordSize, bytes[0] / 1e6);
+    printf("%-10s %8.1f MB/s, %u reads of %8.1f us each\n", "bytewise",
+        bytes[0] / seconds[0] / 1e6, reads[0], seconds[0] * 1e6 / reads[0]);
+    printf("%-10s %8.1f MB/s, %u reads of %8.1f us each\n", "bulk",
+        bytes[1] / seconds[1] / 1e6, reads[1], seconds[1] * 1e6 / reads[1]);
+
+    RingBufDelete(ring);
+    free(oldRing);
+    return 0;
+}
+
+//
+// Record the reference rings can walk: they find the length of a record
+// from its CDB and sense lengths
+//
+static void MakeTraceRecord(PUCHAR Record, ULONG RecordSize)
+{
+    PTRACE_RECORD_HEADER header = (PTRACE_RECORD_HEADER)Record;
+    ULONG variable = RecordSize - sizeof(TRACE_RECORD_HEADER);
+
+    memset(Record, 0x5A, RecordSize);
+    header->Magic = TRACE_RECORD_MAGIC;
+    header->Version = TRACE_RECORD_VERSION;
+    header->Length = RecordSize;
+    header->CdbLength = (UCHAR)(variable < 255 ? variable : 255);
+    header->SenseLength = (UCHAR)(variable - header->CdbLength);
+}
+
+static size_t TraceRecordLength(UCHAR CdbLength, UCHAR SenseLength)
+{
+    return TRACE_RECORD_SIZE(CdbLength, SenseLength);
+}
+
+//
+// The ring of the bulk drain (OLD_RING, BENCH_DRAIN_SIZE bytes), with its
+// put and get: positions wrapped by modulo, one byte always free
+//
+static size_t OldRingUsed(OLD_RING *Ring)
+{
+    return (Ring->Head + Ring->Size - Ring->Tail) % Ring->Size;
+}
+
+static size_t OldRingRecordLength(OLD_RING *Ring, size_t Offset)
+{
+    return TraceRecordLength(Ring->Buffer[(Offset + FIELD_OFFSET(TRACE_RECORD_HEADER, CdbLength)) % Ring->Size],
+        Ring->Buffer[(Offset + FIELD_OFFSET(TRACE_RECORD_HEADER, SenseLength)) % Ring->Size]);
+}
+
+static void OldRingPutEx(OLD_RING *Ring, const UCHAR *Data, size_t DataLength)
+{
+    size_t first;
+
+    if (DataLength == 0 || DataLength > Ring->Size - 1) {
+        return;
+    }
+
+    while (Ring->Size - 1 - OldRingUsed(Ring) < DataLength) {
+        Ring->Tail = (Ring->Tail + OldRingRecordLength(Ring, Ring->Tail)) % Ring->Size;
+    }
+
+    first = Ring->Size - Ring->Head;
+    if (first > DataLength) {
+        first = DataLength;
+    }
+
+    memcpy(&Ring->Buffer[Ring->Head], Data, first);
+    if (first < DataLength) {
+        memcpy(&Ring->Buffer[0], Data + first, DataLength - first);
+    }
+
+    Ring->Head = (Ring->Head + DataLength) % Ring->Size;
+}
+
+static size_t OldRingGetEx(OLD_RING *Ring, PUCHAR Data, size_t DataLength)
+{
+    size_t used = OldRingUsed(Ring);
+    size_t length = 0;
+    size_t first;
+
+    if (used == 0) {
+        return 0;
+    }
+
+    if (DataLength >= used)
+    {
+        length = used;
+    }
+    else
+    {
+        while (TRUE)
+        {
+            size_t recordLength = OldRingRecordLength(Ring, (Ring->Tail + length) % Ring->Size);
+            if (length + recordLength > DataLength) {
+                break;
+            }
+            length += recordLength;
+        }
+    }
+
+    first = Ring->Size - Ring->Tail;
+    if (first > length) {
+        first = length;
+    }
+
+    memcpy(Data, &Ring->Buffer[Ring->Tail], first);
+    if (first < length) {
+        memcpy(Data + first, &Ring->Buffer[0], length - first);
+    }
+
+    Ring->Tail = (Ring->Tail + length) % Ring->Size;
+    return length;
+}
+
+//
+// The ring just after: a power of two size, free-running 64-bit cursors
+// masked into positions, still one producer at a time
+//
+#define MASK_RING_SIZE      (16 * 1024 * 1024)
+
+typedef struct _MASK_RING {
+    UCHAR   Buffer[MASK_RING_SIZE];
+    ULONG64 Head;
+    ULONG64 Tail;
+    size_t  Size;
+    size_t  Mask;
+} MASK_RING;
+
+static size_t MaskRingRecordLength(MASK_RING *Ring, ULONG64 Offset)
+{
+    return TraceRecordLength(Ring->Buffer[(Offset + FIELD_OFFSET(TRACE_RECORD_HEADER, CdbLength)) & Ring->Mask],
+        Ring->Buffer[(Offset + FIELD_OFFSET(TRACE_RECORD_HEADER, SenseLength)) & Ring->Mask]);
+}
+
+static void MaskRingPutEx(MASK_RING *Ring, const UCHAR *Data, size_t DataLength)
+{
+    size_t head;
+    size_t first;
+
+    if (DataLength == 0 || DataLength > Ring->Size) {
+        return;
+    }
+
+    while (Ring->Size - (size_t)(Ring->Head - Ring->Tail) < DataLength) {
+        Ring->Tail += MaskRingRecordLength(Ring, Ring->Tail);
+    }
+
+    head = (size_t)(Ring->Head & Ring->Mask);
+    first = Ring->Size - head;
+    if (first > DataLength) {
+        first = DataLength;
+    }
+
+    memcpy(&Ring->Buffer[head], Data, first);
+    if (first < DataLength) {
+        memcpy(&Ring->Buffer[0], Data + first, DataLength - first);
+    }
+
+    Ring->Head += DataLength;
+}
+
+static size_t MaskRingGetEx(MASK_RING *Ring, PUCHAR Data, size_t DataLength)
+{
+    size_t used = (size_t)(Ring->Head - Ring->Tail);
+    size_t length = 0;
+    size_t tail;
+    size_t first;
+
+    if (used == 0) {
+        return 0;
+    }
+
+    if (DataLength >= used)
+    {
+        length = used;
+    }
+    else
+    {
+        while (TRUE)
+        {
+            size_t recordLength = MaskRingRecordLength(Ring, Ring->Tail + length);
+            if (length + recordLength > DataLength) {
+                break;
+            }
+            length += recordLength;
+        }
+    }
+
+    tail = (size_t)(Ring->Tail & Ring->Mask);
+    first = Ring->Size - tail;
+    if (first > length) {
+        first = length;
+    }
+
+    memcpy(Data, &Ring->Buffer[tail], first);
+    if (first < length) {
+        memcpy(Data + first, &Ring->Buffer[0], length - first);
+    }
+
+    Ring->Tail += length;
+    return length;
+}
+
+//
+// Each ring filled to a quarter of the old one's size, then drained in
+// reads too small for all of it, so the gets walk the records for the
+// last one that fits, as often as the reads are apart
+//
+#define BENCH_GET_SIZE      (64 * 1024)
+
+static int TimePutGet(ULONG RecordSize, ULONG64 Records)
+{
+    OLD_RING *oldRing = (OLD_RING *)calloc(1, sizeof(OLD_RING));
+    MASK_RING *maskRing = (MASK_RING *)calloc(1, sizeof(MASK_RING));
+    PRING_BUF ring = RingBufCreate(MASK_RING_SIZE, RING_OVERFLOW_DROP_NEWEST);
+    const char *names[3] = { "modulo", "mask", "lock-free" };
+    std::vector<UCHAR> record(RecordSize);
+    std::vector<UCHAR> data(BENCH_GET_SIZE);
+    ULONG64 batch = BENCH_DRAIN_SIZE / 4 / RecordSize;
+    double putSeconds[3] = { 0, 0, 0 };
+    double getSeconds[3] = { 0, 0, 0 };
+    ULONG64 got[3] = { 0, 0, 0 };
+
+    if (oldRing == NULL || maskRing == NULL || ring == NULL) {
+        return 1;
+    }
+
+    oldRing->Size = BENCH_DRAIN_SIZE;
+    maskRing->Size = MASK_RING_SIZE;
+    maskRing->Mask = MASK_RING_SIZE - 1;
+
+    MakeTraceRecord(record.data(), RecordSize);
+
+    for (ULONG64 put = 0; put < Records; put += batch)
+    {
+        for (int r = 0; r < 3; r++)
+        {
+            double start = Now();
+            size_t bytes;
+
+            for (ULONG64 i = 0; i < batch; i++)
+            {
+                switch (r)
+                {
+                case 0: OldRingPutEx(oldRing, record.data(), RecordSize); break;
+                case 1: MaskRingPutEx(maskRing, record.data(), RecordSize); break;
+                default: RingBufPutEx(ring, i, record.data(), RecordSize); break;
+                }
+            }
+
+            putSeconds[r] += Now() - start;
+            start = Now();
+
+            do
+            {
+                switch (r)
+                {
+                case 0: bytes = OldRingGetEx(oldRing, data.data(), data.size()); break;
+                case 1: bytes = MaskRingGetEx(maskRing, data.data(), data.size()); break;
+                default: bytes = RingBufGetEx(ring, data.data(), data.size(), NULL); break;
+                }
+                got[r] += bytes;
+            } while (bytes != 0);
+
+            getSeconds[r] += Now() - start;
+        }
+    }
+
+    for (int r = 0; r < 3; r++)
+    {
+        ULONG64 records = got[r] / RecordSize;
+
+        if (got[r] != got[0])
+        {
+            fprintf(stderr, "%s got %llu bytes, %s %llu\n", names[r], (unsigned long long)got[r],
+                names[0], (unsigned long long)got[0]);
+            return 1;
+        }
+
+        printf("%-10s put %6.1f ns/record, get %6.1f ns/record\n", names[r],
+            putSeconds[r] * 1e9 / records, getSeconds[r] * 1e9 / records);
+    }
+
+    RingBufDelete(ring);
+    free(maskRing);
+    free(oldRing);
+    return 0;
+}
+
+//
+// Producers, each on a processor of its own, putting Records each with
+// the driver's timestamps, a reader draining as StApp does. Records the
+// reader could not keep up with are dropped.
+//
+static int TimeProducers(BOOLEAN PerCpu, ULONG Producers, size_t Size, ULONG RecordSize, ULONG64 Records)
+{
+    PTRACE_BUF traceBuf;
+    std::vector<std::thread> producers;
+    volatile ULONG running = Producers;
+    ULONG64 got = 0;
+    RING_BUF_STATS stats;
+    double start;
+    double putSeconds;
+    double seconds;
+
+    WdkShimProcessorCount = Producers;
+
+    traceBuf = TraceBufCreate(Size, PerCpu, RING_OVERFLOW_DROP_NEWEST);
+    if (traceBuf == NULL) {
+        return 1;
+    }
+
+    start = Now();
+
+    std::thread reader([&]()
+    {
+        std::vector<UCHAR> data(BENCH_READ_SIZE);
+        size_t bytes;
+
+        while (TRUE)
+        {
+            BOOL last = (running == 0);
+
+            while ((bytes = TraceBufGet(traceBuf, data.data(), data.size())) != 0) {
+                got += bytes;
+            }
+            if (last) {
+                break;
+            }
+        }
+    });
+
+    for (ULONG p = 0; p < Producers; p++)
+    {
+        producers.push_back(std::thread([&, p]()
+        {
+            std::vector<UCHAR> record(RecordSize, 0x5A);
+
+            WdkShimProcessor = p;
+
+            for (ULONG64 i = 0; i < Records; i++) {
+                TraceBufPut(traceBuf, (ULONG64)KeQueryPerformanceCounter(NULL).QuadPart, record.data(), RecordSize);
+            }
+
+            __atomic_sub_fetch(&running, 1, __ATOMIC_SEQ_CST);
+        }));
+    }
+
+    for (ULONG p = 0; p < Producers; p++) {
+        producers[p].join();
+    }
+    putSeconds = Now() - start;
+
+    reader.join();
+    seconds = Now() - start;
+
+    TraceBufGetStats(traceBuf, &stats);
+
+    if (got + stats.DroppedBytes != Producers * Records * RecordSize)
+    {
+        fprintf(stderr, "put %llu bytes, got %llu, dropped %llu\n",
+            (unsigned long long)(Producers * Records * RecordSize), (unsigned long long)got,
+            (unsigned long long)stats.DroppedBytes);
+        return 1;
+    }
+
+    printf("%-8s %3u producers: %7.2f M records/s put, %7.2f M records/s read, %5.1f%% dropped\n",
+        PerCpu ? "per-cpu" : "shared", Producers, Producers * Records / putSeconds / 1e6,
+        got / RecordSize / seconds / 1e6, 100.0 * stats.DroppedRecords / (Producers * Records));
+
+    TraceBufDelete(traceBuf);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    size_t ringSize = 16 * 1024 * 1024;
+    ULONG recordSize = (ULONG)TRACE_RECORD_SIZE(10, 0);
+    ULONG64 records = 0;
+    BOOL drain = FALSE;
+    BOOL compare = FALSE;
+    ULONG producers = 0;
+    int i;
+
+    for (i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-d") == 0)
+        {
+            drain = TRUE;
+        }
+        else if (strcmp(argv[i], "-o") == 0)
+        {
+            compare = TRUE;
+        }
+        else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc)
+        {
+            producers = strtoul(argv[++i], NULL, 0);
+        }
+        else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc)
+        {
+            ringSize = (size_t)strtoull(argv[++i], NULL, 0) * 1024 * 1024;
+        }
+        else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc)
+        {
+            recordSize = strtoul(argv[++i], NULL, 0);
+        }
+        else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc)
+        {
+            records = strtoull(argv[++i], NULL, 0);
+        }
+        else
+        {
+            fprintf(stderr, "usage: %s [-s MB] [-r Bytes] [-n Records] | -d [-r Bytes] | -o [-r Bytes] [-n Records] | -p N [-s MB] [-r Bytes] [-n Records]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (records == 0) {
+        records = producers != 0 ? 2000000 : 20000000;
+    }
+
+    if (recordSize == 0 || recordSize > TRACE_RECORD_MAX_SIZE || records == 0)
+    {
+        fprintf(stderr, "records of 1 to %d bytes, at least one\n", (int)TRACE_RECORD_MAX_SIZE);
+        return 1;
+    }
+
+    if (drain) {
+        return TimeDrain(recordSize);
+    }
+
+    if (compare)
+    {
+        if (recordSize < sizeof(TRACE_RECORD_HEADER) || recordSize % TRACE_RECORD_ALIGN != 0)
+        {
+            fprintf(stderr, "records of %d bytes or more, by %d\n", (int)sizeof(TRACE_RECORD_HEADER), TRACE_RECORD_ALIGN);
+            return 1;
+        }
+
+        printf("%llu records of %u bytes\n", (unsigned long long)records, recordSize);
+        return TimePutGet(recordSize, records);
+    }
+
+    if (producers != 0)
+    {
+        printf("%llu records of %u bytes a producer, %zu MB trace buffer\n", (unsigned long long)records, recordSize,
+            ringSize >> 20);
+
+        for (int perCpu = 0; perCpu < 2; perCpu++)
+        {
+            for (ULONG n = 1; n <= producers; n++)
+            {
+                if (TimeProducers((BOOLEAN)perCpu, n, ringSize, recordSize, records) != 0) {
+                    return 1;
+                }
+            }
+        }
+        return 0;
+    }
+
+    printf("%llu records of %u bytes, %zu MB ring\n", (unsigned long long)records, recordSize, ringSize >> 20);
+
+    if (TimeAlone(ringSize, recordSize, records) != 0) {
+        return 1;
+    }
+
+    return TimeTogether(ringSize, recordSize, records);
+}
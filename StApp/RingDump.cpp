@@ -0,0 +1,274 @@
+// RingDump.cpp : reference consumer of a trace ring kept in a file.
+//
+// The file has the layout of a mapped trace ring (RingLayout.h): the
+// header page, then the ring. It is mapped read-only and walked with the
+// same RingReader StApp uses on the ring the driver maps, so the record
+// parser and the cursor protocol can be exercised off Windows, with any
+// producer that follows the protocol writing to the file.
+//
+// The tail is released by writing it to the file, where the driver keeps
+// it, standing in for IOCTL_STORTRACE_RELEASE_RING.
+//
+// POSIX only, not part of the Visual Studio solution:
+//
+//   g++ -O2 -o ringdump RingDump.cpp RingReader.cpp
+//
+//   ringdump -c File Size      create an empty ring of Size bytes
+//   ringdump [-p] [-F] File    consume it, -p prints every record,
+//                              -F keeps following it until interrupted,
+//                              then prints the summary
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <map>
+
+#include "RingReader.h"
+
+//
+// Same lag StApp allows in -m mode before it hands space back
+//
+#define RELEASE_FRACTION    4
+#define IDLE_WAIT_US        10000
+
+static volatile sig_atomic_t Stop = 0;
+
+static void OnSignal(int Signal)
+{
+    (void)Signal;
+    Stop = 1;
+}
+
+static int CreateRing(const char *Path, ULONG64 Size)
+{
+    RING_HEADER header;
+    int fd;
+
+    if (Size < RING_HEADER_SIZE || (Size & (Size - 1)) != 0)
+    {
+        fprintf(stderr, "ring size must be a power of two, at least %d\n", RING_HEADER_SIZE);
+        return 1;
+    }
+
+    fd = open(Path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        perror(Path);
+        return 1;
+    }
+
+    memset(&header, 0, sizeof(header));
+    header.Magic = RING_HEADER_MAGIC;
+    header.Version = RING_HEADER_VERSION;
+    header.Size = Size;
+
+    if (ftruncate(fd, (off_t)(RING_HEADER_SIZE + Size)) != 0 ||
+        pwrite(fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header))
+    {
+        perror(Path);
+        close(fd);
+        return 1;
+    }
+
+    close(fd);
+    return 0;
+}
+
+static BOOL ReleaseTail(int Fd, ULONG64 Tail)
+{
+    LONG64 tail = (LONG64)Tail;
+
+    return pwrite(Fd, &tail, sizeof(tail), offsetof(RING_HEADER, Tail)) == (ssize_t)sizeof(tail);
+}
+
+static void PrintRecord(const TRACE_RECORD_HEADER *Record)
+{
+    const UCHAR *cdb = TRACE_RECORD_CDB(Record);
+
+    printf("%u %llu:", Record->DeviceId, (unsigned long long)Record->SequenceNumber);
+    if ((Record->Flags & TRACE_RECORD_FLAG_REQUEST) && Record->CdbLength >= sizeof(TRACE_RECORD_REQUEST))
+    {
+        const TRACE_RECORD_REQUEST *request = (const TRACE_RECORD_REQUEST *)cdb;
+
+        printf(" %s %llu+%u/%u", request->MajorFunction == TRACE_RECORD_REQUEST_WRITE ? "write" : "read",
+            (unsigned long long)request->Offset, request->Length, request->Information);
+    }
+    else
+    {
+        for (UCHAR i = 0; i < Record->CdbLength; i++)
+        {
+            printf(" %02X", cdb[i]);
+        }
+        if (Record->Flags & TRACE_RECORD_FLAG_DECODED)
+        {
+            printf(" lba %llu+%u%s%s", (unsigned long long)Record->Lba, Record->Blocks,
+                (Record->CdbFlags & CDB_FLAG_FUA) ? " fua" : "",
+                (Record->CdbFlags & CDB_FLAG_DPO) ? " dpo" : "");
+        }
+    }
+    printf(" latency %llu status %08X/%02X\n", (unsigned long long)Record->Latency,
+        (unsigned)Record->NtStatus, Record->ScsiStatus);
+}
+
+int main(int argc, char *argv[])
+{
+    BOOL print = FALSE;
+    BOOL follow = FALSE;
+    const char *path = NULL;
+    struct stat st;
+    void *mapping;
+    int fd;
+    int i;
+
+    std::map<ULONG, ULONG64> nextSequence;
+    ULONG64 records = 0;
+    ULONG64 commands = 0;       // records scaled up by their sample rate
+    ULONG64 bytes = 0;
+    ULONG64 lost = 0;
+    ULONG64 bad = 0;
+    ULONG64 released;
+    ULONG64 dropped;
+    ULONG64 droppedBytes;
+    ULONG64 overwritten;
+    ULONG64 overwrittenBytes;
+
+    if (argc == 4 && strcmp(argv[1], "-c") == 0)
+    {
+        return CreateRing(argv[2], strtoull(argv[3], NULL, 0));
+    }
+
+    for (i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-p") == 0)
+        {
+            print = TRUE;
+        }
+        else if (strcmp(argv[i], "-F") == 0)
+        {
+            follow = TRUE;
+        }
+        else
+        {
+            path = argv[i];
+        }
+    }
+
+    if (path == NULL)
+    {
+        fprintf(stderr, "usage: %s -c File Size | [-p] [-F] File\n", argv[0]);
+        return 1;
+    }
+
+    // Written only to release the tail, the ring itself is mapped read-only
+    fd = open(path, O_RDWR);
+    if (fd < 0 || fstat(fd, &st) != 0)
+    {
+        perror(path);
+        return 1;
+    }
+
+    mapping = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (mapping == MAP_FAILED)
+    {
+        perror(path);
+        return 1;
+    }
+
+    RingReader reader(mapping, (size_t)st.st_size);
+    if (!reader.IsValid())
+    {
+        fprintf(stderr, "%s: not a trace ring\n", path);
+        return 1;
+    }
+
+    released = reader.GetTail();
+
+    signal(SIGINT, OnSignal);
+    signal(SIGTERM, OnSignal);
+
+    while (TRUE)
+    {
+        const TRACE_RECORD_HEADER *record = reader.Next();
+
+        if (record == NULL)
+        {
+            if (!reader.IsValid())
+            {
+                fprintf(stderr, "bad ring entry at %llu\n", (unsigned long long)reader.GetTail());
+                break;
+            }
+
+            if (reader.GetTail() != released)
+            {
+                released = reader.GetTail();
+                ReleaseTail(fd, released);
+            }
+
+            if (!follow || Stop)
+            {
+                break;
+            }
+
+            usleep(IDLE_WAIT_US);
+            continue;
+        }
+
+        if (record->Magic != TRACE_RECORD_MAGIC ||
+            record->Version != TRACE_RECORD_VERSION ||
+            record->Length != TRACE_RECORD_SIZE(record->CdbLength, record->SenseLength))
+        {
+            bad++;
+            continue;
+        }
+
+        records++;
+        commands += record->SampleRate ? record->SampleRate : 1;
+        bytes += record->Length;
+
+        std::map<ULONG, ULONG64>::iterator next = nextSequence.find(record->DeviceId);
+        if (next != nextSequence.end() && record->SequenceNumber > next->second)
+        {
+            lost += record->SequenceNumber - next->second;
+        }
+        if (next == nextSequence.end() || record->SequenceNumber >= next->second)
+        {
+            nextSequence[record->DeviceId] = record->SequenceNumber + 1;
+        }
+
+        if (print)
+        {
+            PrintRecord(record);
+        }
+
+        // Do not hold the producers off for a whole ring
+        if (reader.GetTail() - released >= reader.GetSize() / RELEASE_FRACTION)
+        {
+            released = reader.GetTail();
+            ReleaseTail(fd, released);
+        }
+    }
+
+    reader.GetDropped(&dropped, &droppedBytes);
+    reader.GetOverwritten(&overwritten, &overwrittenBytes);
+
+    printf("%llu records (about %llu commands), %llu bytes, %llu lost in sequence, %llu bad\n",
+        (unsigned long long)records, (unsigned long long)commands, (unsigned long long)bytes,
+        (unsigned long long)lost, (unsigned long long)bad);
+    printf("producer dropped %llu records, %llu bytes, overwrote %llu records, %llu bytes; tail %llu\n",
+        (unsigned long long)dropped, (unsigned long long)droppedBytes,
+        (unsigned long long)overwritten, (unsigned long long)overwrittenBytes,
+        (unsigned long long)reader.GetTail());
+
+    munmap(mapping, (size_t)st.st_size);
+    close(fd);
+
+    return (bad != 0);
+}
@@ -0,0 +1,115 @@
+// RingReader.cpp : consume a mapped trace ring in place.
+//
+// Built without the precompiled header, so it also builds off Windows.
+//
+
+#include "RingReader.h"
+
+#include <string.h>
+
+//
+// The producers publish an entry by storing its commit stamp last; loading
+// the stamp with acquire semantics makes the rest of the entry visible
+//
+#ifdef _WIN32
+#define LOAD_ACQUIRE64(p)   ReadAcquire64((volatile LONG64 *)(p))
+#define LOAD_RELAXED64(p)   ReadNoFence64((volatile LONG64 *)(p))
+#else
+#define LOAD_ACQUIRE64(p)   __atomic_load_n((volatile LONG64 *)(p), __ATOMIC_ACQUIRE)
+#define LOAD_RELAXED64(p)   __atomic_load_n((volatile LONG64 *)(p), __ATOMIC_RELAXED)
+#endif
+
+
+RingReader::RingReader(const void *Mapping, size_t Length)
+    : Header((const RING_HEADER *)Mapping), Data(NULL), Size(0), Mask(0), Tail(0), Copy(NULL), Valid(FALSE)
+{
+    if (Length < RING_HEADER_SIZE ||
+        Header->Magic != RING_HEADER_MAGIC ||
+        Header->Version != RING_HEADER_VERSION)
+    {
+        return;
+    }
+
+    Size = Header->Size;
+    if (Size < RING_HEADER_SIZE || (Size & (Size - 1)) != 0 || Size > Length - RING_HEADER_SIZE)
+    {
+        return;
+    }
+
+    Data = (const UCHAR *)Mapping + RING_HEADER_SIZE;
+    Mask = Size - 1;
+    Tail = (ULONG64)LOAD_ACQUIRE64(&Header->Tail);
+    Copy = new ULONG64[TRACE_RECORD_MAX_SIZE / sizeof(ULONG64)];
+    Valid = TRUE;
+}
+
+RingReader::~RingReader()
+{
+    delete[] Copy;
+}
+
+const TRACE_RECORD_HEADER *RingReader::Next()
+{
+    RING_ENTRY_HEADER entry;
+    ULONG64 record;
+
+    if (!Valid || Tail == (ULONG64)LOAD_ACQUIRE64(&Header->Head))
+    {
+        return NULL;
+    }
+
+    // Reserved but still being written
+    if (LOAD_ACQUIRE64(Data + (Tail & Mask)) != RING_COMMIT_STAMP(Tail))
+    {
+        return NULL;
+    }
+
+    CopyOut(Tail, &entry, sizeof(entry));
+
+    if (entry.Length < sizeof(TRACE_RECORD_HEADER) || entry.Length > TRACE_RECORD_MAX_SIZE)
+    {
+        // Not a record this reader can make sense of, stop here
+        Valid = FALSE;
+        return NULL;
+    }
+
+    record = Tail + sizeof(RING_ENTRY_HEADER);
+    Tail += RING_ENTRY_SIZE(entry.Length);
+
+    if ((record & Mask) + entry.Length <= Size)
+    {
+        return (const TRACE_RECORD_HEADER *)(Data + (record & Mask));
+    }
+
+    CopyOut(record, Copy, entry.Length);
+    return (const TRACE_RECORD_HEADER *)Copy;
+}
+
+void RingReader::GetDropped(ULONG64 *Records, ULONG64 *Bytes) const
+{
+    *Records = Valid ? (ULONG64)LOAD_RELAXED64(&Header->DroppedRecords) : 0;
+    *Bytes = Valid ? (ULONG64)LOAD_RELAXED64(&Header->DroppedBytes) : 0;
+}
+
+void RingReader::GetOverwritten(ULONG64 *Records, ULONG64 *Bytes) const
+{
+    *Records = Valid ? (ULONG64)LOAD_RELAXED64(&Header->OverwrittenRecords) : 0;
+    *Bytes = Valid ? (ULONG64)LOAD_RELAXED64(&Header->OverwrittenBytes) : 0;
+}
+
+void RingReader::CopyOut(ULONG64 Offset, void *Buffer, size_t Length) const
+{
+    size_t position = (size_t)(Offset & Mask);
+    size_t first = (size_t)(Size - position);
+
+    if (first > Length)
+    {
+        first = Length;
+    }
+
+    memcpy(Buffer, Data + position, first);
+    if (first < Length)
+    {
+        memcpy((UCHAR *)Buffer + first, Data, Length - first);
+    }
+}
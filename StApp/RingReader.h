@@ -0,0 +1,72 @@
+// RingReader.h : consume a mapped trace ring in place.
+//
+// The driver maps a device's trace ring read-only into the process
+// (IOCTL_STORTRACE_MAP_RING); this walks the committed records in it
+// without copying them, following the cursor protocol of RingLayout.h. It
+// only needs the memory, so a file with the same layout, mapped the same
+// way, works as well (see RingDump.cpp).
+//
+// The reader keeps its own tail. The producers only get the space back
+// once the owner of the mapping hands GetTail() to the driver
+// (IOCTL_STORTRACE_RELEASE_RING), or writes it to the Tail of the file.
+//
+
+#pragma once
+
+#include <stddef.h>
+
+#include "TraceTypes.h"
+#include "../StorTrace/TraceRecord.h"
+#include "../StorTrace/RingLayout.h"
+
+class RingReader
+{
+public:
+    RingReader(const void *Mapping, size_t Length);
+    ~RingReader();
+
+    //
+    // Whether the mapping holds a ring of a layout this reader knows
+    //
+    BOOL IsValid() const { return Valid; }
+
+    //
+    // Next committed record, NULL when there is none yet. The record stays
+    // valid until the next call and until the tail is released past it.
+    // A record that wraps around the end of the ring is returned from a
+    // copy, all others in place.
+    //
+    const TRACE_RECORD_HEADER *Next();
+
+    //
+    // Stream offset up to which records were returned
+    //
+    ULONG64 GetTail() const { return Tail; }
+
+    //
+    // Bytes of the ring, without the header page
+    //
+    ULONG64 GetSize() const { return Size; }
+
+    //
+    // Records the producers dropped because the ring was full
+    //
+    void GetDropped(ULONG64 *Records, ULONG64 *Bytes) const;
+
+    //
+    // Records the producers retired unread because the ring was full, with
+    // the overwrite-oldest policy (never while mapped)
+    //
+    void GetOverwritten(ULONG64 *Records, ULONG64 *Bytes) const;
+
+private:
+    const RING_HEADER   *Header;
+    const UCHAR         *Data;
+    ULONG64             Size;
+    ULONG64             Mask;
+    ULONG64             Tail;
+    ULONG64             *Copy;  // of a record that wraps
+    BOOL                Valid;
+
+    void CopyOut(ULONG64 Offset, void *Buffer, size_t Length) const;
+};
@@ -0,0 +1,544 @@
+// RingTest.cpp : unit test of the driver's trace ring, off Windows.
+//
+// Builds StorTrace's RingBuf.c as it is, on the kernel shim in Wdk, and
+// checks RingBufPutEx and RingBufGetEx against a model of what the ring
+// must hold: records split where they wrap around the end of the buffer
+// come back whole, and a full ring drops or retires records whole, never
+// a part of one. RingBufRelease takes back the space of whole committed
+// entries only.
+//
+// Then producer threads put records at once while a reader drains them,
+// under both overflow policies, and every record put is checked to come
+// back once and whole, in the order its producer put it, or to be counted
+// as dropped or overwritten.
+//
+// POSIX only, not part of the Visual Studio solution:
+//
+//   g++ -O2 -pthread -I Wdk -o ringtest RingTest.cpp -x c ../StorTrace/RingBuf.c
+//
+//   ringtest [Producers [Records]]
+//                              run the tests, exit status 1 if any fails;
+//                              Producers threads (default 8) put Records
+//                              records each (default 50000)
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <deque>
+#include <thread>
+#include <vector>
+
+#include "Wdk/driver.h"
+
+extern "C" {
+#include "../StorTrace/RingBuf.h"
+}
+
+//
+// Smallest ring, so the tests wrap it often
+//
+#define TEST_RING_SIZE      PAGE_SIZE
+
+//
+// Test records: their length, their number, then bytes that depend on
+// both, so a record cut, torn or from the wrong place does not check out
+//
+#define TEST_RECORD_MIN     12
+#define TEST_RECORD_MAX     1024
+
+static ULONG Failures = 0;
+
+#define CHECK(e) \
+    do { if (!(e)) { printf("%s(%d): %s\n", __FILE__, __LINE__, #e); Failures++; } } while (0)
+
+static void MakeRecord(PUCHAR Record, ULONG Length, ULONG64 Number)
+{
+    memcpy(Record, &Length, sizeof(Length));
+    memcpy(Record + 4, &Number, sizeof(Number));
+
+    for (ULONG i = TEST_RECORD_MIN; i < Length; i++) {
+        Record[i] = (UCHAR)(Number * 7 + i);
+    }
+}
+
+//
+// Length of the record, 0 if it is not the one expected, whole
+//
+static ULONG CheckRecord(const UCHAR *Record, size_t Available, ULONG64 Number)
+{
+    ULONG length;
+    ULONG64 number;
+
+    if (Available < TEST_RECORD_MIN) {
+        return 0;
+    }
+
+    memcpy(&length, Record, sizeof(length));
+    memcpy(&number, Record + 4, sizeof(number));
+
+    if (length < TEST_RECORD_MIN || length > Available || number != Number) {
+        return 0;
+    }
+
+    for (ULONG i = TEST_RECORD_MIN; i < length; i++)
+    {
+        if (Record[i] != (UCHAR)(Number * 7 + i)) {
+            return 0;
+        }
+    }
+
+    return length;
+}
+
+//
+// What the ring must hold: its records, oldest first, at their offsets
+//
+typedef struct _MODEL_RECORD {
+    ULONG64 Number;
+    ULONG   Length;
+    ULONG64 Offset;
+} MODEL_RECORD;
+
+typedef struct _MODEL {
+    std::deque<MODEL_RECORD> Records;
+    ULONG64 Head;
+    ULONG64 Tail;
+    ULONG64 Dropped;
+    ULONG64 Overwritten;
+} MODEL;
+
+//
+// Put a record into both, and check the ring did what the model says
+//
+static void Put(PRING_BUF Ring, MODEL *Model, ULONG Policy, ULONG Length, ULONG64 Number)
+{
+    UCHAR record[TEST_RECORD_MAX];
+    size_t entrySize = RING_ENTRY_SIZE(Length);
+    BOOLEAN expected = TRUE;
+
+    MakeRecord(record, Length, Number);
+
+    while (Model->Head - Model->Tail + entrySize > TEST_RING_SIZE)
+    {
+        if (Policy == RING_OVERFLOW_DROP_NEWEST)
+        {
+            expected = FALSE;
+            Model->Dropped++;
+            break;
+        }
+
+        Model->Tail += RING_ENTRY_SIZE(Model->Records.front().Length);
+        Model->Records.pop_front();
+        Model->Overwritten++;
+    }
+
+    if (expected)
+    {
+        MODEL_RECORD added = { Number, Length, Model->Head };
+
+        Model->Records.push_back(added);
+        Model->Head += entrySize;
+    }
+
+    CHECK(RingBufPutEx(Ring, Number, record, Length) == expected);
+}
+
+//
+// Drain into a buffer of DataLength, and check the ring returned the
+// oldest records of the model that fit, whole and back to back
+//
+static void Get(PRING_BUF Ring, MODEL *Model, size_t DataLength, ULONG *Wrapped)
+{
+    static UCHAR data[TEST_RING_SIZE];
+    size_t expected = 0;
+    size_t got;
+    size_t offset = 0;
+    ULONG64 streamOffset;
+
+    for (size_t i = 0; i < Model->Records.size() && expected + Model->Records[i].Length <= DataLength; i++) {
+        expected += Model->Records[i].Length;
+    }
+
+    got = RingBufGetEx(Ring, data, DataLength, &streamOffset);
+
+    CHECK(got == expected);
+    CHECK(streamOffset == Model->Tail);
+
+    while (offset < got && !Model->Records.empty())
+    {
+        MODEL_RECORD record = Model->Records.front();
+        ULONG length = CheckRecord(data + offset, got - offset, record.Number);
+
+        CHECK(length == record.Length);
+        if (length != record.Length) {
+            return;
+        }
+
+        // Of the entry, header or record, across the end of the buffer
+        if ((record.Offset & (TEST_RING_SIZE - 1)) + RING_ENTRY_SIZE(record.Length) > TEST_RING_SIZE) {
+            (*Wrapped)++;
+        }
+
+        offset += length;
+        Model->Tail += RING_ENTRY_SIZE(record.Length);
+        Model->Records.pop_front();
+    }
+}
+
+//
+// One record at a time, of every length, at every position in the buffer
+//
+static void TestWrap()
+{
+    PRING_BUF ring = RingBufCreate(TEST_RING_SIZE, RING_OVERFLOW_DROP_NEWEST);
+    MODEL model = {};
+    ULONG wrapped = 0;
+    ULONG64 number = 0;
+
+    for (ULONG length = TEST_RECORD_MIN; length <= TEST_RECORD_MAX; length++)
+    {
+        for (ULONG i = 0; i < TEST_RING_SIZE / RING_ENTRY_ALIGN / 8; i++)
+        {
+            Put(ring, &model, RING_OVERFLOW_DROP_NEWEST, length, number++);
+            Get(ring, &model, TEST_RING_SIZE, &wrapped);
+        }
+    }
+
+    CHECK(RingBufIsEmpty(ring));
+    CHECK(model.Dropped == 0);
+
+    printf("wrap:      %llu records, %u split at the end of the buffer\n", (unsigned long long)number, wrapped);
+    CHECK(wrapped != 0);
+
+    RingBufDelete(ring);
+}
+
+//
+// Puts and reads of random sizes, the ring full much of the time
+//
+static void TestFull(ULONG Policy)
+{
+    PRING_BUF ring = RingBufCreate(TEST_RING_SIZE, Policy);
+    RING_BUF_STATS stats;
+    MODEL model = {};
+    ULONG wrapped = 0;
+    ULONG64 number = 0;
+
+    srand(Policy + 1);
+
+    for (ULONG i = 0; i < 200000; i++)
+    {
+        if (rand() % 3 != 0)
+        {
+            Put(ring, &model, Policy, TEST_RECORD_MIN + rand() % (TEST_RECORD_MAX - TEST_RECORD_MIN + 1), number++);
+        }
+        else
+        {
+            // Often too small for the oldest record, which must then stay
+            Get(ring, &model, rand() % TEST_RING_SIZE, &wrapped);
+        }
+
+        CHECK(RingBufIsFull(ring) == (model.Head - model.Tail == TEST_RING_SIZE));
+    }
+
+    Get(ring, &model, TEST_RING_SIZE, &wrapped);
+    CHECK(RingBufIsEmpty(ring));
+
+    RingBufGetStats(ring, &stats);
+    CHECK(stats.DroppedRecords == model.Dropped);
+    CHECK(stats.OverwrittenRecords == model.Overwritten);
+    CHECK(stats.HighWater <= TEST_RING_SIZE);
+
+    printf("%-10s %llu records, %llu dropped, %llu overwritten, %u split\n",
+        Policy == RING_OVERFLOW_DROP_NEWEST ? "drop:" : "overwrite:", (unsigned long long)number,
+        (unsigned long long)model.Dropped, (unsigned long long)model.Overwritten, wrapped);
+    CHECK(model.Dropped + model.Overwritten != 0);
+
+    RingBufDelete(ring);
+}
+
+//
+// A record that does not fit whole is dropped whole, even with room for
+// most of it
+//
+static void TestNoRoom()
+{
+    PRING_BUF ring = RingBufCreate(TEST_RING_SIZE, RING_OVERFLOW_DROP_NEWEST);
+    UCHAR record[TEST_RECORD_MAX];
+    UCHAR data[TEST_RING_SIZE];
+    ULONG length = (ULONG)(TEST_RING_SIZE / 4 - sizeof(RING_ENTRY_HEADER));
+    ULONG64 streamOffset;
+    ULONG64 timestamp;
+    RING_BUF_STATS stats;
+
+    for (ULONG64 i = 0; i < 4; i++)
+    {
+        MakeRecord(record, length, i);
+        CHECK(RingBufPutEx(ring, i, record, length));
+    }
+    CHECK(RingBufIsFull(ring));
+
+    // One byte short of an entry, twice
+    CHECK(RingBufGetEx(ring, data, length, NULL) == length);
+    MakeRecord(record, length + 1, 4);
+    CHECK(!RingBufPutEx(ring, 4, record, length + 1));
+    CHECK(!RingBufPutEx(ring, 4, record, length + 1));
+
+    // Nothing of them went in, and the rest is intact
+    CHECK(RingBufPeek(ring, &timestamp) == length && timestamp == 1);
+    CHECK(RingBufGetEx(ring, data, sizeof(data), &streamOffset) == 3 * length);
+    CHECK(streamOffset == TEST_RING_SIZE / 4);
+    for (ULONG i = 0; i < 3; i++) {
+        CHECK(CheckRecord(data + i * length, length, i + 1) == length);
+    }
+
+    RingBufGetStats(ring, &stats);
+    CHECK(stats.DroppedRecords == 2);
+    CHECK(stats.DroppedBytes == 2 * (length + 1));
+
+    // Never fits
+    CHECK(!RingBufPutEx(ring, 5, record, TEST_RING_SIZE));
+    CHECK(!RingBufPutEx(ring, 5, record, 0));
+    CHECK(RingBufIsEmpty(ring));
+
+    RingBufDelete(ring);
+}
+
+//
+// The reader of a mapped ring hands space back on entry boundaries only,
+// and never past an entry still being written
+//
+static void TestRelease()
+{
+    PRING_BUF ring = RingBufCreate(TEST_RING_SIZE, RING_OVERFLOW_DROP_NEWEST);
+    UCHAR record[TEST_RECORD_MAX];
+    std::deque<LONG64> ends;
+    ULONG64 number = 0;
+    PMDL mdl;
+    PRING_HEADER header = (PRING_HEADER)RingBufMapUser(ring, &mdl);
+    LONG64 committed;
+
+    CHECK(header != NULL);
+    if (header == NULL) {
+        return;
+    }
+
+    srand(3);
+
+    // Three laps, released up to an entry of those there when full
+    while (header->Tail < 3 * TEST_RING_SIZE)
+    {
+        ULONG length = TEST_RECORD_MIN + rand() % (TEST_RECORD_MAX / 4 - TEST_RECORD_MIN);
+        size_t n;
+        LONG64 tail = header->Tail;
+        LONG64 end;
+
+        MakeRecord(record, length, number);
+        if (RingBufPutEx(ring, number, record, length))
+        {
+            ends.push_back((LONG64)header->Head);
+            number++;
+            continue;
+        }
+
+        n = 1 + rand() % ends.size();
+        end = ends[n - 1];
+
+        // Inside the entry, inside the next one or past Head, behind Tail
+        CHECK(!RingBufRelease(ring, end - RING_ENTRY_ALIGN));
+        CHECK(!RingBufRelease(ring, end + 1));
+        CHECK(!RingBufRelease(ring, end + RING_ENTRY_ALIGN));
+        CHECK(!RingBufRelease(ring, tail - RING_ENTRY_ALIGN));
+        CHECK(header->Tail == tail);
+
+        CHECK(RingBufRelease(ring, end));
+        CHECK(header->Tail == end);
+        CHECK(RingBufRelease(ring, end));
+
+        ends.erase(ends.begin(), ends.begin() + n);
+    }
+
+    //
+    // A producer reserved an entry and is still writing it, the next one
+    // is committed: only what is before the first can be released
+    //
+    committed = header->Head;
+    header->Head = committed + (LONG64)RING_ENTRY_SIZE(TEST_RECORD_MIN);
+
+    MakeRecord(record, TEST_RECORD_MIN, number);
+    CHECK(RingBufPutEx(ring, number, record, TEST_RECORD_MIN));
+    CHECK(!RingBufRelease(ring, header->Head));
+    CHECK(!RingBufRelease(ring, committed + (LONG64)RING_ENTRY_SIZE(TEST_RECORD_MIN)));
+    CHECK(RingBufRelease(ring, committed));
+    CHECK(header->Tail == committed);
+
+    RingBufUnmapUser(ring, header, mdl);
+    RingBufDelete(ring);
+}
+
+//
+// Number of a record put by a producer thread
+//
+#define STRESS_NUMBER(producer, sequence)   (((ULONG64)(producer) << 40) | (sequence))
+#define STRESS_PRODUCER(number)             ((ULONG)((number) >> 40))
+#define STRESS_SEQUENCE(number)             ((number) & ((1ULL << 40) - 1))
+
+//
+// Producers put at once into a ring small enough to be full much of the
+// time, while one reader drains it as StApp does. Each producer notes
+// which of its records went in, the reader which came out.
+//
+static void TestProducers(ULONG Policy, ULONG Producers, ULONG64 Records)
+{
+    PRING_BUF ring = RingBufCreate(16 * TEST_RING_SIZE, Policy);
+    std::vector<std::vector<bool> > put(Producers, std::vector<bool>(Records));
+    std::vector<std::vector<bool> > got(Producers, std::vector<bool>(Records));
+    std::vector<std::thread> producers;
+    volatile ULONG running = Producers;
+    ULONG64 accepted = 0;
+    ULONG64 received = 0;
+    ULONG64 torn = 0;
+    ULONG64 repeated = 0;
+    ULONG64 unordered = 0;
+    RING_BUF_STATS stats;
+
+    std::thread reader([&]()
+    {
+        std::vector<UCHAR> data(16 * TEST_RING_SIZE);
+        std::vector<ULONG64> next(Producers, 0);
+
+        while (TRUE)
+        {
+            BOOL last = (running == 0);
+            size_t length = RingBufGetEx(ring, data.data(), data.size(), NULL);
+            size_t offset = 0;
+
+            while (offset < length)
+            {
+                ULONG64 number;
+                ULONG producer;
+                ULONG64 sequence;
+                ULONG recordLength;
+
+                memcpy(&number, &data[offset + 4], sizeof(number));
+                producer = STRESS_PRODUCER(number);
+                sequence = STRESS_SEQUENCE(number);
+
+                recordLength = producer < Producers && sequence < Records ?
+                    CheckRecord(&data[offset], length - offset, number) : 0;
+                if (recordLength == 0)
+                {
+                    // Nothing after it can be trusted
+                    torn++;
+                    break;
+                }
+
+                if (got[producer][sequence]) {
+                    repeated++;
+                }
+                if (sequence < next[producer]) {
+                    unordered++;
+                }
+
+                got[producer][sequence] = true;
+                next[producer] = sequence + 1;
+                received++;
+                offset += recordLength;
+            }
+
+            if (last && length == 0) {
+                break;
+            }
+        }
+    });
+
+    for (ULONG p = 0; p < Producers; p++)
+    {
+        producers.push_back(std::thread([&, p]()
+        {
+            UCHAR record[TEST_RECORD_MAX];
+
+            WdkShimProcessor = p;
+
+            for (ULONG64 i = 0; i < Records; i++)
+            {
+                ULONG length = TEST_RECORD_MIN + (ULONG)((i * 13 + p) % 500);
+
+                MakeRecord(record, length, STRESS_NUMBER(p, i));
+                put[p][i] = RingBufPutEx(ring, i, record, length) != FALSE;
+
+                // Let the reader in now and then, with fewer processors than threads
+                if (i % 16 == 0) {
+                    std::this_thread::yield();
+                }
+            }
+
+            __atomic_sub_fetch(&running, 1, __ATOMIC_SEQ_CST);
+        }));
+    }
+
+    for (ULONG p = 0; p < Producers; p++) {
+        producers[p].join();
+    }
+    reader.join();
+
+    RingBufGetStats(ring, &stats);
+
+    //
+    // Nothing came out that did not go in, and what went in came out,
+    // unless a producer retired it to make room
+    //
+    ULONG64 lost = 0;
+    ULONG64 phantom = 0;
+
+    for (ULONG p = 0; p < Producers; p++)
+    {
+        for (ULONG64 i = 0; i < Records; i++)
+        {
+            accepted += put[p][i];
+            lost += put[p][i] && !got[p][i];
+            phantom += !put[p][i] && got[p][i];
+        }
+    }
+
+    printf("%-10s %u producers, %llu records, %llu received, %llu dropped, %llu overwritten\n",
+        Policy == RING_OVERFLOW_DROP_NEWEST ? "drop:" : "overwrite:", Producers,
+        (unsigned long long)(Producers * Records), (unsigned long long)received,
+        (unsigned long long)stats.DroppedRecords, (unsigned long long)stats.OverwrittenRecords);
+
+    CHECK(torn == 0);
+    CHECK(repeated == 0);
+    CHECK(unordered == 0);
+    CHECK(phantom == 0);
+    CHECK(accepted + stats.DroppedRecords == Producers * Records);
+    CHECK(lost == stats.OverwrittenRecords);
+    CHECK(received + stats.OverwrittenRecords == accepted);
+    CHECK(RingBufIsEmpty(ring));
+
+    RingBufDelete(ring);
+}
+
+int main(int argc, char *argv[])
+{
+    ULONG producers = argc > 1 ? strtoul(argv[1], NULL, 0) : 8;
+    ULONG64 records = argc > 2 ? strtoull(argv[2], NULL, 0) : 50000;
+
+    if (producers == 0 || producers > 1024 || records == 0 || records >= 1ULL << 40)
+    {
+        fprintf(stderr, "usage: %s [Producers [Records]]\n", argv[0]);
+        return 1;
+    }
+
+    TestWrap();
+    TestFull(RING_OVERFLOW_DROP_NEWEST);
+    TestFull(RING_OVERFLOW_OVERWRITE_OLDEST);
+    TestNoRoom();
+    TestRelease();
+    TestProducers(RING_OVERFLOW_DROP_NEWEST, producers, records);
+    TestProducers(RING_OVERFLOW_OVERWRITE_OLDEST, producers, records);
+
+    printf("%s, %u failures\n", Failures ? "FAILED" : "passed", Failures);
+    return Failures ? 1 : 0;
+}
@@ -0,0 +1,136 @@
+// SpscQueue.h : single producer, single consumer queue.
+//
+// Hands buffers from one stage of StApp to the next: the pipeline that
+// prints records, and the trace file writer.
+//
+
+#pragma once
+
+#include <stddef.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <vector>
+
+//
+// Bounded queue between two threads, one pushing and one popping. Pushing
+// and popping wait while it is full or empty; the producer closes it when
+// done, and the consumer pops what is left before Pop fails.
+//
+template <class T>
+class SpscQueue
+{
+public:
+    explicit SpscQueue(size_t Capacity)
+        : Items(RoundUp(Capacity)), Mask(RoundUp(Capacity) - 1), Head(0), Tail(0), Closed(false), Waiters(0)
+    {
+    }
+
+    bool TryPush(const T &Item)
+    {
+        size_t head = Head.load(std::memory_order_relaxed);
+
+        if (head - Tail.load(std::memory_order_acquire) > Mask) {
+            return false;
+        }
+
+        Items[head & Mask] = Item;
+        Head.store(head + 1);
+        Wake(WAITER_CONSUMER);
+        return true;
+    }
+
+    void Push(const T &Item)
+    {
+        while (!TryPush(Item))
+        {
+            Wait(WAITER_PRODUCER, [this] {
+                return Head.load(std::memory_order_relaxed) - Tail.load() <= Mask;
+            });
+        }
+    }
+
+    bool TryPop(T *Item)
+    {
+        size_t tail = Tail.load(std::memory_order_relaxed);
+
+        if (tail == Head.load(std::memory_order_acquire)) {
+            return false;
+        }
+
+        *Item = Items[tail & Mask];
+        Tail.store(tail + 1);
+        Wake(WAITER_PRODUCER);
+        return true;
+    }
+
+    bool Pop(T *Item)
+    {
+        while (!TryPop(Item))
+        {
+            // Closed after the last push, so empty once closed is the end
+            if (Closed.load() && Tail.load(std::memory_order_relaxed) == Head.load()) {
+                return false;
+            }
+
+            Wait(WAITER_CONSUMER, [this] {
+                return Closed.load() || Tail.load(std::memory_order_relaxed) != Head.load();
+            });
+        }
+        return true;
+    }
+
+    void Close()
+    {
+        Closed.store(true);
+        Wake(WAITER_CONSUMER);
+    }
+
+private:
+    enum { WAITER_PRODUCER = 1, WAITER_CONSUMER = 2 };
+
+    static size_t RoundUp(size_t Capacity)
+    {
+        size_t size = 1;
+
+        while (size < Capacity) {
+            size <<= 1;
+        }
+        return size;
+    }
+
+    //
+    // A waiter announces itself before it checks the queue once more, and
+    // the other side checks for waiters after it changed the queue, all
+    // sequentially consistent: either the waiter sees the change, or the
+    // other side sees the waiter and wakes it under the lock.
+    //
+    template <class Predicate>
+    void Wait(int Waiter, Predicate Ready)
+    {
+        std::unique_lock<std::mutex> lock(Lock);
+
+        Waiters.fetch_or(Waiter);
+        Wakeup.wait(lock, Ready);
+        Waiters.fetch_and(~Waiter);
+    }
+
+    void Wake(int Waiter)
+    {
+        if (Waiters.load() & Waiter)
+        {
+            std::lock_guard<std::mutex> lock(Lock);
+            Wakeup.notify_all();
+        }
+    }
+
+    std::vector<T>          Items;
+    size_t                  Mask;
+    std::atomic<size_t>     Head;       // next to push, written by the producer
+    std::atomic<size_t>     Tail;       // next to pop, written by the consumer
+    std::atomic<bool>       Closed;
+    std::atomic<int>        Waiters;    // WAITER_*
+    std::mutex              Lock;
+    std::condition_variable Wakeup;
+};
@@ -0,0 +1,267 @@
+// TraceDump.cpp : print or summarize recorded trace files, off Windows.
+//
+// Files recorded with StApp -w, the segments of a rotating recording or a
+// single file, are walked in place with the TraceFileReader StApp builds
+// with, and printed with the same FormatTraceRecord: traces taken on a
+// Windows host are read on any machine, mapped, without a copy or an
+// allocation per record.
+//
+// POSIX only, not part of the Visual Studio solution:
+//
+//   g++ -O2 -o tracedump TraceDump.cpp TraceFileReader.cpp TraceFormat.cpp
+//
+//   tracedump File ...         print the records of the files, in the order
+//                              given (tracedump trace.stf.*), as StApp -f
+//   tracedump -s File ...      only what each file holds, from its index
+//                              when it has one
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <string>
+
+#include "TraceFileReader.h"
+#include "TraceFormat.h"
+
+//
+// Text written out at a time
+//
+#define PRINT_CHUNK     (1024 * 1024)
+
+//
+// 100 ns intervals from 1601 to 1970
+//
+#define FILETIME_UNIX_EPOCH     116444736000000000ULL
+
+static void PrintTime(const char *Name, ULONG64 Time)
+{
+    time_t seconds = (time_t)((Time - FILETIME_UNIX_EPOCH) / 10000000);
+    struct tm utc;
+    char text[32];
+
+    gmtime_r(&seconds, &utc);
+    strftime(text, sizeof(text), "%Y-%m-%d %H:%M:%S", &utc);
+    printf("%s%s.%07llu UTC", Name, text, (unsigned long long)((Time - FILETIME_UNIX_EPOCH) % 10000000));
+}
+
+//
+// A timestamp of the file, as UTC, from when the file was started
+//
+static ULONG64 GetRecordTime(const TRACE_FILE_HEADER *Header, ULONG64 Timestamp)
+{
+    LONG64 ticks = (LONG64)(Timestamp - Header->StartTimestamp);
+
+    return Header->StartTime + ticks * 10000000 / (LONG64)Header->TimestampFrequency;
+}
+
+static int Summarize(const char *Path)
+{
+    TraceFileReader reader;
+    const TRACE_FILE_HEADER *header;
+    const TRACE_FILE_INDEX *index;
+    const TRACE_FILE_INDEX_DEVICE *devices;
+    TRACE_FILE_INDEX scanned;
+    TRACE_FILE_INDEX_DEVICE scannedDevices[TRACE_FILE_MAX_DEVICES];
+
+    if (!reader.Open(Path))
+    {
+        perror(Path);
+        return 1;
+    }
+
+    header = reader.GetHeader();
+    index = reader.GetIndex();
+    devices = reader.GetIndexDevices();
+
+    printf("%s:", Path);
+    if (header != NULL)
+    {
+        printf(" segment %u of %.*s, ", header->Segment, TRACE_FILE_HOST_SIZE, header->HostName);
+        PrintTime("started ", header->StartTime);
+    }
+    printf("\n");
+
+    //
+    // Without an index, the same from the records
+    //
+    if (index == NULL)
+    {
+        const TRACE_RECORD_HEADER *record;
+
+        memset(&scanned, 0, sizeof(scanned));
+
+        while ((record = reader.Next()) != NULL)
+        {
+            ULONG i;
+
+            if (scanned.Records == 0 || record->Timestamp < scanned.FirstTimestamp) {
+                scanned.FirstTimestamp = record->Timestamp;
+            }
+            if (record->Timestamp > scanned.LastTimestamp) {
+                scanned.LastTimestamp = record->Timestamp;
+            }
+            scanned.Records++;
+
+            for (i = 0; i < scanned.DeviceCount; i++)
+            {
+                if (scannedDevices[i].DeviceId == record->DeviceId) {
+                    break;
+                }
+            }
+
+            if (i == scanned.DeviceCount)
+            {
+                if (i == TRACE_FILE_MAX_DEVICES)
+                {
+                    if (scanned.UnlistedRecords != MAXULONG) {
+                        scanned.UnlistedRecords++;
+                    }
+                    continue;
+                }
+                scannedDevices[i].DeviceId = record->DeviceId;
+                scannedDevices[i].Records = 0;
+                scannedDevices[i].FirstSequence = record->SequenceNumber;
+                scannedDevices[i].LastSequence = record->SequenceNumber;
+                scanned.DeviceCount++;
+            }
+
+            scannedDevices[i].Records++;
+            if (record->SequenceNumber < scannedDevices[i].FirstSequence) {
+                scannedDevices[i].FirstSequence = record->SequenceNumber;
+            }
+            if (record->SequenceNumber > scannedDevices[i].LastSequence) {
+                scannedDevices[i].LastSequence = record->SequenceNumber;
+            }
+        }
+
+        if (!reader.IsValid()) {
+            printf("  bad record at offset %llu, the rest is left out\n", (unsigned long long)reader.GetOffset());
+        }
+
+        index = &scanned;
+        devices = scannedDevices;
+        printf("  no index, from the records\n");
+    }
+
+    printf("  %llu records", (unsigned long long)index->Records);
+    if (index->Records != 0 && header != NULL && header->TimestampFrequency != 0)
+    {
+        PrintTime(", ", GetRecordTime(header, index->FirstTimestamp));
+        PrintTime(" to ", GetRecordTime(header, index->LastTimestamp));
+    }
+    printf("\n");
+
+    for (ULONG i = 0; i < index->DeviceCount; i++)
+    {
+        printf("  device %u: %llu records, sequence %llu to %llu\n", devices[i].DeviceId,
+            (unsigned long long)devices[i].Records,
+            (unsigned long long)devices[i].FirstSequence, (unsigned long long)devices[i].LastSequence);
+    }
+    if (index->UnlistedRecords != 0) {
+        printf("  %u%s records of other devices\n", index->UnlistedRecords, index->UnlistedRecords == MAXULONG ? " or more" : "");
+    }
+
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    TraceSequence sequence;
+    std::string text;
+    ULONG deviceId = 0;     // STORTRACE_ALL_DEVICES, no device has it
+    ULONG64 records = 0;
+    ULONG64 lost = 0;
+    BOOL summary = FALSE;
+    int result = 0;
+    int i = 1;
+
+    if (argc > 1 && strcmp(argv[1], "-s") == 0)
+    {
+        summary = TRUE;
+        i++;
+    }
+
+    if (i >= argc)
+    {
+        fprintf(stderr, "usage: %s [-s] File ...\n", argv[0]);
+        return 1;
+    }
+
+    for (; i < argc; i++)
+    {
+        TraceFileReader reader;
+        const TRACE_RECORD_HEADER *record;
+        ULONG64 frequency;
+        char line[128];
+
+        if (summary)
+        {
+            result |= Summarize(argv[i]);
+            continue;
+        }
+
+        if (!reader.Open(argv[i]))
+        {
+            perror(argv[i]);
+            result = 1;
+            continue;
+        }
+
+        frequency = reader.GetHeader() != NULL ? reader.GetHeader()->TimestampFrequency : 0;
+
+        while ((record = reader.Next()) != NULL)
+        {
+            ULONG64 gap;
+
+            if (record->Version != TRACE_RECORD_VERSION)
+            {
+                snprintf(line, sizeof(line), "record version %u not supported\n", record->Version);
+                text.append(line);
+                continue;
+            }
+
+            if (record->DeviceId != deviceId)
+            {
+                deviceId = record->DeviceId;
+                snprintf(line, sizeof(line), "Device %u:\n", deviceId);
+                text.append(line);
+            }
+
+            gap = sequence.Check(record);
+            if (gap != 0)
+            {
+                lost += gap;
+                snprintf(line, sizeof(line), "Device %u: %llu records lost\n", deviceId, (unsigned long long)gap);
+                text.append(line);
+            }
+
+            FormatTraceRecord(record, frequency, &text);
+            records++;
+
+            if (text.size() >= PRINT_CHUNK)
+            {
+                fwrite(text.data(), 1, text.size(), stdout);
+                text.clear();
+            }
+        }
+
+        if (!reader.IsValid())
+        {
+            snprintf(line, sizeof(line), "bad record at offset %llu of %s, the rest is left out\n",
+                (unsigned long long)reader.GetOffset(), argv[i]);
+            text.append(line);
+            result = 1;
+        }
+    }
+
+    if (!summary)
+    {
+        fwrite(text.data(), 1, text.size(), stdout);
+        printf("%llu records, %llu lost\n", (unsigned long long)records, (unsigned long long)lost);
+    }
+
+    return result;
+}
@@ -0,0 +1,111 @@
+// TraceFile.h : layout of a trace file recorded by StApp -w.
+//
+// A TRACE_FILE_HEADER, padded to HeaderSize, then the trace records back to
+// back exactly as the driver returned them (TraceRecord.h), then an index
+// of them. A file without the header, records from the first byte, is read
+// the same way, up to its end.
+//
+// The header is all a reader needs to make sense of the records off the
+// machine they were taken on: the timestamp frequency and when the file
+// was started, to turn timestamps into time, and the disks there were.
+//
+// A recording that rotates is a series of such files, segments, each one
+// complete on its own. The index at the end of each says which records it
+// holds, so the segment covering a time is found without reading them:
+//
+//   TRACE_FILE_INDEX            starts where the records end
+//   TRACE_FILE_INDEX_DEVICE     one per device with records in the file,
+//                               up to TRACE_FILE_MAX_DEVICES
+//   TRACE_FILE_TRAILER          the last bytes, points back to the index
+//
+// A file without an index, cut short by a crash, still reads up to its
+// last whole record.
+//
+
+#pragma once
+
+#include "TraceTypes.h"
+
+#include "../StorTrace/TraceRecord.h"
+
+#define TRACE_FILE_MAGIC            0x46545453  // "STTF", not a record's
+#define TRACE_FILE_VERSION          2   // 2: Segment, the index
+#define TRACE_FILE_INDEX_MAGIC      0x49545453  // "STTI"
+#define TRACE_FILE_TRAILER_MAGIC    0x45545453  // "STTE"
+
+//
+// Header size and the unit of the writes: records start on a sector of any
+// disk, so the file can be written unbuffered
+//
+#define TRACE_FILE_ALIGN            4096
+
+#define TRACE_FILE_MAX_DEVICES      64
+#define TRACE_FILE_HOST_SIZE        256
+
+typedef struct _TRACE_FILE_DEVICE {
+    ULONG   DeviceId;
+    ULONG   SampleRate;         // when the recording started
+    ULONG64 TraceBufSize;
+} TRACE_FILE_DEVICE, *PTRACE_FILE_DEVICE;
+
+typedef struct _TRACE_FILE_HEADER {
+    ULONG   Magic;              // TRACE_FILE_MAGIC
+    ULONG   Version;            // TRACE_FILE_VERSION
+    ULONG   HeaderSize;         // records start here, a multiple of TRACE_FILE_ALIGN
+    ULONG   RecordVersion;      // TRACE_RECORD_VERSION of the driver
+
+    ULONG64 TimestampFrequency; // of the record timestamps, per second
+    ULONG64 StartTimestamp;     // performance counter when the file was started
+    ULONG64 StartTime;          // the same moment, UTC, in 100 ns since 1601
+
+    char    HostName[TRACE_FILE_HOST_SIZE];     // zero terminated
+
+    ULONG   DeviceId;           // recorded, STORTRACE_ALL_DEVICES for all of them
+    ULONG   DeviceCount;
+    TRACE_FILE_DEVICE Devices[TRACE_FILE_MAX_DEVICES];
+
+    ULONG   Segment;            // of a rotating recording, from 0
+    ULONG   Reserved;
+} TRACE_FILE_HEADER, *PTRACE_FILE_HEADER;
+
+typedef struct _TRACE_FILE_INDEX {
+    ULONG   Magic;              // TRACE_FILE_INDEX_MAGIC, not a record's
+    ULONG   Length;             // of the index, devices and trailer included
+    ULONG   DeviceCount;
+    ULONG   UnlistedRecords;    // of devices past the first TRACE_FILE_MAX_DEVICES, up to MAXULONG
+    ULONG64 Records;            // all of them, the unlisted ones included
+    ULONG64 FirstTimestamp;     // earliest of the records
+    ULONG64 LastTimestamp;      // latest of the records
+} TRACE_FILE_INDEX, *PTRACE_FILE_INDEX;
+
+typedef struct _TRACE_FILE_INDEX_DEVICE {
+    ULONG   DeviceId;
+    ULONG   Reserved;
+    ULONG64 Records;
+    ULONG64 FirstSequence;      // lowest sequence number of the device's records
+    ULONG64 LastSequence;       // highest
+} TRACE_FILE_INDEX_DEVICE, *PTRACE_FILE_INDEX_DEVICE;
+
+typedef struct _TRACE_FILE_TRAILER {
+    ULONG64 IndexOffset;        // of the TRACE_FILE_INDEX in the file
+    ULONG   Reserved;
+    ULONG   Magic;              // TRACE_FILE_TRAILER_MAGIC
+} TRACE_FILE_TRAILER, *PTRACE_FILE_TRAILER;
+
+#define TRACE_FILE_INDEX_SIZE(deviceCount) \
+    (sizeof(TRACE_FILE_INDEX) + (deviceCount) * sizeof(TRACE_FILE_INDEX_DEVICE) + sizeof(TRACE_FILE_TRAILER))
+
+//
+// Whether the start of a file is a header a reader of this version can
+// skip, then the records start at HeaderSize. Later versions only add to
+// the end of the header; what version 1 lacks reads as 0, it has no index.
+//
+static __inline BOOL TraceFileHeaderIsValid(const TRACE_FILE_HEADER *Header, size_t Length)
+{
+    return Length >= sizeof(TRACE_FILE_HEADER) &&
+           Header->Magic == TRACE_FILE_MAGIC &&
+           Header->Version >= 1 &&
+           Header->HeaderSize >= sizeof(TRACE_FILE_HEADER) &&
+           Header->HeaderSize % TRACE_FILE_ALIGN == 0 &&
+           Header->DeviceCount <= TRACE_FILE_MAX_DEVICES;
+}
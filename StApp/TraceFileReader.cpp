@@ -0,0 +1,199 @@
+// TraceFileReader.cpp : walk a recorded trace file in place.
+//
+// Built without the precompiled header, so it also builds off Windows.
+//
+
+#include "TraceFileReader.h"
+
+#include <string.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+
+TraceFileReader::TraceFileReader()
+    : Data(NULL), Length(0), Start(0), End(0), Offset(0), Header(NULL), Index(NULL), Valid(FALSE),
+#ifdef _WIN32
+      File(INVALID_HANDLE_VALUE), Mapping(NULL)
+#else
+      File(-1)
+#endif
+{
+}
+
+TraceFileReader::~TraceFileReader()
+{
+    Close();
+}
+
+BOOL TraceFileReader::Open(const char *Path)
+{
+    const TRACE_FILE_TRAILER *trailer;
+
+    Close();
+
+#ifdef _WIN32
+    LARGE_INTEGER size;
+
+    File = CreateFileA(Path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING,
+        FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (File == INVALID_HANDLE_VALUE || !GetFileSizeEx(File, &size)) {
+        Close();
+        return FALSE;
+    }
+
+    Length = (size_t)size.QuadPart;
+    if (Length != 0)
+    {
+        Mapping = CreateFileMapping(File, NULL, PAGE_READONLY, 0, 0, NULL);
+        Data = Mapping != NULL ? (const UCHAR *)MapViewOfFile(Mapping, FILE_MAP_READ, 0, 0, 0) : NULL;
+    }
+#else
+    struct stat status;
+
+    File = open(Path, O_RDONLY);
+    if (File < 0 || fstat(File, &status) != 0) {
+        Close();
+        return FALSE;
+    }
+
+    Length = (size_t)status.st_size;
+    if (Length != 0)
+    {
+        void *mapping = mmap(NULL, Length, PROT_READ, MAP_SHARED, File, 0);
+
+        if (mapping != MAP_FAILED)
+        {
+            Data = (const UCHAR *)mapping;
+            madvise(mapping, Length, MADV_SEQUENTIAL);
+        }
+    }
+#endif
+
+    if (Data == NULL)
+    {
+        // Nothing in it is fine, not being able to map it is not
+        if (Length != 0) {
+            Close();
+            return FALSE;
+        }
+        Valid = TRUE;
+        return TRUE;
+    }
+
+    Start = 0;
+    End = Length;
+
+    if (TraceFileHeaderIsValid((const TRACE_FILE_HEADER *)Data, Length) &&
+        ((const TRACE_FILE_HEADER *)Data)->HeaderSize <= Length)
+    {
+        Header = (const TRACE_FILE_HEADER *)Data;
+        Start = Header->HeaderSize;
+    }
+
+    //
+    // The trailer points back to the index, where the records end. A file
+    // cut short has neither, and its records end at the first thing that
+    // is not a whole one.
+    //
+    trailer = Length - Start >= TRACE_FILE_INDEX_SIZE(0) ?
+        (const TRACE_FILE_TRAILER *)(Data + Length - sizeof(TRACE_FILE_TRAILER)) : NULL;
+
+    if (Header != NULL && trailer != NULL &&
+        trailer->Magic == TRACE_FILE_TRAILER_MAGIC &&
+        trailer->IndexOffset >= Start &&
+        trailer->IndexOffset % TRACE_RECORD_ALIGN == 0 &&
+        trailer->IndexOffset <= Length - TRACE_FILE_INDEX_SIZE(0))
+    {
+        const TRACE_FILE_INDEX *index = (const TRACE_FILE_INDEX *)(Data + trailer->IndexOffset);
+
+        if (index->Magic == TRACE_FILE_INDEX_MAGIC &&
+            index->DeviceCount <= TRACE_FILE_MAX_DEVICES &&
+            index->Length == TRACE_FILE_INDEX_SIZE(index->DeviceCount) &&
+            trailer->IndexOffset + index->Length == Length)
+        {
+            Index = index;
+            End = (size_t)trailer->IndexOffset;
+        }
+    }
+
+    Offset = Start;
+    Valid = TRUE;
+
+    return TRUE;
+}
+
+void TraceFileReader::Close()
+{
+#ifdef _WIN32
+    if (Data != NULL) {
+        UnmapViewOfFile(Data);
+    }
+    if (Mapping != NULL) {
+        CloseHandle(Mapping);
+    }
+    if (File != INVALID_HANDLE_VALUE) {
+        CloseHandle(File);
+    }
+    File = INVALID_HANDLE_VALUE;
+    Mapping = NULL;
+#else
+    if (Data != NULL) {
+        munmap((void *)Data, Length);
+    }
+    if (File >= 0) {
+        close(File);
+    }
+    File = -1;
+#endif
+
+    Data = NULL;
+    Length = 0;
+    Start = 0;
+    End = 0;
+    Offset = 0;
+    Header = NULL;
+    Index = NULL;
+    Valid = FALSE;
+}
+
+const TRACE_RECORD_HEADER *TraceFileReader::Next()
+{
+    const TRACE_RECORD_HEADER *record;
+
+    if (!Valid || End - Offset < sizeof(TRACE_RECORD_HEADER)) {
+        return NULL;
+    }
+
+    record = (const TRACE_RECORD_HEADER *)(Data + Offset);
+
+    // An index the trailer did not lead to, the file was cut short in it
+    if (*(const ULONG *)record == TRACE_FILE_INDEX_MAGIC)
+    {
+        Offset = End;
+        return NULL;
+    }
+
+    // One of this version holds the CDB and sense it says it has
+    if (record->Magic != TRACE_RECORD_MAGIC ||
+        record->Length < sizeof(TRACE_RECORD_HEADER) ||
+        record->Length % TRACE_RECORD_ALIGN != 0 ||
+        (record->Version == TRACE_RECORD_VERSION &&
+         record->Length != TRACE_RECORD_SIZE(record->CdbLength, record->SenseLength)))
+    {
+        Valid = FALSE;
+        return NULL;
+    }
+
+    // Cut short in the middle of it, the end of the records
+    if (record->Length > End - Offset) {
+        return NULL;
+    }
+
+    Offset += record->Length;
+    return record;
+}
@@ -0,0 +1,84 @@
+// TraceFileReader.h : walk a recorded trace file in place.
+//
+// The file (TraceFile.h), one segment of a rotating recording, or records
+// with no header at all, is mapped read-only and its records are returned
+// where they lie: no read, no copy, nothing allocated per record. The CDB,
+// sense data and decoded fields of a record are all reached from the
+// pointer returned (TRACE_RECORD_CDB, TRACE_RECORD_SENSE).
+//
+// Builds on Windows and POSIX alike, so traces taken on a Windows host can
+// be analyzed anywhere. The whole file is mapped at once: files of
+// gigabytes need a 64-bit process.
+//
+
+#pragma once
+
+#include <stddef.h>
+
+#include "TraceTypes.h"
+#include "TraceFile.h"
+
+class TraceFileReader
+{
+public:
+    TraceFileReader();
+    ~TraceFileReader();
+
+    //
+    // Map the file, and find where its records start and end
+    //
+    BOOL Open(const char *Path);
+    void Close();
+
+    //
+    // The file header, NULL if the file starts with records
+    //
+    const TRACE_FILE_HEADER *GetHeader() const { return Header; }
+
+    //
+    // The index and its devices, NULL if the file has none: no header,
+    // version 1, or cut short
+    //
+    const TRACE_FILE_INDEX *GetIndex() const { return Index; }
+    const TRACE_FILE_INDEX_DEVICE *GetIndexDevices() const { return Index != NULL ? (const TRACE_FILE_INDEX_DEVICE *)(Index + 1) : NULL; }
+
+    //
+    // Next record, in place, valid until Close. NULL at the end of the
+    // records, or at one that is not a record, after which IsValid fails.
+    // So is a record of this version that is not as long as its CDB and
+    // sense make it. A record of another version is returned all the same.
+    //
+    const TRACE_RECORD_HEADER *Next();
+
+    //
+    // Back to the first record
+    //
+    void Rewind() { Offset = Start; Valid = TRUE; }
+
+    //
+    // Whether everything up to here were records
+    //
+    BOOL IsValid() const { return Valid; }
+
+    //
+    // In the file, of the next record
+    //
+    ULONG64 GetOffset() const { return Offset; }
+
+private:
+    const UCHAR                 *Data;
+    size_t                      Length;
+    size_t                      Start;      // of the records
+    size_t                      End;
+    size_t                      Offset;
+    const TRACE_FILE_HEADER     *Header;
+    const TRACE_FILE_INDEX      *Index;
+    BOOL                        Valid;
+
+#ifdef _WIN32
+    HANDLE                      File;
+    HANDLE                      Mapping;
+#else
+    int                         File;
+#endif
+};
@@ -0,0 +1,395 @@
+// TraceFileWriter.cpp : record trace blocks to files, as they are read.
+//
+
+#include "stdafx.h"
+
+#include "TraceFileWriter.h"
+
+
+TraceFileWriter::TraceFileWriter()
+    : Writes(TRACE_WRITE_COUNT), Current(NULL), Segment(0), SegmentLength(0), SegmentStart(0), Length(0),
+      Opened(FALSE), File(INVALID_HANDLE_VALUE), FileSegment(0), FileLength(0), Failed(FALSE),
+      Free(TRACE_WRITE_COUNT), Full(TRACE_WRITE_COUNT)
+{
+    for (ULONG i = 0; i < TRACE_WRITE_COUNT; i++)
+    {
+        // Page aligned, as unbuffered writes need
+        Writes[i].Buffer = (PUCHAR)VirtualAlloc(NULL, TRACE_WRITE_SIZE, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+    }
+}
+
+TraceFileWriter::~TraceFileWriter()
+{
+    Close();
+
+    for (ULONG i = 0; i < TRACE_WRITE_COUNT; i++)
+    {
+        if (Writes[i].Buffer != NULL) {
+            VirtualFree(Writes[i].Buffer, 0, MEM_RELEASE);
+        }
+    }
+}
+
+BOOL TraceFileWriter::Open(const char *Path, const TRACE_FILE_HEADER *Header, const TRACE_FILE_ROTATION *Rotation)
+{
+    for (ULONG i = 0; i < TRACE_WRITE_COUNT; i++)
+    {
+        if (Writes[i].Buffer == NULL)
+        {
+            printf("Not enough memory for the trace file buffers\n");
+            return FALSE;
+        }
+    }
+
+    this->Path = Path;
+    this->Header = *Header;
+    this->Rotation = *Rotation;
+
+    // The first file here, so a bad path fails the recording right away
+    File = CreateFileA(GetSegmentPath(0).c_str(),
+        GENERIC_WRITE,
+        FILE_SHARE_READ,
+        NULL,
+        CREATE_ALWAYS,
+        FILE_FLAG_NO_BUFFERING,
+        NULL);
+
+    if (File == INVALID_HANDLE_VALUE)
+    {
+        printf("Failed to create %s, error %d\n", GetSegmentPath(0).c_str(), GetLastError());
+        return FALSE;
+    }
+
+    for (ULONG i = 0; i < TRACE_WRITE_COUNT; i++) {
+        Free.TryPush(&Writes[i]);
+    }
+
+    Segment = 0;
+    BeginSegment();
+
+    Thread = std::thread(&TraceFileWriter::Writer, this);
+    Opened = TRUE;
+
+    return TRUE;
+}
+
+BOOL TraceFileWriter::Write(const UCHAR *Data, ULONG Length)
+{
+    if (Failed) {
+        return FALSE;
+    }
+
+    //
+    // On to the next segment between blocks, so each one holds whole
+    // records. A segment takes at least one block, however large.
+    //
+    if (SegmentLength > Header.HeaderSize &&
+        ((Rotation.SegmentSize != 0 &&
+          SegmentLength + Length + TRACE_FILE_INDEX_SIZE(TRACE_FILE_MAX_DEVICES) > Rotation.SegmentSize) ||
+         (Rotation.SegmentSeconds != 0 &&
+          GetTickCount64() - SegmentStart >= Rotation.SegmentSeconds * 1000ULL)))
+    {
+        EndSegment();
+        Segment++;
+        BeginSegment();
+    }
+
+    Account(Data, Length);
+    Append(Data, Length);
+
+    return !Failed;
+}
+
+BOOL TraceFileWriter::Close()
+{
+    if (!Opened) {
+        return TRUE;
+    }
+
+    EndSegment();
+    Full.Close();
+    Thread.join();
+    Opened = FALSE;
+
+    return !Failed;
+}
+
+
+//-------------------------------------------------------
+// Drain thread
+//-------------------------------------------------------
+
+//
+// Start a segment in a buffer of its own with the header, written at the
+// start of its file
+//
+void TraceFileWriter::BeginSegment()
+{
+    LARGE_INTEGER counter;
+    FILETIME now;
+
+    Free.Pop(&Current);
+    Current->Used = 0;
+    Current->Segment = Segment;
+    Current->Last = FALSE;
+
+    // The same moment, on both clocks
+    QueryPerformanceCounter(&counter);
+    GetSystemTimeAsFileTime(&now);
+
+    Header.Segment = Segment;
+    Header.StartTimestamp = (ULONG64)counter.QuadPart;
+    Header.StartTime = ((ULONG64)now.dwHighDateTime << 32) | now.dwLowDateTime;
+
+    memset(Current->Buffer, 0, Header.HeaderSize);
+    memcpy(Current->Buffer, &Header, sizeof(Header));
+    Current->Used = Header.HeaderSize;
+
+    SegmentLength = Header.HeaderSize;
+    SegmentStart = GetTickCount64();
+    Length += Header.HeaderSize;
+
+    memset(&Index, 0, sizeof(Index));
+    IndexDevices.clear();
+}
+
+//
+// Close the segment with its index, and hand its last buffer to the writer
+// to finish the file
+//
+void TraceFileWriter::EndSegment()
+{
+    TRACE_FILE_TRAILER trailer;
+
+    trailer.IndexOffset = SegmentLength;
+    trailer.Reserved = 0;
+    trailer.Magic = TRACE_FILE_TRAILER_MAGIC;
+
+    Index.Magic = TRACE_FILE_INDEX_MAGIC;
+    Index.Length = (ULONG)TRACE_FILE_INDEX_SIZE(IndexDevices.size());
+    Index.DeviceCount = (ULONG)IndexDevices.size();
+
+    Append(&Index, sizeof(Index));
+    if (!IndexDevices.empty()) {
+        Append(&IndexDevices[0], (ULONG)(IndexDevices.size() * sizeof(TRACE_FILE_INDEX_DEVICE)));
+    }
+    Append(&trailer, sizeof(trailer));
+
+    Current->Last = TRUE;
+    Full.Push(Current);
+    Current = NULL;
+}
+
+//
+// Copy into the buffers, handing each one to the writer as it fills
+//
+void TraceFileWriter::Append(const void *Data, ULONG Length)
+{
+    const UCHAR *data = (const UCHAR *)Data;
+
+    SegmentLength += Length;
+    this->Length += Length;
+
+    while (Length != 0)
+    {
+        ULONG bytes = TRACE_WRITE_SIZE - Current->Used;
+
+        if (bytes > Length) {
+            bytes = Length;
+        }
+
+        memcpy(Current->Buffer + Current->Used, data, bytes);
+        Current->Used += bytes;
+        data += bytes;
+        Length -= bytes;
+
+        if (Current->Used == TRACE_WRITE_SIZE)
+        {
+            Full.Push(Current);
+
+            Free.Pop(&Current);
+            Current->Used = 0;
+            Current->Segment = Segment;
+            Current->Last = FALSE;
+        }
+    }
+}
+
+//
+// Add the records of a block to the segment's index
+//
+void TraceFileWriter::Account(const UCHAR *Data, ULONG Length)
+{
+    ULONG offset = 0;
+    size_t device = 0;
+
+    while (offset + sizeof(TRACE_RECORD_HEADER) <= Length)
+    {
+        const TRACE_RECORD_HEADER *record = (const TRACE_RECORD_HEADER *)(Data + offset);
+        PTRACE_FILE_INDEX_DEVICE entry;
+
+        if (record->Magic != TRACE_RECORD_MAGIC || record->Length < sizeof(TRACE_RECORD_HEADER)) {
+            break;
+        }
+        offset += record->Length;
+
+        if (Index.Records == 0 || record->Timestamp < Index.FirstTimestamp) {
+            Index.FirstTimestamp = record->Timestamp;
+        }
+        if (record->Timestamp > Index.LastTimestamp) {
+            Index.LastTimestamp = record->Timestamp;
+        }
+        Index.Records++;
+
+        // Records of one device come in runs
+        if (device >= IndexDevices.size() || IndexDevices[device].DeviceId != record->DeviceId)
+        {
+            for (device = 0; device < IndexDevices.size(); device++)
+            {
+                if (IndexDevices[device].DeviceId == record->DeviceId) {
+                    break;
+                }
+            }
+
+            if (device == IndexDevices.size())
+            {
+                TRACE_FILE_INDEX_DEVICE added = { record->DeviceId, 0, 0, record->SequenceNumber, record->SequenceNumber };
+
+                // No room in the index, only counted
+                if (device == TRACE_FILE_MAX_DEVICES)
+                {
+                    if (Index.UnlistedRecords != MAXULONG) {
+                        Index.UnlistedRecords++;
+                    }
+                    continue;
+                }
+                IndexDevices.push_back(added);
+            }
+        }
+
+        entry = &IndexDevices[device];
+        entry->Records++;
+        if (record->SequenceNumber < entry->FirstSequence) {
+            entry->FirstSequence = record->SequenceNumber;
+        }
+        if (record->SequenceNumber > entry->LastSequence) {
+            entry->LastSequence = record->SequenceNumber;
+        }
+    }
+}
+
+
+//-------------------------------------------------------
+// Writer thread
+//-------------------------------------------------------
+void TraceFileWriter::Writer()
+{
+    TRACE_WRITE *write;
+    DWORD bytes;
+
+    while (Full.Pop(&write))
+    {
+        ULONG length = (write->Used + TRACE_FILE_ALIGN - 1) & ~(TRACE_FILE_ALIGN - 1);
+
+        if (Failed)
+        {
+            Free.Push(write);
+            continue;
+        }
+
+        if (File == INVALID_HANDLE_VALUE)
+        {
+            FileSegment = write->Segment;
+            FileLength = 0;
+
+            // Make room for it first
+            if (Rotation.SegmentCount != 0 && FileSegment >= Rotation.SegmentCount) {
+                DeleteFileA(GetSegmentPath(FileSegment - Rotation.SegmentCount).c_str());
+            }
+
+            File = CreateFileA(GetSegmentPath(FileSegment).c_str(),
+                GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_FLAG_NO_BUFFERING, NULL);
+
+            if (File == INVALID_HANDLE_VALUE)
+            {
+                printf("Failed to create %s, error %d\n", GetSegmentPath(FileSegment).c_str(), GetLastError());
+                Failed = TRUE;
+                Free.Push(write);
+                continue;
+            }
+        }
+
+        //
+        // Only the last buffer of a segment is not full, it is written whole
+        // sectors, padded with zeros the file is then cut back from
+        //
+        memset(write->Buffer + write->Used, 0, length - write->Used);
+
+        if (!WriteFile(File, write->Buffer, length, &bytes, NULL) || bytes != length)
+        {
+            printf("Write to %s failed, error %d\n", GetSegmentPath(FileSegment).c_str(), GetLastError());
+            CloseHandle(File);
+            File = INVALID_HANDLE_VALUE;
+            Failed = TRUE;
+        }
+        else
+        {
+            FileLength += write->Used;
+
+            if (write->Last && !FinishSegment(FileLength)) {
+                Failed = TRUE;
+            }
+        }
+
+        Free.Push(write);
+    }
+}
+
+//
+// Close the segment's file and cut it to what was recorded
+//
+BOOL TraceFileWriter::FinishSegment(ULONG64 Length)
+{
+    std::string path = GetSegmentPath(FileSegment);
+    LARGE_INTEGER position;
+    BOOL success = TRUE;
+
+    CloseHandle(File);
+    File = INVALID_HANDLE_VALUE;
+
+    if (Length % TRACE_FILE_ALIGN == 0) {
+        return TRUE;
+    }
+
+    // Cut through the file cache, which unbuffered handles cannot
+    File = CreateFileA(path.c_str(), GENERIC_WRITE, FILE_SHARE_READ, NULL, OPEN_EXISTING, 0, NULL);
+    position.QuadPart = (LONGLONG)Length;
+
+    if (File == INVALID_HANDLE_VALUE ||
+        !SetFilePointerEx(File, position, NULL, FILE_BEGIN) ||
+        !SetEndOfFile(File))
+    {
+        printf("Failed to cut %s at %I64u bytes, error %d\n", path.c_str(), Length, GetLastError());
+        success = FALSE;
+    }
+
+    if (File != INVALID_HANDLE_VALUE)
+    {
+        CloseHandle(File);
+        File = INVALID_HANDLE_VALUE;
+    }
+
+    return success;
+}
+
+std::string TraceFileWriter::GetSegmentPath(ULONG Segment) const
+{
+    char suffix[16];
+
+    if (Rotation.SegmentSize == 0 && Rotation.SegmentSeconds == 0) {
+        return Path;
+    }
+
+    sprintf_s(suffix, sizeof(suffix), ".%06u", Segment);
+    return Path + suffix;
+}
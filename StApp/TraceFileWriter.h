@@ -0,0 +1,119 @@
+// TraceFileWriter.h : record trace blocks to files, as they are read.
+//
+// The records are written as they come from the driver, behind a file
+// header and followed by an index (TraceFile.h), so a recording costs a
+// copy and a write, and a file is read back with StApp -f. The writes are
+// unbuffered: large aligned buffers go straight to the disk without the
+// file cache, so hours of trace do not crowd it out.
+//
+// The thread draining the driver only copies blocks into free buffers.
+// A thread of the writer's own writes them out, and does what can take
+// long: creating, finishing and deleting files. A recording can rotate,
+// to a new segment once the current one reaches a size or an age, keeping
+// only the last few.
+//
+
+#pragma once
+
+#include "TraceFile.h"
+
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "SpscQueue.h"
+
+//
+// Size of each buffer, written whole, a multiple of TRACE_FILE_ALIGN
+//
+#define TRACE_WRITE_SIZE    (4 * 1024 * 1024)
+
+//
+// Buffers, what the disk and finishing a segment can be behind the reads
+//
+#define TRACE_WRITE_COUNT   8
+
+//
+// When a recording moves on to its next segment, and how many it keeps,
+// all 0 for one file. A segment is named after the recording, with its
+// number appended: trace.stf.000012.
+//
+typedef struct _TRACE_FILE_ROTATION {
+    ULONG64 SegmentSize;        // bytes, at most; more only for a single block
+    ULONG   SegmentSeconds;     // at most, checked as blocks arrive
+    ULONG   SegmentCount;       // kept, the oldest deleted; 0 keeps all
+} TRACE_FILE_ROTATION, *PTRACE_FILE_ROTATION;
+
+class TraceFileWriter
+{
+public:
+    TraceFileWriter();
+    ~TraceFileWriter();
+
+    //
+    // Start the recording, replacing any file of the same name. Header is
+    // what every segment starts with, its times and Segment filled in.
+    //
+    BOOL Open(const char *Path, const TRACE_FILE_HEADER *Header, const TRACE_FILE_ROTATION *Rotation);
+
+    //
+    // Append a block of whole records. Only waits for the disk when all
+    // buffers are full. FALSE once a write failed.
+    //
+    BOOL Write(const UCHAR *Data, ULONG Length);
+
+    //
+    // Finish the last segment and wait until everything is written
+    //
+    BOOL Close();
+
+    //
+    // Bytes and segments recorded, written or not yet
+    //
+    ULONG64 GetLength() const { return Length; }
+    ULONG GetSegments() const { return Segment + 1; }
+
+private:
+    typedef struct _TRACE_WRITE {
+        PUCHAR  Buffer;
+        ULONG   Used;
+        ULONG   Segment;
+        BOOL    Last;           // of its segment, which ends with this buffer
+    } TRACE_WRITE;
+
+    void BeginSegment();
+    void EndSegment();
+    void Append(const void *Data, ULONG Length);
+    void Account(const UCHAR *Data, ULONG Length);
+    void Writer();
+    BOOL FinishSegment(ULONG64 Length);
+    std::string GetSegmentPath(ULONG Segment) const;
+
+    //
+    // Drain thread
+    //
+    std::string                 Path;
+    TRACE_FILE_HEADER           Header;
+    TRACE_FILE_ROTATION         Rotation;
+    std::vector<TRACE_WRITE>    Writes;
+    TRACE_WRITE                 *Current;       // filling, NULL between segments
+    ULONG                       Segment;
+    ULONG64                     SegmentLength;  // bytes appended to it
+    ULONG64                     SegmentStart;   // GetTickCount64
+    ULONG64                     Length;
+    TRACE_FILE_INDEX            Index;
+    std::vector<TRACE_FILE_INDEX_DEVICE> IndexDevices;
+    BOOL                        Opened;
+
+    //
+    // Writer thread
+    //
+    HANDLE                      File;
+    ULONG                       FileSegment;
+    ULONG64                     FileLength;     // bytes written to it
+    std::thread                 Thread;
+    volatile BOOL               Failed;
+
+    SpscQueue<TRACE_WRITE *>    Free;           // writer to drain
+    SpscQueue<TRACE_WRITE *>    Full;           // drain to writer
+};
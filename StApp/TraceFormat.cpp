@@ -0,0 +1,314 @@
+// TraceFormat.cpp : trace records as text.
+//
+// Built without the precompiled header, so it also builds off Windows.
+//
+
+#include "TraceFormat.h"
+
+#include <string.h>
+
+//
+// Most text one record can take: its fixed lines, and 255 CDB and 255 sense
+// bytes of "XX " each, with a new line every 16 sense bytes
+//
+#define FORMAT_RECORD_MAX_SIZE  (1024 + 255 * 3 + 255 * 3 + (255 / 16 + 1) * 9)
+
+//
+// "XX " of every byte value, so a byte is one 4 byte copy from the table,
+// the 4th byte overwritten by the next one
+//
+static const char HexBytes[256 * 3 + 1] =
+    "00 01 02 03 04 05 06 07 08 09 0A 0B 0C 0D 0E 0F "
+    "10 11 12 13 14 15 16 17 18 19 1A 1B 1C 1D 1E 1F "
+    "20 21 22 23 24 25 26 27 28 29 2A 2B 2C 2D 2E 2F "
+    "30 31 32 33 34 35 36 37 38 39 3A 3B 3C 3D 3E 3F "
+    "40 41 42 43 44 45 46 47 48 49 4A 4B 4C 4D 4E 4F "
+    "50 51 52 53 54 55 56 57 58 59 5A 5B 5C 5D 5E 5F "
+    "60 61 62 63 64 65 66 67 68 69 6A 6B 6C 6D 6E 6F "
+    "70 71 72 73 74 75 76 77 78 79 7A 7B 7C 7D 7E 7F "
+    "80 81 82 83 84 85 86 87 88 89 8A 8B 8C 8D 8E 8F "
+    "90 91 92 93 94 95 96 97 98 99 9A 9B 9C 9D 9E 9F "
+    "A0 A1 A2 A3 A4 A5 A6 A7 A8 A9 AA AB AC AD AE AF "
+    "B0 B1 B2 B3 B4 B5 B6 B7 B8 B9 BA BB BC BD BE BF "
+    "C0 C1 C2 C3 C4 C5 C6 C7 C8 C9 CA CB CC CD CE CF "
+    "D0 D1 D2 D3 D4 D5 D6 D7 D8 D9 DA DB DC DD DE DF "
+    "E0 E1 E2 E3 E4 E5 E6 E7 E8 E9 EA EB EC ED EE EF "
+    "F0 F1 F2 F3 F4 F5 F6 F7 F8 F9 FA FB FC FD FE FF ";
+
+static const char HexDigits[] = "0123456789ABCDEF";
+
+//
+// Literal text, without its terminating zero
+//
+#define PUT_TEXT(Out, Literal)  PutText(Out, Literal, sizeof(Literal) - 1)
+
+static char *PutText(char *Out, const char *Text, size_t Length);
+static char *PutDecimal(char *Out, ULONG64 Value, ULONG Width);
+static char *PutHexNumber(char *Out, ULONG64 Value, ULONG Width);
+static char *PutHexBytes(char *Out, const UCHAR *Bytes, ULONG Length, ULONG PerLine);
+static char *PutLatency(char *Out, const TRACE_RECORD_HEADER *Record, ULONG64 Frequency);
+static BOOL GetSenseCodes(const UCHAR *Sense, ULONG Length, UCHAR *Key, UCHAR *Code, UCHAR *Qualifier);
+static char *FormatTraceRequest(char *Out, const TRACE_RECORD_HEADER *Record, ULONG64 Frequency);
+
+
+//
+// The text is built in a buffer of the largest size a record can take and
+// appended in one go, no call per field or byte
+//
+void FormatTraceRecord(const TRACE_RECORD_HEADER *Record, ULONG64 Frequency, std::string *Text)
+{
+    const UCHAR *cdb = TRACE_RECORD_CDB(Record);
+    const UCHAR *senseData = TRACE_RECORD_SENSE(Record);
+    char buffer[FORMAT_RECORD_MAX_SIZE];
+    char *out = buffer;
+
+    if ((Record->Flags & TRACE_RECORD_FLAG_REQUEST) && Record->CdbLength >= sizeof(TRACE_RECORD_REQUEST))
+    {
+        out = FormatTraceRequest(out, Record, Frequency);
+        Text->append(buffer, out - buffer);
+        return;
+    }
+
+    if (Record->CdbLength > 32)
+    {
+        out = PUT_TEXT(out, "CDB length is ");
+        out = PutDecimal(out, Record->CdbLength, 0);
+        out = PUT_TEXT(out, ", Abnormal!!\n");
+    }
+
+    if (Record->SenseLength > 100)
+    {
+        out = PUT_TEXT(out, "Sense length is ");
+        out = PutDecimal(out, Record->SenseLength, 0);
+        out = PUT_TEXT(out, ", Abnormal!!\n");
+    }
+
+    out = PUT_TEXT(out, "CDB ");
+    out = PutDecimal(out, Record->CdbLength, 2);
+    out = PUT_TEXT(out, " Bytes: ");
+    out = PutHexBytes(out, cdb, Record->CdbLength, 0);
+
+    // Decoded by the driver
+    if (Record->Flags & TRACE_RECORD_FLAG_DECODED)
+    {
+        out = PUT_TEXT(out, " LBA 0x");
+        out = PutHexNumber(out, Record->Lba, 1);
+        out = PUT_TEXT(out, ", ");
+        out = PutDecimal(out, Record->Blocks, 0);
+        out = PUT_TEXT(out, " blocks");
+        if (Record->CdbFlags & CDB_FLAG_FUA) {
+            out = PUT_TEXT(out, " FUA");
+        }
+        if (Record->CdbFlags & CDB_FLAG_DPO) {
+            out = PUT_TEXT(out, " DPO");
+        }
+    }
+
+    out = PutLatency(out, Record, Frequency);
+
+    if (Record->ScsiStatus || Record->NtStatus)
+    {
+        out = PUT_TEXT(out, "    NtStatus: ");
+        out = PutHexNumber(out, (ULONG)Record->NtStatus, 8);
+        out = PUT_TEXT(out, " \n    ScsiStatus: ");
+        out = PutHexNumber(out, Record->ScsiStatus, 8);
+        out = PUT_TEXT(out, " \n");
+    }
+
+    // only to print it if
+    if (Record->SenseLength && Record->ScsiStatus)
+    {
+        UCHAR senseKey = 0;
+        UCHAR adSenseCode = 0;
+        UCHAR adSenseCodeQual = 0;
+
+        GetSenseCodes(senseData, Record->SenseLength, &senseKey, &adSenseCode, &adSenseCodeQual);
+
+        out = PUT_TEXT(out, "    Sense Key: ");
+        out = PutHexNumber(out, senseKey, 2);
+        out = PUT_TEXT(out, " \n    Sense Code: ");
+        out = PutHexNumber(out, adSenseCode, 2);
+        out = PUT_TEXT(out, " ");
+        out = PutHexNumber(out, adSenseCodeQual, 2);
+        out = PUT_TEXT(out, " \n    Sense Raw ");
+        out = PutDecimal(out, Record->SenseLength, 0);
+        out = PUT_TEXT(out, " Bytes:");
+        out = PutHexBytes(out, senseData, Record->SenseLength, 16);
+        *out++ = '\n';
+    }
+
+    Text->append(buffer, out - buffer);
+}
+
+ULONG64 TraceSequence::Check(const TRACE_RECORD_HEADER *Record)
+{
+    std::map<ULONG, ULONG64>::iterator next = Next.find(Record->DeviceId);
+    ULONG64 lost = 0;
+
+    if (next == Next.end()) {
+        Next[Record->DeviceId] = Record->SequenceNumber + 1;
+    }
+    else if (Record->SequenceNumber >= next->second) {
+        lost = Record->SequenceNumber - next->second;
+        next->second = Record->SequenceNumber + 1;
+    }
+
+    return lost;
+}
+
+
+//
+// A READ or WRITE request, as sent to the disk from above
+//
+char *FormatTraceRequest(char *Out, const TRACE_RECORD_HEADER *Record, ULONG64 Frequency)
+{
+    const TRACE_RECORD_REQUEST *request = (const TRACE_RECORD_REQUEST *)TRACE_RECORD_CDB(Record);
+
+    if (request->MajorFunction == TRACE_RECORD_REQUEST_READ) {
+        Out = PUT_TEXT(Out, "READ  offset 0x");
+    }
+    else if (request->MajorFunction == TRACE_RECORD_REQUEST_WRITE) {
+        Out = PUT_TEXT(Out, "WRITE offset 0x");
+    }
+    else {
+        Out = PUT_TEXT(Out, "?     offset 0x");
+    }
+
+    Out = PutHexNumber(Out, request->Offset, 1);
+    Out = PUT_TEXT(Out, ", ");
+    Out = PutDecimal(Out, request->Length, 0);
+    Out = PUT_TEXT(Out, " bytes");
+    Out = PutLatency(Out, Record, Frequency);
+
+    if (Record->NtStatus || request->Information != request->Length)
+    {
+        Out = PUT_TEXT(Out, "    NtStatus: ");
+        Out = PutHexNumber(Out, (ULONG)Record->NtStatus, 8);
+        Out = PUT_TEXT(Out, ", ");
+        Out = PutDecimal(Out, request->Information, 0);
+        Out = PUT_TEXT(Out, " bytes transferred\n");
+    }
+
+    return Out;
+}
+
+//
+// The end of the first line: latency, sampling rate, new line
+//
+char *PutLatency(char *Out, const TRACE_RECORD_HEADER *Record, ULONG64 Frequency)
+{
+    if (Record->IssueTimestamp && Frequency)
+    {
+        *Out++ = ' ';
+        Out = PutDecimal(Out, Record->Latency * 1000000 / Frequency, 0);
+        Out = PUT_TEXT(Out, " us");
+    }
+
+    if (Record->SampleRate > 1)
+    {
+        Out = PUT_TEXT(Out, " (1 in ");
+        Out = PutDecimal(Out, Record->SampleRate, 0);
+        *Out++ = ')';
+    }
+
+    *Out++ = '\n';
+    return Out;
+}
+
+char *PutText(char *Out, const char *Text, size_t Length)
+{
+    memcpy(Out, Text, Length);
+    return Out + Length;
+}
+
+//
+// As "%*llu", right aligned in Width characters
+//
+char *PutDecimal(char *Out, ULONG64 Value, ULONG Width)
+{
+    char digits[20];
+    ULONG count = 0;
+
+    do {
+        digits[sizeof(digits) - ++count] = (char)('0' + Value % 10);
+        Value /= 10;
+    } while (Value != 0);
+
+    while (Width > count)
+    {
+        *Out++ = ' ';
+        Width--;
+    }
+
+    return PutText(Out, digits + sizeof(digits) - count, count);
+}
+
+//
+// As "%0*llX", at least Width digits
+//
+char *PutHexNumber(char *Out, ULONG64 Value, ULONG Width)
+{
+    char digits[16];
+    ULONG count = 0;
+
+    do {
+        digits[sizeof(digits) - ++count] = HexDigits[Value & 0xF];
+        Value >>= 4;
+    } while (Value != 0);
+
+    while (Width > count)
+    {
+        *Out++ = '0';
+        Width--;
+    }
+
+    return PutText(Out, digits + sizeof(digits) - count, count);
+}
+
+//
+// Bytes as "%02X " each, a new indented line every PerLine bytes if not 0.
+// Each copy writes one byte past the text, which the buffer has room for.
+//
+char *PutHexBytes(char *Out, const UCHAR *Bytes, ULONG Length, ULONG PerLine)
+{
+    for (ULONG i = 0; i < Length; i++)
+    {
+        if (PerLine && i % PerLine == 0) {
+            Out = PUT_TEXT(Out, "\n        ");
+        }
+        memcpy(Out, HexBytes + Bytes[i] * 3, 4);
+        Out += 3;
+    }
+
+    return Out;
+}
+
+//
+// Sense key and additional sense code and qualifier, of fixed or descriptor
+// format sense data. Formats not indicated as either are taken as fixed:
+// some devices (Toshiba) return fixed format with a response code of FF.
+//
+BOOL GetSenseCodes(const UCHAR *Sense, ULONG Length, UCHAR *Key, UCHAR *Code, UCHAR *Qualifier)
+{
+    UCHAR responseCode = Sense[0] & 0x7F;
+
+    if (responseCode == 0x72 || responseCode == 0x73)
+    {
+        if (Length < 4) {
+            return FALSE;
+        }
+        *Key = Sense[1] & 0x0F;
+        *Code = Sense[2];
+        *Qualifier = Sense[3];
+        return TRUE;
+    }
+
+    if (Length < 3) {
+        return FALSE;
+    }
+
+    *Key = Sense[2] & 0x0F;
+    *Code = Length > 12 ? Sense[12] : 0;
+    *Qualifier = Length > 13 ? Sense[13] : 0;
+    return TRUE;
+}
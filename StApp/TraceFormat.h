@@ -0,0 +1,38 @@
+// TraceFormat.h : trace records as text.
+//
+// What StApp prints for a record, appended to a string instead of printed,
+// so records can be formatted on one thread and written out on another.
+//
+
+#pragma once
+
+#include "TraceTypes.h"
+
+#include <map>
+#include <string>
+
+#include "../StorTrace/TraceRecord.h"
+
+//
+// Append the lines of a record to Text. Frequency is that of the record
+// timestamps, 0 if unknown: latencies are left out then.
+//
+void FormatTraceRecord(const TRACE_RECORD_HEADER *Record, ULONG64 Frequency, std::string *Text);
+
+//
+// Lost records, by the per device sequence numbers. Every record takes a
+// sequence number, dropped ones too. With per-processor rings a record may
+// still show up after a later one that completed on another processor; it
+// is not counted twice.
+//
+class TraceSequence
+{
+public:
+    //
+    // Records lost between the previous record of the device and this one
+    //
+    ULONG64 Check(const TRACE_RECORD_HEADER *Record);
+
+private:
+    std::map<ULONG, ULONG64> Next;     // sequence number expected next, by device
+};
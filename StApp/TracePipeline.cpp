@@ -0,0 +1,295 @@
+// TracePipeline.cpp : drain, parse, format and write trace records on
+// threads of their own.
+//
+// Built without the precompiled header, so it also builds off Windows.
+//
+
+#include "TracePipeline.h"
+
+#include <string.h>
+
+//
+// Processors left to the reader, the parser and the writer before any
+// go to formatters
+//
+#define TRACE_PIPELINE_STAGE_THREADS    3
+
+
+TracePipeline::TracePipeline(TraceSource *Source, ULONG64 Frequency, FILE *Output, BOOL Lossless, ULONG Formatters)
+    : Source(Source), Frequency(Frequency), Output(Output), Lossless(Lossless),
+      Blocks(TRACE_PIPELINE_BUFFERS), Free(TRACE_PIPELINE_BUFFERS), Read(TRACE_PIPELINE_BUFFERS)
+{
+    if (Formatters == 0)
+    {
+        ULONG processors = std::thread::hardware_concurrency();
+
+        Formatters = processors > TRACE_PIPELINE_STAGE_THREADS ? processors - TRACE_PIPELINE_STAGE_THREADS : 1;
+    }
+    FormatterCount = Formatters < TRACE_PIPELINE_MAX_FORMATTERS ? Formatters : TRACE_PIPELINE_MAX_FORMATTERS;
+
+    for (ULONG i = 0; i < FormatterCount; i++)
+    {
+        Parsed.push_back(new SpscQueue<TRACE_BLOCK *>(TRACE_PIPELINE_BUFFERS));
+        Formatted.push_back(new SpscQueue<TRACE_BLOCK *>(TRACE_PIPELINE_BUFFERS));
+    }
+
+    //
+    // A block of records without notes needs no more entries than this.
+    // Entries and text keep what they grew to when the block is reused.
+    //
+    for (size_t i = 0; i < Blocks.size(); i++)
+    {
+        Blocks[i].Data = new ULONG64[TRACE_READ_SIZE / sizeof(ULONG64)];
+        Blocks[i].Entries.reserve(TRACE_READ_SIZE / sizeof(TRACE_RECORD_HEADER));
+        Free.TryPush(&Blocks[i]);
+    }
+
+    memset(&Stats, 0, sizeof(Stats));
+}
+
+TracePipeline::~TracePipeline()
+{
+    for (size_t i = 0; i < Blocks.size(); i++) {
+        delete[] Blocks[i].Data;
+    }
+
+    for (ULONG i = 0; i < FormatterCount; i++)
+    {
+        delete Parsed[i];
+        delete Formatted[i];
+    }
+}
+
+void TracePipeline::Run()
+{
+    std::vector<std::thread> threads;
+
+    threads.push_back(std::thread(&TracePipeline::Writer, this));
+    for (ULONG i = 0; i < FormatterCount; i++) {
+        threads.push_back(std::thread(&TracePipeline::Formatter, this, i));
+    }
+    threads.push_back(std::thread(&TracePipeline::Parser, this));
+
+    // The reader is this thread
+    Reader();
+
+    for (size_t i = 0; i < threads.size(); i++) {
+        threads[i].join();
+    }
+
+    fflush(Output);
+}
+
+//
+// Drain the source as fast as it returns blocks. Nothing here waits on the
+// other stages, unless lossless.
+//
+void TracePipeline::Reader()
+{
+    ULONG64 droppedBlocks = 0;
+    ULONG64 droppedBytes = 0;
+    TRACE_BLOCK *block;
+    const UCHAR *data;
+    ULONG length;
+
+    while ((data = Source->Next(&length)) != NULL)
+    {
+        Stats.Blocks++;
+        Stats.Bytes += length;
+
+        if (!Free.TryPop(&block))
+        {
+            if (!Lossless)
+            {
+                droppedBlocks++;
+                droppedBytes += length;
+                Stats.DroppedBlocks++;
+                Stats.DroppedBytes += length;
+                continue;
+            }
+            Free.Pop(&block);
+        }
+
+        memcpy(block->Data, data, length);
+        block->Length = length;
+        block->DroppedBlocks = droppedBlocks;
+        block->DroppedBytes = droppedBytes;
+        droppedBlocks = 0;
+        droppedBytes = 0;
+
+        Read.Push(block);
+    }
+
+    // The source has ended, an empty block can wait to say what was dropped last
+    if (droppedBlocks != 0 && Free.Pop(&block))
+    {
+        block->Length = 0;
+        block->DroppedBlocks = droppedBlocks;
+        block->DroppedBytes = droppedBytes;
+        Read.Push(block);
+    }
+
+    Read.Close();
+}
+
+//
+// Check the records of each block in order, and note where devices change
+// and records were lost. The formatters then need no state of their own.
+//
+void TracePipeline::Parser()
+{
+    TraceSequence sequence;
+    ULONG deviceId = 0;     // STORTRACE_ALL_DEVICES, no device has it
+    ULONG next = 0;
+    TRACE_BLOCK *block;
+
+    while (Read.Pop(&block))
+    {
+        const UCHAR *data = (const UCHAR *)block->Data;
+        ULONG offset = 0;
+
+        block->Entries.clear();
+
+        //
+        // Records are back to back, each one says how long it is
+        //
+        while (offset + sizeof(TRACE_RECORD_HEADER) <= block->Length)
+        {
+            const TRACE_RECORD_HEADER *record = (const TRACE_RECORD_HEADER *)(data + offset);
+            TRACE_ENTRY entry = { ENTRY_RECORD, offset, record->DeviceId, 0 };
+            ULONG64 lost;
+
+            if (record->Magic != TRACE_RECORD_MAGIC ||
+                record->Length < sizeof(TRACE_RECORD_HEADER) ||
+                record->Length % TRACE_RECORD_ALIGN != 0 ||
+                record->Length > block->Length - offset)
+            {
+                entry.Kind = ENTRY_BAD;
+                entry.Count = block->Length - offset;
+                block->Entries.push_back(entry);
+                break;
+            }
+
+            offset += record->Length;
+
+            if (record->Version != TRACE_RECORD_VERSION)
+            {
+                entry.Kind = ENTRY_VERSION;
+                entry.Count = record->Version;
+                block->Entries.push_back(entry);
+                continue;
+            }
+
+            //
+            // Formatting trusts CdbLength and SenseLength, they must fit
+            //
+            if (record->Length != TRACE_RECORD_SIZE(record->CdbLength, record->SenseLength))
+            {
+                entry.Kind = ENTRY_BAD;
+                entry.Count = block->Length - entry.Offset;
+                block->Entries.push_back(entry);
+                break;
+            }
+
+            if (record->DeviceId != deviceId)
+            {
+                deviceId = record->DeviceId;
+                entry.Kind = ENTRY_DEVICE;
+                block->Entries.push_back(entry);
+            }
+
+            lost = sequence.Check(record);
+            if (lost)
+            {
+                Stats.LostRecords += lost;
+                entry.Kind = ENTRY_LOST;
+                entry.Count = lost;
+                block->Entries.push_back(entry);
+            }
+
+            Stats.Records++;
+            entry.Kind = ENTRY_RECORD;
+            entry.Count = 0;
+            block->Entries.push_back(entry);
+        }
+
+        // Round robin, the writer takes them back in the same order
+        Parsed[next]->Push(block);
+        next = (next + 1) % FormatterCount;
+    }
+
+    for (ULONG i = 0; i < FormatterCount; i++) {
+        Parsed[i]->Close();
+    }
+}
+
+void TracePipeline::Formatter(ULONG Index)
+{
+    TRACE_BLOCK *block;
+    char line[128];
+
+    while (Parsed[Index]->Pop(&block))
+    {
+        const UCHAR *data = (const UCHAR *)block->Data;
+
+        block->Text.clear();
+
+        if (block->DroppedBlocks)
+        {
+            snprintf(line, sizeof(line), "%llu blocks, %llu bytes of trace not printed, output too slow\n",
+                (unsigned long long)block->DroppedBlocks, (unsigned long long)block->DroppedBytes);
+            block->Text.append(line);
+        }
+
+        for (size_t i = 0; i < block->Entries.size(); i++)
+        {
+            const TRACE_ENTRY *entry = &block->Entries[i];
+
+            switch (entry->Kind)
+            {
+            case ENTRY_RECORD:
+                FormatTraceRecord((const TRACE_RECORD_HEADER *)(data + entry->Offset), Frequency, &block->Text);
+                continue;
+
+            case ENTRY_DEVICE:
+                snprintf(line, sizeof(line), "Device %u:\n", entry->DeviceId);
+                break;
+
+            case ENTRY_LOST:
+                snprintf(line, sizeof(line), "Device %u: %llu records lost\n", entry->DeviceId, (unsigned long long)entry->Count);
+                break;
+
+            case ENTRY_VERSION:
+                snprintf(line, sizeof(line), "record version %u not supported\n", (ULONG)entry->Count);
+                break;
+
+            default:
+                snprintf(line, sizeof(line), "bad record at offset %u, dropping %u bytes\n", entry->Offset, (ULONG)entry->Count);
+                break;
+            }
+
+            block->Text.append(line);
+        }
+
+        Formatted[Index]->Push(block);
+    }
+
+    Formatted[Index]->Close();
+}
+
+void TracePipeline::Writer()
+{
+    ULONG next = 0;
+    TRACE_BLOCK *block;
+
+    while (Formatted[next]->Pop(&block))
+    {
+        fwrite(block->Text.data(), 1, block->Text.size(), Output);
+
+        // Shown as it comes, a block at a time
+        fflush(Output);
+
+        Free.Push(block);
+        next = (next + 1) % FormatterCount;
+    }
+}
@@ -0,0 +1,114 @@
+// TracePipeline.h : drain, parse, format and write trace records on
+// threads of their own.
+//
+// Printing a record costs far more than capturing it, and a console can
+// stall for as long as it likes. Done on the thread that reads, that stalls
+// the reads, and the driver's rings overflow. Here each stage runs on its
+// own thread and hands whole blocks to the next through single producer,
+// single consumer queues:
+//
+//   reader      copies each block the source returns into a free buffer,
+//               and goes straight back to the source
+//   parser      checks the records and accounts for lost ones
+//   formatters  turn the records into text, several blocks at once
+//   writer      writes the text out in order, and frees the buffers
+//
+// The buffers are allocated up front. When the writer is so far behind
+// that none is free, a lossy pipeline (the control device) drops the block
+// rather than wait, and says so in the output; a lossless one (a file)
+// waits for the writer.
+//
+
+#pragma once
+
+#include "TraceTypes.h"
+
+#include <stdio.h>
+
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "SpscQueue.h"
+#include "TraceSource.h"
+#include "TraceFormat.h"
+
+//
+// Buffers of TRACE_READ_SIZE the blocks are copied into, the most the
+// writer can be behind the reader
+//
+#define TRACE_PIPELINE_BUFFERS      32
+
+#define TRACE_PIPELINE_MAX_FORMATTERS   8
+
+//
+// What came through the pipeline
+//
+typedef struct _TRACE_PIPELINE_STATS {
+    ULONG64 Blocks;             // returned by the source
+    ULONG64 Bytes;
+    ULONG64 Records;            // printed
+    ULONG64 LostRecords;        // by the sequence numbers, dropped ones included
+    ULONG64 DroppedBlocks;      // by a lossy pipeline, no buffer free
+    ULONG64 DroppedBytes;
+} TRACE_PIPELINE_STATS, *PTRACE_PIPELINE_STATS;
+
+class TracePipeline
+{
+public:
+    //
+    // Frequency is that of the record timestamps, 0 if unknown. Formatters
+    // is the number of formatting threads, 0 for one per spare processor.
+    //
+    TracePipeline(TraceSource *Source, ULONG64 Frequency, FILE *Output, BOOL Lossless, ULONG Formatters);
+    ~TracePipeline();
+
+    //
+    // Print the records of the source until it ends and they are all out
+    //
+    void Run();
+
+    void GetStats(PTRACE_PIPELINE_STATS Stats) const { *Stats = this->Stats; }
+
+private:
+    //
+    // What a parsed block holds, in order: records to print, and notes to
+    // print before them
+    //
+    enum { ENTRY_RECORD, ENTRY_DEVICE, ENTRY_LOST, ENTRY_VERSION, ENTRY_BAD };
+
+    typedef struct _TRACE_ENTRY {
+        ULONG   Kind;           // ENTRY_*
+        ULONG   Offset;         // of the record in the block
+        ULONG   DeviceId;
+        ULONG64 Count;          // records lost, or bytes dropped from a bad record on
+    } TRACE_ENTRY;
+
+    typedef struct _TRACE_BLOCK {
+        ULONG64                     *Data;
+        ULONG                       Length;
+        ULONG64                     DroppedBlocks;  // before this one
+        ULONG64                     DroppedBytes;
+        std::vector<TRACE_ENTRY>    Entries;
+        std::string                 Text;
+    } TRACE_BLOCK;
+
+    void Reader();
+    void Parser();
+    void Formatter(ULONG Index);
+    void Writer();
+
+    TraceSource                 *Source;
+    ULONG64                     Frequency;
+    FILE                        *Output;
+    BOOL                        Lossless;
+    ULONG                       FormatterCount;
+
+    std::vector<TRACE_BLOCK>    Blocks;
+    SpscQueue<TRACE_BLOCK *>    Free;       // writer to reader
+    SpscQueue<TRACE_BLOCK *>    Read;       // reader to parser
+    std::vector<SpscQueue<TRACE_BLOCK *> *> Parsed;     // parser to each formatter
+    std::vector<SpscQueue<TRACE_BLOCK *> *> Formatted;  // each formatter to writer
+
+    TRACE_PIPELINE_STATS        Stats;      // each field written by one stage
+};
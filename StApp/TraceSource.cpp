@@ -0,0 +1,214 @@
+// TraceSource.cpp : the control device and file trace sources.
+//
+// Built without the precompiled header, so it also builds off Windows
+// (without the control device).
+//
+
+#include "TraceSource.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+
+//-------------------------------------------------------
+// File or pipe
+//-------------------------------------------------------
+FileTraceSource::FileTraceSource(FILE *File)
+    : File(File), Valid(0), Consumed(0), HasHeader(FALSE), Ended(FALSE)
+{
+    PUCHAR buffer;
+
+    Buffer = new ULONG64[TRACE_READ_SIZE / sizeof(ULONG64)];
+    buffer = (PUCHAR)Buffer;
+
+    //
+    // Records start right away or after the header. Whatever is not the
+    // header stays in the buffer for Next; the header is skipped by
+    // reading, so a pipe works too.
+    //
+    Valid = fread(buffer, 1, TRACE_FILE_ALIGN, File);
+
+    if (!TraceFileHeaderIsValid((const TRACE_FILE_HEADER *)buffer, Valid)) {
+        return;
+    }
+
+    memcpy(&Header, buffer, sizeof(Header));
+    HasHeader = TRUE;
+    Valid = 0;
+
+    for (ULONG64 skipped = TRACE_FILE_ALIGN; skipped < Header.HeaderSize; skipped += TRACE_FILE_ALIGN)
+    {
+        if (fread(buffer, 1, TRACE_FILE_ALIGN, File) != TRACE_FILE_ALIGN) {
+            break;
+        }
+    }
+}
+
+FileTraceSource::~FileTraceSource()
+{
+    delete[] Buffer;
+}
+
+const UCHAR *FileTraceSource::Next(ULONG *Length)
+{
+    PUCHAR buffer = (PUCHAR)Buffer;
+    size_t whole = 0;
+
+    if (Ended) {
+        return NULL;
+    }
+
+    //
+    // Keep the partial record the last block ended with, records stay
+    // 8-byte aligned since their lengths are
+    //
+    memmove(buffer, buffer + Consumed, Valid - Consumed);
+    Valid -= Consumed;
+    Consumed = 0;
+
+    Valid += fread(buffer + Valid, 1, TRACE_READ_SIZE - Valid, File);
+
+    while (whole + sizeof(TRACE_RECORD_HEADER) <= Valid)
+    {
+        PTRACE_RECORD_HEADER record = (PTRACE_RECORD_HEADER)(buffer + whole);
+
+        // The records end where the index starts
+        if (*(const ULONG *)record == TRACE_FILE_INDEX_MAGIC)
+        {
+            Ended = TRUE;
+            break;
+        }
+
+        if (record->Magic != TRACE_RECORD_MAGIC ||
+            record->Length < sizeof(TRACE_RECORD_HEADER) ||
+            record->Length % TRACE_RECORD_ALIGN != 0)
+        {
+            // Not a record, hand it all out for the reader to report
+            whole = Valid;
+            break;
+        }
+
+        if (record->Length > Valid - whole) {
+            break;
+        }
+
+        whole += record->Length;
+    }
+
+    // End of the file, a partial record left at its end is dropped
+    if (whole == 0) {
+        return NULL;
+    }
+
+    Consumed = whole;
+    *Length = (ULONG)whole;
+
+    return buffer;
+}
+
+
+#ifdef _WIN32
+
+//-------------------------------------------------------
+// Control device
+//-------------------------------------------------------
+DeviceTraceSource::DeviceTraceSource(HANDLE Device)
+    : Device(Device), Current(0), Started(FALSE)
+{
+    for (ULONG i = 0; i < TRACE_READ_COUNT; i++)
+    {
+        memset(&Reads[i].Overlapped, 0, sizeof(OVERLAPPED));
+        Reads[i].Overlapped.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+        Reads[i].Buffer = new ULONG64[TRACE_READ_SIZE / sizeof(ULONG64)];
+        Reads[i].Pending = FALSE;
+    }
+}
+
+DeviceTraceSource::~DeviceTraceSource()
+{
+    DWORD bytes;
+
+    CancelIoEx(Device, NULL);
+
+    for (ULONG i = 0; i < TRACE_READ_COUNT; i++)
+    {
+        // The buffer belongs to the driver until the read is done
+        if (Reads[i].Pending) {
+            GetOverlappedResult(Device, &Reads[i].Overlapped, &bytes, TRUE);
+        }
+
+        CloseHandle(Reads[i].Overlapped.hEvent);
+        delete[] Reads[i].Buffer;
+    }
+}
+
+BOOL DeviceTraceSource::Issue(ULONG Index)
+{
+    TRACE_READ *read = &Reads[Index];
+
+    read->Overlapped.Offset = 0;
+    read->Overlapped.OffsetHigh = 0;
+
+    if (!ReadFile(Device, read->Buffer, TRACE_READ_SIZE, NULL, &read->Overlapped) &&
+        GetLastError() != ERROR_IO_PENDING)
+    {
+        printf("Read failed, error %d\n", GetLastError());
+        return FALSE;
+    }
+
+    read->Pending = TRUE;
+    return TRUE;
+}
+
+const UCHAR *DeviceTraceSource::Next(ULONG *Length)
+{
+    if (!Started)
+    {
+        for (ULONG i = 0; i < TRACE_READ_COUNT; i++)
+        {
+            if (!Issue(i)) {
+                return NULL;
+            }
+        }
+        Started = TRUE;
+    }
+    else
+    {
+        // The caller is done with the block handed out last time
+        if (!Issue(Current)) {
+            return NULL;
+        }
+        Current = (Current + 1) % TRACE_READ_COUNT;
+    }
+
+    //
+    // The control queue is sequential, so reads complete in the order
+    // they were issued and the records stay in order
+    //
+    while (TRUE)
+    {
+        TRACE_READ *read = &Reads[Current];
+        DWORD bytes = 0;
+        BOOL success;
+
+        success = GetOverlappedResult(Device, &read->Overlapped, &bytes, TRUE);
+        read->Pending = FALSE;
+
+        if (!success) {
+            return NULL;
+        }
+
+        if (bytes != 0) {
+            *Length = bytes;
+            return (PUCHAR)read->Buffer;
+        }
+
+        // The driver holds reads until there is trace, but just in case
+        if (!Issue(Current)) {
+            return NULL;
+        }
+        Current = (Current + 1) % TRACE_READ_COUNT;
+    }
+}
+
+#endif
@@ -0,0 +1,103 @@
+// TraceSource.h : where the trace records come from.
+//
+// A trace source hands out blocks of whole trace records, as the driver
+// returns them on a read of the control device. The control device only
+// exists on Windows; a file or a pipe of recorded records can stand in
+// for it anywhere, which is how the rest of the pipeline is benchmarked
+// off the target.
+//
+
+#pragma once
+
+#include "TraceTypes.h"
+
+#include <stdio.h>
+
+#include "../StorTrace/TraceRecord.h"
+#include "TraceFile.h"
+
+//
+// Size of one block, the driver drains as much as fits in one read
+//
+#define TRACE_READ_SIZE     (1024 * 1024)
+
+class TraceSource
+{
+public:
+    virtual ~TraceSource() {}
+
+    //
+    // Next block of whole records, waiting until there is one. The block
+    // stays valid until the next call. NULL when the source has ended.
+    //
+    virtual const UCHAR *Next(ULONG *Length) = 0;
+};
+
+//
+// Records from a file or a pipe (stdin for "-"), as recorded from the
+// driver, between the file header and index if there are (TraceFile.h).
+// Blocks are cut at record boundaries.
+//
+class FileTraceSource : public TraceSource
+{
+public:
+    //
+    // Reads the file header, if the file starts with one
+    //
+    FileTraceSource(FILE *File);
+    ~FileTraceSource();
+
+    const UCHAR *Next(ULONG *Length);
+
+    //
+    // The file header, NULL if the file has none
+    //
+    const TRACE_FILE_HEADER *GetHeader() const { return HasHeader ? &Header : NULL; }
+
+private:
+    FILE    *File;
+    ULONG64 *Buffer;
+    size_t  Valid;      // bytes in Buffer
+    size_t  Consumed;   // bytes handed out by the last Next
+    BOOL    HasHeader;
+    BOOL    Ended;      // at the index, the rest is not records
+    TRACE_FILE_HEADER Header;
+};
+
+#ifdef _WIN32
+
+//
+// Reads outstanding on the control device at once, so the driver always
+// has a buffer to drain into while the previous block is being printed.
+// The driver holds them until it has enough trace for them.
+//
+#define TRACE_READ_COUNT    4
+
+//
+// Records from the control device, through a pool of overlapped reads.
+// The handle must be opened with FILE_FLAG_OVERLAPPED.
+//
+class DeviceTraceSource : public TraceSource
+{
+public:
+    DeviceTraceSource(HANDLE Device);
+    ~DeviceTraceSource();
+
+    const UCHAR *Next(ULONG *Length);
+
+private:
+    typedef struct _TRACE_READ {
+        OVERLAPPED  Overlapped;
+        ULONG64     *Buffer;
+        BOOL        Pending;
+    } TRACE_READ;
+
+    BOOL Issue(ULONG Index);
+
+    HANDLE      Device;
+    TRACE_READ  Reads[TRACE_READ_COUNT];
+    ULONG       Current;    // read to complete next
+    BOOL        Started;
+};
+
+#endif
@@ -0,0 +1,27 @@
+// TraceTypes.h : the Windows types the driver's shared headers use.
+//
+// On Windows they come from windows.h; elsewhere they are defined here, so
+// the record and ring layouts, and the code that parses them, build off
+// the target too.
+//
+
+#pragma once
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <stdint.h>
+
+typedef uint8_t     UCHAR, *PUCHAR;
+typedef uint8_t     BOOLEAN;
+typedef uint16_t    USHORT;
+typedef uint32_t    ULONG;
+typedef int32_t     LONG;
+typedef uint64_t    ULONG64;
+typedef int64_t     LONG64;
+typedef int         BOOL;
+
+#define TRUE        1
+#define FALSE       0
+#define MAXULONG    0xffffffffUL
+#endif
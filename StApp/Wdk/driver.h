@@ -0,0 +1,231 @@
+// driver.h : the kernel the driver's portable modules use, in user mode.
+//
+// Stands in for StorTrace's driver.h and the WDK headers behind it, so the
+// modules free of WDF (RingBuf.c, TraceBuf.c, ReadBatch.c, CaptureFilter.c,
+// Sampler.c, Counters.c, LatencyStats.c) build into POSIX test tools as
+// they are, with -I Wdk. The modules include "driver.h" while the driver's
+// own is Driver.h, so this one is only picked up on a case-sensitive file
+// system.
+//
+// Pool is the C heap, interlocked operations are GCC atomics, and the
+// processor is whatever the calling thread says it is (WdkShimProcessor),
+// out of WdkShimProcessorCount.
+//
+
+#pragma once
+
+#include "../TraceTypes.h"
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef void                VOID, *PVOID;
+typedef size_t              SIZE_T;
+typedef uintptr_t           ULONG_PTR;
+typedef uint32_t            UINT32, *PULONG;
+typedef uint64_t            ULONGLONG, *PULONG64;
+typedef int64_t             LONGLONG, *PLONG64;
+typedef int32_t             NTSTATUS;
+typedef BOOLEAN             *PBOOLEAN;
+
+typedef union _LARGE_INTEGER {
+    LONGLONG QuadPart;
+} LARGE_INTEGER;
+
+#define _In_
+#define _Out_
+#define _Inout_
+#define _In_opt_
+#define _Out_opt_
+#define __inline                    inline
+#define DECLSPEC_CACHEALIGN         __attribute__((aligned(64)))
+
+#define UNREFERENCED_PARAMETER(P)   ((void)(P))
+#define FIELD_OFFSET(type, field)   offsetof(type, field)
+#define ANYSIZE_ARRAY               1
+#define PAGE_SIZE                   4096
+#define MAXLONG                     0x7fffffffL
+#define MAXULONG64                  ((ULONG64)~0ULL)
+
+#ifdef __cplusplus
+#define C_ASSERT(e)                 static_assert(e, #e)
+#else
+#define C_ASSERT(e)                 _Static_assert(e, #e)
+#endif
+
+#define STATUS_SUCCESS              ((NTSTATUS)0x00000000L)
+#define NT_SUCCESS(Status)          (((NTSTATUS)(Status)) >= 0)
+
+#define STORTRACE_POOL_TAG          0
+
+//
+// Pool: the tag and type only matter to the kernel
+//
+#define NonPagedPoolNx              0
+#define NonPagedPoolNxCacheAligned  0
+
+static __inline PVOID
+ExAllocatePoolWithTag(int PoolType, SIZE_T Size, ULONG Tag)
+{
+    PVOID p;
+
+    (void)PoolType;
+    (void)Tag;
+
+    // Cache aligned, and page aligned from a page on, as pool is
+    return posix_memalign(&p, Size >= PAGE_SIZE ? PAGE_SIZE : 64, Size) == 0 ? p : NULL;
+}
+
+#define ExFreePoolWithTag(P, Tag)   free(P)
+
+#define RtlCopyMemory               memcpy
+#define RtlZeroMemory(D, L)         memset((D), 0, (L))
+
+//
+// Debug output goes to the kernel debugger, of which there is none
+//
+#define DbgPrint(...)               ((void)0)
+#define KdPrint(_x_)                ((void)0)
+
+//
+// Interlocked operations and fenced accesses, all full barriers
+//
+#define InterlockedIncrement(P)                 __atomic_add_fetch((P), 1, __ATOMIC_SEQ_CST)
+#define InterlockedIncrement64(P)               __atomic_add_fetch((P), 1, __ATOMIC_SEQ_CST)
+#define InterlockedDecrement(P)                 __atomic_sub_fetch((P), 1, __ATOMIC_SEQ_CST)
+#define InterlockedExchange(P, V)               __atomic_exchange_n((P), (V), __ATOMIC_SEQ_CST)
+#define InterlockedExchange64(P, V)             __atomic_exchange_n((P), (V), __ATOMIC_SEQ_CST)
+#define InterlockedExchangeAdd(P, V)            __atomic_fetch_add((P), (V), __ATOMIC_SEQ_CST)
+#define InterlockedExchangeAdd64(P, V)          __atomic_fetch_add((P), (V), __ATOMIC_SEQ_CST)
+#define InterlockedExchangePointer(P, V)        __atomic_exchange_n((P), (V), __ATOMIC_SEQ_CST)
+
+static __inline LONG
+InterlockedCompareExchange(volatile LONG *Destination, LONG Exchange, LONG Comparand)
+{
+    __atomic_compare_exchange_n(Destination, &Comparand, Exchange, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    return Comparand;
+}
+
+static __inline LONG64
+InterlockedCompareExchange64(volatile LONG64 *Destination, LONG64 Exchange, LONG64 Comparand)
+{
+    __atomic_compare_exchange_n(Destination, &Comparand, Exchange, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    return Comparand;
+}
+
+#define ReadNoFence(P)              __atomic_load_n((P), __ATOMIC_RELAXED)
+#define ReadNoFence64(P)            __atomic_load_n((P), __ATOMIC_RELAXED)
+#define ReadAcquire(P)              __atomic_load_n((P), __ATOMIC_ACQUIRE)
+#define ReadAcquire64(P)            __atomic_load_n((P), __ATOMIC_ACQUIRE)
+#define WriteNoFence(P, V)          __atomic_store_n((P), (V), __ATOMIC_RELAXED)
+#define WriteNoFence64(P, V)        __atomic_store_n((P), (V), __ATOMIC_RELAXED)
+#define WriteRelease(P, V)          __atomic_store_n((P), (V), __ATOMIC_RELEASE)
+#define WriteRelease64(P, V)        __atomic_store_n((P), (V), __ATOMIC_RELEASE)
+
+//
+// Processors: set WdkShimProcessor on each thread, and the count before
+// creating anything per processor
+//
+__attribute__((weak)) __thread ULONG WdkShimProcessor;
+__attribute__((weak)) ULONG WdkShimProcessorCount = 1;
+
+#define ALL_PROCESSOR_GROUPS                    0xffff
+#define KeQueryActiveProcessorCountEx(Group)    (WdkShimProcessorCount)
+#define KeGetCurrentProcessorNumberEx(Number)   (WdkShimProcessor)
+
+//
+// Nanoseconds, the frequency is 1 GHz
+//
+static __inline LARGE_INTEGER
+KeQueryPerformanceCounter(LARGE_INTEGER *Frequency)
+{
+    struct timespec now;
+    LARGE_INTEGER counter;
+
+    if (Frequency != NULL) {
+        Frequency->QuadPart = 1000000000LL;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    counter.QuadPart = (LONGLONG)now.tv_sec * 1000000000LL + now.tv_nsec;
+    return counter;
+}
+
+//
+// Mapping into user mode: the process is the same, the mapping is the
+// memory itself
+//
+typedef struct _MDL {
+    PVOID   Address;
+    ULONG   Length;
+} MDL, *PMDL;
+
+#define UserMode                    1
+#define MmCached                    1
+#define NormalPagePriority          0
+#define MdlMappingNoWrite           0
+#define MdlMappingNoExecute         0
+
+static __inline PMDL
+IoAllocateMdl(PVOID Address, ULONG Length, BOOLEAN Secondary, BOOLEAN Charge, PVOID Irp)
+{
+    PMDL mdl = (PMDL)malloc(sizeof(MDL));
+
+    (void)Secondary;
+    (void)Charge;
+    (void)Irp;
+
+    if (mdl != NULL) {
+        mdl->Address = Address;
+        mdl->Length = Length;
+    }
+    return mdl;
+}
+
+#define IoFreeMdl(Mdl)                                  free(Mdl)
+#define MmBuildMdlForNonPagedPool(Mdl)                  ((void)(Mdl))
+#define MmMapLockedPagesSpecifyCache(Mdl, M, C, A, B, P) ((Mdl)->Address)
+#define MmUnmapLockedPages(Address, Mdl)                ((void)(Address))
+
+static __inline BOOLEAN
+_BitScanReverse(ULONG *Index, ULONG Mask)
+{
+    if (Mask == 0) {
+        return FALSE;
+    }
+    *Index = 31 - __builtin_clz(Mask);
+    return TRUE;
+}
+
+//
+// Structured exception handling, only RingBuf.c's C has it, and nothing
+// raises
+//
+#ifndef __cplusplus
+#define __try                       if (1)
+#define __except(Filter)            else
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+//
+// What the driver's headers share with StApp, as the driver's driver.h
+// has it through Device.h
+//
+#define DEFINE_GUID(Name, ...)
+#define CTL_CODE(DeviceType, Function, Method, Access) \
+    (((DeviceType) << 16) | ((Access) << 14) | ((Function) << 2) | (Method))
+#define FILE_DEVICE_UNKNOWN         0x00000022
+#define METHOD_BUFFERED             0
+#define FILE_READ_DATA              0x0001
+#define FILE_WRITE_DATA             0x0002
+
+#include "../../StorTrace/Public.h"
@@ -0,0 +1,6 @@
+// ntdef.h : see driver.h, which defines what the modules take from here.
+//
+
+#pragma once
+
+#include "driver.h"
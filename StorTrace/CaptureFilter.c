@@ -0,0 +1,155 @@
+/*++
+
+Module Name:
+
+    CaptureFilter.c
+
+Abstract:
+
+    Capture filters of the trace, by CDB operation code, LBA range,
+    transfer length and completion status. Setting a filter compiles it
+    down to what is cheapest to test on the completion path: an opcode
+    bitmap, and the conditions that cannot reject anything left out.
+
+Environment:
+
+    Kernel-mode Driver Framework
+
+--*/
+
+#include "driver.h"
+
+#include "CaptureFilter.h"
+#include "CdbDecode.h"
+
+
+//=========================================
+// Public Function
+//=========================================
+
+VOID
+CaptureFilterInit(PCAPTURE_FILTER Filter)
+{
+    RtlZeroMemory(Filter, sizeof(CAPTURE_FILTER));
+}
+
+BOOLEAN
+CaptureFilterSet(PCAPTURE_FILTER Filter, PSTORTRACE_CAPTURE_FILTER Config)
+/*++
+
+Routine Description:
+
+    Compile Config into Filter, while completions may be matching against
+    it. They go unfiltered during the update; one that read the flags just
+    before may meet a mix of the old and the new conditions.
+
+Return Value:
+
+    FALSE if Config is not a valid filter, Filter is unchanged then.
+
+--*/
+{
+    CAPTURE_FILTER filter;
+    ULONG i;
+
+    if ((Config->Flags & ~STORTRACE_FILTER_VALID_FLAGS) != 0 ||
+        Config->LbaFirst > Config->LbaLast ||
+        Config->MinBlocks > Config->MaxBlocks) {
+        return FALSE;
+    }
+
+    RtlZeroMemory(&filter, sizeof(filter));
+    filter.Flags = (LONG)Config->Flags;
+    RtlCopyMemory(filter.Opcodes, Config->Opcodes, sizeof(filter.Opcodes));
+    filter.LbaFirst = Config->LbaFirst;
+    filter.LbaLast = Config->LbaLast;
+    filter.MinBlocks = Config->MinBlocks;
+    filter.MaxBlocks = Config->MaxBlocks;
+
+    //
+    // Leave out what every command meets, so a filter that is only an
+    // opcode set decodes no CDB it rejects
+    //
+    for (i = 0; i < sizeof(filter.Opcodes) && filter.Opcodes[i] == 0xFF; i++);
+
+    if (i == sizeof(filter.Opcodes)) {
+        filter.Flags &= ~STORTRACE_FILTER_OPCODES;
+    }
+
+    if (filter.LbaFirst == 0 && filter.LbaLast == MAXULONG64) {
+        filter.Flags &= ~STORTRACE_FILTER_LBA;
+    }
+
+    InterlockedExchange(&Filter->Flags, 0);
+
+    Filter->Reserved = 0;
+    RtlCopyMemory(Filter->Opcodes, filter.Opcodes, sizeof(Filter->Opcodes));
+    Filter->LbaFirst = filter.LbaFirst;
+    Filter->LbaLast = filter.LbaLast;
+    Filter->MinBlocks = filter.MinBlocks;
+    Filter->MaxBlocks = filter.MaxBlocks;
+
+    WriteRelease(&Filter->Flags, filter.Flags);
+
+    return TRUE;
+}
+
+BOOLEAN
+CaptureFilterMatch(PCAPTURE_FILTER Filter, PUCHAR Cdb, UCHAR CdbLength, NTSTATUS NtStatus, UCHAR ScsiStatus,
+    PCDB_FIELDS Fields, PBOOLEAN Decoded)
+/*++
+
+Routine Description:
+
+    Whether a completed command is to be traced. Callable at any IRQL
+    from any number of processors.
+
+    The CDB is decoded past the checks that do not need it, and only once:
+    when the command is to be traced, Fields and Decoded hold what
+    CdbDecode made of it, for the record.
+
+--*/
+{
+    LONG flags = ReadAcquire(&Filter->Flags);
+    ULONG64 lba;
+    ULONG blocks;
+
+    if ((flags & STORTRACE_FILTER_ERRORS_ONLY) && NtStatus == 0 && ScsiStatus == 0) {
+        return FALSE;
+    }
+
+    if (flags & STORTRACE_FILTER_OPCODES) {
+        if (CdbLength == 0 || (Filter->Opcodes[Cdb[0] >> 3] & (1 << (Cdb[0] & 7))) == 0) {
+            return FALSE;
+        }
+    }
+
+    *Decoded = CdbDecode(Cdb, CdbLength, Fields);
+
+    if ((flags & (STORTRACE_FILTER_LBA | STORTRACE_FILTER_BLOCKS)) == 0) {
+        return TRUE;
+    }
+
+    if (!*Decoded) {
+        return FALSE;
+    }
+
+    lba = Fields->Lba;
+    blocks = Fields->Blocks;
+
+    if (flags & STORTRACE_FILTER_BLOCKS) {
+        if (blocks < Filter->MinBlocks || blocks > Filter->MaxBlocks) {
+            return FALSE;
+        }
+    }
+
+    if (flags & STORTRACE_FILTER_LBA) {
+        // Touches a block of the range, a command of 0 blocks its LBA
+        if (lba > Filter->LbaLast ||
+            (lba < Filter->LbaFirst && Filter->LbaFirst - lba >= (blocks ? blocks : 1))) {
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+//
+// Which completed commands a device traces (IOCTL_STORTRACE_SET_CAPTURE_FILTER).
+// Evaluated on every completion before anything else is done for the
+// record, so a command filtered out costs a few loads and compares. The
+// CDB is decoded once, by the match, for the filter and the record both.
+// Free of WDF, like the trace buffers.
+//
+typedef struct _CAPTURE_FILTER {
+    volatile LONG Flags;        // STORTRACE_FILTER_*, 0 captures everything
+    ULONG   Reserved;
+    UCHAR   Opcodes[32];
+    ULONG64 LbaFirst;
+    ULONG64 LbaLast;
+    ULONG   MinBlocks;
+    ULONG   MaxBlocks;
+} CAPTURE_FILTER, *PCAPTURE_FILTER;
+
+VOID
+CaptureFilterInit(PCAPTURE_FILTER Filter);
+
+BOOLEAN
+CaptureFilterSet(PCAPTURE_FILTER Filter, PSTORTRACE_CAPTURE_FILTER Config);
+
+BOOLEAN
+CaptureFilterMatch(PCAPTURE_FILTER Filter, PUCHAR Cdb, UCHAR CdbLength, NTSTATUS NtStatus, UCHAR ScsiStatus,
+    PCDB_FIELDS Fields, PBOOLEAN Decoded);
@@ -0,0 +1,215 @@
+/*++
+
+Module Name:
+
+    CdbDecode.h
+
+Abstract:
+
+    Table driven decoding of SCSI block command CDBs: the LBA, the
+    transfer length in blocks, the FUA and DPO bits and the class of the
+    command. Shared by the driver, which decodes a traced command once
+    into its record, and the user applications.
+
+    One byte per operation code says where the fields are, so decoding is
+    a table lookup and a few loads rather than a switch over the operation
+    codes.
+
+Environment:
+
+    user and kernel
+
+--*/
+
+#pragma once
+
+//
+// Class of a command, the same as STORTRACE_LATENCY_*
+//
+#define CDB_CLASS_READ              0
+#define CDB_CLASS_WRITE             1
+#define CDB_CLASS_FLUSH             2
+#define CDB_CLASS_OTHER             3
+
+//
+// CDB_FIELDS.Flags
+//
+#define CDB_FLAG_FUA                0x01    // force unit access
+#define CDB_FLAG_DPO                0x02    // disable page out
+
+typedef struct _CDB_FIELDS {
+    ULONG64 Lba;
+    ULONG   Blocks;         // transfer length, 0 is none but for the 6 byte CDBs
+    UCHAR   Opcode;
+    UCHAR   Flags;          // CDB_FLAG_*
+    UCHAR   Class;          // CDB_CLASS_*
+    UCHAR   Reserved;
+} CDB_FIELDS, *PCDB_FIELDS;
+
+//
+// A table entry: the layout of the CDB in bits 0-2, the class in bits 3-4,
+// and which of the FUA and DPO bits byte 1 has
+//
+#define CDB_LAYOUT_NONE             0
+#define CDB_LAYOUT_6                1   // 21 bit LBA in bytes 1-3, length in byte 4, 0 is 256
+#define CDB_LAYOUT_10               2   // LBA in bytes 2-5, length in bytes 7-8
+#define CDB_LAYOUT_12               3   // LBA in bytes 2-5, length in bytes 6-9
+#define CDB_LAYOUT_16               4   // LBA in bytes 2-9, length in bytes 10-13
+#define CDB_LAYOUT_16_BYTE_13       5   // LBA in bytes 2-9, length in byte 13
+#define CDB_LAYOUT_MASK             0x07
+#define CDB_CLASS_SHIFT             3
+#define CDB_CLASS_MASK              0x18
+#define CDB_HAS_FUA                 0x20    // bit 3
+#define CDB_HAS_DPO                 0x40    // bit 4
+#define CDB_HAS_FUA_DPO             (CDB_HAS_FUA | CDB_HAS_DPO)
+
+#define NA      (CDB_CLASS_OTHER << CDB_CLASS_SHIFT)
+#define R6      (CDB_LAYOUT_6 | (CDB_CLASS_READ << CDB_CLASS_SHIFT))
+#define W6      (CDB_LAYOUT_6 | (CDB_CLASS_WRITE << CDB_CLASS_SHIFT))
+#define R10     (CDB_LAYOUT_10 | (CDB_CLASS_READ << CDB_CLASS_SHIFT) | CDB_HAS_FUA_DPO)
+#define W10     (CDB_LAYOUT_10 | (CDB_CLASS_WRITE << CDB_CLASS_SHIFT) | CDB_HAS_FUA_DPO)
+#define WV10    (CDB_LAYOUT_10 | (CDB_CLASS_WRITE << CDB_CLASS_SHIFT) | CDB_HAS_DPO)
+#define WX10    (CDB_LAYOUT_10 | (CDB_CLASS_WRITE << CDB_CLASS_SHIFT))
+#define V10     (CDB_LAYOUT_10 | (CDB_CLASS_OTHER << CDB_CLASS_SHIFT) | CDB_HAS_DPO)
+#define X10     (CDB_LAYOUT_10 | (CDB_CLASS_OTHER << CDB_CLASS_SHIFT))
+#define F10     (CDB_LAYOUT_10 | (CDB_CLASS_FLUSH << CDB_CLASS_SHIFT))
+#define R12     (CDB_LAYOUT_12 | (CDB_CLASS_READ << CDB_CLASS_SHIFT) | CDB_HAS_FUA_DPO)
+#define W12     (CDB_LAYOUT_12 | (CDB_CLASS_WRITE << CDB_CLASS_SHIFT) | CDB_HAS_FUA_DPO)
+#define WV12    (CDB_LAYOUT_12 | (CDB_CLASS_WRITE << CDB_CLASS_SHIFT) | CDB_HAS_DPO)
+#define V12     (CDB_LAYOUT_12 | (CDB_CLASS_OTHER << CDB_CLASS_SHIFT) | CDB_HAS_DPO)
+#define R16     (CDB_LAYOUT_16 | (CDB_CLASS_READ << CDB_CLASS_SHIFT) | CDB_HAS_FUA_DPO)
+#define W16     (CDB_LAYOUT_16 | (CDB_CLASS_WRITE << CDB_CLASS_SHIFT) | CDB_HAS_FUA_DPO)
+#define WV16    (CDB_LAYOUT_16 | (CDB_CLASS_WRITE << CDB_CLASS_SHIFT) | CDB_HAS_DPO)
+#define WX16    (CDB_LAYOUT_16 | (CDB_CLASS_WRITE << CDB_CLASS_SHIFT))
+#define V16     (CDB_LAYOUT_16 | (CDB_CLASS_OTHER << CDB_CLASS_SHIFT) | CDB_HAS_DPO)
+#define X16     (CDB_LAYOUT_16 | (CDB_CLASS_OTHER << CDB_CLASS_SHIFT))
+#define F16     (CDB_LAYOUT_16 | (CDB_CLASS_FLUSH << CDB_CLASS_SHIFT))
+#define CW      (CDB_LAYOUT_16_BYTE_13 | (CDB_CLASS_WRITE << CDB_CLASS_SHIFT) | CDB_HAS_FUA_DPO)
+
+//
+// 0x08 READ(6), 0x0A WRITE(6)
+// 0x28 READ(10), 0x2A WRITE(10), 0x2E WRITE AND VERIFY(10), 0x2F VERIFY(10)
+// 0x34 PRE-FETCH(10), 0x35 SYNCHRONIZE CACHE(10), 0x41 WRITE SAME(10)
+// 0x88 READ(16), 0x89 COMPARE AND WRITE, 0x8A WRITE(16),
+// 0x8E WRITE AND VERIFY(16), 0x8F VERIFY(16)
+// 0x90 PRE-FETCH(16), 0x91 SYNCHRONIZE CACHE(16), 0x93 WRITE SAME(16)
+// 0xA8 READ(12), 0xAA WRITE(12), 0xAE WRITE AND VERIFY(12), 0xAF VERIFY(12)
+//
+static const UCHAR CdbDecodeTable[256] = {
+//   x0    x1    x2    x3    x4    x5    x6    x7    x8    x9    xA    xB    xC    xD    xE    xF
+    NA,   NA,   NA,   NA,   NA,   NA,   NA,   NA,   R6,   NA,   W6,   NA,   NA,   NA,   NA,   NA,     // 0x
+    NA,   NA,   NA,   NA,   NA,   NA,   NA,   NA,   NA,   NA,   NA,   NA,   NA,   NA,   NA,   NA,     // 1x
+    NA,   NA,   NA,   NA,   NA,   NA,   NA,   NA,   R10,  NA,   W10,  NA,   NA,   NA,   WV10, V10,    // 2x
+    NA,   NA,   NA,   NA,   X10,  F10,  NA,   NA,   NA,   NA,   NA,   NA,   NA,   NA,   NA,   NA,     // 3x
+    NA,   WX10, NA,   NA,   NA,   NA,   NA,   NA,   NA,   NA,   NA,   NA,   NA,   NA,   NA,   NA,     // 4x
+    NA,   NA,   NA,   NA,   NA,   NA,   NA,   NA,   NA,   NA,   NA,   NA,   NA,   NA,   NA,   NA,     // 5x
+    NA,   NA,   NA,   NA,   NA,   NA,   NA,   NA,   NA,   NA,   NA,   NA,   NA,   NA,   NA,   NA,     // 6x
+    NA,   NA,   NA,   NA,   NA,   NA,   NA,   NA,   NA,   NA,   NA,   NA,   NA,   NA,   NA,   NA,     // 7x
+    NA,   NA,   NA,   NA,   NA,   NA,   NA,   NA,   R16,  CW,   W16,  NA,   NA,   NA,   WV16, V16,    // 8x
+    X16,  F16,  NA,   WX16, NA,   NA,   NA,   NA,   NA,   NA,   NA,   NA,   NA,   NA,   NA,   NA,     // 9x
+    NA,   NA,   NA,   NA,   NA,   NA,   NA,   NA,   R12,  NA,   W12,  NA,   NA,   NA,   WV12, V12,    // Ax
+    NA,   NA,   NA,   NA,   NA,   NA,   NA,   NA,   NA,   NA,   NA,   NA,   NA,   NA,   NA,   NA,     // Bx
+    NA,   NA,   NA,   NA,   NA,   NA,   NA,   NA,   NA,   NA,   NA,   NA,   NA,   NA,   NA,   NA,     // Cx
+    NA,   NA,   NA,   NA,   NA,   NA,   NA,   NA,   NA,   NA,   NA,   NA,   NA,   NA,   NA,   NA,     // Dx
+    NA,   NA,   NA,   NA,   NA,   NA,   NA,   NA,   NA,   NA,   NA,   NA,   NA,   NA,   NA,   NA,     // Ex
+    NA,   NA,   NA,   NA,   NA,   NA,   NA,   NA,   NA,   NA,   NA,   NA,   NA,   NA,   NA,   NA,     // Fx
+};
+
+#undef NA
+#undef R6
+#undef W6
+#undef R10
+#undef W10
+#undef WV10
+#undef WX10
+#undef V10
+#undef X10
+#undef F10
+#undef R12
+#undef W12
+#undef WV12
+#undef V12
+#undef R16
+#undef W16
+#undef WV16
+#undef WX16
+#undef V16
+#undef X16
+#undef F16
+#undef CW
+
+static __inline ULONG
+CdbDecodeBe32(const UCHAR *Bytes)
+{
+    return ((ULONG)Bytes[0] << 24) | ((ULONG)Bytes[1] << 16) | ((ULONG)Bytes[2] << 8) | Bytes[3];
+}
+
+//
+// CDB_CLASS_* of an operation code
+//
+static __inline UCHAR
+CdbDecodeClass(UCHAR Opcode)
+{
+    return (UCHAR)((CdbDecodeTable[Opcode] & CDB_CLASS_MASK) >> CDB_CLASS_SHIFT);
+}
+
+//
+// Decode a CDB into Fields. FALSE if it has no LBA and transfer length, or
+// is too short for them: Lba and Blocks are 0 then, the other fields are
+// still set.
+//
+static __inline BOOLEAN
+CdbDecode(const UCHAR *Cdb, UCHAR CdbLength, PCDB_FIELDS Fields)
+{
+    static const UCHAR layoutLength[] = { 0, 6, 10, 12, 16, 16, 0xFF, 0xFF };
+    UCHAR entry = CdbLength ? CdbDecodeTable[Cdb[0]] : CdbDecodeTable[0];
+    UCHAR layout = entry & CDB_LAYOUT_MASK;
+
+    Fields->Lba = 0;
+    Fields->Blocks = 0;
+    Fields->Opcode = CdbLength ? Cdb[0] : 0;
+    Fields->Flags = 0;
+    Fields->Class = (UCHAR)((entry & CDB_CLASS_MASK) >> CDB_CLASS_SHIFT);
+    Fields->Reserved = 0;
+
+    if (layout == CDB_LAYOUT_NONE || CdbLength < layoutLength[layout]) {
+        return FALSE;
+    }
+
+    if ((entry & CDB_HAS_FUA) && (Cdb[1] & 0x08)) {
+        Fields->Flags |= CDB_FLAG_FUA;
+    }
+
+    if ((entry & CDB_HAS_DPO) && (Cdb[1] & 0x10)) {
+        Fields->Flags |= CDB_FLAG_DPO;
+    }
+
+    switch (layout) {
+    case CDB_LAYOUT_6:
+        Fields->Lba = ((ULONG)(Cdb[1] & 0x1F) << 16) | ((ULONG)Cdb[2] << 8) | Cdb[3];
+        Fields->Blocks = Cdb[4] ? Cdb[4] : 256;
+        break;
+
+    case CDB_LAYOUT_10:
+        Fields->Lba = CdbDecodeBe32(Cdb + 2);
+        Fields->Blocks = ((ULONG)Cdb[7] << 8) | Cdb[8];
+        break;
+
+    case CDB_LAYOUT_12:
+        Fields->Lba = CdbDecodeBe32(Cdb + 2);
+        Fields->Blocks = CdbDecodeBe32(Cdb + 6);
+        break;
+
+    case CDB_LAYOUT_16_BYTE_13:
+        Fields->Lba = ((ULONG64)CdbDecodeBe32(Cdb + 2) << 32) | CdbDecodeBe32(Cdb + 6);
+        Fields->Blocks = Cdb[13];
+        break;
+
+    default:
+        Fields->Lba = ((ULONG64)CdbDecodeBe32(Cdb + 2) << 32) | CdbDecodeBe32(Cdb + 6);
+        Fields->Blocks = CdbDecodeBe32(Cdb + 10);
+        break;
+    }
+
+    return TRUE;
+}
@@ -0,0 +1,172 @@
+/*++
+
+Module Name:
+
+    Counters.c
+
+Abstract:
+
+    Aggregate counters by operation code, SCSI status and latency, kept
+    per processor so counting a command writes only to the processor's own
+    cache lines, and added up when a snapshot is taken.
+
+Environment:
+
+    Kernel-mode Driver Framework
+
+--*/
+
+#include "driver.h"
+
+#include "Counters.h"
+
+
+//=========================================
+// Data Type Definition
+//=========================================
+
+//
+// Written by its processor only. A command completing at PASSIVE_LEVEL may
+// be preempted and lose a count to another one; counts are for dashboards,
+// which tolerate that, and locked adds would cost on every command.
+//
+typedef struct DECLSPEC_CACHEALIGN _COUNTERS_CPU {
+    STORTRACE_COUNTERS Counters;
+} COUNTERS_CPU, *PCOUNTERS_CPU;
+
+struct _COUNTERS {
+    ULONG           CpuCount;
+    ULONG64         MicrosecondScale;   // 2^32 microseconds per timestamp tick
+    ULONG64         MaxTicks;           // timed by the scale without overflowing
+    COUNTERS_CPU    Cpus[ANYSIZE_ARRAY];
+};
+
+//
+// From NtErrors on, STORTRACE_COUNTERS is nothing but ULONG64 counts
+//
+#define COUNTERS_FIRST_COUNT    FIELD_OFFSET(STORTRACE_COUNTERS, NtErrors)
+#define COUNTERS_COUNT          ((sizeof(STORTRACE_COUNTERS) - COUNTERS_FIRST_COUNT) / sizeof(ULONG64))
+
+C_ASSERT(COUNTERS_FIRST_COUNT % sizeof(ULONG64) == 0);
+C_ASSERT(sizeof(STORTRACE_COUNTERS) % sizeof(ULONG64) == 0);
+
+
+//=========================================
+// Public Function
+//=========================================
+
+PCOUNTERS
+CountersCreate(ULONG64 Frequency)
+/*++
+
+Routine Description:
+
+    Allocate zeroed counters. Frequency is that of the timestamps given to
+    CountersAdd, per second. Called at PASSIVE_LEVEL.
+
+--*/
+{
+    PCOUNTERS counters;
+    ULONG cpuCount = KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+    size_t allocSize = FIELD_OFFSET(COUNTERS, Cpus) + cpuCount * sizeof(COUNTERS_CPU);
+
+    counters = ExAllocatePoolWithTag(NonPagedPoolNxCacheAligned, allocSize, STORTRACE_POOL_TAG);
+    if (counters == NULL)
+    {
+        return NULL;
+    }
+
+    RtlZeroMemory(counters, allocSize);
+    counters->CpuCount = cpuCount;
+    // Rounded up, so a whole number of microseconds is not timed a bit short
+    counters->MicrosecondScale = Frequency ? ((1000000ULL << 32) + Frequency - 1) / Frequency : 0;
+    counters->MaxTicks = counters->MicrosecondScale ? MAXULONG64 / counters->MicrosecondScale : 0;
+
+    return counters;
+}
+
+VOID
+CountersDelete(PCOUNTERS Counters)
+{
+    if (Counters != NULL)
+    {
+        ExFreePoolWithTag(Counters, STORTRACE_POOL_TAG);
+    }
+}
+
+VOID
+CountersAdd(PCOUNTERS Counters, UCHAR Opcode, ULONG Bytes, NTSTATUS NtStatus, UCHAR ScsiStatus, ULONG64 IssueTime, ULONG64 Timestamp)
+/*++
+
+Routine Description:
+
+    Count a command that completed at Timestamp, issued at IssueTime (0 if
+    unknown). Callable at IRQL <= DISPATCH_LEVEL from any number of
+    processors.
+
+--*/
+{
+    PSTORTRACE_COUNTERS counters = &Counters->Cpus[KeGetCurrentProcessorNumberEx(NULL) % Counters->CpuCount].Counters;
+    PSTORTRACE_OPCODE_COUNTERS opcode = &counters->Opcodes[Opcode];
+
+    opcode->Commands++;
+    opcode->Bytes += Bytes;
+
+    if (NtStatus != STATUS_SUCCESS || ScsiStatus != 0)
+    {
+        opcode->Errors++;
+        counters->NtErrors += (NtStatus != STATUS_SUCCESS);
+    }
+
+    counters->ScsiStatus[(ScsiStatus / 2 < STORTRACE_COUNTERS_SCSI_STATUS) ? ScsiStatus / 2 : STORTRACE_COUNTERS_SCSI_STATUS - 1]++;
+
+    if (IssueTime != 0 && Timestamp >= IssueTime)
+    {
+        ULONG64 ticks = Timestamp - IssueTime;
+        ULONG64 microseconds;
+        ULONG bucket = STORTRACE_COUNTERS_LATENCY - 1;
+        ULONG index;
+
+        // Longer than that is the last bucket anyway
+        if (ticks <= Counters->MaxTicks)
+        {
+            microseconds = (ticks * Counters->MicrosecondScale) >> 32;
+
+            if (microseconds <= MAXULONG)
+            {
+                bucket = _BitScanReverse(&index, (ULONG)microseconds) ? index + 1 : 0;
+                if (bucket >= STORTRACE_COUNTERS_LATENCY)
+                {
+                    bucket = STORTRACE_COUNTERS_LATENCY - 1;
+                }
+            }
+        }
+
+        counters->Latency[bucket]++;
+    }
+}
+
+VOID
+CountersSnapshot(PCOUNTERS Counters, PSTORTRACE_COUNTERS Snapshot)
+/*++
+
+Routine Description:
+
+    Add the counts of all processors to Snapshot, which may hold those of
+    other devices already. Counts go on meanwhile, so the snapshot is not
+    of one instant, but no count in it ever goes back.
+
+--*/
+{
+    PULONG64 snapshot = (PULONG64)((PUCHAR)Snapshot + COUNTERS_FIRST_COUNT);
+
+    for (ULONG i = 0; i < Counters->CpuCount; i++)
+    {
+        volatile ULONG64 *counts = (volatile ULONG64 *)((PUCHAR)&Counters->Cpus[i].Counters + COUNTERS_FIRST_COUNT);
+
+        for (ULONG j = 0; j < COUNTERS_COUNT; j++)
+        {
+            snapshot[j] += counts[j];
+        }
+    }
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+//
+// Aggregate counters of a device (STORTRACE_COUNTERS), for running with
+// no per-command records at all. Each processor counts into its own
+// block, the blocks are only added up for a snapshot.
+//
+
+//
+// Optional DWORD under the service's Parameters key, the
+// STORTRACE_CAPTURE_* all disks start with
+//
+#define CAPTURE_MODE_VALUE          L"CaptureMode"
+
+typedef struct _COUNTERS COUNTERS, *PCOUNTERS;
+
+PCOUNTERS
+CountersCreate(ULONG64 Frequency);
+
+VOID
+CountersDelete(PCOUNTERS Counters);
+
+VOID
+CountersAdd(PCOUNTERS Counters, UCHAR Opcode, ULONG Bytes, NTSTATUS NtStatus, UCHAR ScsiStatus, ULONG64 IssueTime, ULONG64 Timestamp);
+
+VOID
+CountersSnapshot(PCOUNTERS Counters, PSTORTRACE_COUNTERS Snapshot);
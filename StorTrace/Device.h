@@ -1,52 +1,124 @@
-/*++
-
-Module Name:
-
-    device.h
-
-Abstract:
-
-    This file contains the device definitions.
-
-Environment:
-
-    Kernel-mode Driver Framework
-
---*/
-
-#include "public.h"
-
-EXTERN_C_START
-
-//
-// The device context performs the same job as
-// a WDM device extension in the driver frameworks
-//
-typedef struct _DEVICE_CONTEXT
-{
-    ULONG SerialNo; 
-} DEVICE_CONTEXT, *PDEVICE_CONTEXT;
-
-//
-// This macro will generate an inline function called DeviceGetContext
-// which will be used to get a pointer to the device context memory
-// in a type safe manner.
-//
-WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(DEVICE_CONTEXT, DeviceGetContext)
-
-
-typedef struct _CONTROL_DEVICE_CONTEXT {
-    ULONG   SerialNo;
-
-} CONTROL_DEVICE_CONTEXT, *PCONTROL_DEVICE_CONTEXT;
-
-WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(CONTROL_DEVICE_CONTEXT, ControlGetData)
-//
-// Function to initialize the device and its callbacks
-//
-NTSTATUS
-StorTraceCreateDevice(
-    _Inout_ PWDFDEVICE_INIT DeviceInit
-    );
-
-EXTERN_C_END
+/*++
+
+Module Name:
+
+    device.h
+
+Abstract:
+
+    This file contains the device definitions.
+
+Environment:
+
+    Kernel-mode Driver Framework
+
+--*/
+
+#include "public.h"
+#include "TraceBuf.h"
+#include "ReadBatch.h"
+#include "CaptureFilter.h"
+#include "Sampler.h"
+#include "Counters.h"
+#include "LatencyStats.h"
+
+EXTERN_C_START
+
+//
+// The device context performs the same job as
+// a WDM device extension in the driver frameworks
+//
+typedef struct _DEVICE_CONTEXT
+{
+    ULONG SerialNo; 
+
+    //
+    // Id reported to the control device, never reused
+    //
+    ULONG DeviceId;
+
+    //
+    // Where this disk captures its trace records, NULL if it could not
+    // be allocated (the disk is then filtered without tracing). Producers
+    // put into it under TraceBufRundown, so it can be replaced on a live
+    // disk (IOCTL_STORTRACE_RESIZE_TRACE_BUF).
+    //
+    PTRACE_BUF volatile TraceBuf;
+    PEX_RUNDOWN_REF_CACHE_AWARE TraceBufRundown;
+
+    //
+    // Which completed commands make it into the trace
+    //
+    CAPTURE_FILTER CaptureFilter;
+
+    //
+    // Which of those are traced, NULL if it could not be allocated
+    // (every command is traced then)
+    //
+    PSAMPLER Sampler;
+
+    //
+    // STORTRACE_CAPTURE_*, what is made of a captured command. The counters
+    // and histograms are allocated when the device first keeps them, and
+    // kept.
+    //
+    volatile LONG CaptureMode;
+    PCOUNTERS volatile Counters;
+    PLATENCY_STATS volatile LatencyStats;
+
+    //
+    // Of the last trace record, see TRACE_RECORD_HEADER
+    //
+    volatile LONG64 SequenceNumber;
+
+    //
+    // Traced and not read yet, to decide when parked reads complete
+    //
+    READ_BATCH ReadBatch;
+} DEVICE_CONTEXT, *PDEVICE_CONTEXT;
+
+//
+// This macro will generate an inline function called DeviceGetContext
+// which will be used to get a pointer to the device context memory
+// in a type safe manner.
+//
+WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(DEVICE_CONTEXT, DeviceGetContext)
+
+
+typedef struct _CONTROL_DEVICE_CONTEXT {
+    ULONG   SerialNo;
+
+} CONTROL_DEVICE_CONTEXT, *PCONTROL_DEVICE_CONTEXT;
+
+WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(CONTROL_DEVICE_CONTEXT, ControlGetData)
+
+//
+// Per handle state of a control device reader
+//
+typedef struct _CONTROL_FILE_CONTEXT {
+    ULONG   DeviceId;   // STORTRACE_ALL_DEVICES or the device to drain
+    ULONG   NextDevice; // collection index to start from when draining all
+    PRING_BUF Ring;     // mapped by IOCTL_STORTRACE_MAP_RING, or NULL
+    PMDL    Mdl;
+    PVOID   UserAddress;
+    PEPROCESS Process;  // the mapping belongs to, referenced
+} CONTROL_FILE_CONTEXT, *PCONTROL_FILE_CONTEXT;
+
+WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(CONTROL_FILE_CONTEXT, ControlFileGetContext)
+
+EVT_WDF_OBJECT_CONTEXT_CLEANUP StorTraceEvtDeviceContextCleanup;
+//
+// Function to initialize the device and its callbacks
+//
+NTSTATUS
+StorTraceCreateDevice(
+    _Inout_ PWDFDEVICE_INIT DeviceInit
+    );
+
+NTSTATUS
+StorTraceSetCaptureMode(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ ULONG Mode
+    );
+
+EXTERN_C_END
@@ -1,233 +1,304 @@
-/*++
-
-Module Name:
-
-    driver.c
-
-Abstract:
-
-    This file contains the driver entry points and callbacks.
-
-Environment:
-
-    Kernel-mode Driver Framework
-
---*/
-
-#include "driver.h"
-#include "driver.tmh"
-
-#include "RingBuf.h"
-//-------------------------------------------------------
-// Variable Definition
-//-------------------------------------------------------
-
-
-//-------------------------------------------------------
-// Imported Function & Variable Declaration
-//-------------------------------------------------------
-extern WDFCOLLECTION   DeviceCollection;
-extern WDFWAITLOCK     DeviceCollectionLock;
-extern WDFSPINLOCK     CdbBufSpinLock;
-
-
-//-------------------------------------------------------
-// Function Implementatjion
-//-------------------------------------------------------
-
-#ifdef ALLOC_PRAGMA
-#pragma alloc_text (INIT, DriverEntry)
-#endif
-
-VOID
-DriverUnload(
-    _In_
-    WDFDRIVER Driver
-)
-{
-    UNREFERENCED_PARAMETER(Driver);
-    DbgPrint("Driver Unload \n");
-}
-
-NTSTATUS
-DriverEntry(
-    _In_ PDRIVER_OBJECT  DriverObject,
-    _In_ PUNICODE_STRING RegistryPath
-    )
-/*++
-
-Routine Description:
-    DriverEntry initializes the driver and is the first routine called by the
-    system after the driver is loaded. DriverEntry specifies the other entry
-    points in the function driver, such as EvtDevice and DriverUnload.
-
-Parameters Description:
-
-    DriverObject - represents the instance of the function driver that is loaded
-    into memory. DriverEntry must initialize members of DriverObject before it
-    returns to the caller. DriverObject is allocated by the system before the
-    driver is loaded, and it is released by the system after the system unloads
-    the function driver from memory.
-
-    RegistryPath - represents the driver specific path in the Registry.
-    The function driver can use the path to store driver related data between
-    reboots. The path does not store hardware instance specific data.
-
-Return Value:
-
-    STATUS_SUCCESS if successful,
-    STATUS_UNSUCCESSFUL otherwise.
-
---*/
-{
-    WDF_DRIVER_CONFIG config;
-    NTSTATUS status;
-    WDF_OBJECT_ATTRIBUTES attributes;
-
-    //
-    // Initialize WPP Tracing
-    //
-    WPP_INIT_TRACING(DriverObject, RegistryPath);
-
-    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DRIVER, "%!FUNC! Entry");    
-
-    // 
-    // Init ring buffer for data capture
-    // TODO: make it per-device? 
-    //
-    RingBufReset();
-
-    //
-    // Register a cleanup callback so that we can call WPP_CLEANUP when
-    // the framework driver object is deleted during driver unload.
-    //
-    WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
-    attributes.EvtCleanupCallback = StorTraceEvtDriverContextCleanup;
-
-    WDF_DRIVER_CONFIG_INIT(&config,
-                           StorTraceEvtDeviceAdd
-                           );
-
-    // config.DriverInitFlags = WdfDriverInitNonPnpDriver;
-    config.EvtDriverUnload = DriverUnload;
-
-    status = WdfDriverCreate(DriverObject,
-                             RegistryPath,
-                             &attributes,
-                             &config,
-                             WDF_NO_HANDLE
-                             );
-
-    if (!NT_SUCCESS(status)) {
-        TraceEvents(TRACE_LEVEL_ERROR, TRACE_DRIVER, "WdfDriverCreate failed %!STATUS!", status);
-        WPP_CLEANUP(DriverObject);
-        return status;
-    }
-
-    //
-    // Since there is only one control-device for all the instances
-    // of the physical device, we need an ability to get to particular instance
-    // of the device in our FilterEvtIoDeviceControlForControl. For that we
-    // will create a collection object and store filter device objects.        
-    // The collection object has the driver object as a default parent.
-    //
-
-    status = WdfCollectionCreate(WDF_NO_OBJECT_ATTRIBUTES,
-        &DeviceCollection);
-    if (!NT_SUCCESS(status))
-    {
-        DbgPrint("WdfCollectionCreate failed with status 0x%x\n", status);
-        WPP_CLEANUP(DriverObject);
-        return status;
-    }
-
-    //
-    // The wait-lock object has the driver object as a default parent.
-    //
-    status = WdfWaitLockCreate(WDF_NO_OBJECT_ATTRIBUTES, &DeviceCollectionLock);
-    if (!NT_SUCCESS(status))
-    {
-        DbgPrint("DeviceCollectionLock failed with status 0x%x\n", status);
-        return status;
-    }
-
-    status = WdfSpinLockCreate(WDF_NO_OBJECT_ATTRIBUTES, &CdbBufSpinLock);
-    if (!NT_SUCCESS(status))
-    {
-        DbgPrint("CdbBufSpinLock failed with status 0x%x\n", status);
-        return status;
-    }
-
-    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DRIVER, "%!FUNC! Exit");
-
-    DbgPrint("DriverEntry status 0x%x\n", status);
-    return status;
-}
-
-NTSTATUS
-StorTraceEvtDeviceAdd(
-    _In_    WDFDRIVER       Driver,
-    _Inout_ PWDFDEVICE_INIT DeviceInit
-    )
-/*++
-Routine Description:
-
-    EvtDeviceAdd is called by the framework in response to AddDevice
-    call from the PnP manager. We create and initialize a device object to
-    represent a new instance of the device.
-
-Arguments:
-
-    Driver - Handle to a framework driver object created in DriverEntry
-
-    DeviceInit - Pointer to a framework-allocated WDFDEVICE_INIT structure.
-
-Return Value:
-
-    NTSTATUS
-
---*/
-{
-    NTSTATUS status;
-
-    UNREFERENCED_PARAMETER(Driver);
-
-    DbgPrint("StorTraceEvtDeviceAdd\n");
-
-    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DRIVER, "%!FUNC! Entry");
-
-    status = StorTraceCreateDevice(DeviceInit);
-
-    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DRIVER, "%!FUNC! Exit");
-
-    return status;
-}
-
-VOID
-StorTraceEvtDriverContextCleanup(
-    _In_ WDFOBJECT DriverObject
-    )
-/*++
-Routine Description:
-
-    Free all the resources allocated in DriverEntry.
-
-Arguments:
-
-    DriverObject - handle to a WDF Driver object.
-
-Return Value:
-
-    VOID.
-
---*/
-{
-    UNREFERENCED_PARAMETER(DriverObject);
-
-    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DRIVER, "%!FUNC! Entry");
-
-    //
-    // Stop WPP Tracing
-    //
-    WPP_CLEANUP(WdfDriverWdmGetDriverObject((WDFDRIVER)DriverObject));
-}
+/*++
+
+Module Name:
+
+    driver.c
+
+Abstract:
+
+    This file contains the driver entry points and callbacks.
+
+Environment:
+
+    Kernel-mode Driver Framework
+
+--*/
+
+#include "driver.h"
+#include "driver.tmh"
+
+
+//-------------------------------------------------------
+// Macro
+//-------------------------------------------------------
+
+//
+// Optional DWORD under the service's Parameters key, non-zero to have
+// one trace ring per logical processor
+//
+#define PER_CPU_TRACE_BUFFER_VALUE  L"PerCpuTraceBuffer"
+
+//
+// Optional DWORD under the service's Parameters key, what a full trace
+// ring does with a new record, RING_OVERFLOW_*
+//
+#define OVERFLOW_POLICY_VALUE       L"OverflowPolicy"
+
+//
+// Optional DWORD under the service's Parameters key, initial
+// STORTRACE_VERBOSITY_* level
+//
+#define VERBOSITY_VALUE             L"Verbosity"
+
+//-------------------------------------------------------
+// Variable Definition
+//-------------------------------------------------------
+
+
+//-------------------------------------------------------
+// Imported Function & Variable Declaration
+//-------------------------------------------------------
+extern WDFCOLLECTION   DeviceCollection;
+extern WDFWAITLOCK     DeviceCollectionLock;
+extern BOOLEAN         PerCpuTraceBuffer;
+extern ULONG           TraceBufOverflowPolicy;
+extern ULONG           TraceBufDefaultSize;
+extern READ_BATCH_CONFIG ReadBatchConfig;
+extern STORTRACE_SAMPLING DefaultSampling;
+extern ULONG           DefaultCaptureMode;
+
+
+//-------------------------------------------------------
+// Function Implementatjion
+//-------------------------------------------------------
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text (INIT, DriverEntry)
+#endif
+
+VOID
+DriverUnload(
+    _In_
+    WDFDRIVER Driver
+)
+{
+    UNREFERENCED_PARAMETER(Driver);
+    DbgPrint("Driver Unload \n");
+}
+
+NTSTATUS
+DriverEntry(
+    _In_ PDRIVER_OBJECT  DriverObject,
+    _In_ PUNICODE_STRING RegistryPath
+    )
+/*++
+
+Routine Description:
+    DriverEntry initializes the driver and is the first routine called by the
+    system after the driver is loaded. DriverEntry specifies the other entry
+    points in the function driver, such as EvtDevice and DriverUnload.
+
+Parameters Description:
+
+    DriverObject - represents the instance of the function driver that is loaded
+    into memory. DriverEntry must initialize members of DriverObject before it
+    returns to the caller. DriverObject is allocated by the system before the
+    driver is loaded, and it is released by the system after the system unloads
+    the function driver from memory.
+
+    RegistryPath - represents the driver specific path in the Registry.
+    The function driver can use the path to store driver related data between
+    reboots. The path does not store hardware instance specific data.
+
+Return Value:
+
+    STATUS_SUCCESS if successful,
+    STATUS_UNSUCCESSFUL otherwise.
+
+--*/
+{
+    WDF_DRIVER_CONFIG config;
+    NTSTATUS status;
+    WDF_OBJECT_ATTRIBUTES attributes;
+    WDFDRIVER driver;
+    WDFKEY key;
+    ULONG perCpu = 0;
+    ULONG verbosity = STORTRACE_VERBOSITY_OFF;
+
+    //
+    // Initialize WPP Tracing
+    //
+    WPP_INIT_TRACING(DriverObject, RegistryPath);
+
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DRIVER, "%!FUNC! Entry");    
+
+    //
+    // Register a cleanup callback so that we can call WPP_CLEANUP when
+    // the framework driver object is deleted during driver unload.
+    //
+    WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+    attributes.EvtCleanupCallback = StorTraceEvtDriverContextCleanup;
+
+    WDF_DRIVER_CONFIG_INIT(&config,
+                           StorTraceEvtDeviceAdd
+                           );
+
+    // config.DriverInitFlags = WdfDriverInitNonPnpDriver;
+    config.EvtDriverUnload = DriverUnload;
+
+    status = WdfDriverCreate(DriverObject,
+                             RegistryPath,
+                             &attributes,
+                             &config,
+                             &driver
+                             );
+
+    if (!NT_SUCCESS(status)) {
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_DRIVER, "WdfDriverCreate failed %!STATUS!", status);
+        WPP_CLEANUP(DriverObject);
+        return status;
+    }
+
+    //
+    // Since there is only one control-device for all the instances
+    // of the physical device, we need an ability to get to particular instance
+    // of the device in our FilterEvtIoDeviceControlForControl. For that we
+    // will create a collection object and store filter device objects.        
+    // The collection object has the driver object as a default parent.
+    //
+
+    status = WdfCollectionCreate(WDF_NO_OBJECT_ATTRIBUTES,
+        &DeviceCollection);
+    if (!NT_SUCCESS(status))
+    {
+        DbgPrint("WdfCollectionCreate failed with status 0x%x\n", status);
+        WPP_CLEANUP(DriverObject);
+        return status;
+    }
+
+    //
+    // The wait-lock object has the driver object as a default parent.
+    //
+    status = WdfWaitLockCreate(WDF_NO_OBJECT_ATTRIBUTES, &DeviceCollectionLock);
+    if (!NT_SUCCESS(status))
+    {
+        DbgPrint("DeviceCollectionLock failed with status 0x%x\n", status);
+        return status;
+    }
+
+    // 
+    // Trace buffer, read and debug output options, the buffers themselves
+    // are per-device
+    //
+    ReadBatchInitConfig(&ReadBatchConfig);
+
+    status = WdfDriverOpenParametersRegistryKey(driver, KEY_READ, WDF_NO_OBJECT_ATTRIBUTES, &key);
+    if (NT_SUCCESS(status))
+    {
+        DECLARE_CONST_UNICODE_STRING(valueName, PER_CPU_TRACE_BUFFER_VALUE);
+        DECLARE_CONST_UNICODE_STRING(policyName, OVERFLOW_POLICY_VALUE);
+        DECLARE_CONST_UNICODE_STRING(sizeName, TRACE_BUF_SIZE_VALUE);
+        DECLARE_CONST_UNICODE_STRING(verbosityName, VERBOSITY_VALUE);
+        DECLARE_CONST_UNICODE_STRING(bytesName, READ_BATCH_BYTES_VALUE);
+        DECLARE_CONST_UNICODE_STRING(recordsName, READ_BATCH_RECORDS_VALUE);
+        DECLARE_CONST_UNICODE_STRING(timeoutName, READ_BATCH_TIMEOUT_VALUE);
+        DECLARE_CONST_UNICODE_STRING(rateName, SAMPLE_RATE_VALUE);
+        DECLARE_CONST_UNICODE_STRING(budgetName, SAMPLE_BUDGET_VALUE);
+        DECLARE_CONST_UNICODE_STRING(modeName, CAPTURE_MODE_VALUE);
+
+        // Values are optional, keep the default when one is not there
+        (VOID)WdfRegistryQueryULong(key, &valueName, &perCpu);
+        (VOID)WdfRegistryQueryULong(key, &policyName, &TraceBufOverflowPolicy);
+        (VOID)WdfRegistryQueryULong(key, &sizeName, &TraceBufDefaultSize);
+        (VOID)WdfRegistryQueryULong(key, &verbosityName, &verbosity);
+        (VOID)WdfRegistryQueryULong(key, &bytesName, &ReadBatchConfig.ByteWatermark);
+        (VOID)WdfRegistryQueryULong(key, &recordsName, &ReadBatchConfig.RecordWatermark);
+        (VOID)WdfRegistryQueryULong(key, &timeoutName, &ReadBatchConfig.FlushTimeoutMs);
+        (VOID)WdfRegistryQueryULong(key, &rateName, &DefaultSampling.Rate);
+        (VOID)WdfRegistryQueryULong(key, &budgetName, &DefaultSampling.Budget);
+        (VOID)WdfRegistryQueryULong(key, &modeName, &DefaultCaptureMode);
+        WdfRegistryClose(key);
+    }
+
+    // The flush timer re-arms while reads are parked, it must not spin
+    if (ReadBatchConfig.FlushTimeoutMs == 0) {
+        ReadBatchConfig.FlushTimeoutMs = 1;
+    }
+
+    // Unknown policies fall back to the one that never loses old trace
+    if (TraceBufOverflowPolicy > RING_OVERFLOW_OVERWRITE_OLDEST) {
+        TraceBufOverflowPolicy = RING_OVERFLOW_DROP_NEWEST;
+    }
+
+    // Unknown modes fall back to tracing records, as without the value
+    if ((DefaultCaptureMode & ~STORTRACE_CAPTURE_VALID_MODES) != 0) {
+        DefaultCaptureMode = STORTRACE_CAPTURE_RECORDS;
+    }
+
+    PerCpuTraceBuffer = (perCpu != 0);
+    Verbosity = (LONG)verbosity;
+    status = STATUS_SUCCESS;
+
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DRIVER, "%!FUNC! Exit");
+
+    DbgPrint("DriverEntry status 0x%x\n", status);
+    return status;
+}
+
+NTSTATUS
+StorTraceEvtDeviceAdd(
+    _In_    WDFDRIVER       Driver,
+    _Inout_ PWDFDEVICE_INIT DeviceInit
+    )
+/*++
+Routine Description:
+
+    EvtDeviceAdd is called by the framework in response to AddDevice
+    call from the PnP manager. We create and initialize a device object to
+    represent a new instance of the device.
+
+Arguments:
+
+    Driver - Handle to a framework driver object created in DriverEntry
+
+    DeviceInit - Pointer to a framework-allocated WDFDEVICE_INIT structure.
+
+Return Value:
+
+    NTSTATUS
+
+--*/
+{
+    NTSTATUS status;
+
+    UNREFERENCED_PARAMETER(Driver);
+
+    DbgPrint("StorTraceEvtDeviceAdd\n");
+
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DRIVER, "%!FUNC! Entry");
+
+    status = StorTraceCreateDevice(DeviceInit);
+
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DRIVER, "%!FUNC! Exit");
+
+    return status;
+}
+
+VOID
+StorTraceEvtDriverContextCleanup(
+    _In_ WDFOBJECT DriverObject
+    )
+/*++
+Routine Description:
+
+    Free all the resources allocated in DriverEntry.
+
+Arguments:
+
+    DriverObject - handle to a WDF Driver object.
+
+Return Value:
+
+    VOID.
+
+--*/
+{
+    UNREFERENCED_PARAMETER(DriverObject);
+
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DRIVER, "%!FUNC! Entry");
+
+    //
+    // Stop WPP Tracing
+    //
+    WPP_CLEANUP(WdfDriverWdmGetDriverObject((WDFDRIVER)DriverObject));
+}
@@ -1,35 +1,51 @@
-/*++
-
-Module Name:
-
-    driver.h
-
-Abstract:
-
-    This file contains the driver definitions.
-
-Environment:
-
-    Kernel-mode Driver Framework
-
---*/
-
-#include <ntddk.h>
-#include <wdf.h>
-#include <initguid.h>
-
-#include "device.h"
-#include "queue.h"
-#include "trace.h"
-
-EXTERN_C_START
-
-//
-// WDFDRIVER Events
-//
-
-DRIVER_INITIALIZE DriverEntry;
-EVT_WDF_DRIVER_DEVICE_ADD StorTraceEvtDeviceAdd;
-EVT_WDF_OBJECT_CONTEXT_CLEANUP StorTraceEvtDriverContextCleanup;
-
-EXTERN_C_END
+/*++
+
+Module Name:
+
+    driver.h
+
+Abstract:
+
+    This file contains the driver definitions.
+
+Environment:
+
+    Kernel-mode Driver Framework
+
+--*/
+
+#include <ntddk.h>
+#include <wdf.h>
+#include <initguid.h>
+
+#include "device.h"
+#include "queue.h"
+#include "trace.h"
+
+//
+// Tag for the driver's pool allocations
+//
+#define STORTRACE_POOL_TAG  'rTtS'
+
+//
+// Debug output on the I/O path, DbgPrint and WPP alike, is only formatted
+// when Verbosity is raised to the given STORTRACE_VERBOSITY_* level
+//
+extern volatile LONG Verbosity;
+
+#define VERBOSITY_ENABLED(level)    (ReadNoFence(&Verbosity) >= (LONG)(level))
+
+#define VerbosePrint(level, _x_)    \
+    do { if (VERBOSITY_ENABLED(level)) { DbgPrint _x_; } } while (0)
+
+EXTERN_C_START
+
+//
+// WDFDRIVER Events
+//
+
+DRIVER_INITIALIZE DriverEntry;
+EVT_WDF_DRIVER_DEVICE_ADD StorTraceEvtDeviceAdd;
+EVT_WDF_OBJECT_CONTEXT_CLEANUP StorTraceEvtDriverContextCleanup;
+
+EXTERN_C_END
@@ -0,0 +1,114 @@
+/*++
+
+Module Name:
+
+    Histogram.h
+
+Abstract:
+
+    Log-linear latency histograms, shared by the driver and the user
+    applications that read them with IOCTL_STORTRACE_SNAP_LATENCY.
+
+    Latencies are in microseconds. Below 2^HISTOGRAM_SUB_BUCKET_BITS each
+    value has its own bucket; above, each power of two is split into
+    2^HISTOGRAM_SUB_BUCKET_BITS buckets of equal width. A bucket is never
+    wider than 1/16 of its lowest value, so any percentile read from the
+    histogram is within 6.25% of the exact one. Values past MAXULONG
+    microseconds (71 minutes) go to the last bucket.
+
+Environment:
+
+    user and kernel
+
+--*/
+
+#pragma once
+
+#define HISTOGRAM_SUB_BUCKET_BITS   4
+#define HISTOGRAM_SUB_BUCKETS       (1 << HISTOGRAM_SUB_BUCKET_BITS)
+#define HISTOGRAM_BUCKETS           ((32 - HISTOGRAM_SUB_BUCKET_BITS + 1) * HISTOGRAM_SUB_BUCKETS)
+
+typedef struct _STORTRACE_HISTOGRAM {
+    ULONG64 Count;
+    ULONG64 Sum;                // of the latencies, microseconds
+    ULONG64 Buckets[HISTOGRAM_BUCKETS];
+} STORTRACE_HISTOGRAM, *PSTORTRACE_HISTOGRAM;
+
+//
+// Bucket of a latency
+//
+static __inline ULONG
+HistogramBucket(ULONG Microseconds)
+{
+    ULONG exponent = 0;
+    ULONG value = Microseconds;
+
+    if (Microseconds < HISTOGRAM_SUB_BUCKETS) {
+        return Microseconds;
+    }
+
+    // Highest bit set, the same in C and C++, kernel and user mode
+    if (value >= 1u << 16) { value >>= 16; exponent += 16; }
+    if (value >= 1u << 8) { value >>= 8; exponent += 8; }
+    if (value >= 1u << 4) { value >>= 4; exponent += 4; }
+    if (value >= 1u << 2) { value >>= 2; exponent += 2; }
+    if (value >= 1u << 1) { exponent += 1; }
+
+    return (exponent - HISTOGRAM_SUB_BUCKET_BITS + 1) * HISTOGRAM_SUB_BUCKETS +
+        ((Microseconds >> (exponent - HISTOGRAM_SUB_BUCKET_BITS)) & (HISTOGRAM_SUB_BUCKETS - 1));
+}
+
+//
+// Lowest and highest latency of a bucket
+//
+static __inline ULONG
+HistogramBucketLow(ULONG Bucket)
+{
+    ULONG shift;
+
+    if (Bucket < HISTOGRAM_SUB_BUCKETS) {
+        return Bucket;
+    }
+
+    shift = Bucket / HISTOGRAM_SUB_BUCKETS - 1;
+    return (HISTOGRAM_SUB_BUCKETS + Bucket % HISTOGRAM_SUB_BUCKETS) << shift;
+}
+
+static __inline ULONG
+HistogramBucketHigh(ULONG Bucket)
+{
+    ULONG shift = (Bucket < HISTOGRAM_SUB_BUCKETS) ? 0 : Bucket / HISTOGRAM_SUB_BUCKETS - 1;
+
+    return HistogramBucketLow(Bucket) + ((1u << shift) - 1);
+}
+
+//
+// Latency at or under which PartsPerMillion of the commands completed,
+// the highest of its bucket so it is never understated; 999000 for p99.9.
+// 0 for an empty histogram.
+//
+static __inline ULONG
+HistogramPercentile(const STORTRACE_HISTOGRAM *Histogram, ULONG PartsPerMillion)
+{
+    ULONG64 rank;
+    ULONG64 count = 0;
+
+    if (Histogram->Count == 0) {
+        return 0;
+    }
+
+    // Commands at or under the percentile, at least one
+    rank = (Histogram->Count * PartsPerMillion + 999999) / 1000000;
+    if (rank == 0) {
+        rank = 1;
+    }
+
+    for (ULONG i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        count += Histogram->Buckets[i];
+        if (count >= rank) {
+            return HistogramBucketHigh(i);
+        }
+    }
+
+    return HistogramBucketHigh(HISTOGRAM_BUCKETS - 1);
+}
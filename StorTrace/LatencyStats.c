@@ -0,0 +1,203 @@
+/*++
+
+Module Name:
+
+    LatencyStats.c
+
+Abstract:
+
+    Per processor latency histograms (Histogram.h) of a device, by class
+    of command. Processors only ever add to their own histograms, and a
+    snapshot never writes to them: it resets by remembering what it
+    returned and taking that off the next time.
+
+Environment:
+
+    Kernel-mode Driver Framework
+
+--*/
+
+#include "driver.h"
+
+#include "LatencyStats.h"
+#include "CdbDecode.h"
+
+
+//=========================================
+// Data Type Definition
+//=========================================
+
+//
+// Written by its processor only, see COUNTERS_CPU
+//
+typedef struct DECLSPEC_CACHEALIGN _LATENCY_STATS_CPU {
+    STORTRACE_HISTOGRAM Classes[STORTRACE_LATENCY_CLASSES];
+} LATENCY_STATS_CPU, *PLATENCY_STATS_CPU;
+
+struct _LATENCY_STATS {
+    ULONG               CpuCount;
+    ULONG64             Frequency;
+    ULONG64             MicrosecondScale;   // 2^32 microseconds per timestamp tick
+    ULONG64             MaxTicks;           // timed by the scale without overflowing
+
+    //
+    // Sums as of the last snapshot, and when it was taken (or the
+    // histograms created). Snapshots are serialized by the caller.
+    //
+    ULONG64             LastSnapshot;
+    STORTRACE_HISTOGRAM Returned[STORTRACE_LATENCY_CLASSES];
+
+    LATENCY_STATS_CPU   Cpus[ANYSIZE_ARRAY];
+};
+
+//
+// STORTRACE_HISTOGRAM is nothing but ULONG64 counts
+//
+#define HISTOGRAM_COUNTS    (sizeof(STORTRACE_HISTOGRAM) / sizeof(ULONG64))
+
+C_ASSERT(sizeof(STORTRACE_HISTOGRAM) % sizeof(ULONG64) == 0);
+
+//
+// Commands are classed by CdbDecodeClass
+//
+C_ASSERT(CDB_CLASS_READ == STORTRACE_LATENCY_READ);
+C_ASSERT(CDB_CLASS_WRITE == STORTRACE_LATENCY_WRITE);
+C_ASSERT(CDB_CLASS_FLUSH == STORTRACE_LATENCY_FLUSH);
+C_ASSERT(CDB_CLASS_OTHER == STORTRACE_LATENCY_OTHER);
+
+
+//=========================================
+// Public Function
+//=========================================
+
+PLATENCY_STATS
+LatencyStatsCreate(ULONG64 Frequency)
+/*++
+
+Routine Description:
+
+    Allocate empty histograms. Frequency is that of the timestamps given
+    to LatencyStatsAdd, per second. Called at PASSIVE_LEVEL.
+
+--*/
+{
+    PLATENCY_STATS stats;
+    ULONG cpuCount = KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+    size_t allocSize = FIELD_OFFSET(LATENCY_STATS, Cpus) + cpuCount * sizeof(LATENCY_STATS_CPU);
+
+    stats = ExAllocatePoolWithTag(NonPagedPoolNxCacheAligned, allocSize, STORTRACE_POOL_TAG);
+    if (stats == NULL)
+    {
+        return NULL;
+    }
+
+    RtlZeroMemory(stats, allocSize);
+    stats->CpuCount = cpuCount;
+    stats->Frequency = Frequency;
+
+    // Rounded up, so a whole number of microseconds is not timed a bit short
+    stats->MicrosecondScale = Frequency ? ((1000000ULL << 32) + Frequency - 1) / Frequency : 0;
+    stats->MaxTicks = stats->MicrosecondScale ? MAXULONG64 / stats->MicrosecondScale : 0;
+    stats->LastSnapshot = (ULONG64)KeQueryPerformanceCounter(NULL).QuadPart;
+
+    return stats;
+}
+
+VOID
+LatencyStatsDelete(PLATENCY_STATS Stats)
+{
+    if (Stats != NULL)
+    {
+        ExFreePoolWithTag(Stats, STORTRACE_POOL_TAG);
+    }
+}
+
+VOID
+LatencyStatsAdd(PLATENCY_STATS Stats, UCHAR Opcode, ULONG64 IssueTime, ULONG64 Timestamp)
+/*++
+
+Routine Description:
+
+    Add the latency of a command issued at IssueTime (0 if unknown, it is
+    not added then) that completed at Timestamp. Callable at IRQL <=
+    DISPATCH_LEVEL from any number of processors.
+
+--*/
+{
+    PSTORTRACE_HISTOGRAM histogram;
+    ULONG64 ticks;
+    ULONG microseconds = MAXULONG;
+
+    if (IssueTime == 0 || Timestamp < IssueTime)
+    {
+        return;
+    }
+
+    ticks = Timestamp - IssueTime;
+    if (ticks <= Stats->MaxTicks && ((ticks * Stats->MicrosecondScale) >> 32) < MAXULONG)
+    {
+        microseconds = (ULONG)((ticks * Stats->MicrosecondScale) >> 32);
+    }
+
+    histogram = &Stats->Cpus[KeGetCurrentProcessorNumberEx(NULL) % Stats->CpuCount].Classes[CdbDecodeClass(Opcode)];
+    histogram->Count++;
+    histogram->Sum += microseconds;
+    histogram->Buckets[HistogramBucket(microseconds)]++;
+}
+
+VOID
+LatencyStatsSnapshot(PLATENCY_STATS Stats, PSTORTRACE_LATENCY Snapshot, ULONG64 Now)
+/*++
+
+Routine Description:
+
+    Add the latencies since the last snapshot to Snapshot, which may hold
+    those of other devices already, and start over. Now is the time of the
+    snapshot, in timestamp ticks. Called with DeviceCollectionLock held.
+
+--*/
+{
+    //
+    // Summed in place, not on the stack (a histogram is kilobytes): what
+    // was returned comes off the snapshot, Returned starts over as the sum
+    // of the processors, and goes onto the snapshot
+    //
+    for (ULONG c = 0; c < STORTRACE_LATENCY_CLASSES; c++)
+    {
+        PULONG64 returned = (PULONG64)&Stats->Returned[c];
+        PULONG64 snapshot = (PULONG64)&Snapshot->Classes[c];
+
+        for (ULONG j = 0; j < HISTOGRAM_COUNTS; j++)
+        {
+            snapshot[j] -= returned[j];
+            returned[j] = 0;
+        }
+
+        for (ULONG i = 0; i < Stats->CpuCount; i++)
+        {
+            volatile ULONG64 *cpu = (volatile ULONG64 *)&Stats->Cpus[i].Classes[c];
+
+            for (ULONG j = 0; j < HISTOGRAM_COUNTS; j++)
+            {
+                returned[j] += cpu[j];
+            }
+        }
+
+        for (ULONG j = 0; j < HISTOGRAM_COUNTS; j++)
+        {
+            snapshot[j] += returned[j];
+        }
+    }
+
+    // Of the longest interval, when devices are added up
+    if (Stats->Frequency != 0 && Now > Stats->LastSnapshot)
+    {
+        ULONG64 microseconds = (Now - Stats->LastSnapshot) * 1000000 / Stats->Frequency;
+
+        if (microseconds > Snapshot->Microseconds)
+        {
+            Snapshot->Microseconds = microseconds;
+        }
+    }
+    Stats->LastSnapshot = Now;
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+//
+// Latency histograms of a device by class of command (STORTRACE_LATENCY),
+// for tail latency without per-command records. Each processor adds to
+// its own histograms; a snapshot adds them up, less what the previous
+// snapshot returned.
+//
+typedef struct _LATENCY_STATS LATENCY_STATS, *PLATENCY_STATS;
+
+PLATENCY_STATS
+LatencyStatsCreate(ULONG64 Frequency);
+
+VOID
+LatencyStatsDelete(PLATENCY_STATS Stats);
+
+VOID
+LatencyStatsAdd(PLATENCY_STATS Stats, UCHAR Opcode, ULONG64 IssueTime, ULONG64 Timestamp);
+
+VOID
+LatencyStatsSnapshot(PLATENCY_STATS Stats, PSTORTRACE_LATENCY Snapshot, ULONG64 Now);
@@ -1,24 +1,245 @@
-/*++
-
-Module Name:
-
-    public.h
-
-Abstract:
-
-    This module contains the common declarations shared by driver
-    and user applications.
-
-Environment:
-
-    user and kernel
-
---*/
-
-//
-// Define an Interface Guid so that apps can find the device and talk to it.
-//
-
-DEFINE_GUID (GUID_DEVINTERFACE_StorTrace,
-    0xd0483345,0x7c86,0x45b6,0xb9,0x48,0x28,0x14,0xf9,0x5f,0x72,0x36);
-// {d0483345-7c86-45b6-b948-2814f95f7236}
+/*++
+
+Module Name:
+
+    public.h
+
+Abstract:
+
+    This module contains the common declarations shared by driver
+    and user applications.
+
+Environment:
+
+    user and kernel
+
+--*/
+
+#include "TraceRecord.h"
+#include "RingLayout.h"
+#include "Histogram.h"
+
+//
+// Define an Interface Guid so that apps can find the device and talk to it.
+//
+
+DEFINE_GUID (GUID_DEVINTERFACE_StorTrace,
+    0xd0483345,0x7c86,0x45b6,0xb9,0x48,0x28,0x14,0xf9,0x5f,0x72,0x36);
+// {d0483345-7c86-45b6-b948-2814f95f7236}
+
+//
+// IOCTLs of the control device (\\.\StorTraceFilter), which only SYSTEM and
+// administrators can open
+//
+// IOCTL_STORTRACE_LIST_DEVICES
+//   Output: array of STORTRACE_DEVICE_INFO, one per filtered disk. As
+//   many as fit, with STATUS_BUFFER_OVERFLOW if there are more
+//
+// IOCTL_STORTRACE_SELECT_DEVICE
+//   Input: ULONG DeviceId, or STORTRACE_ALL_DEVICES (the default)
+//   Selects which device the reads on this handle drain
+//
+// IOCTL_STORTRACE_SET_VERBOSITY
+//   Input: ULONG, one of STORTRACE_VERBOSITY_*
+//   Output (optional): ULONG, the previous level
+//   Sets the driver's debug output on the I/O path, for all devices
+//
+// IOCTL_STORTRACE_MAP_RING
+//   Input: ULONG DeviceId
+//   Output: STORTRACE_RING_MAPPING
+//   Maps the device's trace ring read-only into the calling process, for
+//   the life of the handle (see RingLayout.h). One ring per handle, one
+//   mapping per ring, and not with PerCpuTraceBuffer. Reads no longer
+//   return that device's records meanwhile.
+//
+// IOCTL_STORTRACE_RELEASE_RING
+//   Input: ULONG64, the stream offset the mapped ring was consumed up to
+//   Hands the space before it back to the producers (moves Tail). It must
+//   be the end of a committed entry, STATUS_INVALID_PARAMETER otherwise
+//
+// IOCTL_STORTRACE_GET_RING_STATS
+//   Output: array of STORTRACE_RING_STATS, one per filtered disk, as
+//   many as fit as with IOCTL_STORTRACE_LIST_DEVICES
+//   What the trace rings lost to overflowing and how full they got, to
+//   size them (TraceBufferSize) from data
+//
+// IOCTL_STORTRACE_RESIZE_TRACE_BUF
+//   Input: STORTRACE_RESIZE
+//   Replaces the trace buffer of a device by one of about Size bytes, or
+//   of all devices (STORTRACE_ALL_DEVICES), which also sets the size for
+//   disks that arrive later. The trace it holds moves over; what no
+//   longer fits is dropped or overwritten as the overflow policy has it,
+//   and records completing meanwhile are lost. Fails on a mapped ring.
+//
+// IOCTL_STORTRACE_SET_CAPTURE_FILTER
+//   Input: STORTRACE_SET_CAPTURE_FILTER
+//   Which completed commands a device traces, or all devices do
+//   (STORTRACE_ALL_DEVICES). Commands filtered out take no sequence
+//   number, so the reader sees no gap for them. No conditions captures
+//   everything (the default).
+//
+// IOCTL_STORTRACE_SET_SAMPLING
+//   Input: STORTRACE_SAMPLING
+//   Traces 1 in Rate of the commands the capture filter passes, of a
+//   device or of all devices (STORTRACE_ALL_DEVICES), and with a Budget
+//   no more records per second than that, sampling more as needed.
+//   Failed commands are always traced. Records carry the rate they were
+//   sampled at (TRACE_RECORD_HEADER.SampleRate), skipped commands take
+//   no sequence number.
+//
+// IOCTL_STORTRACE_SET_CAPTURE_MODE
+//   Input: STORTRACE_CAPTURE_MODE
+//   What a device, or all devices (STORTRACE_ALL_DEVICES), make of the
+//   commands the capture filter passes: any of trace records, aggregate
+//   counters and latency histograms (STORTRACE_CAPTURE_*), and whether
+//   the READ and WRITE requests sent to it are traced
+//
+// IOCTL_STORTRACE_GET_COUNTERS
+//   Input: ULONG DeviceId, or STORTRACE_ALL_DEVICES for the sum of all
+//   Output: STORTRACE_COUNTERS
+//   The aggregate counters since the device first counted, for polling
+//   and taking the difference
+//
+// IOCTL_STORTRACE_SNAP_LATENCY
+//   Input: ULONG DeviceId, or STORTRACE_ALL_DEVICES for the sum of all
+//   Output: STORTRACE_LATENCY
+//   The latency histograms since the last snapshot of the device, which
+//   start over. With STORTRACE_CAPTURE_LATENCY only.
+//
+#define IOCTL_STORTRACE_LIST_DEVICES    CTL_CODE(FILE_DEVICE_UNKNOWN, 0x800, METHOD_BUFFERED, FILE_READ_DATA)
+#define IOCTL_STORTRACE_SELECT_DEVICE   CTL_CODE(FILE_DEVICE_UNKNOWN, 0x801, METHOD_BUFFERED, FILE_READ_DATA)
+#define IOCTL_STORTRACE_SET_VERBOSITY   CTL_CODE(FILE_DEVICE_UNKNOWN, 0x802, METHOD_BUFFERED, FILE_WRITE_DATA)
+#define IOCTL_STORTRACE_MAP_RING        CTL_CODE(FILE_DEVICE_UNKNOWN, 0x803, METHOD_BUFFERED, FILE_READ_DATA)
+#define IOCTL_STORTRACE_RELEASE_RING    CTL_CODE(FILE_DEVICE_UNKNOWN, 0x804, METHOD_BUFFERED, FILE_READ_DATA)
+#define IOCTL_STORTRACE_GET_RING_STATS  CTL_CODE(FILE_DEVICE_UNKNOWN, 0x805, METHOD_BUFFERED, FILE_READ_DATA)
+#define IOCTL_STORTRACE_RESIZE_TRACE_BUF CTL_CODE(FILE_DEVICE_UNKNOWN, 0x806, METHOD_BUFFERED, FILE_WRITE_DATA)
+#define IOCTL_STORTRACE_SET_CAPTURE_FILTER CTL_CODE(FILE_DEVICE_UNKNOWN, 0x807, METHOD_BUFFERED, FILE_WRITE_DATA)
+#define IOCTL_STORTRACE_SET_SAMPLING    CTL_CODE(FILE_DEVICE_UNKNOWN, 0x808, METHOD_BUFFERED, FILE_WRITE_DATA)
+#define IOCTL_STORTRACE_SET_CAPTURE_MODE CTL_CODE(FILE_DEVICE_UNKNOWN, 0x809, METHOD_BUFFERED, FILE_WRITE_DATA)
+#define IOCTL_STORTRACE_GET_COUNTERS    CTL_CODE(FILE_DEVICE_UNKNOWN, 0x80A, METHOD_BUFFERED, FILE_READ_DATA)
+#define IOCTL_STORTRACE_SNAP_LATENCY    CTL_CODE(FILE_DEVICE_UNKNOWN, 0x80B, METHOD_BUFFERED, FILE_READ_DATA)
+
+#define STORTRACE_ALL_DEVICES           0
+
+#define STORTRACE_VERBOSITY_OFF         0   // nothing formatted per I/O (the default)
+#define STORTRACE_VERBOSITY_IO          1   // a line per forwarded request and per anomaly
+#define STORTRACE_VERBOSITY_CDB         2   // and SRB details and a CDB dump per completion
+
+//
+// Conditions of a capture filter, a command is traced if it meets all of
+// those set. LBA and length are those of the CDB, so commands without
+// them (TEST UNIT READY, INQUIRY, ...) never meet the last two.
+//
+#define STORTRACE_FILTER_OPCODES        0x1 // operation code in Opcodes
+#define STORTRACE_FILTER_LBA            0x2 // touches a block of LbaFirst..LbaLast
+#define STORTRACE_FILTER_BLOCKS         0x4 // MinBlocks..MaxBlocks blocks long
+#define STORTRACE_FILTER_ERRORS_ONLY    0x8 // non-zero NTSTATUS or SCSI status
+#define STORTRACE_FILTER_VALID_FLAGS    0xF
+
+//
+// What is made of a captured command
+//
+#define STORTRACE_CAPTURE_RECORDS       0x1 // a trace record (the default)
+#define STORTRACE_CAPTURE_COUNTERS      0x2 // counted in STORTRACE_COUNTERS
+#define STORTRACE_CAPTURE_LATENCY       0x4 // timed in STORTRACE_LATENCY
+#define STORTRACE_CAPTURE_REQUESTS      0x8 // READ and WRITE requests traced too
+#define STORTRACE_CAPTURE_VALID_MODES   0xF
+
+#define STORTRACE_COUNTERS_SCSI_STATUS  64  // by ScsiStatus / 2, SCSI statuses are even
+#define STORTRACE_COUNTERS_LATENCY      32  // log2 of microseconds
+
+//
+// Classes of commands of the latency histograms
+//
+#define STORTRACE_LATENCY_READ          0
+#define STORTRACE_LATENCY_WRITE         1   // WRITE, WRITE AND VERIFY, WRITE SAME, COMPARE AND WRITE
+#define STORTRACE_LATENCY_FLUSH         2   // SYNCHRONIZE CACHE
+#define STORTRACE_LATENCY_OTHER         3
+#define STORTRACE_LATENCY_CLASSES       4
+
+typedef struct _STORTRACE_DEVICE_INFO {
+    ULONG   DeviceId;
+    ULONG   SampleRate;         // 1 in SampleRate commands traced, now
+    ULONG64 TraceBufSize;
+    ULONG64 TimestampFrequency; // of the record timestamps, per second
+} STORTRACE_DEVICE_INFO, *PSTORTRACE_DEVICE_INFO;
+
+typedef struct _STORTRACE_RING_MAPPING {
+    ULONG64 Address;            // of the RING_HEADER in the caller
+    ULONG64 Length;             // RING_HEADER_SIZE + the ring size
+} STORTRACE_RING_MAPPING, *PSTORTRACE_RING_MAPPING;
+
+typedef struct _STORTRACE_RING_STATS {
+    ULONG   DeviceId;
+    ULONG   Policy;             // RING_OVERFLOW_*
+    ULONG   RingCount;          // more than one with PerCpuTraceBuffer
+    ULONG   Reserved;
+    ULONG64 RingSize;           // of each ring
+    ULONG64 HighWater;          // most bytes any one ring held
+    ULONG64 DroppedRecords;     // new records refused, ring full
+    ULONG64 DroppedBytes;
+    ULONG64 OverwrittenRecords; // oldest records retired, ring full
+    ULONG64 OverwrittenBytes;
+} STORTRACE_RING_STATS, *PSTORTRACE_RING_STATS;
+
+typedef struct _STORTRACE_RESIZE {
+    ULONG   DeviceId;           // or STORTRACE_ALL_DEVICES
+    ULONG   Reserved;
+    ULONG64 Size;               // in bytes, 64 KB to 1 GB
+} STORTRACE_RESIZE, *PSTORTRACE_RESIZE;
+
+typedef struct _STORTRACE_CAPTURE_FILTER {
+    ULONG   Flags;              // STORTRACE_FILTER_*
+    ULONG   Reserved;
+    UCHAR   Opcodes[32];        // bitmap, bit (Opcode % 8) of byte (Opcode / 8)
+    ULONG64 LbaFirst;
+    ULONG64 LbaLast;            // inclusive
+    ULONG   MinBlocks;
+    ULONG   MaxBlocks;          // inclusive
+} STORTRACE_CAPTURE_FILTER, *PSTORTRACE_CAPTURE_FILTER;
+
+typedef struct _STORTRACE_SET_CAPTURE_FILTER {
+    ULONG   DeviceId;           // or STORTRACE_ALL_DEVICES
+    ULONG   Reserved;
+    STORTRACE_CAPTURE_FILTER Filter;
+} STORTRACE_SET_CAPTURE_FILTER, *PSTORTRACE_SET_CAPTURE_FILTER;
+
+typedef struct _STORTRACE_SAMPLING {
+    ULONG   DeviceId;           // or STORTRACE_ALL_DEVICES
+    ULONG   Rate;               // 1 in Rate commands, 0 or 1 for all
+    ULONG   Budget;             // records per second at most, 0 for no budget
+    ULONG   Reserved;
+} STORTRACE_SAMPLING, *PSTORTRACE_SAMPLING;
+
+typedef struct _STORTRACE_CAPTURE_MODE {
+    ULONG   DeviceId;           // or STORTRACE_ALL_DEVICES
+    ULONG   Mode;               // STORTRACE_CAPTURE_*
+} STORTRACE_CAPTURE_MODE, *PSTORTRACE_CAPTURE_MODE;
+
+typedef struct _STORTRACE_OPCODE_COUNTERS {
+    ULONG64 Commands;
+    ULONG64 Bytes;              // transferred
+    ULONG64 Errors;             // non-zero NTSTATUS or SCSI status
+} STORTRACE_OPCODE_COUNTERS, *PSTORTRACE_OPCODE_COUNTERS;
+
+typedef struct _STORTRACE_COUNTERS {
+    ULONG   DeviceId;           // or STORTRACE_ALL_DEVICES, summed
+    ULONG   Reserved;
+    ULONG64 NtErrors;           // non-zero NTSTATUS
+    ULONG64 ScsiStatus[STORTRACE_COUNTERS_SCSI_STATUS];
+
+    //
+    // Commands by latency, [0] under 1 us, [i] from 2^(i-1) to 2^i us, the
+    // last one anything longer. Commands not timed from issue are not in.
+    //
+    ULONG64 Latency[STORTRACE_COUNTERS_LATENCY];
+
+    STORTRACE_OPCODE_COUNTERS Opcodes[256];
+} STORTRACE_COUNTERS, *PSTORTRACE_COUNTERS;
+
+typedef struct _STORTRACE_LATENCY {
+    ULONG   DeviceId;           // or STORTRACE_ALL_DEVICES, summed
+    ULONG   Reserved;
+    ULONG64 Microseconds;       // since the last snapshot, 0 if unknown
+    STORTRACE_HISTOGRAM Classes[STORTRACE_LATENCY_CLASSES];
+} STORTRACE_LATENCY, *PSTORTRACE_LATENCY;
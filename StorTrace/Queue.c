@@ -1,878 +1,2213 @@
-/*++
-
-Module Name:
-
-    queue.c
-
-Abstract:
-
-    This file contains the queue entry points and callbacks.
-
-Environment:
-
-    Kernel-mode Driver Framework
-
---*/
-
-#include "driver.h"
-#include "queue.tmh"
-
-#include "srb.h"
-#include "ntstrsafe.h"
-#include "ntddscsi.h"
-#include "scsi.h"
-#include "srbhelper.h"
-
-#include "RingBuf.h"
-
-//-------------------------------------------------------
-// Macro
-//-------------------------------------------------------
-#define MIN(X, Y) (((X) < (Y)) ? (X) : (Y))
-
-//-------------------------------------------------------
-// Function Decldaration
-//-------------------------------------------------------
-static VOID
-ForwardRequest(
-    IN WDFREQUEST Request,
-    IN WDFIOTARGET Target
-);
-
-static VOID
-ForwardRequestWithCompletion(
-    IN WDFREQUEST Request,
-    IN WDFIOTARGET Target,
-    IN PFN_WDF_REQUEST_COMPLETION_ROUTINE CompletionFunc
-);
-
-static VOID
-CompletionDevCtlScsiPassThrDirect(
-    IN WDFREQUEST                  Request,
-    IN WDFIOTARGET                 Target,
-    PWDF_REQUEST_COMPLETION_PARAMS CompletionParams,
-    IN WDFCONTEXT                  Context
-);
-
-static VOID
-CompletionInternalDevCtl(
-    IN WDFREQUEST                  Request,
-    IN WDFIOTARGET                 Target,
-    PWDF_REQUEST_COMPLETION_PARAMS CompletionParams,
-    IN WDFCONTEXT                  Context
-);
-
-
-static VOID
-ControlDeviceEvtIoDeviceControl(
-    _In_ WDFQUEUE Queue,
-    _In_ WDFREQUEST Request,
-    _In_ size_t OutputBufferLength,
-    _In_ size_t InputBufferLength,
-    _In_ ULONG IoControlCode
-);
-
-static VOID
-DbgPrintCdb(_In_ PUCHAR pCdb, _In_ UCHAR CdbLength);
-
-static VOID
-SaveCdbToRingBufEx(_In_ PUCHAR pCdb, _In_ UCHAR CdbLength, _In_ PUCHAR SenseData, _In_ UCHAR SenseDataLength, _In_ NTSTATUS ntStatus, _In_ UCHAR scsiStatus);
-
-static VOID
-SaveCdbToRingBuf(_In_ PUCHAR pCdb, _In_ UCHAR CdbLength);
-
-static BOOLEAN
-GetByteFromRingBuf(_Out_ PUCHAR Data);
-//-------------------------------------------------------
-// Imported Function & Variable Declaration
-//-------------------------------------------------------
-extern WDFCOLLECTION   DeviceCollection;
-extern WDFWAITLOCK     DeviceCollectionLock;
-extern WDFSPINLOCK     CdbBufSpinLock;
-
-
-//-------------------------------------------------------
-// Function Implementation, For filter device queue
-//-------------------------------------------------------
-NTSTATUS
-StorTraceQueueInitialize(
-    _In_ WDFDEVICE Device
-    )
-{
-    WDFQUEUE queue;
-    NTSTATUS status;
-    WDF_IO_QUEUE_CONFIG queueConfig;
-    
-
-    //
-    // Configure a default queue so that requests that are not
-    // configure-fowarded using WdfDeviceConfigureRequestDispatching to goto
-    // other queues get dispatched here.
-    //
-    WDF_IO_QUEUE_CONFIG_INIT_DEFAULT_QUEUE(
-         &queueConfig,
-        WdfIoQueueDispatchParallel
-        );
-
-    // we need to handle IRP_MJ_INTERNAL_DEVICE_CONTROL which is also IRP_MJ_SCSI
-    // queueConfig.EvtIoInternalDeviceControl = ....
-    queueConfig.EvtIoDeviceControl = StorTraceEvtIoDeviceControl;
-    queueConfig.EvtIoStop = StorTraceEvtIoStop;
-    queueConfig.EvtIoInternalDeviceControl = StorTraceEvtIoInternalDeviceControl;
-    queueConfig.EvtIoRead = StorTraceEvtIoRead;
-    queueConfig.EvtIoWrite = StorTraceEvtIoWrite;
-
-    status = WdfIoQueueCreate(
-                 Device,
-                 &queueConfig,
-                 WDF_NO_OBJECT_ATTRIBUTES,
-                 &queue
-                 );
-     
-    if(!NT_SUCCESS(status)) {
-        TraceEvents(TRACE_LEVEL_ERROR, TRACE_QUEUE, "WdfIoQueueCreate failed %!STATUS!", status);
-        return status;
-    }
-
-    return status;
-}
-
-VOID
-StorTraceEvtIoRead(
-    _In_    WDFQUEUE Queue,
-    _In_    WDFREQUEST Request,
-    _In_    size_t Length
-)
-{
-    WDFDEVICE                       device;
-
-    device = WdfIoQueueGetDevice(Queue);
-    DbgPrint("%s, length 0x%x \n", __FUNCTION__, (int)Length);
-
-    ForwardRequest(Request, WdfDeviceGetIoTarget(device));
-
-    return;
-}
-
-VOID
-StorTraceEvtIoWrite(
-    _In_    WDFQUEUE Queue,
-    _In_    WDFREQUEST Request,
-    _In_    size_t Length
-)
-{
-    WDFDEVICE                       device;
-
-    device = WdfIoQueueGetDevice(Queue);
-    DbgPrint("%s, length 0x%x \n", __FUNCTION__, (int)Length);
-
-    ForwardRequest(Request, WdfDeviceGetIoTarget(device));
-
-    return;
-}
-
-
-VOID
-StorTraceEvtIoInternalDeviceControl(
-    _In_ WDFQUEUE Queue,
-    _In_ WDFREQUEST Request,
-    _In_ size_t OutputBufferLength,
-    _In_ size_t InputBufferLength,
-    _In_ ULONG IoControlCode
-)
-{
-    WDFDEVICE  device = WdfIoQueueGetDevice(Queue);
-    
-    UNREFERENCED_PARAMETER(OutputBufferLength);
-    UNREFERENCED_PARAMETER(InputBufferLength);
-    UNREFERENCED_PARAMETER(IoControlCode);    
-
-    // IoControlCode here is normally 0
-    DbgPrint("%s IoControl Code %x \n", __FUNCTION__, IoControlCode);
-              
-    ForwardRequestWithCompletion(Request, WdfDeviceGetIoTarget(device), CompletionInternalDevCtl);
-    
-    return;
-}
-
-VOID
-StorTraceEvtIoDeviceControl(
-    _In_ WDFQUEUE Queue,
-    _In_ WDFREQUEST Request,
-    _In_ size_t OutputBufferLength,
-    _In_ size_t InputBufferLength,
-    _In_ ULONG IoControlCode
-)
-/*++
-
-Routine Description:
-
-    This event is invoked when the framework receives IRP_MJ_DEVICE_CONTROL request.
-
-Arguments:
-
-    Queue -  Handle to the framework queue object that is associated with the
-             I/O request.
-
-    Request - Handle to a framework request object.
-
-    OutputBufferLength - Size of the output buffer in bytes
-
-    InputBufferLength - Size of the input buffer in bytes
-
-    IoControlCode - I/O control code.
-
-Return Value:
-
-    VOID
-
---*/
-{
-    WDFDEVICE device;
-    
-    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_QUEUE, "%!FUNC! Queue 0x%p, Request 0x%p OutputBufferLength %d InputBufferLength %d IoControlCode %d", Queue, Request, (int)OutputBufferLength, (int)InputBufferLength, IoControlCode);
-
-    device = WdfIoQueueGetDevice(Queue);
-
-
-    if (IoControlCode == IOCTL_SCSI_PASS_THROUGH_DIRECT) {
-        ForwardRequestWithCompletion(Request, WdfDeviceGetIoTarget(device), CompletionDevCtlScsiPassThrDirect);        
-    }
-    else
-    {
-        DbgPrint("IoControlCode 0x%x, not IOCTL_SCSI_PASS_THROUGH_DIRECT\n", IoControlCode);
-        ForwardRequest(Request, WdfDeviceGetIoTarget(device));
-    }        
-
-    return;
-}
-
-VOID
-StorTraceEvtIoStop(
-    _In_ WDFQUEUE Queue,
-    _In_ WDFREQUEST Request,
-    _In_ ULONG ActionFlags
-)
-/*++
-
-Routine Description:
-
-    This event is invoked for a power-managed queue before the device leaves the working state (D0).
-
-Arguments:
-
-    Queue -  Handle to the framework queue object that is associated with the
-             I/O request.
-
-    Request - Handle to a framework request object.
-
-    ActionFlags - A bitwise OR of one or more WDF_REQUEST_STOP_ACTION_FLAGS-typed flags
-                  that identify the reason that the callback function is being called
-                  and whether the request is cancelable.
-
-Return Value:
-
-    VOID
-
---*/
-{
-    TraceEvents(TRACE_LEVEL_INFORMATION, 
-                TRACE_QUEUE, 
-                "%!FUNC! Queue 0x%p, Request 0x%p ActionFlags %d", 
-                Queue, Request, ActionFlags);
-
-    //
-    // In most cases, the EvtIoStop callback function completes, cancels, or postpones
-    // further processing of the I/O request.
-    //
-    // Typically, the driver uses the following rules:
-    //
-    // - If the driver owns the I/O request, it calls WdfRequestUnmarkCancelable
-    //   (if the request is cancelable) and either calls WdfRequestStopAcknowledge
-    //   with a Requeue value of TRUE, or it calls WdfRequestComplete with a
-    //   completion status value of STATUS_SUCCESS or STATUS_CANCELLED.
-    //
-    //   Before it can call these methods safely, the driver must make sure that
-    //   its implementation of EvtIoStop has exclusive access to the request.
-    //
-    //   In order to do that, the driver must synchronize access to the request
-    //   to prevent other threads from manipulating the request concurrently.
-    //   The synchronization method you choose will depend on your driver's design.
-    //
-    //   For example, if the request is held in a shared context, the EvtIoStop callback
-    //   might acquire an internal driver lock, take the request from the shared context,
-    //   and then release the lock. At this point, the EvtIoStop callback owns the request
-    //   and can safely complete or requeue the request.
-    //
-    // - If the driver has forwarded the I/O request to an I/O target, it either calls
-    //   WdfRequestCancelSentRequest to attempt to cancel the request, or it postpones
-    //   further processing of the request and calls WdfRequestStopAcknowledge with
-    //   a Requeue value of FALSE.
-    //
-    // A driver might choose to take no action in EvtIoStop for requests that are
-    // guaranteed to complete in a small amount of time.
-    //
-    // In this case, the framework waits until the specified request is complete
-    // before moving the device (or system) to a lower power state or removing the device.
-    // Potentially, this inaction can prevent a system from entering its hibernation state
-    // or another low system power state. In extreme cases, it can cause the system
-    // to crash with bugcheck code 9F.
-    //
-
-    return;
-}
-
-
-VOID
-ForwardRequest(
-    IN WDFREQUEST Request,
-    IN WDFIOTARGET Target
-)
-{
-    WDF_REQUEST_SEND_OPTIONS options;
-    BOOLEAN ret;
-    NTSTATUS status;
-
-    //
-    // We are not interested in post processing the IRP so 
-    // fire and forget.
-    //
-    WDF_REQUEST_SEND_OPTIONS_INIT(&options,
-        WDF_REQUEST_SEND_OPTION_SEND_AND_FORGET);
-
-    ret = WdfRequestSend(Request, Target, &options);    
-
-    if (ret == FALSE) {
-        status = WdfRequestGetStatus(Request);
-        KdPrint(("WdfRequestSend failed: 0x%x\n", status));
-        WdfRequestComplete(Request, status);
-    }
-
-    return;
-}
-
-VOID
-ForwardRequestWithCompletion(
-    IN WDFREQUEST Request,
-    IN WDFIOTARGET Target,
-    PFN_WDF_REQUEST_COMPLETION_ROUTINE CompletionFunc
-)
-{
-    BOOLEAN ret;
-    NTSTATUS status;
-
-    //
-    // The following funciton essentially copies the content of
-    // current stack location of the underlying IRP to the next one. 
-    //
-    WdfRequestFormatRequestUsingCurrentType(Request);
-
-    WdfRequestSetCompletionRoutine(Request,
-        CompletionFunc,
-        WDF_NO_CONTEXT);
-
-    ret = WdfRequestSend(Request,
-        Target,
-        WDF_NO_SEND_OPTIONS);
-
-    if (ret == FALSE) {
-        status = WdfRequestGetStatus(Request);
-        KdPrint(("WdfRequestSend failed: 0x%x\n", status));
-        WdfRequestComplete(Request, status);
-    }
-
-    return;
-}
-
-static VOID
-CompletionInternalDevCtl(
-    IN WDFREQUEST                  Request,
-    IN WDFIOTARGET                 Target,
-    PWDF_REQUEST_COMPLETION_PARAMS CompletionParams,
-    IN WDFCONTEXT                  Context
-)
-{
-    UNREFERENCED_PARAMETER(Target);
-    UNREFERENCED_PARAMETER(Context); 
-
-    // Reference, function SrbGetScsiData() in srbhelper.h
-    do
-    {
-        PIO_STACK_LOCATION  irpStack;
-
-        // https://docs.microsoft.com/en-us/windows-hardware/drivers/storage/storage-filter-driver-s-dispatch-routines
-        irpStack = IoGetCurrentIrpStackLocation(WdfRequestWdmGetIrp(Request));
-        if (irpStack == NULL)
-        {
-            DbgPrint("irpStack is null\n");
-            break;
-        }
-
-        //
-        // https://docs.microsoft.com/en-us/windows-hardware/drivers/ddi/content/wdm/ns-wdm-_io_stack_location
-        // 
-        if (irpStack->MajorFunction != IRP_MJ_SCSI) {
-            DbgPrint("%s Major 0x%x minor 0x%x \n", __FUNCTION__, irpStack->MajorFunction, irpStack->MinorFunction);
-            break;
-        }
-
-
-        PSCSI_REQUEST_BLOCK srb;
-        PUCHAR cdb;
-        UCHAR cdbLength;
-        UCHAR scsiStatus;
-        PUCHAR senseData;
-        UCHAR senseDataLength;
-
-        
-        srb = irpStack->Parameters.Scsi.Srb;
-        if (srb == NULL)
-        {
-            DbgPrint("srb is null\n");
-            break;
-        }
-
-        // Could be STORAGE_REQUEST_BLOCK, checking the function field
-        // https://www.osr.com/nt-insider/2014-issue4/win7-vs-win8-storport-miniports/
-        //
-        if (srb->Function == SRB_FUNCTION_EXECUTE_SCSI)
-        {
-            cdb = srb->Cdb;
-            cdbLength = srb->CdbLength;
-            senseData = srb->SenseInfoBuffer;
-            senseDataLength = srb->SenseInfoBufferLength;
-            scsiStatus = srb->ScsiStatus;
-
-            if (cdbLength == 0 || cdbLength > 16)
-            {
-                DbgPrint("CDB %2d bytes, abnormal!!\n", cdbLength);
-                break;
-            }
-
-            DbgPrint("SRB_FUNCTION_EXECUTE_SCSI complete  buffer %p, senseInfoLength %x, status %x \n", srb->SenseInfoBuffer, srb->SenseInfoBufferLength, srb->ScsiStatus);
-
-            SaveCdbToRingBufEx(cdb, cdbLength, senseData, senseDataLength, CompletionParams->IoStatus.Status, scsiStatus);
-        }
-        else if (srb->Function == SRB_FUNCTION_STORAGE_REQUEST_BLOCK)
-        {
-
-            PSTORAGE_REQUEST_BLOCK  storRequestBlock = (PSTORAGE_REQUEST_BLOCK)srb;
-
-            DbgPrint("NumSrbExData %d \n", storRequestBlock->NumSrbExData);
-
-            for (ULONG srbExDataIndex = 0; srbExDataIndex < storRequestBlock->NumSrbExData; srbExDataIndex++)
-            {
-
-                PSRBEX_DATA srbExDataTmp = (PSRBEX_DATA)((PUCHAR)storRequestBlock + storRequestBlock->SrbExDataOffset[srbExDataIndex]);
-                DbgPrint("SrbExType %x \n", srbExDataTmp->Type);
-
-                if (srbExDataTmp->Type == SrbExDataTypeScsiCdb16)
-                {
-                    PSRBEX_DATA_SCSI_CDB16 srbEx = (PSRBEX_DATA_SCSI_CDB16)srbExDataTmp;
-
-                    cdb = srbEx->Cdb;
-                    cdbLength = srbEx->CdbLength;
-                    senseData = srbEx->SenseInfoBuffer;
-                    senseDataLength = srbEx->SenseInfoBufferLength;
-                    scsiStatus = srb->ScsiStatus;
-
-                    DbgPrint("scsi status %x, sensebuf %p, senseLength %d\n", srbEx->ScsiStatus, srbEx->SenseInfoBuffer, srbEx->SenseInfoBufferLength);
-
-                    if (cdbLength == 0 || cdbLength > 16)
-                    {
-                        DbgPrint("CDB %2d bytes, abnormal!!\n", cdbLength);
-                        break;
-                    }
-                }
-                else if (srbExDataTmp->Type == SrbExDataTypeScsiCdb32)
-                {
-                    PSRBEX_DATA_SCSI_CDB32 srbEx = (PSRBEX_DATA_SCSI_CDB32)srbExDataTmp;
-
-                    cdb = srbEx->Cdb;
-                    cdbLength = srbEx->CdbLength;
-                    senseData = srbEx->SenseInfoBuffer;
-                    senseDataLength = srbEx->SenseInfoBufferLength;
-                    scsiStatus = srb->ScsiStatus;
-
-                    DbgPrint("scsi status %x, sensebuf %p, senseLength %d\n", srbEx->ScsiStatus, srbEx->SenseInfoBuffer, srbEx->SenseInfoBufferLength);
-
-                    if (cdbLength == 0 || cdbLength > 32)
-                    {
-                        DbgPrint("CDB %2d bytes, abnormal!!\n", cdbLength);
-                        break;
-                    }
-                }
-                else if (srbExDataTmp->Type == SrbExDataTypeScsiCdbVar)
-                {
-                    PSRBEX_DATA_SCSI_CDB_VAR srbEx = (PSRBEX_DATA_SCSI_CDB_VAR)srbExDataTmp;
-
-                    cdb = srbEx->Cdb;
-                    cdbLength = (srbEx->CdbLength > 255) ? 255 : (UCHAR)srbEx->CdbLength;
-                    senseData = srbEx->SenseInfoBuffer;
-                    senseDataLength = srbEx->SenseInfoBufferLength;
-                    scsiStatus = srb->ScsiStatus;
-
-                    DbgPrint("scsi status %x, sensebuf %p, senseLength %d\n", srbEx->ScsiStatus, srbEx->SenseInfoBuffer, srbEx->SenseInfoBufferLength);
-                    
-
-                    if (cdbLength == 0)
-                    {
-                        DbgPrint("CDB %2d bytes, abnormal!!\n", cdbLength);
-                        break;
-                    }
-                }
-                else {
-                    continue;
-                }
-
-                SaveCdbToRingBufEx(cdb, cdbLength, senseData, senseDataLength, CompletionParams->IoStatus.Status, scsiStatus);
-                // SaveCdbToRingBuf(cdb, cdbLength);
-            }
-        }
-        else
-        {
-            DbgPrint("srb function is 0x%x, not supported\n", srb->Function);
-            break;
-        }
-    } while (FALSE);
-
-    WdfRequestComplete(Request, CompletionParams->IoStatus.Status);
-    return;
-}
-
-VOID
-CompletionDevCtlScsiPassThrDirect(
-    IN WDFREQUEST                  Request,
-    IN WDFIOTARGET                 Target,
-    PWDF_REQUEST_COMPLETION_PARAMS CompletionParams,
-    IN WDFCONTEXT                  Context
-)
-{
-    UNREFERENCED_PARAMETER(Target);
-    UNREFERENCED_PARAMETER(Context);    
-
-    // 
-    // Storage class drivers set the minor IRP number to IRP_MN_SCSI_CLASS to indicate that the request has been processed by a storage class driver. 
-    // Parameters.DeviceIoControl.InputBufferLength indicates the size, in bytes, of the buffer at Irp->AssociatedIrp.SystemBuffer, which must be at least 
-    //  (sense data size + sizeof (SCSI_PASS_THROUGH_DIRECT)). The size of the SCSI_PASS_THROUGH_DIRECT structure is fixed.
-    // For most public I / O control codes, device drivers transfer a small amount of data to or from the buffer at Irp->AssociatedIrp.SystemBuffer.
-    // Reference:
-    //   https://docs.microsoft.com/en-us/windows-hardware/drivers/ddi/content/ntddscsi/ni-ntddscsi-ioctl_scsi_pass_through_direct
-    //   https://docs.microsoft.com/en-us/windows-hardware/drivers/ddi/content/ntddscsi/ns-ntddscsi-_scsi_pass_through_direct
-    //   https://docs.microsoft.com/en-us/windows-hardware/drivers/kernel/irp-mj-device-control
-    //   https://github.com/Microsoft/Windows-driver-samples/blob/master/filesys/fastfat/devctrl.c 
-    //   https://docs.microsoft.com/en-us/windows-hardware/drivers/ddi/content/wdm/ns-wdm-_io_stack_location
-    //   https://docs.microsoft.com/en-us/windows-hardware/drivers/wdf/wdm-equivalents-for-kmdf-buffer-pointers
-    //
-    do {
-        PVOID  buffer;
-        size_t  bufferSize;
-        NTSTATUS status;
-        size_t minSize;
-        PUCHAR pCdb;
-        UCHAR cdbLength;
-        PUCHAR senseData = NULL;
-        UCHAR senseLength = 0;
-        UCHAR scsiStatus;
-        
-        PIRP irp = WdfRequestWdmGetIrp(Request);
-        PIO_STACK_LOCATION  irpStack = IoGetCurrentIrpStackLocation(irp);
-        if (irpStack->MajorFunction != IRP_MJ_DEVICE_CONTROL)
-        {
-            DbgPrint("Not IRP_MJ_DEVICE_CONTROL, type is %d\n", irpStack->MajorFunction);
-            break;
-        }
-
-        if (WdfRequestIsFrom32BitProcess(Request)) {
-            minSize = sizeof(SCSI_PASS_THROUGH_DIRECT32);
-        }
-        else {
-            minSize = sizeof(SCSI_PASS_THROUGH_DIRECT);
-        }
-
-        status = WdfRequestRetrieveInputBuffer(Request, minSize, &buffer, &bufferSize);
-        if (!NT_SUCCESS(status)) {
-            DbgPrint("Cannot get the input buffer\n");
-            break;
-        }
-
-        if (WdfRequestIsFrom32BitProcess(Request)) {
-            PSCSI_PASS_THROUGH_DIRECT32 pScsi = buffer;
-            pCdb = pScsi->Cdb;
-            cdbLength = pScsi->CdbLength;
-            scsiStatus = pScsi->ScsiStatus;
-
-            if (pScsi->SenseInfoLength)
-            {
-                senseData = ((PUCHAR)pScsi + pScsi->SenseInfoOffset);
-                senseLength = pScsi->SenseInfoLength;                
-            }
-
-            DbgPrint("senseLen %d, senseOffset %d, scsiStatus %x \n", pScsi->SenseInfoLength, pScsi->SenseInfoOffset, pScsi->ScsiStatus);
-        }
-        else {
-            PSCSI_PASS_THROUGH_DIRECT pScsi = buffer;
-            pCdb = pScsi->Cdb;
-            cdbLength = pScsi->CdbLength;
-            scsiStatus = pScsi->ScsiStatus;
-
-            if (pScsi->SenseInfoLength)
-            {
-                senseData = ((PUCHAR)pScsi + pScsi->SenseInfoOffset);
-                senseLength = pScsi->SenseInfoLength;
-            }
-
-            DbgPrint("senseLen %d, senseOffset %d, scsiStatus %x \n", pScsi->SenseInfoLength, pScsi->SenseInfoOffset, pScsi->ScsiStatus);            
-        }
-
-        if (cdbLength == 0 || cdbLength > 16)
-        {
-            DbgPrint("CDB %2d bytes, abnormal!!\n", cdbLength);
-            break;
-        }
-
-        //
-        // Save CDB to ring buf
-        //
-        SaveCdbToRingBufEx(pCdb, cdbLength, senseData, senseLength, CompletionParams->IoStatus.Status, scsiStatus);
-
-    } while (FALSE);
-
-    WdfRequestComplete(Request, CompletionParams->IoStatus.Status);
-
-    return;
-}
-
-VOID 
-DbgPrintCdb(PUCHAR pCdb, UCHAR CdbLength)
-{
-    char dbgBuffer[100];
-    char *pBufferPos = dbgBuffer;
-    for (UCHAR i = 0; i < CdbLength; i++)
-    {
-        RtlStringCchPrintfA(pBufferPos, 3 + 1, " %02x", pCdb[i]);
-        pBufferPos += 3;
-    }
-    pBufferPos[0] = 0;
-    DbgPrint("%s \n", dbgBuffer);
-}
-
-BOOLEAN
-GetByteFromRingBuf(PUCHAR Data)
-{
-    BOOLEAN success;
-    WdfSpinLockAcquire(CdbBufSpinLock);
-
-    success = RingBufGet(Data);
-
-    WdfSpinLockRelease(CdbBufSpinLock);
-
-    return success;
-}
-
-VOID
-SaveCdbToRingBuf(PUCHAR Cdb, UCHAR CdbLength)
-{
-    SaveCdbToRingBufEx(Cdb, CdbLength, NULL, 0, 0, 0);
-}
-
-VOID 
-SaveCdbToRingBufEx(PUCHAR Cdb, UCHAR CdbLength, PUCHAR SenseData, UCHAR SenseDataLength, NTSTATUS ntStatus, UCHAR scsiStatus)
-{
-    WdfSpinLockAcquire(CdbBufSpinLock);
-
-    DbgPrintCdb(Cdb, CdbLength);
-
-    // TODO: make the copy faster, not one byte by one byte
-    // Save data to CDB info to ring buffer
-
-    // Magic number 0xDEAF
-    RingBufPut(0xDE); 
-    RingBufPut(0xAF);
-
-    // NtStatus code
-    RingBufPutEx((PUCHAR)&ntStatus, sizeof(NTSTATUS));
-    
-    // ScsiStatus
-    RingBufPut(scsiStatus);
-    
-    // CDB length
-    RingBufPut(CdbLength);
-
-    // Sense Data length
-    RingBufPut(SenseDataLength);
-
-    // CDB data
-    RingBufPutEx(Cdb, CdbLength);
-
-    // Sense data (if any)
-    if (SenseDataLength)
-    {
-        ASSERT(SenseData);
-
-        // raw data
-        RingBufPutEx(SenseData, SenseDataLength);
-    }
-
-    WdfSpinLockRelease(CdbBufSpinLock);
-}
-
-
-//-------------------------------------------------------
-// Function Implementation, For control device queue
-//-------------------------------------------------------
-NTSTATUS
-StorTraceControlDeviceQueueInitialize(
-    _In_ WDFDEVICE Device
-)
-{
-    WDFQUEUE queue;
-    NTSTATUS status;
-    WDF_IO_QUEUE_CONFIG queueConfig;
-    WDF_OBJECT_ATTRIBUTES  queueAttributes;
-
-    //
-    // Configure the default queue associated with the control device object
-    // to be Serial so that request passed to EvtIoDeviceControl are serialized.
-    //
-    WDF_IO_QUEUE_CONFIG_INIT_DEFAULT_QUEUE(&queueConfig,
-        WdfIoQueueDispatchSequential);
-
-    queueConfig.EvtIoDeviceControl = ControlDeviceEvtIoDeviceControl;
-    queueConfig.EvtIoRead = ControlDeviceEvtIoRead;
-    queueConfig.EvtIoWrite = ControlDeviceEvtIoWrite;
-
-    WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&queueAttributes, QUEUE_CONTEXT);
-    queueAttributes.SynchronizationScope = WdfSynchronizationScopeQueue;
-
-    //
-    // Framework by default creates non-power managed queues for
-    // filter drivers.
-    //
-    status = WdfIoQueueCreate(Device,
-        &queueConfig,
-        &queueAttributes,
-        &queue // pointer to default queue
-    );
-    if (!NT_SUCCESS(status)) {
-        DbgPrint("Failed to create Io Queue for controldevice\n");
-        return status;
-    }
-
-    return status;
-}
-
-
-VOID
-ControlDeviceEvtIoDeviceControl(
-    _In_ WDFQUEUE Queue,
-    _In_ WDFREQUEST Request,
-    _In_ size_t OutputBufferLength,
-    _In_ size_t InputBufferLength,
-    _In_ ULONG IoControlCode
-)
-{
-    
-    ULONG               i;
-    ULONG               noItems;
-    WDFDEVICE           hDevice;
-    PDEVICE_CONTEXT     deviceContext;
-    
-    UNREFERENCED_PARAMETER(Queue);
-    UNREFERENCED_PARAMETER(OutputBufferLength);
-    UNREFERENCED_PARAMETER(InputBufferLength);
-    UNREFERENCED_PARAMETER(IoControlCode);
-
-    
-    // DbgPrint("%s.\n", __FUNCTION__);
-
-    WdfWaitLockAcquire(DeviceCollectionLock, NULL);
-
-    noItems = WdfCollectionGetCount(DeviceCollection);
-
-    for (i = 0; i<noItems; i++) {
-
-        hDevice = WdfCollectionGetItem(DeviceCollection, i);
-
-        deviceContext = DeviceGetContext(hDevice);
-
-        DbgPrint("Device Serial No: 0x%x\n", deviceContext->SerialNo);
-    }
-
-    WdfWaitLockRelease(DeviceCollectionLock);
-    
-
-    WdfRequestCompleteWithInformation(Request, STATUS_SUCCESS, 0);
-}
-
-VOID
-ControlDeviceEvtIoWrite(
-    _In_     WDFQUEUE Queue,
-    _In_    WDFREQUEST Request,
-    _In_    size_t Length
-)
-{
-    WDFDEVICE                       device;
-    NTSTATUS       status = STATUS_SUCCESS;
-
-    device = WdfIoQueueGetDevice(Queue);
-    DbgPrint("%s, length 0x%x \n", __FUNCTION__, Length);
-
-    Length = 0L;
-    WdfRequestSetInformation(Request, (ULONG_PTR)0);    
-
-    WdfRequestComplete(Request, status);
-    return;
-}
-
-VOID
-ControlDeviceEvtIoRead(
-    _In_     WDFQUEUE Queue,
-    _In_    WDFREQUEST Request,
-    _In_    size_t Length
-)
-{
-    WDFDEVICE device;
-    NTSTATUS status = STATUS_SUCCESS;
-    WDFMEMORY memory;
-
-    device = WdfIoQueueGetDevice(Queue);
-    // DbgPrint("%s, length 0x%x", __FUNCTION__, Length);
-    
-    status = WdfRequestRetrieveOutputMemory(Request, &memory);
-
-    if (!NT_SUCCESS(status)) {
-        KdPrint(("EchoEvtIoRead Could not get request memory buffer 0x%x\n", status));
-        WdfVerifierDbgBreakPoint();
-        WdfRequestCompleteWithInformation(Request, status, 0L);
-        return;
-    }
-
-    // Copy data byte by byte
-    // TODO: optimize it        
-    size_t copied;
-    for (copied = 0; copied < Length; copied++) {
-        UCHAR data; 
-        if (!GetByteFromRingBuf(&data)) {
-            break;
-        }
-        // Copy the memory out
-        status = WdfMemoryCopyFromBuffer(
-            memory,     // destination
-            copied,     // offset into the destination memory
-            &data,      // source
-            1);         // copy one byte
-        if (!NT_SUCCESS(status)) {
-            KdPrint(("EchoEvtIoRead: WdfMemoryCopyFromBuffer failed 0x%x\n", status));
-            break;
-        }
-    }
-
-    // 
-    // Set how many bytes are copied
-    WdfRequestSetInformation(Request, (ULONG_PTR)copied);
-    
-    WdfRequestComplete(Request, status);
-
-    return;
-}
+/*++
+
+Module Name:
+
+    queue.c
+
+Abstract:
+
+    This file contains the queue entry points and callbacks.
+
+Environment:
+
+    Kernel-mode Driver Framework
+
+--*/
+
+#include "driver.h"
+#include "queue.tmh"
+
+#include "srb.h"
+#include "ntstrsafe.h"
+#include "ntddscsi.h"
+#include "scsi.h"
+#include "srbhelper.h"
+
+#include "TraceBuf.h"
+
+//-------------------------------------------------------
+// Macro
+//-------------------------------------------------------
+#define MIN(X, Y) (((X) < (Y)) ? (X) : (Y))
+
+//-------------------------------------------------------
+// Function Decldaration
+//-------------------------------------------------------
+static VOID
+ForwardRequest(
+    IN WDFREQUEST Request,
+    IN WDFIOTARGET Target
+);
+
+static VOID
+ForwardRequestWithCompletion(
+    IN WDFREQUEST Request,
+    IN WDFIOTARGET Target,
+    IN PFN_WDF_REQUEST_COMPLETION_ROUTINE CompletionFunc,
+    IN WDFCONTEXT Context
+);
+
+static VOID
+CompletionDevCtlScsiPassThrDirect(
+    IN WDFREQUEST                  Request,
+    IN WDFIOTARGET                 Target,
+    PWDF_REQUEST_COMPLETION_PARAMS CompletionParams,
+    IN WDFCONTEXT                  Context
+);
+
+static VOID
+CompletionInternalDevCtl(
+    IN WDFREQUEST                  Request,
+    IN WDFIOTARGET                 Target,
+    PWDF_REQUEST_COMPLETION_PARAMS CompletionParams,
+    IN WDFCONTEXT                  Context
+);
+
+static VOID
+CompletionReadWrite(
+    IN WDFREQUEST                  Request,
+    IN WDFIOTARGET                 Target,
+    PWDF_REQUEST_COMPLETION_PARAMS CompletionParams,
+    IN WDFCONTEXT                  Context
+);
+
+
+static VOID
+ControlDeviceEvtIoDeviceControl(
+    _In_ WDFQUEUE Queue,
+    _In_ WDFREQUEST Request,
+    _In_ size_t OutputBufferLength,
+    _In_ size_t InputBufferLength,
+    _In_ ULONG IoControlCode
+);
+
+static NTSTATUS
+MapTraceRing(
+    _In_ WDFREQUEST Request
+);
+
+static NTSTATUS
+ResizeTraceBufs(
+    _In_ ULONG DeviceId,
+    _In_ size_t Size
+);
+
+static NTSTATUS
+ResizeTraceBuf(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ size_t Size
+);
+
+static VOID
+RestartReadBatch(
+    _In_ PDEVICE_CONTEXT DeviceContext
+);
+
+static size_t
+ReadTraceBufs(
+    _In_ PCONTROL_FILE_CONTEXT FileContext,
+    _Out_writes_bytes_(BufferLength) PUCHAR Buffer,
+    _In_ size_t BufferLength
+);
+
+static size_t
+TakeTrace(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _Out_writes_bytes_(BufferLength) PUCHAR Buffer,
+    _In_ size_t BufferLength
+);
+
+static BOOLEAN
+AnyTraceReady(
+    _In_ BOOLEAN Flush
+);
+
+static VOID
+ServicePendingReads(
+    _In_ BOOLEAN Flush
+);
+
+static ULONG
+ParkedReadCount(
+    _In_ ULONG Queue
+);
+
+static PVOID
+RetrieveParkedRead(
+    _In_ ULONG Queue
+);
+
+static NTSTATUS
+ParkRead(
+    _In_ PVOID Read,
+    _In_ ULONG Queue
+);
+
+static size_t
+FillRead(
+    _In_ PVOID Read
+);
+
+static VOID
+CompleteRead(
+    _In_ PVOID Read,
+    _In_ NTSTATUS Status,
+    _In_ size_t Information
+);
+
+static EVT_WDF_WORKITEM ReadWorkItemCallback;
+static EVT_WDF_TIMER FlushTimerCallback;
+
+static VOID
+DbgPrintCdb(_In_ PUCHAR pCdb, _In_ UCHAR CdbLength);
+
+static VOID
+SaveCdbToRingBufEx(_In_ PDEVICE_CONTEXT DeviceContext, _In_ ULONG64 IssueTime, _In_ PUCHAR pCdb, _In_ UCHAR CdbLength, _In_ PUCHAR SenseData, _In_ UCHAR SenseDataLength, _In_ NTSTATUS ntStatus, _In_ UCHAR scsiStatus, _In_ ULONG DataTransferLength);
+
+static VOID
+SaveCdbToRingBuf(_In_ PDEVICE_CONTEXT DeviceContext, _In_ PUCHAR pCdb, _In_ UCHAR CdbLength);
+
+static VOID
+SaveRequestToRingBuf(_In_ PDEVICE_CONTEXT DeviceContext, _In_ ULONG64 IssueTime, _In_ UCHAR MajorFunction, _In_ LONGLONG Offset, _In_ ULONG Length, _In_ NTSTATUS ntStatus, _In_ ULONG_PTR Information);
+
+static VOID
+PutTraceRecord(_In_ PDEVICE_CONTEXT DeviceContext, _Inout_ PTRACE_RECORD_HEADER Record);
+
+//-------------------------------------------------------
+// Imported Function & Variable Declaration
+//-------------------------------------------------------
+extern WDFCOLLECTION   DeviceCollection;
+extern WDFWAITLOCK     DeviceCollectionLock;
+extern READ_BATCH_CONFIG ReadBatchConfig;
+extern BOOLEAN         PerCpuTraceBuffer;
+extern ULONG           TraceBufOverflowPolicy;
+extern ULONG           TraceBufDefaultSize;
+extern STORTRACE_CAPTURE_FILTER DefaultCaptureFilter;
+extern STORTRACE_SAMPLING DefaultSampling;
+extern ULONG           DefaultCaptureMode;
+
+//-------------------------------------------------------
+// Variable Definition
+//-------------------------------------------------------
+//
+// Reads on the control device wait in PendingReadQueue until
+// ServicePendingReads completes them: on arrival, when a device reaches a
+// watermark (ReadWorkItem), or when FlushTimer expires. A pass puts the
+// reads it has nothing for in AsideReadQueue meanwhile (ReadBatchService).
+//
+static WDFQUEUE        PendingReadQueue = NULL;
+static WDFQUEUE        AsideReadQueue = NULL;
+static WDFWAITLOCK     PendingReadLock = NULL;
+static WDFTIMER        FlushTimer = NULL;
+static WDFWORKITEM     ReadWorkItem = NULL;
+static volatile LONG   FlushTimerArmed = FALSE;
+static volatile LONG   FlushRequested = FALSE;
+
+
+//-------------------------------------------------------
+// Function Implementation, For filter device queue
+//-------------------------------------------------------
+NTSTATUS
+StorTraceQueueInitialize(
+    _In_ WDFDEVICE Device
+    )
+{
+    WDFQUEUE queue;
+    NTSTATUS status;
+    WDF_IO_QUEUE_CONFIG queueConfig;
+    
+
+    //
+    // Configure a default queue so that requests that are not
+    // configure-fowarded using WdfDeviceConfigureRequestDispatching to goto
+    // other queues get dispatched here.
+    //
+    WDF_IO_QUEUE_CONFIG_INIT_DEFAULT_QUEUE(
+         &queueConfig,
+        WdfIoQueueDispatchParallel
+        );
+
+    // we need to handle IRP_MJ_INTERNAL_DEVICE_CONTROL which is also IRP_MJ_SCSI
+    // queueConfig.EvtIoInternalDeviceControl = ....
+    queueConfig.EvtIoDeviceControl = StorTraceEvtIoDeviceControl;
+    queueConfig.EvtIoStop = StorTraceEvtIoStop;
+    queueConfig.EvtIoInternalDeviceControl = StorTraceEvtIoInternalDeviceControl;
+    queueConfig.EvtIoRead = StorTraceEvtIoRead;
+    queueConfig.EvtIoWrite = StorTraceEvtIoWrite;
+
+    status = WdfIoQueueCreate(
+                 Device,
+                 &queueConfig,
+                 WDF_NO_OBJECT_ATTRIBUTES,
+                 &queue
+                 );
+     
+    if(!NT_SUCCESS(status)) {
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_QUEUE, "WdfIoQueueCreate failed %!STATUS!", status);
+        return status;
+    }
+
+    return status;
+}
+
+VOID
+StorTraceEvtIoRead(
+    _In_    WDFQUEUE Queue,
+    _In_    WDFREQUEST Request,
+    _In_    size_t Length
+)
+{
+    WDFDEVICE                       device;
+    PDEVICE_CONTEXT                 deviceContext;
+
+    device = WdfIoQueueGetDevice(Queue);
+    deviceContext = DeviceGetContext(device);
+    VerbosePrint(STORTRACE_VERBOSITY_IO, ("%s, length 0x%x \n", __FUNCTION__, (int)Length));
+
+    // Fire and forget unless the request is traced
+    if (ReadAcquire(&deviceContext->CaptureMode) & STORTRACE_CAPTURE_REQUESTS) {
+        ForwardRequestWithCompletion(Request, WdfDeviceGetIoTarget(device), CompletionReadWrite, deviceContext);
+    }
+    else {
+        ForwardRequest(Request, WdfDeviceGetIoTarget(device));
+    }
+
+    return;
+}
+
+VOID
+StorTraceEvtIoWrite(
+    _In_    WDFQUEUE Queue,
+    _In_    WDFREQUEST Request,
+    _In_    size_t Length
+)
+{
+    WDFDEVICE                       device;
+    PDEVICE_CONTEXT                 deviceContext;
+
+    device = WdfIoQueueGetDevice(Queue);
+    deviceContext = DeviceGetContext(device);
+    VerbosePrint(STORTRACE_VERBOSITY_IO, ("%s, length 0x%x \n", __FUNCTION__, (int)Length));
+
+    // Fire and forget unless the request is traced
+    if (ReadAcquire(&deviceContext->CaptureMode) & STORTRACE_CAPTURE_REQUESTS) {
+        ForwardRequestWithCompletion(Request, WdfDeviceGetIoTarget(device), CompletionReadWrite, deviceContext);
+    }
+    else {
+        ForwardRequest(Request, WdfDeviceGetIoTarget(device));
+    }
+
+    return;
+}
+
+
+VOID
+StorTraceEvtIoInternalDeviceControl(
+    _In_ WDFQUEUE Queue,
+    _In_ WDFREQUEST Request,
+    _In_ size_t OutputBufferLength,
+    _In_ size_t InputBufferLength,
+    _In_ ULONG IoControlCode
+)
+{
+    WDFDEVICE  device = WdfIoQueueGetDevice(Queue);
+    
+    UNREFERENCED_PARAMETER(OutputBufferLength);
+    UNREFERENCED_PARAMETER(InputBufferLength);
+    UNREFERENCED_PARAMETER(IoControlCode);    
+
+    // IoControlCode here is normally 0
+    VerbosePrint(STORTRACE_VERBOSITY_IO, ("%s IoControl Code %x \n", __FUNCTION__, IoControlCode));
+              
+    ForwardRequestWithCompletion(Request, WdfDeviceGetIoTarget(device), CompletionInternalDevCtl, DeviceGetContext(device));
+    
+    return;
+}
+
+VOID
+StorTraceEvtIoDeviceControl(
+    _In_ WDFQUEUE Queue,
+    _In_ WDFREQUEST Request,
+    _In_ size_t OutputBufferLength,
+    _In_ size_t InputBufferLength,
+    _In_ ULONG IoControlCode
+)
+/*++
+
+Routine Description:
+
+    This event is invoked when the framework receives IRP_MJ_DEVICE_CONTROL request.
+
+Arguments:
+
+    Queue -  Handle to the framework queue object that is associated with the
+             I/O request.
+
+    Request - Handle to a framework request object.
+
+    OutputBufferLength - Size of the output buffer in bytes
+
+    InputBufferLength - Size of the input buffer in bytes
+
+    IoControlCode - I/O control code.
+
+Return Value:
+
+    VOID
+
+--*/
+{
+    WDFDEVICE device;
+    
+    if (VERBOSITY_ENABLED(STORTRACE_VERBOSITY_IO)) {
+        TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_QUEUE, "%!FUNC! Queue 0x%p, Request 0x%p OutputBufferLength %d InputBufferLength %d IoControlCode %d", Queue, Request, (int)OutputBufferLength, (int)InputBufferLength, IoControlCode);
+    }
+
+    device = WdfIoQueueGetDevice(Queue);
+
+
+    if (IoControlCode == IOCTL_SCSI_PASS_THROUGH_DIRECT) {
+        ForwardRequestWithCompletion(Request, WdfDeviceGetIoTarget(device), CompletionDevCtlScsiPassThrDirect, DeviceGetContext(device));        
+    }
+    else
+    {
+        VerbosePrint(STORTRACE_VERBOSITY_IO, ("IoControlCode 0x%x, not IOCTL_SCSI_PASS_THROUGH_DIRECT\n", IoControlCode));
+        ForwardRequest(Request, WdfDeviceGetIoTarget(device));
+    }        
+
+    return;
+}
+
+VOID
+StorTraceEvtIoStop(
+    _In_ WDFQUEUE Queue,
+    _In_ WDFREQUEST Request,
+    _In_ ULONG ActionFlags
+)
+/*++
+
+Routine Description:
+
+    This event is invoked for a power-managed queue before the device leaves the working state (D0).
+
+Arguments:
+
+    Queue -  Handle to the framework queue object that is associated with the
+             I/O request.
+
+    Request - Handle to a framework request object.
+
+    ActionFlags - A bitwise OR of one or more WDF_REQUEST_STOP_ACTION_FLAGS-typed flags
+                  that identify the reason that the callback function is being called
+                  and whether the request is cancelable.
+
+Return Value:
+
+    VOID
+
+--*/
+{
+    TraceEvents(TRACE_LEVEL_INFORMATION, 
+                TRACE_QUEUE, 
+                "%!FUNC! Queue 0x%p, Request 0x%p ActionFlags %d", 
+                Queue, Request, ActionFlags);
+
+    //
+    // In most cases, the EvtIoStop callback function completes, cancels, or postpones
+    // further processing of the I/O request.
+    //
+    // Typically, the driver uses the following rules:
+    //
+    // - If the driver owns the I/O request, it calls WdfRequestUnmarkCancelable
+    //   (if the request is cancelable) and either calls WdfRequestStopAcknowledge
+    //   with a Requeue value of TRUE, or it calls WdfRequestComplete with a
+    //   completion status value of STATUS_SUCCESS or STATUS_CANCELLED.
+    //
+    //   Before it can call these methods safely, the driver must make sure that
+    //   its implementation of EvtIoStop has exclusive access to the request.
+    //
+    //   In order to do that, the driver must synchronize access to the request
+    //   to prevent other threads from manipulating the request concurrently.
+    //   The synchronization method you choose will depend on your driver's design.
+    //
+    //   For example, if the request is held in a shared context, the EvtIoStop callback
+    //   might acquire an internal driver lock, take the request from the shared context,
+    //   and then release the lock. At this point, the EvtIoStop callback owns the request
+    //   and can safely complete or requeue the request.
+    //
+    // - If the driver has forwarded the I/O request to an I/O target, it either calls
+    //   WdfRequestCancelSentRequest to attempt to cancel the request, or it postpones
+    //   further processing of the request and calls WdfRequestStopAcknowledge with
+    //   a Requeue value of FALSE.
+    //
+    // A driver might choose to take no action in EvtIoStop for requests that are
+    // guaranteed to complete in a small amount of time.
+    //
+    // In this case, the framework waits until the specified request is complete
+    // before moving the device (or system) to a lower power state or removing the device.
+    // Potentially, this inaction can prevent a system from entering its hibernation state
+    // or another low system power state. In extreme cases, it can cause the system
+    // to crash with bugcheck code 9F.
+    //
+
+    return;
+}
+
+
+VOID
+ForwardRequest(
+    IN WDFREQUEST Request,
+    IN WDFIOTARGET Target
+)
+{
+    WDF_REQUEST_SEND_OPTIONS options;
+    BOOLEAN ret;
+    NTSTATUS status;
+
+    //
+    // We are not interested in post processing the IRP so 
+    // fire and forget.
+    //
+    WDF_REQUEST_SEND_OPTIONS_INIT(&options,
+        WDF_REQUEST_SEND_OPTION_SEND_AND_FORGET);
+
+    ret = WdfRequestSend(Request, Target, &options);    
+
+    if (ret == FALSE) {
+        status = WdfRequestGetStatus(Request);
+        KdPrint(("WdfRequestSend failed: 0x%x\n", status));
+        WdfRequestComplete(Request, status);
+    }
+
+    return;
+}
+
+VOID
+ForwardRequestWithCompletion(
+    IN WDFREQUEST Request,
+    IN WDFIOTARGET Target,
+    PFN_WDF_REQUEST_COMPLETION_ROUTINE CompletionFunc,
+    IN WDFCONTEXT Context
+)
+{
+    BOOLEAN ret;
+    NTSTATUS status;
+
+    //
+    // The following funciton essentially copies the content of
+    // current stack location of the underlying IRP to the next one. 
+    //
+    WdfRequestFormatRequestUsingCurrentType(Request);
+
+    WdfRequestSetCompletionRoutine(Request,
+        CompletionFunc,
+        Context);
+
+    //
+    // Latency is measured from here, as late as possible before the
+    // request goes down
+    //
+    RequestGetContext(Request)->IssueTime = (ULONG64)KeQueryPerformanceCounter(NULL).QuadPart;
+
+    ret = WdfRequestSend(Request,
+        Target,
+        WDF_NO_SEND_OPTIONS);
+
+    if (ret == FALSE) {
+        status = WdfRequestGetStatus(Request);
+        KdPrint(("WdfRequestSend failed: 0x%x\n", status));
+        WdfRequestComplete(Request, status);
+    }
+
+    return;
+}
+
+static VOID
+CompletionInternalDevCtl(
+    IN WDFREQUEST                  Request,
+    IN WDFIOTARGET                 Target,
+    PWDF_REQUEST_COMPLETION_PARAMS CompletionParams,
+    IN WDFCONTEXT                  Context
+)
+{
+    PDEVICE_CONTEXT deviceContext = (PDEVICE_CONTEXT)Context;
+
+    UNREFERENCED_PARAMETER(Target);
+
+    // Reference, function SrbGetScsiData() in srbhelper.h
+    do
+    {
+        PIO_STACK_LOCATION  irpStack;
+
+        // https://docs.microsoft.com/en-us/windows-hardware/drivers/storage/storage-filter-driver-s-dispatch-routines
+        irpStack = IoGetCurrentIrpStackLocation(WdfRequestWdmGetIrp(Request));
+        if (irpStack == NULL)
+        {
+            VerbosePrint(STORTRACE_VERBOSITY_IO, ("irpStack is null\n"));
+            break;
+        }
+
+        //
+        // https://docs.microsoft.com/en-us/windows-hardware/drivers/ddi/content/wdm/ns-wdm-_io_stack_location
+        // 
+        if (irpStack->MajorFunction != IRP_MJ_SCSI) {
+            VerbosePrint(STORTRACE_VERBOSITY_IO, ("%s Major 0x%x minor 0x%x \n", __FUNCTION__, irpStack->MajorFunction, irpStack->MinorFunction));
+            break;
+        }
+
+
+        PSCSI_REQUEST_BLOCK srb;
+        PUCHAR cdb;
+        UCHAR cdbLength;
+        UCHAR scsiStatus;
+        PUCHAR senseData;
+        UCHAR senseDataLength;
+
+        
+        srb = irpStack->Parameters.Scsi.Srb;
+        if (srb == NULL)
+        {
+            VerbosePrint(STORTRACE_VERBOSITY_IO, ("srb is null\n"));
+            break;
+        }
+
+        // Could be STORAGE_REQUEST_BLOCK, checking the function field
+        // https://www.osr.com/nt-insider/2014-issue4/win7-vs-win8-storport-miniports/
+        //
+        if (srb->Function == SRB_FUNCTION_EXECUTE_SCSI)
+        {
+            cdb = srb->Cdb;
+            cdbLength = srb->CdbLength;
+            senseData = srb->SenseInfoBuffer;
+            senseDataLength = srb->SenseInfoBufferLength;
+            scsiStatus = srb->ScsiStatus;
+
+            if (cdbLength == 0 || cdbLength > 16)
+            {
+                VerbosePrint(STORTRACE_VERBOSITY_IO, ("CDB %2d bytes, abnormal!!\n", cdbLength));
+                break;
+            }
+
+            VerbosePrint(STORTRACE_VERBOSITY_CDB, ("SRB_FUNCTION_EXECUTE_SCSI complete  buffer %p, senseInfoLength %x, status %x \n", srb->SenseInfoBuffer, srb->SenseInfoBufferLength, srb->ScsiStatus));
+
+            SaveCdbToRingBufEx(deviceContext, RequestGetContext(Request)->IssueTime, cdb, cdbLength, senseData, senseDataLength, CompletionParams->IoStatus.Status, scsiStatus, srb->DataTransferLength);
+        }
+        else if (srb->Function == SRB_FUNCTION_STORAGE_REQUEST_BLOCK)
+        {
+
+            PSTORAGE_REQUEST_BLOCK  storRequestBlock = (PSTORAGE_REQUEST_BLOCK)srb;
+
+            VerbosePrint(STORTRACE_VERBOSITY_CDB, ("NumSrbExData %d \n", storRequestBlock->NumSrbExData));
+
+            for (ULONG srbExDataIndex = 0; srbExDataIndex < storRequestBlock->NumSrbExData; srbExDataIndex++)
+            {
+
+                PSRBEX_DATA srbExDataTmp = (PSRBEX_DATA)((PUCHAR)storRequestBlock + storRequestBlock->SrbExDataOffset[srbExDataIndex]);
+                VerbosePrint(STORTRACE_VERBOSITY_CDB, ("SrbExType %x \n", srbExDataTmp->Type));
+
+                if (srbExDataTmp->Type == SrbExDataTypeScsiCdb16)
+                {
+                    PSRBEX_DATA_SCSI_CDB16 srbEx = (PSRBEX_DATA_SCSI_CDB16)srbExDataTmp;
+
+                    cdb = srbEx->Cdb;
+                    cdbLength = srbEx->CdbLength;
+                    senseData = srbEx->SenseInfoBuffer;
+                    senseDataLength = srbEx->SenseInfoBufferLength;
+                    scsiStatus = srb->ScsiStatus;
+
+                    VerbosePrint(STORTRACE_VERBOSITY_CDB, ("scsi status %x, sensebuf %p, senseLength %d\n", srbEx->ScsiStatus, srbEx->SenseInfoBuffer, srbEx->SenseInfoBufferLength));
+
+                    if (cdbLength == 0 || cdbLength > 16)
+                    {
+                        VerbosePrint(STORTRACE_VERBOSITY_IO, ("CDB %2d bytes, abnormal!!\n", cdbLength));
+                        break;
+                    }
+                }
+                else if (srbExDataTmp->Type == SrbExDataTypeScsiCdb32)
+                {
+                    PSRBEX_DATA_SCSI_CDB32 srbEx = (PSRBEX_DATA_SCSI_CDB32)srbExDataTmp;
+
+                    cdb = srbEx->Cdb;
+                    cdbLength = srbEx->CdbLength;
+                    senseData = srbEx->SenseInfoBuffer;
+                    senseDataLength = srbEx->SenseInfoBufferLength;
+                    scsiStatus = srb->ScsiStatus;
+
+                    VerbosePrint(STORTRACE_VERBOSITY_CDB, ("scsi status %x, sensebuf %p, senseLength %d\n", srbEx->ScsiStatus, srbEx->SenseInfoBuffer, srbEx->SenseInfoBufferLength));
+
+                    if (cdbLength == 0 || cdbLength > 32)
+                    {
+                        VerbosePrint(STORTRACE_VERBOSITY_IO, ("CDB %2d bytes, abnormal!!\n", cdbLength));
+                        break;
+                    }
+                }
+                else if (srbExDataTmp->Type == SrbExDataTypeScsiCdbVar)
+                {
+                    PSRBEX_DATA_SCSI_CDB_VAR srbEx = (PSRBEX_DATA_SCSI_CDB_VAR)srbExDataTmp;
+
+                    cdb = srbEx->Cdb;
+                    cdbLength = (srbEx->CdbLength > 255) ? 255 : (UCHAR)srbEx->CdbLength;
+                    senseData = srbEx->SenseInfoBuffer;
+                    senseDataLength = srbEx->SenseInfoBufferLength;
+                    scsiStatus = srb->ScsiStatus;
+
+                    VerbosePrint(STORTRACE_VERBOSITY_CDB, ("scsi status %x, sensebuf %p, senseLength %d\n", srbEx->ScsiStatus, srbEx->SenseInfoBuffer, srbEx->SenseInfoBufferLength));
+                    
+
+                    if (cdbLength == 0)
+                    {
+                        VerbosePrint(STORTRACE_VERBOSITY_IO, ("CDB %2d bytes, abnormal!!\n", cdbLength));
+                        break;
+                    }
+                }
+                else {
+                    continue;
+                }
+
+                SaveCdbToRingBufEx(deviceContext, RequestGetContext(Request)->IssueTime, cdb, cdbLength, senseData, senseDataLength, CompletionParams->IoStatus.Status, scsiStatus, storRequestBlock->DataTransferLength);
+                // SaveCdbToRingBuf(cdb, cdbLength);
+            }
+        }
+        else
+        {
+            VerbosePrint(STORTRACE_VERBOSITY_IO, ("srb function is 0x%x, not supported\n", srb->Function));
+            break;
+        }
+    } while (FALSE);
+
+    WdfRequestComplete(Request, CompletionParams->IoStatus.Status);
+    return;
+}
+
+static VOID
+CompletionReadWrite(
+    IN WDFREQUEST                  Request,
+    IN WDFIOTARGET                 Target,
+    PWDF_REQUEST_COMPLETION_PARAMS CompletionParams,
+    IN WDFCONTEXT                  Context
+)
+{
+    PDEVICE_CONTEXT deviceContext = (PDEVICE_CONTEXT)Context;
+    WDF_REQUEST_PARAMETERS params;
+
+    UNREFERENCED_PARAMETER(Target);
+
+    // The current stack location is still the one the request came down with
+    WDF_REQUEST_PARAMETERS_INIT(&params);
+    WdfRequestGetParameters(Request, &params);
+
+    if (params.Type == WdfRequestTypeRead)
+    {
+        SaveRequestToRingBuf(deviceContext, RequestGetContext(Request)->IssueTime, TRACE_RECORD_REQUEST_READ,
+            params.Parameters.Read.DeviceOffset, (ULONG)params.Parameters.Read.Length,
+            CompletionParams->IoStatus.Status, CompletionParams->IoStatus.Information);
+    }
+    else if (params.Type == WdfRequestTypeWrite)
+    {
+        SaveRequestToRingBuf(deviceContext, RequestGetContext(Request)->IssueTime, TRACE_RECORD_REQUEST_WRITE,
+            params.Parameters.Write.DeviceOffset, (ULONG)params.Parameters.Write.Length,
+            CompletionParams->IoStatus.Status, CompletionParams->IoStatus.Information);
+    }
+
+    // The bytes transferred go up too
+    WdfRequestCompleteWithInformation(Request, CompletionParams->IoStatus.Status, CompletionParams->IoStatus.Information);
+    return;
+}
+
+VOID
+CompletionDevCtlScsiPassThrDirect(
+    IN WDFREQUEST                  Request,
+    IN WDFIOTARGET                 Target,
+    PWDF_REQUEST_COMPLETION_PARAMS CompletionParams,
+    IN WDFCONTEXT                  Context
+)
+{
+    PDEVICE_CONTEXT deviceContext = (PDEVICE_CONTEXT)Context;
+
+    UNREFERENCED_PARAMETER(Target);
+
+    // 
+    // Storage class drivers set the minor IRP number to IRP_MN_SCSI_CLASS to indicate that the request has been processed by a storage class driver. 
+    // Parameters.DeviceIoControl.InputBufferLength indicates the size, in bytes, of the buffer at Irp->AssociatedIrp.SystemBuffer, which must be at least 
+    //  (sense data size + sizeof (SCSI_PASS_THROUGH_DIRECT)). The size of the SCSI_PASS_THROUGH_DIRECT structure is fixed.
+    // For most public I / O control codes, device drivers transfer a small amount of data to or from the buffer at Irp->AssociatedIrp.SystemBuffer.
+    // Reference:
+    //   https://docs.microsoft.com/en-us/windows-hardware/drivers/ddi/content/ntddscsi/ni-ntddscsi-ioctl_scsi_pass_through_direct
+    //   https://docs.microsoft.com/en-us/windows-hardware/drivers/ddi/content/ntddscsi/ns-ntddscsi-_scsi_pass_through_direct
+    //   https://docs.microsoft.com/en-us/windows-hardware/drivers/kernel/irp-mj-device-control
+    //   https://github.com/Microsoft/Windows-driver-samples/blob/master/filesys/fastfat/devctrl.c 
+    //   https://docs.microsoft.com/en-us/windows-hardware/drivers/ddi/content/wdm/ns-wdm-_io_stack_location
+    //   https://docs.microsoft.com/en-us/windows-hardware/drivers/wdf/wdm-equivalents-for-kmdf-buffer-pointers
+    //
+    do {
+        PVOID  buffer;
+        size_t  bufferSize;
+        NTSTATUS status;
+        size_t minSize;
+        PUCHAR pCdb;
+        UCHAR cdbLength;
+        PUCHAR senseData = NULL;
+        UCHAR senseLength = 0;
+        UCHAR scsiStatus;
+        ULONG dataTransferLength;
+        
+        PIRP irp = WdfRequestWdmGetIrp(Request);
+        PIO_STACK_LOCATION  irpStack = IoGetCurrentIrpStackLocation(irp);
+        if (irpStack->MajorFunction != IRP_MJ_DEVICE_CONTROL)
+        {
+            VerbosePrint(STORTRACE_VERBOSITY_IO, ("Not IRP_MJ_DEVICE_CONTROL, type is %d\n", irpStack->MajorFunction));
+            break;
+        }
+
+        if (WdfRequestIsFrom32BitProcess(Request)) {
+            minSize = sizeof(SCSI_PASS_THROUGH_DIRECT32);
+        }
+        else {
+            minSize = sizeof(SCSI_PASS_THROUGH_DIRECT);
+        }
+
+        status = WdfRequestRetrieveInputBuffer(Request, minSize, &buffer, &bufferSize);
+        if (!NT_SUCCESS(status)) {
+            VerbosePrint(STORTRACE_VERBOSITY_IO, ("Cannot get the input buffer\n"));
+            break;
+        }
+
+        if (WdfRequestIsFrom32BitProcess(Request)) {
+            PSCSI_PASS_THROUGH_DIRECT32 pScsi = buffer;
+            pCdb = pScsi->Cdb;
+            cdbLength = pScsi->CdbLength;
+            scsiStatus = pScsi->ScsiStatus;
+            dataTransferLength = pScsi->DataTransferLength;
+
+            if (pScsi->SenseInfoLength)
+            {
+                senseData = ((PUCHAR)pScsi + pScsi->SenseInfoOffset);
+                senseLength = pScsi->SenseInfoLength;                
+            }
+
+            VerbosePrint(STORTRACE_VERBOSITY_CDB, ("senseLen %d, senseOffset %d, scsiStatus %x \n", pScsi->SenseInfoLength, pScsi->SenseInfoOffset, pScsi->ScsiStatus));
+        }
+        else {
+            PSCSI_PASS_THROUGH_DIRECT pScsi = buffer;
+            pCdb = pScsi->Cdb;
+            cdbLength = pScsi->CdbLength;
+            scsiStatus = pScsi->ScsiStatus;
+            dataTransferLength = pScsi->DataTransferLength;
+
+            if (pScsi->SenseInfoLength)
+            {
+                senseData = ((PUCHAR)pScsi + pScsi->SenseInfoOffset);
+                senseLength = pScsi->SenseInfoLength;
+            }
+
+            VerbosePrint(STORTRACE_VERBOSITY_CDB, ("senseLen %d, senseOffset %d, scsiStatus %x \n", pScsi->SenseInfoLength, pScsi->SenseInfoOffset, pScsi->ScsiStatus));
+        }
+
+        if (cdbLength == 0 || cdbLength > 16)
+        {
+            VerbosePrint(STORTRACE_VERBOSITY_IO, ("CDB %2d bytes, abnormal!!\n", cdbLength));
+            break;
+        }
+
+        //
+        // Save CDB to ring buf
+        //
+        SaveCdbToRingBufEx(deviceContext, RequestGetContext(Request)->IssueTime, pCdb, cdbLength, senseData, senseLength, CompletionParams->IoStatus.Status, scsiStatus, dataTransferLength);
+
+    } while (FALSE);
+
+    WdfRequestComplete(Request, CompletionParams->IoStatus.Status);
+
+    return;
+}
+
+VOID 
+DbgPrintCdb(PUCHAR pCdb, UCHAR CdbLength)
+{
+    char dbgBuffer[100];
+    char *pBufferPos = dbgBuffer;
+    for (UCHAR i = 0; i < CdbLength; i++)
+    {
+        RtlStringCchPrintfA(pBufferPos, 3 + 1, " %02x", pCdb[i]);
+        pBufferPos += 3;
+    }
+    pBufferPos[0] = 0;
+    DbgPrint("%s \n", dbgBuffer);
+}
+
+VOID
+SaveCdbToRingBuf(PDEVICE_CONTEXT DeviceContext, PUCHAR Cdb, UCHAR CdbLength)
+{
+    SaveCdbToRingBufEx(DeviceContext, 0, Cdb, CdbLength, NULL, 0, 0, 0, 0);
+}
+
+VOID 
+SaveCdbToRingBufEx(PDEVICE_CONTEXT DeviceContext, ULONG64 IssueTime, PUCHAR Cdb, UCHAR CdbLength, PUCHAR SenseData, UCHAR SenseDataLength, NTSTATUS ntStatus, UCHAR scsiStatus, ULONG DataTransferLength)
+{
+    ULONG64 record[TRACE_RECORD_MAX_SIZE / sizeof(ULONG64)];
+    PTRACE_RECORD_HEADER header = (PTRACE_RECORD_HEADER)record;
+    UINT32 length = (UINT32)TRACE_RECORD_SIZE(CdbLength, SenseData ? SenseDataLength : 0);
+    ULONG64 timestamp;
+    ULONG sampleRate = 1;
+    LONG mode;
+    CDB_FIELDS fields;
+    BOOLEAN decoded;
+
+    // Before the record takes a sequence number, so nothing is missed for
+    // it. Decodes the CDB for the record too.
+    if (!CaptureFilterMatch(&DeviceContext->CaptureFilter, Cdb, CdbLength, ntStatus, scsiStatus, &fields, &decoded))
+    {
+        return;
+    }
+
+    mode = ReadAcquire(&DeviceContext->CaptureMode);
+    timestamp = (ULONG64)KeQueryPerformanceCounter(NULL).QuadPart;
+
+    // Counted and timed whatever the sampling
+    if ((mode & STORTRACE_CAPTURE_COUNTERS) && DeviceContext->Counters != NULL)
+    {
+        CountersAdd(DeviceContext->Counters, Cdb[0], DataTransferLength, ntStatus, scsiStatus, IssueTime, timestamp);
+    }
+
+    if ((mode & STORTRACE_CAPTURE_LATENCY) && DeviceContext->LatencyStats != NULL)
+    {
+        LatencyStatsAdd(DeviceContext->LatencyStats, Cdb[0], IssueTime, timestamp);
+    }
+
+    // Not tracing this disk
+    if ((mode & STORTRACE_CAPTURE_RECORDS) == 0 || DeviceContext->TraceBuf == NULL)
+    {
+        return;
+    }
+
+    // Failed commands are traced whatever the rate
+    if (ntStatus == STATUS_SUCCESS && scsiStatus == 0 && DeviceContext->Sampler != NULL)
+    {
+        sampleRate = SamplerTake(DeviceContext->Sampler, timestamp);
+        if (sampleRate == 0)
+        {
+            return;
+        }
+    }
+
+    //
+    // Build the whole record first, so it goes into the ring buffer
+    // with one bulk copy
+    //
+    header->Magic = TRACE_RECORD_MAGIC;
+    header->Version = TRACE_RECORD_VERSION;
+    header->Length = length;
+    header->Timestamp = timestamp;
+    header->IssueTimestamp = IssueTime;
+    header->Latency = IssueTime ? header->Timestamp - IssueTime : 0;
+    header->DeviceId = DeviceContext->DeviceId;
+    header->NtStatus = ntStatus;
+    header->ScsiStatus = scsiStatus;
+    header->CdbLength = CdbLength;
+    header->SenseLength = SenseData ? SenseDataLength : 0;
+    header->SampleRate = sampleRate;
+
+    // Decoded once by the filter, readers go by the fields
+    header->Flags = decoded ? TRACE_RECORD_FLAG_DECODED : 0;
+    header->Lba = fields.Lba;
+    header->Blocks = fields.Blocks;
+    header->Opcode = fields.Opcode;
+    header->CdbFlags = fields.Flags;
+    header->Reserved = 0;
+
+    RtlCopyMemory(TRACE_RECORD_CDB(header), Cdb, CdbLength);
+
+    if (header->SenseLength)
+    {
+        RtlCopyMemory(TRACE_RECORD_SENSE(header), SenseData, header->SenseLength);
+    }
+
+    // Padding, so no stack garbage goes out to user mode
+    RtlZeroMemory(TRACE_RECORD_SENSE(header) + header->SenseLength,
+        length - (sizeof(TRACE_RECORD_HEADER) + CdbLength + header->SenseLength));
+
+    if (VERBOSITY_ENABLED(STORTRACE_VERBOSITY_CDB))
+    {
+        DbgPrintCdb(Cdb, CdbLength);
+    }
+
+    PutTraceRecord(DeviceContext, header);
+}
+
+VOID
+SaveRequestToRingBuf(PDEVICE_CONTEXT DeviceContext, ULONG64 IssueTime, UCHAR MajorFunction, LONGLONG Offset, ULONG Length, NTSTATUS ntStatus, ULONG_PTR Information)
+{
+    ULONG64 record[TRACE_RECORD_SIZE(sizeof(TRACE_RECORD_REQUEST), 0) / sizeof(ULONG64)];
+    PTRACE_RECORD_HEADER header = (PTRACE_RECORD_HEADER)record;
+    PTRACE_RECORD_REQUEST request = (PTRACE_RECORD_REQUEST)TRACE_RECORD_CDB(header);
+    ULONG64 timestamp;
+    ULONG sampleRate = 1;
+
+    // Neither filtered nor counted, those go by the CDB
+    if (DeviceContext->TraceBuf == NULL)
+    {
+        return;
+    }
+
+    timestamp = (ULONG64)KeQueryPerformanceCounter(NULL).QuadPart;
+
+    // Sampled like the commands, failures are traced whatever the rate
+    if (ntStatus == STATUS_SUCCESS && DeviceContext->Sampler != NULL)
+    {
+        sampleRate = SamplerTake(DeviceContext->Sampler, timestamp);
+        if (sampleRate == 0)
+        {
+            return;
+        }
+    }
+
+    header->Magic = TRACE_RECORD_MAGIC;
+    header->Version = TRACE_RECORD_VERSION;
+    header->Length = (ULONG)sizeof(record);
+    header->Timestamp = timestamp;
+    header->IssueTimestamp = IssueTime;
+    header->Latency = IssueTime ? timestamp - IssueTime : 0;
+    header->DeviceId = DeviceContext->DeviceId;
+    header->NtStatus = ntStatus;
+    header->ScsiStatus = 0;
+    header->CdbLength = (UCHAR)sizeof(TRACE_RECORD_REQUEST);
+    header->SenseLength = 0;
+    header->Flags = TRACE_RECORD_FLAG_REQUEST;
+    header->SampleRate = sampleRate;
+    header->Lba = 0;
+    header->Blocks = 0;
+    header->Opcode = 0;
+    header->CdbFlags = 0;
+    header->Reserved = 0;
+
+    // Reserved bytes and padding included, so no stack garbage goes out to user mode
+    RtlZeroMemory(request, sizeof(record) - sizeof(TRACE_RECORD_HEADER));
+    request->Offset = (ULONG64)Offset;
+    request->Length = Length;
+    request->Information = (ULONG)Information;
+    request->MajorFunction = MajorFunction;
+
+    VerbosePrint(STORTRACE_VERBOSITY_CDB, ("Request 0x%x offset 0x%I64x length 0x%x status 0x%x\n", MajorFunction, Offset, Length, ntStatus));
+
+    PutTraceRecord(DeviceContext, header);
+}
+
+VOID
+PutTraceRecord(PDEVICE_CONTEXT DeviceContext, PTRACE_RECORD_HEADER Record)
+{
+    BOOLEAN signal;
+
+    // Taken even if the record is dropped below, so the reader sees the gap
+    Record->SequenceNumber = (ULONG64)InterlockedIncrement64(&DeviceContext->SequenceNumber);
+
+    //
+    // Hold a resize off while putting. While one is replacing the trace
+    // buffer, the record is lost, and the reader sees the gap.
+    //
+    if (!ExAcquireRundownProtectionCacheAware(DeviceContext->TraceBufRundown))
+    {
+        return;
+    }
+
+    // Lock free, a full ring drops or overwrites as its policy has it, and counts it
+    signal = TraceBufPut(DeviceContext->TraceBuf, Record->Timestamp, (PUCHAR)Record, Record->Length) &&
+        ReadBatchAdd(&DeviceContext->ReadBatch, &ReadBatchConfig, Record->Length);
+
+    ExReleaseRundownProtectionCacheAware(DeviceContext->TraceBufRundown);
+
+    if (signal && ReadWorkItem != NULL)
+    {
+        // Enough for the parked reads, they are serviced at passive level
+        WdfWorkItemEnqueue(ReadWorkItem);
+    }
+}
+
+
+//-------------------------------------------------------
+// Function Implementation, For control device queue
+//-------------------------------------------------------
+NTSTATUS
+StorTraceControlDeviceQueueInitialize(
+    _In_ WDFDEVICE Device
+)
+{
+    WDFQUEUE queue;
+    NTSTATUS status;
+    WDF_IO_QUEUE_CONFIG queueConfig;
+    WDF_OBJECT_ATTRIBUTES  queueAttributes;
+    WDF_OBJECT_ATTRIBUTES  attributes;
+    WDF_TIMER_CONFIG timerConfig;
+    WDF_WORKITEM_CONFIG workItemConfig;
+    WDFWORKITEM workItem;
+
+    //
+    // Configure the default queue associated with the control device object
+    // to be Serial so that request passed to EvtIoDeviceControl are serialized.
+    //
+    WDF_IO_QUEUE_CONFIG_INIT_DEFAULT_QUEUE(&queueConfig,
+        WdfIoQueueDispatchSequential);
+
+    queueConfig.EvtIoDeviceControl = ControlDeviceEvtIoDeviceControl;
+    queueConfig.EvtIoRead = ControlDeviceEvtIoRead;
+    queueConfig.EvtIoWrite = ControlDeviceEvtIoWrite;
+
+    WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&queueAttributes, QUEUE_CONTEXT);
+    queueAttributes.SynchronizationScope = WdfSynchronizationScopeQueue;
+
+    //
+    // The callbacks take DeviceCollectionLock, a wait lock
+    //
+    queueAttributes.ExecutionLevel = WdfExecutionLevelPassive;
+
+    //
+    // Framework by default creates non-power managed queues for
+    // filter drivers.
+    //
+    status = WdfIoQueueCreate(Device,
+        &queueConfig,
+        &queueAttributes,
+        &queue // pointer to default queue
+    );
+    if (!NT_SUCCESS(status)) {
+        DbgPrint("Failed to create Io Queue for controldevice\n");
+        return status;
+    }
+
+    //
+    // Reads are parked in a manual queue until there is trace for them
+    //
+    WDF_IO_QUEUE_CONFIG_INIT(&queueConfig, WdfIoQueueDispatchManual);
+
+    status = WdfIoQueueCreate(Device,
+        &queueConfig,
+        WDF_NO_OBJECT_ATTRIBUTES,
+        &PendingReadQueue
+    );
+    if (!NT_SUCCESS(status)) {
+        DbgPrint("Failed to create pending read queue\n");
+        return status;
+    }
+
+    status = WdfIoQueueCreate(Device,
+        &queueConfig,
+        WDF_NO_OBJECT_ATTRIBUTES,
+        &AsideReadQueue
+    );
+    if (!NT_SUCCESS(status)) {
+        DbgPrint("Failed to create aside read queue\n");
+        return status;
+    }
+
+    WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+    attributes.ParentObject = Device;
+
+    status = WdfWaitLockCreate(&attributes, &PendingReadLock);
+    if (!NT_SUCCESS(status)) {
+        DbgPrint("Failed to create pending read lock\n");
+        return status;
+    }
+
+    WDF_TIMER_CONFIG_INIT(&timerConfig, FlushTimerCallback);
+    timerConfig.AutomaticSerialization = FALSE;
+
+    status = WdfTimerCreate(&timerConfig, &attributes, &FlushTimer);
+    if (!NT_SUCCESS(status)) {
+        DbgPrint("Failed to create flush timer\n");
+        return status;
+    }
+
+    WDF_WORKITEM_CONFIG_INIT(&workItemConfig, ReadWorkItemCallback);
+    workItemConfig.AutomaticSerialization = FALSE;
+
+    status = WdfWorkItemCreate(&workItemConfig, &attributes, &workItem);
+    if (!NT_SUCCESS(status)) {
+        DbgPrint("Failed to create read work item\n");
+        return status;
+    }
+
+    // Producers may signal from now on
+    ReadWorkItem = workItem;
+
+    return status;
+}
+
+
+VOID
+ControlDeviceEvtIoDeviceControl(
+    _In_ WDFQUEUE Queue,
+    _In_ WDFREQUEST Request,
+    _In_ size_t OutputBufferLength,
+    _In_ size_t InputBufferLength,
+    _In_ ULONG IoControlCode
+)
+{
+    
+    ULONG               i;
+    ULONG               noItems;
+    WDFDEVICE           hDevice;
+    PDEVICE_CONTEXT     deviceContext;
+    NTSTATUS            status = STATUS_SUCCESS;
+    ULONG_PTR           information = 0;
+    PVOID               buffer;
+    
+    UNREFERENCED_PARAMETER(Queue);
+    UNREFERENCED_PARAMETER(OutputBufferLength);
+    UNREFERENCED_PARAMETER(InputBufferLength);
+
+    
+    // DbgPrint("%s.\n", __FUNCTION__);
+
+    switch (IoControlCode)
+    {
+    case IOCTL_STORTRACE_LIST_DEVICES:
+    {
+        PSTORTRACE_DEVICE_INFO deviceInfo;
+        size_t bufferLength;
+        LARGE_INTEGER frequency;
+
+        status = WdfRequestRetrieveOutputBuffer(Request, 0, &buffer, &bufferLength);
+        if (!NT_SUCCESS(status)) {
+            break;
+        }
+
+        deviceInfo = (PSTORTRACE_DEVICE_INFO)buffer;
+        KeQueryPerformanceCounter(&frequency);
+
+        WdfWaitLockAcquire(DeviceCollectionLock, NULL);
+
+        noItems = WdfCollectionGetCount(DeviceCollection);
+
+        //
+        // As many as fit, and STATUS_BUFFER_OVERFLOW if not all of them do,
+        // for the caller to ask again with more room
+        //
+        if (bufferLength < noItems * sizeof(STORTRACE_DEVICE_INFO)) {
+            noItems = (ULONG)(bufferLength / sizeof(STORTRACE_DEVICE_INFO));
+            status = STATUS_BUFFER_OVERFLOW;
+        }
+
+        for (i = 0; i < noItems; i++) {
+
+            hDevice = WdfCollectionGetItem(DeviceCollection, i);
+
+            deviceContext = DeviceGetContext(hDevice);
+
+            deviceInfo[i].DeviceId = deviceContext->DeviceId;
+            deviceInfo[i].SampleRate = deviceContext->Sampler ? SamplerGetRate(deviceContext->Sampler) : 1;
+            deviceInfo[i].TraceBufSize = deviceContext->TraceBuf ? TraceBufGetSize(deviceContext->TraceBuf) : 0;
+            deviceInfo[i].TimestampFrequency = (ULONG64)frequency.QuadPart;
+        }
+        information = noItems * sizeof(STORTRACE_DEVICE_INFO);
+
+        WdfWaitLockRelease(DeviceCollectionLock);
+        break;
+    }
+
+    case IOCTL_STORTRACE_GET_RING_STATS:
+    {
+        PSTORTRACE_RING_STATS ringStats;
+        size_t bufferLength;
+        ULONG count = 0;
+
+        status = WdfRequestRetrieveOutputBuffer(Request, 0, &buffer, &bufferLength);
+        if (!NT_SUCCESS(status)) {
+            break;
+        }
+
+        ringStats = (PSTORTRACE_RING_STATS)buffer;
+
+        WdfWaitLockAcquire(DeviceCollectionLock, NULL);
+
+        noItems = WdfCollectionGetCount(DeviceCollection);
+
+        for (i = 0; i < noItems; i++) {
+            RING_BUF_STATS stats;
+
+            deviceContext = DeviceGetContext(WdfCollectionGetItem(DeviceCollection, i));
+            if (deviceContext->TraceBuf == NULL) {
+                continue;
+            }
+
+            if (bufferLength < (count + 1) * sizeof(STORTRACE_RING_STATS)) {
+                status = STATUS_BUFFER_OVERFLOW;
+                break;
+            }
+
+            TraceBufGetStats(deviceContext->TraceBuf, &stats);
+
+            ringStats[count].DeviceId = deviceContext->DeviceId;
+            ringStats[count].Policy = TraceBufGetPolicy(deviceContext->TraceBuf);
+            ringStats[count].RingCount = TraceBufGetRingCount(deviceContext->TraceBuf);
+            ringStats[count].Reserved = 0;
+            ringStats[count].RingSize = TraceBufGetRingSize(deviceContext->TraceBuf);
+            ringStats[count].HighWater = stats.HighWater;
+            ringStats[count].DroppedRecords = stats.DroppedRecords;
+            ringStats[count].DroppedBytes = stats.DroppedBytes;
+            ringStats[count].OverwrittenRecords = stats.OverwrittenRecords;
+            ringStats[count].OverwrittenBytes = stats.OverwrittenBytes;
+            count++;
+        }
+
+        WdfWaitLockRelease(DeviceCollectionLock);
+
+        information = count * sizeof(STORTRACE_RING_STATS);
+        break;
+    }
+
+    case IOCTL_STORTRACE_RESIZE_TRACE_BUF:
+    {
+        PSTORTRACE_RESIZE resize;
+
+        status = WdfRequestRetrieveInputBuffer(Request, sizeof(STORTRACE_RESIZE), &buffer, NULL);
+        if (!NT_SUCCESS(status)) {
+            break;
+        }
+
+        resize = (PSTORTRACE_RESIZE)buffer;
+
+        if (resize->Size < TRACE_BUF_MIN_RING_SIZE || resize->Size > TRACE_BUF_MAX_SIZE) {
+            status = STATUS_INVALID_PARAMETER;
+            break;
+        }
+
+        status = ResizeTraceBufs(resize->DeviceId, (size_t)resize->Size);
+        break;
+    }
+
+    case IOCTL_STORTRACE_SET_CAPTURE_FILTER:
+    {
+        PSTORTRACE_SET_CAPTURE_FILTER setFilter;
+        CAPTURE_FILTER check;
+
+        status = WdfRequestRetrieveInputBuffer(Request, sizeof(STORTRACE_SET_CAPTURE_FILTER), &buffer, NULL);
+        if (!NT_SUCCESS(status)) {
+            break;
+        }
+
+        setFilter = (PSTORTRACE_SET_CAPTURE_FILTER)buffer;
+
+        // Refused as a whole, not device by device
+        if (!CaptureFilterSet(&check, &setFilter->Filter)) {
+            status = STATUS_INVALID_PARAMETER;
+            break;
+        }
+
+        status = (setFilter->DeviceId == STORTRACE_ALL_DEVICES) ? STATUS_SUCCESS : STATUS_NOT_FOUND;
+
+        WdfWaitLockAcquire(DeviceCollectionLock, NULL);
+
+        noItems = WdfCollectionGetCount(DeviceCollection);
+
+        for (i = 0; i < noItems; i++) {
+            deviceContext = DeviceGetContext(WdfCollectionGetItem(DeviceCollection, i));
+
+            if (setFilter->DeviceId != STORTRACE_ALL_DEVICES && deviceContext->DeviceId != setFilter->DeviceId) {
+                continue;
+            }
+
+            CaptureFilterSet(&deviceContext->CaptureFilter, &setFilter->Filter);
+            status = STATUS_SUCCESS;
+        }
+
+        if (setFilter->DeviceId == STORTRACE_ALL_DEVICES) {
+            DefaultCaptureFilter = setFilter->Filter;
+        }
+
+        WdfWaitLockRelease(DeviceCollectionLock);
+        break;
+    }
+
+    case IOCTL_STORTRACE_SET_SAMPLING:
+    {
+        PSTORTRACE_SAMPLING sampling;
+
+        status = WdfRequestRetrieveInputBuffer(Request, sizeof(STORTRACE_SAMPLING), &buffer, NULL);
+        if (!NT_SUCCESS(status)) {
+            break;
+        }
+
+        sampling = (PSTORTRACE_SAMPLING)buffer;
+        status = (sampling->DeviceId == STORTRACE_ALL_DEVICES) ? STATUS_SUCCESS : STATUS_NOT_FOUND;
+
+        WdfWaitLockAcquire(DeviceCollectionLock, NULL);
+
+        noItems = WdfCollectionGetCount(DeviceCollection);
+
+        for (i = 0; i < noItems; i++) {
+            deviceContext = DeviceGetContext(WdfCollectionGetItem(DeviceCollection, i));
+
+            if (sampling->DeviceId != STORTRACE_ALL_DEVICES && deviceContext->DeviceId != sampling->DeviceId) {
+                continue;
+            }
+
+            if (deviceContext->Sampler == NULL) {
+                status = STATUS_INSUFFICIENT_RESOURCES;
+                continue;
+            }
+
+            SamplerSet(deviceContext->Sampler, sampling->Rate, sampling->Budget);
+            if (sampling->DeviceId != STORTRACE_ALL_DEVICES) {
+                status = STATUS_SUCCESS;
+            }
+        }
+
+        if (sampling->DeviceId == STORTRACE_ALL_DEVICES) {
+            DefaultSampling = *sampling;
+        }
+
+        WdfWaitLockRelease(DeviceCollectionLock);
+        break;
+    }
+
+    case IOCTL_STORTRACE_SET_CAPTURE_MODE:
+    {
+        PSTORTRACE_CAPTURE_MODE captureMode;
+
+        status = WdfRequestRetrieveInputBuffer(Request, sizeof(STORTRACE_CAPTURE_MODE), &buffer, NULL);
+        if (!NT_SUCCESS(status)) {
+            break;
+        }
+
+        captureMode = (PSTORTRACE_CAPTURE_MODE)buffer;
+
+        if ((captureMode->Mode & ~STORTRACE_CAPTURE_VALID_MODES) != 0) {
+            status = STATUS_INVALID_PARAMETER;
+            break;
+        }
+
+        status = (captureMode->DeviceId == STORTRACE_ALL_DEVICES) ? STATUS_SUCCESS : STATUS_NOT_FOUND;
+
+        WdfWaitLockAcquire(DeviceCollectionLock, NULL);
+
+        noItems = WdfCollectionGetCount(DeviceCollection);
+
+        for (i = 0; i < noItems; i++) {
+            NTSTATUS set;
+
+            deviceContext = DeviceGetContext(WdfCollectionGetItem(DeviceCollection, i));
+
+            if (captureMode->DeviceId != STORTRACE_ALL_DEVICES && deviceContext->DeviceId != captureMode->DeviceId) {
+                continue;
+            }
+
+            set = StorTraceSetCaptureMode(deviceContext, captureMode->Mode);
+            if (!NT_SUCCESS(set) || captureMode->DeviceId != STORTRACE_ALL_DEVICES) {
+                status = set;
+            }
+        }
+
+        if (captureMode->DeviceId == STORTRACE_ALL_DEVICES) {
+            DefaultCaptureMode = captureMode->Mode;
+        }
+
+        WdfWaitLockRelease(DeviceCollectionLock);
+        break;
+    }
+
+    case IOCTL_STORTRACE_GET_COUNTERS:
+    {
+        PSTORTRACE_COUNTERS counters;
+        ULONG deviceId;
+
+        status = WdfRequestRetrieveInputBuffer(Request, sizeof(ULONG), &buffer, NULL);
+        if (!NT_SUCCESS(status)) {
+            break;
+        }
+
+        deviceId = *(PULONG)buffer;
+
+        status = WdfRequestRetrieveOutputBuffer(Request, sizeof(STORTRACE_COUNTERS), &buffer, NULL);
+        if (!NT_SUCCESS(status)) {
+            break;
+        }
+
+        // In and out share the system buffer
+        counters = (PSTORTRACE_COUNTERS)buffer;
+        RtlZeroMemory(counters, sizeof(STORTRACE_COUNTERS));
+        counters->DeviceId = deviceId;
+
+        status = (deviceId == STORTRACE_ALL_DEVICES) ? STATUS_SUCCESS : STATUS_NOT_FOUND;
+
+        WdfWaitLockAcquire(DeviceCollectionLock, NULL);
+
+        noItems = WdfCollectionGetCount(DeviceCollection);
+
+        for (i = 0; i < noItems; i++) {
+            deviceContext = DeviceGetContext(WdfCollectionGetItem(DeviceCollection, i));
+
+            if (deviceId != STORTRACE_ALL_DEVICES && deviceContext->DeviceId != deviceId) {
+                continue;
+            }
+
+            // Never counted, nothing to add
+            if (deviceContext->Counters != NULL) {
+                CountersSnapshot(deviceContext->Counters, counters);
+            }
+            status = STATUS_SUCCESS;
+        }
+
+        WdfWaitLockRelease(DeviceCollectionLock);
+
+        if (NT_SUCCESS(status)) {
+            information = sizeof(STORTRACE_COUNTERS);
+        }
+        break;
+    }
+
+    case IOCTL_STORTRACE_SNAP_LATENCY:
+    {
+        PSTORTRACE_LATENCY latency;
+        ULONG deviceId;
+        ULONG64 now = (ULONG64)KeQueryPerformanceCounter(NULL).QuadPart;
+
+        status = WdfRequestRetrieveInputBuffer(Request, sizeof(ULONG), &buffer, NULL);
+        if (!NT_SUCCESS(status)) {
+            break;
+        }
+
+        deviceId = *(PULONG)buffer;
+
+        status = WdfRequestRetrieveOutputBuffer(Request, sizeof(STORTRACE_LATENCY), &buffer, NULL);
+        if (!NT_SUCCESS(status)) {
+            break;
+        }
+
+        // In and out share the system buffer
+        latency = (PSTORTRACE_LATENCY)buffer;
+        RtlZeroMemory(latency, sizeof(STORTRACE_LATENCY));
+        latency->DeviceId = deviceId;
+
+        status = (deviceId == STORTRACE_ALL_DEVICES) ? STATUS_SUCCESS : STATUS_NOT_FOUND;
+
+        // Also serializes the snapshots of a device
+        WdfWaitLockAcquire(DeviceCollectionLock, NULL);
+
+        noItems = WdfCollectionGetCount(DeviceCollection);
+
+        for (i = 0; i < noItems; i++) {
+            deviceContext = DeviceGetContext(WdfCollectionGetItem(DeviceCollection, i));
+
+            if (deviceId != STORTRACE_ALL_DEVICES && deviceContext->DeviceId != deviceId) {
+                continue;
+            }
+
+            // Never timed, nothing to add
+            if (deviceContext->LatencyStats != NULL) {
+                LatencyStatsSnapshot(deviceContext->LatencyStats, latency, now);
+            }
+            status = STATUS_SUCCESS;
+        }
+
+        WdfWaitLockRelease(DeviceCollectionLock);
+
+        if (NT_SUCCESS(status)) {
+            information = sizeof(STORTRACE_LATENCY);
+        }
+        break;
+    }
+
+    case IOCTL_STORTRACE_SELECT_DEVICE:
+    {
+        PCONTROL_FILE_CONTEXT fileContext = ControlFileGetContext(WdfRequestGetFileObject(Request));
+
+        status = WdfRequestRetrieveInputBuffer(Request, sizeof(ULONG), &buffer, NULL);
+        if (!NT_SUCCESS(status)) {
+            break;
+        }
+
+        fileContext->DeviceId = *(PULONG)buffer;
+        fileContext->NextDevice = 0;
+        break;
+    }
+
+    case IOCTL_STORTRACE_SET_VERBOSITY:
+    {
+        LONG previous;
+
+        status = WdfRequestRetrieveInputBuffer(Request, sizeof(ULONG), &buffer, NULL);
+        if (!NT_SUCCESS(status)) {
+            break;
+        }
+
+        previous = InterlockedExchange(&Verbosity, *(PLONG)buffer);
+        DbgPrint("Verbosity %d -> %d\n", previous, *(PLONG)buffer);
+
+        // Reporting the previous level is optional
+        if (NT_SUCCESS(WdfRequestRetrieveOutputBuffer(Request, sizeof(ULONG), &buffer, NULL))) {
+            *(PULONG)buffer = (ULONG)previous;
+            information = sizeof(ULONG);
+        }
+        break;
+    }
+
+    case IOCTL_STORTRACE_RELEASE_RING:
+    {
+        PCONTROL_FILE_CONTEXT fileContext = ControlFileGetContext(WdfRequestGetFileObject(Request));
+
+        status = WdfRequestRetrieveInputBuffer(Request, sizeof(ULONG64), &buffer, NULL);
+        if (!NT_SUCCESS(status)) {
+            break;
+        }
+
+        if (fileContext->Ring == NULL) {
+            status = STATUS_INVALID_DEVICE_STATE;
+            break;
+        }
+
+        if (!RingBufRelease(fileContext->Ring, *(PLONG64)buffer)) {
+            status = STATUS_INVALID_PARAMETER;
+        }
+        break;
+    }
+
+    default:
+        WdfWaitLockAcquire(DeviceCollectionLock, NULL);
+
+        noItems = WdfCollectionGetCount(DeviceCollection);
+
+        for (i = 0; i<noItems; i++) {
+
+            hDevice = WdfCollectionGetItem(DeviceCollection, i);
+
+            deviceContext = DeviceGetContext(hDevice);
+
+            DbgPrint("Device Serial No: 0x%x, Id %d\n", deviceContext->SerialNo, deviceContext->DeviceId);
+        }
+
+        WdfWaitLockRelease(DeviceCollectionLock);
+        break;
+    }
+
+    WdfRequestCompleteWithInformation(Request, status, information);
+}
+
+VOID
+ControlDeviceEvtIoInCallerContext(
+    _In_ WDFDEVICE Device,
+    _In_ WDFREQUEST Request
+)
+/*++
+
+Routine Description:
+
+    IOCTL_STORTRACE_MAP_RING has to map into the process that sent it, so
+    it is handled here, before the request is queued. Everything else goes
+    to the default queue.
+
+--*/
+{
+    WDF_REQUEST_PARAMETERS params;
+    NTSTATUS status;
+
+    WDF_REQUEST_PARAMETERS_INIT(&params);
+    WdfRequestGetParameters(Request, &params);
+
+    if (params.Type == WdfRequestTypeDeviceControl &&
+        params.Parameters.DeviceIoControl.IoControlCode == IOCTL_STORTRACE_MAP_RING) {
+
+        status = MapTraceRing(Request);
+        WdfRequestCompleteWithInformation(Request, status,
+            NT_SUCCESS(status) ? sizeof(STORTRACE_RING_MAPPING) : 0);
+        return;
+    }
+
+    status = WdfDeviceEnqueueRequest(Device, Request);
+    if (!NT_SUCCESS(status)) {
+        WdfRequestComplete(Request, status);
+    }
+}
+
+NTSTATUS
+MapTraceRing(
+    _In_ WDFREQUEST Request
+)
+/*++
+
+Routine Description:
+
+    Map the trace ring of the device given in the request into the calling
+    process, and remember the mapping on the handle. Called in the context
+    of the caller, at PASSIVE_LEVEL.
+
+--*/
+{
+    PCONTROL_FILE_CONTEXT fileContext = ControlFileGetContext(WdfRequestGetFileObject(Request));
+    PSTORTRACE_RING_MAPPING mapping;
+    PVOID buffer;
+    PRING_BUF ring = NULL;
+    PMDL mdl = NULL;
+    PVOID address = NULL;
+    NTSTATUS status;
+    ULONG deviceId;
+    ULONG noItems;
+
+    status = WdfRequestRetrieveInputBuffer(Request, sizeof(ULONG), &buffer, NULL);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+    deviceId = *(PULONG)buffer;
+
+    status = WdfRequestRetrieveOutputBuffer(Request, sizeof(STORTRACE_RING_MAPPING), (PVOID*)&mapping, NULL);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    // One mapping per handle
+    if (fileContext->Ring != NULL) {
+        return STATUS_INVALID_DEVICE_STATE;
+    }
+
+    status = STATUS_NOT_FOUND;
+
+    WdfWaitLockAcquire(DeviceCollectionLock, NULL);
+
+    noItems = WdfCollectionGetCount(DeviceCollection);
+
+    for (ULONG i = 0; i < noItems; i++) {
+        PDEVICE_CONTEXT deviceContext = DeviceGetContext(WdfCollectionGetItem(DeviceCollection, i));
+
+        if (deviceContext->DeviceId != deviceId || deviceContext->TraceBuf == NULL) {
+            continue;
+        }
+
+        ring = TraceBufGetRing(deviceContext->TraceBuf);
+        if (ring == NULL) {
+            status = STATUS_NOT_SUPPORTED;
+            break;
+        }
+
+        // Takes its own reference, the ring outlives the device if need be
+        address = RingBufMapUser(ring, &mdl);
+        status = (address != NULL) ? STATUS_SUCCESS : STATUS_SHARING_VIOLATION;
+        break;
+    }
+
+    WdfWaitLockRelease(DeviceCollectionLock);
+
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    // Another thread may have mapped on this handle meanwhile
+    if (InterlockedCompareExchangePointer((PVOID*)&fileContext->Ring, ring, NULL) != NULL) {
+        RingBufUnmapUser(ring, address, mdl);
+        return STATUS_INVALID_DEVICE_STATE;
+    }
+
+    fileContext->DeviceId = deviceId;
+    fileContext->Mdl = mdl;
+    fileContext->UserAddress = address;
+    fileContext->Process = PsGetCurrentProcess();
+    ObReferenceObject(fileContext->Process);
+
+    mapping->Address = (ULONG64)(ULONG_PTR)address;
+    mapping->Length = MmGetMdlByteCount(mdl);
+
+    DbgPrint("Trace ring of device %d mapped at %p\n", deviceId, address);
+
+    return STATUS_SUCCESS;
+}
+
+VOID
+ControlDeviceEvtFileCleanup(
+    _In_ WDFFILEOBJECT FileObject
+)
+/*++
+
+Routine Description:
+
+    Last handle closed: unmap the ring mapped on it, if any. Cleanup normally
+    runs in the process that owns the mapping, as it closes the handle or
+    exits; attach to it otherwise.
+
+--*/
+{
+    PCONTROL_FILE_CONTEXT fileContext = ControlFileGetContext(FileObject);
+    KAPC_STATE apcState;
+    BOOLEAN attached = FALSE;
+    ULONG noItems;
+
+    if (fileContext->Ring == NULL) {
+        return;
+    }
+
+    if (PsGetCurrentProcess() != fileContext->Process) {
+        KeStackAttachProcess(fileContext->Process, &apcState);
+        attached = TRUE;
+    }
+
+    RingBufUnmapUser(fileContext->Ring, fileContext->UserAddress, fileContext->Mdl);
+
+    if (attached) {
+        KeUnstackDetachProcess(&apcState);
+    }
+
+    ObDereferenceObject(fileContext->Process);
+    fileContext->Ring = NULL;
+    fileContext->Mdl = NULL;
+    fileContext->UserAddress = NULL;
+    fileContext->Process = NULL;
+
+    //
+    // The mapping's owner took records without the read batch knowing, and
+    // left the rest in the ring: reads count afresh from what it holds.
+    // Reads and producers are held off meanwhile, the locks taken in the
+    // order ResizeTraceBufs takes them.
+    //
+    WdfWaitLockAcquire(PendingReadLock, NULL);
+    WdfWaitLockAcquire(DeviceCollectionLock, NULL);
+
+    noItems = WdfCollectionGetCount(DeviceCollection);
+
+    for (ULONG i = 0; i < noItems; i++) {
+        PDEVICE_CONTEXT deviceContext = DeviceGetContext(WdfCollectionGetItem(DeviceCollection, i));
+
+        if (deviceContext->DeviceId == fileContext->DeviceId) {
+            if (deviceContext->TraceBuf != NULL && deviceContext->TraceBufRundown != NULL) {
+                RestartReadBatch(deviceContext);
+            }
+            break;
+        }
+    }
+
+    WdfWaitLockRelease(DeviceCollectionLock);
+    WdfWaitLockRelease(PendingReadLock);
+}
+
+VOID
+ControlDeviceEvtIoWrite(
+    _In_     WDFQUEUE Queue,
+    _In_    WDFREQUEST Request,
+    _In_    size_t Length
+)
+{
+    WDFDEVICE                       device;
+    NTSTATUS       status = STATUS_SUCCESS;
+
+    device = WdfIoQueueGetDevice(Queue);
+    DbgPrint("%s, length 0x%x \n", __FUNCTION__, Length);
+
+    Length = 0L;
+    WdfRequestSetInformation(Request, (ULONG_PTR)0);    
+
+    WdfRequestComplete(Request, status);
+    return;
+}
+
+VOID
+ControlDeviceEvtIoRead(
+    _In_     WDFQUEUE Queue,
+    _In_    WDFREQUEST Request,
+    _In_    size_t Length
+)
+{
+    NTSTATUS status = STATUS_SUCCESS;
+    PVOID buffer;
+    size_t bufferLength;
+
+    UNREFERENCED_PARAMETER(Queue);
+    // DbgPrint("%s, length 0x%x", __FUNCTION__, Length);
+
+    //
+    // A read takes whole records only, so one that cannot hold the largest
+    // would wait forever behind it
+    //
+    if (Length < TRACE_RECORD_MAX_SIZE) {
+        WdfRequestCompleteWithInformation(Request, STATUS_BUFFER_TOO_SMALL, 0L);
+        return;
+    }
+
+    status = WdfRequestRetrieveOutputBuffer(Request, TRACE_RECORD_MAX_SIZE, &buffer, &bufferLength);
+
+    if (!NT_SUCCESS(status)) {
+        KdPrint(("ControlDeviceEvtIoRead Could not get request buffer 0x%x\n", status));
+        WdfVerifierDbgBreakPoint();
+        WdfRequestCompleteWithInformation(Request, status, 0L);
+        return;
+    }
+
+    //
+    // Park the read, it completes once there is enough trace for it or
+    // the flush timeout expires with some
+    //
+    status = WdfRequestForwardToIoQueue(Request, PendingReadQueue);
+    if (!NT_SUCCESS(status)) {
+        WdfRequestCompleteWithInformation(Request, status, 0L);
+        return;
+    }
+
+    ServicePendingReads(FALSE);
+
+    return;
+}
+
+//
+// The parked reads, as ReadBatchService gets at them
+//
+static const READ_BATCH_READS ParkedReads = {
+    ParkedReadCount,
+    RetrieveParkedRead,
+    ParkRead,
+    AnyTraceReady,
+    FillRead,
+    CompleteRead
+};
+
+VOID
+ServicePendingReads(
+    _In_ BOOLEAN Flush
+)
+/*++
+
+Routine Description:
+
+    Complete parked reads for as long as some device has trace ready for
+    them (see ReadBatchService). Reads still parked are flushed when the
+    flush timeout expires at the latest. Called at PASSIVE_LEVEL.
+
+--*/
+{
+    ULONG parked;
+
+    // Reads take the trace in the order they complete
+    WdfWaitLockAcquire(PendingReadLock, NULL);
+
+    parked = ReadBatchService(&ParkedReads, Flush);
+
+    if (parked != 0 && InterlockedCompareExchange(&FlushTimerArmed, TRUE, FALSE) == FALSE) {
+        WdfTimerStart(FlushTimer, WDF_REL_TIMEOUT_IN_MS(ReadBatchConfig.FlushTimeoutMs));
+    }
+
+    WdfWaitLockRelease(PendingReadLock);
+}
+
+ULONG
+ParkedReadCount(
+    _In_ ULONG Queue
+)
+{
+    ULONG count;
+
+    WdfIoQueueGetState(Queue == READ_BATCH_ASIDE ? AsideReadQueue : PendingReadQueue, &count, NULL);
+
+    return count;
+}
+
+PVOID
+RetrieveParkedRead(
+    _In_ ULONG Queue
+)
+{
+    WDFREQUEST request;
+
+    if (!NT_SUCCESS(WdfIoQueueRetrieveNextRequest(Queue == READ_BATCH_ASIDE ? AsideReadQueue : PendingReadQueue, &request))) {
+        return NULL;
+    }
+
+    return request;
+}
+
+NTSTATUS
+ParkRead(
+    _In_ PVOID Read,
+    _In_ ULONG Queue
+)
+{
+    return WdfRequestForwardToIoQueue((WDFREQUEST)Read, Queue == READ_BATCH_ASIDE ? AsideReadQueue : PendingReadQueue);
+}
+
+size_t
+FillRead(
+    _In_ PVOID Read
+)
+{
+    WDFREQUEST request = (WDFREQUEST)Read;
+    PVOID buffer;
+    size_t bufferLength;
+
+    // Checked when the read was parked
+    (VOID)WdfRequestRetrieveOutputBuffer(request, TRACE_RECORD_MAX_SIZE, &buffer, &bufferLength);
+
+    //
+    // Drain whole records straight into the (buffered I/O) request buffer
+    //
+    return ReadTraceBufs(ControlFileGetContext(WdfRequestGetFileObject(request)), (PUCHAR)buffer, bufferLength);
+}
+
+VOID
+CompleteRead(
+    _In_ PVOID Read,
+    _In_ NTSTATUS Status,
+    _In_ size_t Information
+)
+{
+    WdfRequestCompleteWithInformation((WDFREQUEST)Read, Status, (ULONG_PTR)Information);
+}
+
+BOOLEAN
+AnyTraceReady(
+    _In_ BOOLEAN Flush
+)
+{
+    BOOLEAN ready = FALSE;
+    ULONG noItems;
+
+    WdfWaitLockAcquire(DeviceCollectionLock, NULL);
+
+    noItems = WdfCollectionGetCount(DeviceCollection);
+
+    for (ULONG i = 0; i < noItems && !ready; i++) {
+        PDEVICE_CONTEXT deviceContext = DeviceGetContext(WdfCollectionGetItem(DeviceCollection, i));
+
+        // A mapped ring is not read from here, whatever it holds
+        ready = (deviceContext->TraceBuf != NULL &&
+            !TraceBufIsMapped(deviceContext->TraceBuf) &&
+            ReadBatchIsReady(&deviceContext->ReadBatch, &ReadBatchConfig, Flush));
+    }
+
+    WdfWaitLockRelease(DeviceCollectionLock);
+
+    return ready;
+}
+
+VOID
+FlushTimerCallback(
+    _In_ WDFTIMER Timer
+)
+{
+    UNREFERENCED_PARAMETER(Timer);
+
+    InterlockedExchange(&FlushTimerArmed, FALSE);
+    InterlockedExchange(&FlushRequested, TRUE);
+
+    WdfWorkItemEnqueue(ReadWorkItem);
+}
+
+VOID
+ReadWorkItemCallback(
+    _In_ WDFWORKITEM WorkItem
+)
+{
+    UNREFERENCED_PARAMETER(WorkItem);
+
+    ServicePendingReads(InterlockedExchange(&FlushRequested, FALSE) != FALSE);
+}
+
+NTSTATUS
+ResizeTraceBufs(ULONG DeviceId, size_t Size)
+/*++
+
+Routine Description:
+
+    Resize the trace buffer of the device DeviceId, or of all devices and
+    the default for disks to come. Called at PASSIVE_LEVEL.
+
+Return Value:
+
+    The failure of the last device that could not be resized, if any.
+
+--*/
+{
+    NTSTATUS status = (DeviceId == STORTRACE_ALL_DEVICES) ? STATUS_SUCCESS : STATUS_NOT_FOUND;
+    ULONG noItems;
+
+    //
+    // Reads must not drain the trace buffers being replaced, and take the
+    // locks in this order too
+    //
+    WdfWaitLockAcquire(PendingReadLock, NULL);
+    WdfWaitLockAcquire(DeviceCollectionLock, NULL);
+
+    noItems = WdfCollectionGetCount(DeviceCollection);
+
+    for (ULONG i = 0; i < noItems; i++) {
+        PDEVICE_CONTEXT deviceContext = DeviceGetContext(WdfCollectionGetItem(DeviceCollection, i));
+        NTSTATUS resized;
+
+        if (DeviceId != STORTRACE_ALL_DEVICES && deviceContext->DeviceId != DeviceId) {
+            continue;
+        }
+
+        resized = ResizeTraceBuf(deviceContext, Size);
+        if (!NT_SUCCESS(resized) || DeviceId != STORTRACE_ALL_DEVICES) {
+            status = resized;
+        }
+    }
+
+    if (DeviceId == STORTRACE_ALL_DEVICES) {
+        TraceBufDefaultSize = (ULONG)Size;
+    }
+
+    WdfWaitLockRelease(DeviceCollectionLock);
+    WdfWaitLockRelease(PendingReadLock);
+
+    return status;
+}
+
+NTSTATUS
+ResizeTraceBuf(PDEVICE_CONTEXT DeviceContext, size_t Size)
+/*++
+
+Routine Description:
+
+    Replace the device's trace buffer by a new one of about Size bytes and
+    move the trace over, oldest first. Producers are held off from the
+    moment the old buffer stops taking records until the new one is in
+    place; their records are lost meanwhile.
+
+    The caller holds PendingReadLock and DeviceCollectionLock, so neither
+    a read nor a mapping can get at the trace buffer meanwhile.
+
+--*/
+{
+    ULONG64 scratch[TRACE_RECORD_MAX_SIZE / sizeof(ULONG64)];
+    PTRACE_BUF oldBuf = DeviceContext->TraceBuf;
+    PTRACE_BUF newBuf;
+    ULONG64 records;
+    ULONG64 bytes = 0;
+
+    if (DeviceContext->TraceBufRundown == NULL) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    // The mapping's owner reads the ring in place
+    if (oldBuf != NULL && TraceBufIsMapped(oldBuf)) {
+        return STATUS_DEVICE_BUSY;
+    }
+
+    newBuf = TraceBufCreate(Size, PerCpuTraceBuffer, TraceBufOverflowPolicy);
+    if (newBuf == NULL) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    ExWaitForRundownProtectionReleaseCacheAware(DeviceContext->TraceBufRundown);
+
+    records = (oldBuf != NULL) ? TraceBufMigrate(newBuf, oldBuf, (PUCHAR)scratch, sizeof(scratch), &bytes) : 0;
+
+    // What the migration overwrote is counted from 0, as part of records
+    ReadBatchRestart(&DeviceContext->ReadBatch, bytes, records, 0, 0);
+
+    InterlockedExchangePointer((PVOID volatile *)&DeviceContext->TraceBuf, newBuf);
+    ExReInitializeRundownProtectionCacheAware(DeviceContext->TraceBufRundown);
+
+    TraceBufDelete(oldBuf);
+
+    DbgPrint("Device %d: trace buffer resized to 0x%Ix bytes, %I64u records moved\n",
+        DeviceContext->DeviceId, TraceBufGetSize(newBuf), records);
+
+    return STATUS_SUCCESS;
+}
+
+VOID
+RestartReadBatch(PDEVICE_CONTEXT DeviceContext)
+/*++
+
+Routine Description:
+
+    Count the device's read batch afresh from what its trace buffer holds,
+    and from its overwrite counters as they are. Producers are held off
+    meanwhile, their records are lost.
+
+    The caller holds PendingReadLock and DeviceCollectionLock, so no read
+    takes from the trace buffer meanwhile.
+
+--*/
+{
+    RING_BUF_STATS stats;
+    ULONG64 records;
+    ULONG64 bytes;
+
+    ExWaitForRundownProtectionReleaseCacheAware(DeviceContext->TraceBufRundown);
+
+    records = TraceBufCount(DeviceContext->TraceBuf, &bytes);
+    TraceBufGetStats(DeviceContext->TraceBuf, &stats);
+    ReadBatchRestart(&DeviceContext->ReadBatch, bytes, records, stats.OverwrittenBytes, stats.OverwrittenRecords);
+
+    ExReInitializeRundownProtectionCacheAware(DeviceContext->TraceBufRundown);
+}
+
+size_t
+ReadTraceBufs(PCONTROL_FILE_CONTEXT FileContext, PUCHAR Buffer, size_t BufferLength)
+/*++
+
+Routine Description:
+
+    Drain the trace buffer of the device selected on this handle, or of all
+    devices one after the other; each record carries its DeviceId. When
+    draining all, the device to start from rotates so one busy disk cannot
+    starve the others out of a small read buffer.
+
+    Only ServicePendingReads calls this, under PendingReadLock, which makes
+    it the only reader of the trace buffers, so they need no lock.
+    DeviceCollectionLock keeps the devices, and their trace buffers, from
+    going away meanwhile.
+
+Return Value:
+
+    Number of bytes copied.
+
+--*/
+{
+    ULONG noItems;
+    size_t copied = 0;
+
+    WdfWaitLockAcquire(DeviceCollectionLock, NULL);
+
+    noItems = WdfCollectionGetCount(DeviceCollection);
+
+    for (ULONG n = 0; n < noItems; n++) {
+        ULONG i = (FileContext->NextDevice + n) % noItems;
+        PDEVICE_CONTEXT deviceContext = DeviceGetContext(WdfCollectionGetItem(DeviceCollection, i));
+
+        if (deviceContext->TraceBuf == NULL) {
+            continue;
+        }
+
+        if (FileContext->DeviceId != STORTRACE_ALL_DEVICES) {
+            if (deviceContext->DeviceId == FileContext->DeviceId) {
+                copied = TakeTrace(deviceContext, Buffer, BufferLength);
+                break;
+            }
+            continue;
+        }
+
+        copied += TakeTrace(deviceContext, Buffer + copied, BufferLength - copied);
+    }
+
+    if (noItems) {
+        FileContext->NextDevice = (FileContext->NextDevice + 1) % noItems;
+    }
+
+    WdfWaitLockRelease(DeviceCollectionLock);
+
+    return copied;
+}
+
+size_t
+TakeTrace(PDEVICE_CONTEXT DeviceContext, PUCHAR Buffer, size_t BufferLength)
+/*++
+
+Routine Description:
+
+    Drain one device's trace buffer, and count what was taken against its
+    read batch.
+
+--*/
+{
+    size_t got = TraceBufGet(DeviceContext->TraceBuf, Buffer, BufferLength);
+    ULONG64 records = 0;
+    RING_BUF_STATS stats;
+
+    TraceBufGetStats(DeviceContext->TraceBuf, &stats);
+    ReadBatchOverwritten(&DeviceContext->ReadBatch, stats.OverwrittenBytes, stats.OverwrittenRecords);
+
+    for (size_t offset = 0; offset < got; offset += ((PTRACE_RECORD_HEADER)(Buffer + offset))->Length) {
+        records++;
+    }
+
+    if (got) {
+        ReadBatchTaken(&DeviceContext->ReadBatch, got, records);
+    }
+
+    return got;
+}
@@ -1,54 +1,68 @@
-/*++
-
-Module Name:
-
-    queue.h
-
-Abstract:
-
-    This file contains the queue definitions.
-
-Environment:
-
-    Kernel-mode Driver Framework
-
---*/
-
-EXTERN_C_START
-
-//
-// This is the context that can be placed per queue
-// and would contain per queue information.
-//
-typedef struct _QUEUE_CONTEXT {
-
-    ULONG PrivateDeviceData;  // just a placeholder
-
-} QUEUE_CONTEXT, *PQUEUE_CONTEXT;
-
-WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(QUEUE_CONTEXT, QueueGetContext)
-
-NTSTATUS
-StorTraceQueueInitialize(
-    _In_ WDFDEVICE Device
-);
-
-NTSTATUS
-StorTraceControlDeviceQueueInitialize(
-    _In_ WDFDEVICE Device
-);
-
-//
-// Events from the IoQueue object
-//
-EVT_WDF_IO_QUEUE_IO_DEVICE_CONTROL StorTraceEvtIoDeviceControl;
-EVT_WDF_IO_QUEUE_IO_STOP StorTraceEvtIoStop;
-
-EVT_WDF_IO_QUEUE_IO_INTERNAL_DEVICE_CONTROL StorTraceEvtIoInternalDeviceControl;
-EVT_WDF_IO_QUEUE_IO_WRITE StorTraceEvtIoWrite;
-EVT_WDF_IO_QUEUE_IO_READ StorTraceEvtIoRead;
-
-EVT_WDF_IO_QUEUE_IO_WRITE ControlDeviceEvtIoWrite;
-EVT_WDF_IO_QUEUE_IO_READ ControlDeviceEvtIoRead;
-
-EXTERN_C_END
+/*++
+
+Module Name:
+
+    queue.h
+
+Abstract:
+
+    This file contains the queue definitions.
+
+Environment:
+
+    Kernel-mode Driver Framework
+
+--*/
+
+EXTERN_C_START
+
+//
+// This is the context that can be placed per queue
+// and would contain per queue information.
+//
+typedef struct _QUEUE_CONTEXT {
+
+    ULONG PrivateDeviceData;  // just a placeholder
+
+} QUEUE_CONTEXT, *PQUEUE_CONTEXT;
+
+WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(QUEUE_CONTEXT, QueueGetContext)
+
+//
+// Context of every request the filter device receives, carries the
+// issue time to the completion routine
+//
+typedef struct _REQUEST_CONTEXT {
+
+    ULONG64 IssueTime;  // performance counter when sent down, 0 if not
+
+} REQUEST_CONTEXT, *PREQUEST_CONTEXT;
+
+WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(REQUEST_CONTEXT, RequestGetContext)
+
+NTSTATUS
+StorTraceQueueInitialize(
+    _In_ WDFDEVICE Device
+);
+
+NTSTATUS
+StorTraceControlDeviceQueueInitialize(
+    _In_ WDFDEVICE Device
+);
+
+//
+// Events from the IoQueue object
+//
+EVT_WDF_IO_QUEUE_IO_DEVICE_CONTROL StorTraceEvtIoDeviceControl;
+EVT_WDF_IO_QUEUE_IO_STOP StorTraceEvtIoStop;
+
+EVT_WDF_IO_QUEUE_IO_INTERNAL_DEVICE_CONTROL StorTraceEvtIoInternalDeviceControl;
+EVT_WDF_IO_QUEUE_IO_WRITE StorTraceEvtIoWrite;
+EVT_WDF_IO_QUEUE_IO_READ StorTraceEvtIoRead;
+
+EVT_WDF_IO_QUEUE_IO_WRITE ControlDeviceEvtIoWrite;
+EVT_WDF_IO_QUEUE_IO_READ ControlDeviceEvtIoRead;
+EVT_WDF_IO_IN_CALLER_CONTEXT ControlDeviceEvtIoInCallerContext;
+EVT_WDF_FILE_CLEANUP ControlDeviceEvtFileCleanup;
+
+EXTERN_C_END
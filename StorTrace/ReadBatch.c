@@ -0,0 +1,221 @@
+/*++
+
+Module Name:
+
+    ReadBatch.c
+
+Abstract:
+
+    Watermark and flush policy of the reads parked on the control device.
+    Producers count what they trace, the reader counts what it takes;
+    only the producer that takes a device over its watermark asks for the
+    parked reads to be serviced, and ReadBatchService decides which of
+    them get the trace.
+
+Environment:
+
+    Kernel-mode Driver Framework
+
+--*/
+
+#include "driver.h"
+
+#include "ReadBatch.h"
+
+
+//=========================================
+// Public Function
+//=========================================
+
+VOID
+ReadBatchInitConfig(PREAD_BATCH_CONFIG Config)
+{
+    Config->ByteWatermark = READ_BATCH_DEFAULT_BYTES;
+    Config->RecordWatermark = READ_BATCH_DEFAULT_RECORDS;
+    Config->FlushTimeoutMs = READ_BATCH_DEFAULT_TIMEOUT_MS;
+}
+
+VOID
+ReadBatchInit(PREAD_BATCH Batch)
+{
+    Batch->Bytes = 0;
+    Batch->Records = 0;
+    Batch->Signaled = FALSE;
+    Batch->OverwrittenRecords = 0;
+    Batch->OverwrittenBytes = 0;
+}
+
+VOID
+ReadBatchRestart(PREAD_BATCH Batch, ULONG64 Bytes, ULONG64 Records, ULONG64 OverwrittenBytes, ULONG64 OverwrittenRecords)
+/*++
+
+Routine Description:
+
+    Count afresh from what the trace buffer holds, when it was replaced or
+    read other than through ReadBatchTaken (a mapped ring). Overwritten*
+    are its overwrite counters as of now, so only what is overwritten
+    from now on is counted as taken. The producers and the reader must be
+    held off.
+
+--*/
+{
+    ReadBatchInit(Batch);
+    Batch->Bytes = (LONG64)Bytes;
+    Batch->Records = (LONG64)Records;
+    Batch->OverwrittenBytes = OverwrittenBytes;
+    Batch->OverwrittenRecords = OverwrittenRecords;
+}
+
+BOOLEAN
+ReadBatchAdd(PREAD_BATCH Batch, PREAD_BATCH_CONFIG Config, ULONG Bytes)
+/*++
+
+Routine Description:
+
+    Count one record put into the device's trace buffer. Callable at
+    IRQL <= DISPATCH_LEVEL from any number of processors.
+
+Return Value:
+
+    TRUE if the caller has to get the parked reads serviced: the device
+    just reached a watermark, and nobody reported it yet.
+
+--*/
+{
+    LONG64 bytes = InterlockedExchangeAdd64(&Batch->Bytes, Bytes) + Bytes;
+    LONG64 records = InterlockedIncrement64(&Batch->Records);
+
+    if ((ULONG64)bytes < Config->ByteWatermark && (ULONG64)records < Config->RecordWatermark)
+    {
+        return FALSE;
+    }
+
+    // Only one producer reports it, until the reader takes the records
+    return (InterlockedCompareExchange(&Batch->Signaled, TRUE, FALSE) == FALSE);
+}
+
+BOOLEAN
+ReadBatchIsReady(PREAD_BATCH Batch, PREAD_BATCH_CONFIG Config, BOOLEAN Flush)
+/*++
+
+Routine Description:
+
+    Whether a parked read should take the device's records now: it reached
+    a watermark, or it has any and Flush (the timeout expired) is set.
+
+--*/
+{
+    LONG64 bytes = ReadNoFence64(&Batch->Bytes);
+    LONG64 records = ReadNoFence64(&Batch->Records);
+
+    if (Flush)
+    {
+        return (records > 0);
+    }
+
+    return ((ULONG64)bytes >= Config->ByteWatermark || (ULONG64)records >= Config->RecordWatermark);
+}
+
+VOID
+ReadBatchTaken(PREAD_BATCH Batch, ULONG64 Bytes, ULONG64 Records)
+/*++
+
+Routine Description:
+
+    Count records the reader took from the device's trace buffer. Reader
+    only.
+
+--*/
+{
+    InterlockedExchangeAdd64(&Batch->Bytes, -(LONG64)Bytes);
+    InterlockedExchangeAdd64(&Batch->Records, -(LONG64)Records);
+
+    //
+    // The next producer over a watermark reports again; the reader itself
+    // goes on while any device is still over it
+    //
+    InterlockedExchange(&Batch->Signaled, FALSE);
+}
+
+VOID
+ReadBatchOverwritten(PREAD_BATCH Batch, ULONG64 TotalBytes, ULONG64 TotalRecords)
+/*++
+
+Routine Description:
+
+    Records the producers retired unread (overwrite-oldest policy) will
+    never be taken: count them as taken. TotalBytes and TotalRecords are
+    the trace buffer's overwrite counters. Reader only.
+
+--*/
+{
+    ULONG64 bytes = TotalBytes - Batch->OverwrittenBytes;
+    ULONG64 records = TotalRecords - Batch->OverwrittenRecords;
+
+    if (records == 0)
+    {
+        return;
+    }
+
+    Batch->OverwrittenBytes = TotalBytes;
+    Batch->OverwrittenRecords = TotalRecords;
+
+    ReadBatchTaken(Batch, bytes, records);
+}
+
+ULONG
+ReadBatchService(const READ_BATCH_READS *Reads, BOOLEAN Flush)
+/*++
+
+Routine Description:
+
+    Complete parked reads, oldest first, for as long as some device has
+    trace ready for them. A read whose handle selected a device with
+    nothing for it is put aside, and the next one is tried; each read
+    parked on entry is tried at most once. Those put aside then go back
+    in line, behind the reads still parked. Only one caller at a time.
+
+Return Value:
+
+    Number of reads still parked.
+
+--*/
+{
+    ULONG parked = Reads->Count(READ_BATCH_PARKED);
+    NTSTATUS status;
+    size_t copied;
+    PVOID read;
+
+    for (; parked != 0 && Reads->AnyReady(Flush); parked--)
+    {
+        read = Reads->Retrieve(READ_BATCH_PARKED);
+        if (read == NULL)
+        {
+            break;
+        }
+
+        copied = Reads->Fill(read);
+        if (copied != 0)
+        {
+            Reads->Complete(read, STATUS_SUCCESS, copied);
+            continue;
+        }
+
+        status = Reads->Park(read, READ_BATCH_ASIDE);
+        if (!NT_SUCCESS(status))
+        {
+            Reads->Complete(read, status, 0);
+        }
+    }
+
+    while ((read = Reads->Retrieve(READ_BATCH_ASIDE)) != NULL)
+    {
+        status = Reads->Park(read, READ_BATCH_PARKED);
+        if (!NT_SUCCESS(status))
+        {
+            Reads->Complete(read, status, 0);
+        }
+    }
+
+    return Reads->Count(READ_BATCH_PARKED);
+}
@@ -0,0 +1,87 @@
+#pragma once
+
+//
+// When to complete the reads parked on the control device: as soon as a
+// device has traced enough for a worthwhile read (a byte or a record
+// watermark), or, when the flush timeout expires, as soon as it has
+// traced anything at all. Free of WDF, so the policy does not depend on
+// how the reads are parked.
+//
+#define READ_BATCH_DEFAULT_BYTES        (256 * 1024)
+#define READ_BATCH_DEFAULT_RECORDS      2048
+#define READ_BATCH_DEFAULT_TIMEOUT_MS   100
+
+//
+// Optional DWORDs under the service's Parameters key
+//
+#define READ_BATCH_BYTES_VALUE          L"ReadByteWatermark"
+#define READ_BATCH_RECORDS_VALUE        L"ReadRecordWatermark"
+#define READ_BATCH_TIMEOUT_VALUE        L"ReadFlushTimeout"
+
+typedef struct _READ_BATCH_CONFIG {
+    ULONG   ByteWatermark;
+    ULONG   RecordWatermark;
+    ULONG   FlushTimeoutMs;
+} READ_BATCH_CONFIG, *PREAD_BATCH_CONFIG;
+
+//
+// What one device has traced and the reader has not taken yet
+//
+typedef struct _READ_BATCH {
+    volatile LONG64 Bytes;
+    volatile LONG64 Records;
+    volatile LONG   Signaled;   // watermark reported and not read since
+
+    //
+    // Overwritten in the trace buffer as of the last read, reader only
+    //
+    ULONG64 OverwrittenRecords;
+    ULONG64 OverwrittenBytes;
+} READ_BATCH, *PREAD_BATCH;
+
+//
+// The reads are parked in one of two queues: they wait in
+// READ_BATCH_PARKED, and a pass over them puts those it has nothing for
+// in READ_BATCH_ASIDE, then back. A read is never put back in the queue
+// it was just taken from; KMDF does not forward a request to its own
+// queue.
+//
+#define READ_BATCH_PARKED               0
+#define READ_BATCH_ASIDE                1
+
+//
+// How ReadBatchService gets at the parked reads and the trace, so the
+// order the reads are served in does not depend on WDF either
+//
+typedef struct _READ_BATCH_READS {
+    ULONG       (*Count)(ULONG Queue);
+    PVOID       (*Retrieve)(ULONG Queue);       // oldest read of the queue, NULL if none
+    NTSTATUS    (*Park)(PVOID Read, ULONG Queue);
+    BOOLEAN     (*AnyReady)(BOOLEAN Flush);     // some device has trace for a read
+    size_t      (*Fill)(PVOID Read);            // bytes of trace put in the read
+    VOID        (*Complete)(PVOID Read, NTSTATUS Status, size_t Information);
+} READ_BATCH_READS, *PREAD_BATCH_READS;
+
+VOID
+ReadBatchInitConfig(PREAD_BATCH_CONFIG Config);
+
+VOID
+ReadBatchInit(PREAD_BATCH Batch);
+
+BOOLEAN
+ReadBatchAdd(PREAD_BATCH Batch, PREAD_BATCH_CONFIG Config, ULONG Bytes);
+
+BOOLEAN
+ReadBatchIsReady(PREAD_BATCH Batch, PREAD_BATCH_CONFIG Config, BOOLEAN Flush);
+
+VOID
+ReadBatchTaken(PREAD_BATCH Batch, ULONG64 Bytes, ULONG64 Records);
+
+VOID
+ReadBatchRestart(PREAD_BATCH Batch, ULONG64 Bytes, ULONG64 Records, ULONG64 OverwrittenBytes, ULONG64 OverwrittenRecords);
+
+VOID
+ReadBatchOverwritten(PREAD_BATCH Batch, ULONG64 TotalBytes, ULONG64 TotalRecords);
+
+ULONG
+ReadBatchService(const READ_BATCH_READS *Reads, BOOLEAN Flush);
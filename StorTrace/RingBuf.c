@@ -1,131 +1,647 @@
-/*
-    Reference:
-    https://embeddedartistry.com/blog/2017/4/6/circular-buffers-in-cc
-*/
-
-#include "driver.h"
-#include "ntdef.h"
-
-#include "RingBuf.h"
-
-
-//=========================================
-// Macro definition
-//=========================================
-#define RING_BUF_SIZE  (10 * 1024 * 1024)
-
-//=========================================
-// Data Type Definition
-//=========================================
-
-typedef struct _RING_BUF {
-    UCHAR  Buffer[RING_BUF_SIZE];
-    size_t  Head;
-    size_t  Tail;
-    size_t  Size; //of the buffer
-} RING_BUFF;
-
-
-//=========================================
-// Function Declaration
-//=========================================
-static VOID
-InternalPut(UCHAR Data);
-
-//=========================================
-// Variable definition
-//=========================================
-static RING_BUFF RingBuf;
-
-
-//=========================================
-// Public Function
-//=========================================
-
-VOID
-RingBufReset(void)
-{
-    RingBuf.Head = 0;
-    RingBuf.Tail = 0;
-    RingBuf.Size = RING_BUF_SIZE;
-}
-
-BOOLEAN
-RingBufIsEmpty(void)
-{    
-    // We define empty as Head == Tail
-    return (RingBuf.Head == RingBuf.Tail);
-}
-
-BOOLEAN
-RingBufIsFull(void)
-{
-    // We determine "full" case by Head being one position behind the Tail
-    // Note that this means we are wasting one space in the buffer!
-    // Instead, you could have an "empty" flag and determine buffer full that way
-    return ((RingBuf.Head + 1) % RingBuf.Size) == RingBuf.Tail;
-}
-
-
-VOID
-RingBufPutEx(PUCHAR Data, UINT32 DataLength)
-{    
-    if (FALSE)
-    //if ((RingBuf.Head + DataLength) < (RingBuf.Size - 1))
-    {
-        RtlCopyMemory(&(RingBuf.Buffer[RingBuf.Head]), Data, DataLength);
-        // if the head will cross the tail, meaning overwrite some data
-        if (RingBuf.Head < RingBuf.Tail && (RingBuf.Head + DataLength) >= RingBuf.Tail)
-        {
-            RingBuf.Tail = (RingBuf.Head + DataLength) + 1;
-        }
-
-        RingBuf.Head = (RingBuf.Head + DataLength);
-    }
-    else
-    {
-        for (UINT32 i = 0; i < DataLength; i++)
-        {
-            InternalPut(Data[i]);
-        }
-    }
-}
-
-
-VOID
-RingBufPut(UCHAR Data)
-{        
-    InternalPut(Data);
-}
-
-BOOLEAN
-RingBufGet(UCHAR *pData)
-{
-    BOOLEAN r = FALSE;
-
-    if (pData && !RingBufIsEmpty())
-    {
-        *pData = RingBuf.Buffer[RingBuf.Tail];
-        RingBuf.Tail = (RingBuf.Tail + 1) % RingBuf.Size;
-
-        r = TRUE;
-    }
-
-    return r;
-}
-
-
-//=========================================
-//  Private function
-//=========================================
-VOID
-InternalPut(UCHAR Data)
-{
-    RingBuf.Buffer[RingBuf.Head] = Data;
-    RingBuf.Head = (RingBuf.Head + 1) % RingBuf.Size;
-
-    if (RingBuf.Head == RingBuf.Tail)
-    {
-        RingBuf.Tail = (RingBuf.Tail + 1) % RingBuf.Size;
-    }
-}
+/*
+    Reference:
+    https://embeddedartistry.com/blog/2017/4/6/circular-buffers-in-cc
+
+    Head and Tail are free-running 64-bit byte counters: they are never
+    wrapped, the buffer position is the counter masked with (Size - 1).
+    Head - Tail is the number of bytes in the ring, so full and empty are
+    exact and no slot is wasted, and each byte has an absolute stream offset.
+
+    The ring is multi-producer, single-consumer and takes no lock:
+    - a producer reserves an entry by moving Head forward with a
+      compare-exchange, copies its record in, then publishes the entry by
+      writing the commit stamp of its offset into the entry header;
+    - the reader walks entries from Tail, stops at the first entry that is
+      not committed yet, and takes each one by moving Tail past it with a
+      compare-exchange.
+    When a record does not fit, the ring's policy either drops it, or
+    retires the oldest committed entries whole, moving Tail past them the
+    same way the reader does, until it fits. A reader whose compare-exchange
+    fails lost the entry it was copying to a producer and drops the copy.
+    Either way the loss is counted, and an entry is never cut in the middle.
+
+    The cursors and the drop counters live in a header page in front of the
+    data, in the layout of RingLayout.h, so the whole ring can be mapped
+    read-only into a user-mode reader (RingBufMapUser). While it is mapped,
+    that reader walks the entries in place and the driver only moves Tail
+    on its behalf (RingBufRelease).
+*/
+
+#include "driver.h"
+#include "ntdef.h"
+
+#include "RingBuf.h"
+
+
+//=========================================
+// Data Type Definition
+//=========================================
+
+//
+// The header page and the data area are one allocation, so the ring can
+// be mapped into a consumer as is (see RingLayout.h)
+//
+struct _RING_BUF {
+    PRING_HEADER Header;
+    PUCHAR  Buffer; //data area, right after the header page
+    size_t  Size; //of the data area
+    size_t  Mask; //Size - 1
+    ULONG   Policy; //RING_OVERFLOW_*
+    volatile LONG References;
+    volatile LONG Mapped;
+};
+
+
+//=========================================
+// Function Declaration
+//=========================================
+static VOID
+InternalCopyIn(PRING_BUF Ring, ULONG64 Offset, PUCHAR Data, size_t DataLength);
+
+static VOID
+InternalCopyOut(PRING_BUF Ring, ULONG64 Offset, PUCHAR Data, size_t DataLength);
+
+static ULONG
+InternalPeek(PRING_BUF Ring, LONG64 Offset, PULONG64 Timestamp);
+
+static BOOLEAN
+InternalRetireOldest(PRING_BUF Ring, LONG64 Tail);
+
+static VOID
+InternalRaiseHighWater(PRING_BUF Ring, LONG64 Used);
+
+
+//=========================================
+// Public Function
+//=========================================
+
+PRING_BUF
+RingBufCreate(size_t Size, ULONG Policy)
+/*++
+
+Routine Description:
+
+    Allocate a ring of Size bytes from nonpaged pool. Size must be a power
+    of two. Policy, a RING_OVERFLOW_* value, is what to do when a record
+    does not fit. Called at PASSIVE_LEVEL.
+
+--*/
+{
+    PRING_BUF ring;
+
+    if (Size < PAGE_SIZE || (Size & (Size - 1)) != 0 || Policy > RING_OVERFLOW_OVERWRITE_OLDEST)
+    {
+        return NULL;
+    }
+
+    ring = ExAllocatePoolWithTag(NonPagedPoolNxCacheAligned, sizeof(RING_BUF), STORTRACE_POOL_TAG);
+    if (ring == NULL)
+    {
+        return NULL;
+    }
+
+    RtlZeroMemory(ring, sizeof(RING_BUF));
+
+    // Page aligned, as any allocation of a page or more
+    ring->Header = ExAllocatePoolWithTag(NonPagedPoolNx, RING_HEADER_SIZE + Size, STORTRACE_POOL_TAG);
+    if (ring->Header == NULL)
+    {
+        ExFreePoolWithTag(ring, STORTRACE_POOL_TAG);
+        return NULL;
+    }
+
+    RtlZeroMemory(ring->Header, RING_HEADER_SIZE);
+    ring->Header->Magic = RING_HEADER_MAGIC;
+    ring->Header->Version = RING_HEADER_VERSION;
+    ring->Header->Size = Size;
+    ring->Header->Policy = Policy;
+
+    ring->Buffer = (PUCHAR)ring->Header + RING_HEADER_SIZE;
+    ring->Size = Size;
+    ring->Mask = Size - 1;
+    ring->Policy = Policy;
+    ring->References = 1;
+    RingBufReset(ring);
+
+    return ring;
+}
+
+VOID
+RingBufDelete(PRING_BUF Ring)
+/*++
+
+Routine Description:
+
+    Drop the creator's reference. The memory goes away with the last
+    reference, which may be held by a user mapping (RingBufMapUser).
+
+--*/
+{
+    if (Ring && InterlockedDecrement(&Ring->References) == 0)
+    {
+        ExFreePoolWithTag(Ring->Header, STORTRACE_POOL_TAG);
+        ExFreePoolWithTag(Ring, STORTRACE_POOL_TAG);
+    }
+}
+
+VOID
+RingBufReset(PRING_BUF Ring)
+{
+    // Cursors restart from 0, old stamps must not survive
+    RtlZeroMemory(Ring->Buffer, Ring->Size);
+    Ring->Header->Head = 0;
+    Ring->Header->Tail = 0;
+    Ring->Header->DroppedRecords = 0;
+    Ring->Header->DroppedBytes = 0;
+    Ring->Header->OverwrittenRecords = 0;
+    Ring->Header->OverwrittenBytes = 0;
+    Ring->Header->HighWater = 0;
+}
+
+BOOLEAN
+RingBufIsEmpty(PRING_BUF Ring)
+{
+    // We define empty as Head == Tail
+    return (ReadAcquire64(&Ring->Header->Head) == ReadAcquire64(&Ring->Header->Tail));
+}
+
+BOOLEAN
+RingBufIsFull(PRING_BUF Ring)
+{
+    return (ULONG64)(ReadAcquire64(&Ring->Header->Head) - ReadAcquire64(&Ring->Header->Tail)) == Ring->Size;
+}
+
+
+BOOLEAN
+RingBufPutEx(PRING_BUF Ring, ULONG64 Timestamp, PUCHAR Data, UINT32 DataLength)
+/*++
+
+Routine Description:
+
+    Put one complete record into the ring, safe to call from any number of
+    processors at once at IRQL <= DISPATCH_LEVEL. The entry header and the
+    record are copied in one after the other, each with one RtlCopyMemory
+    call, or two where it wraps around the end of the buffer. Timestamp is
+    kept with the record for RingBufPeek.
+
+Return Value:
+
+    FALSE if the record was dropped because the ring is full.
+
+--*/
+{
+    size_t entrySize = RING_ENTRY_SIZE(DataLength);
+    RING_ENTRY_HEADER header;
+    LONG64 head;
+    LONG64 tail;
+
+    if (DataLength == 0 || entrySize > Ring->Size)
+    {
+        return FALSE;
+    }
+
+    //
+    // Reserve the entry
+    //
+    while (TRUE)
+    {
+        head = ReadNoFence64(&Ring->Header->Head);
+        tail = ReadAcquire64(&Ring->Header->Tail);
+
+        if ((ULONG64)(head - tail) + entrySize > Ring->Size)
+        {
+            // Make room and look again, or give up on this record
+            if (InternalRetireOldest(Ring, tail))
+            {
+                continue;
+            }
+
+            InterlockedIncrement64(&Ring->Header->DroppedRecords);
+            InterlockedExchangeAdd64(&Ring->Header->DroppedBytes, DataLength);
+            return FALSE;
+        }
+
+        if (InterlockedCompareExchange64(&Ring->Header->Head, head + (LONG64)entrySize, head) == head)
+        {
+            break;
+        }
+    }
+
+    InternalRaiseHighWater(Ring, head + (LONG64)entrySize - tail);
+
+    //
+    // Fill it in, then publish it
+    //
+    header.Timestamp = Timestamp;
+    header.Length = DataLength;
+    header.Reserved = 0;
+
+    InternalCopyIn(Ring, (ULONG64)head + FIELD_OFFSET(RING_ENTRY_HEADER, Timestamp),
+        (PUCHAR)&header.Timestamp, sizeof(RING_ENTRY_HEADER) - FIELD_OFFSET(RING_ENTRY_HEADER, Timestamp));
+    InternalCopyIn(Ring, (ULONG64)head + sizeof(RING_ENTRY_HEADER), Data, DataLength);
+
+    InterlockedExchange64((PLONG64)&(Ring->Buffer[head & Ring->Mask]), RING_COMMIT_STAMP((ULONG64)head));
+
+    return TRUE;
+}
+
+
+size_t
+RingBufGetEx(PRING_BUF Ring, PUCHAR Data, size_t DataLength, PULONG64 StreamOffset)
+/*++
+
+Routine Description:
+
+    Drain committed records into Data, as many as fit in DataLength. Only
+    one reader may call this at a time. Records are returned back to back,
+    without the ring's entry headers.
+
+    StreamOffset (optional) receives the absolute offset of the first entry
+    returned. If it is ahead of where the previous read ended, the
+    difference is the number of bytes that were overwritten in between.
+
+Return Value:
+
+    Number of bytes copied, 0 if there is no committed record or Data
+    cannot hold the oldest one.
+
+--*/
+{
+    LONG64 tail = ReadAcquire64(&Ring->Header->Tail);
+    LONG64 current;
+    size_t copied = 0;
+    ULONG length;
+    ULONG64 timestamp;
+
+    if (StreamOffset)
+    {
+        *StreamOffset = (ULONG64)tail;
+    }
+
+    if (Data == NULL)
+    {
+        return 0;
+    }
+
+    while ((length = InternalPeek(Ring, tail, &timestamp)) != 0)
+    {
+        if (copied + length > DataLength)
+        {
+            break;
+        }
+
+        InternalCopyOut(Ring, (ULONG64)tail + sizeof(RING_ENTRY_HEADER), Data + copied, length);
+
+        //
+        // Take the entry and hand its space back to the producers. If a
+        // producer retired it meanwhile, the copy may be torn: drop it and
+        // go on from the new oldest entry.
+        //
+        current = InterlockedCompareExchange64(&Ring->Header->Tail, tail + (LONG64)RING_ENTRY_SIZE(length), tail);
+        if (current != tail)
+        {
+            tail = current;
+            if (StreamOffset && copied == 0)
+            {
+                *StreamOffset = (ULONG64)tail;
+            }
+            continue;
+        }
+
+        copied += length;
+        tail += (LONG64)RING_ENTRY_SIZE(length);
+    }
+
+    return copied;
+}
+
+ULONG
+RingBufPeek(PRING_BUF Ring, PULONG64 Timestamp)
+/*++
+
+Routine Description:
+
+    Look at the oldest committed record without consuming it. Reader only.
+
+Return Value:
+
+    Length of the record, 0 if there is no committed record.
+
+--*/
+{
+    return InternalPeek(Ring, Ring->Header->Tail, Timestamp);
+}
+
+VOID
+RingBufGetStats(PRING_BUF Ring, PRING_BUF_STATS Stats)
+{
+    Stats->HighWater = (ULONG64)ReadNoFence64(&Ring->Header->HighWater);
+    Stats->DroppedRecords = (ULONG64)ReadNoFence64(&Ring->Header->DroppedRecords);
+    Stats->DroppedBytes = (ULONG64)ReadNoFence64(&Ring->Header->DroppedBytes);
+    Stats->OverwrittenRecords = (ULONG64)ReadNoFence64(&Ring->Header->OverwrittenRecords);
+    Stats->OverwrittenBytes = (ULONG64)ReadNoFence64(&Ring->Header->OverwrittenBytes);
+}
+
+ULONG64
+RingBufCount(PRING_BUF Ring, PULONG64 Bytes)
+/*++
+
+Routine Description:
+
+    Count the committed records in the ring, up to the first one still
+    being written. Reader only; exact if the producers are held off.
+
+Return Value:
+
+    Number of records, Bytes receives their length.
+
+--*/
+{
+    LONG64 tail = ReadAcquire64(&Ring->Header->Tail);
+    ULONG64 records = 0;
+    ULONG length;
+    ULONG64 timestamp;
+
+    *Bytes = 0;
+
+    while ((length = InternalPeek(Ring, tail, &timestamp)) != 0)
+    {
+        records++;
+        *Bytes += length;
+        tail += (LONG64)RING_ENTRY_SIZE(length);
+    }
+
+    return records;
+}
+
+PVOID
+RingBufMapUser(PRING_BUF Ring, PMDL *Mdl)
+/*++
+
+Routine Description:
+
+    Map the header page and the data area read-only into the current
+    process. Must be called in the context of the process that gets the
+    mapping, at PASSIVE_LEVEL. Only one mapping may exist at a time: the
+    mapping's owner becomes the ring's only reader.
+
+    The mapping holds a reference on the ring until RingBufUnmapUser.
+
+Return Value:
+
+    User address of the RING_HEADER, NULL on failure.
+
+--*/
+{
+    PMDL mdl;
+    PVOID address = NULL;
+
+    if (InterlockedCompareExchange(&Ring->Mapped, TRUE, FALSE) != FALSE)
+    {
+        return NULL;
+    }
+
+    mdl = IoAllocateMdl(Ring->Header, (ULONG)(RING_HEADER_SIZE + Ring->Size), FALSE, FALSE, NULL);
+    if (mdl == NULL)
+    {
+        InterlockedExchange(&Ring->Mapped, FALSE);
+        return NULL;
+    }
+
+    MmBuildMdlForNonPagedPool(mdl);
+
+    __try
+    {
+        address = MmMapLockedPagesSpecifyCache(mdl, UserMode, MmCached, NULL, FALSE,
+            NormalPagePriority | MdlMappingNoWrite | MdlMappingNoExecute);
+    }
+    __except (EXCEPTION_EXECUTE_HANDLER)
+    {
+        address = NULL;
+    }
+
+    if (address == NULL)
+    {
+        IoFreeMdl(mdl);
+        InterlockedExchange(&Ring->Mapped, FALSE);
+        return NULL;
+    }
+
+    InterlockedIncrement(&Ring->References);
+    *Mdl = mdl;
+
+    return address;
+}
+
+VOID
+RingBufUnmapUser(PRING_BUF Ring, PVOID Address, PMDL Mdl)
+/*++
+
+Routine Description:
+
+    Undo RingBufMapUser. Must be called in the context of the process that
+    owns the mapping, at PASSIVE_LEVEL. May free the ring if it was deleted
+    while mapped.
+
+--*/
+{
+    MmUnmapLockedPages(Address, Mdl);
+    IoFreeMdl(Mdl);
+
+    InterlockedExchange(&Ring->Mapped, FALSE);
+    RingBufDelete(Ring);
+}
+
+BOOLEAN
+RingBufIsMapped(PRING_BUF Ring)
+{
+    return ReadNoFence(&Ring->Mapped) != FALSE;
+}
+
+BOOLEAN
+RingBufRelease(PRING_BUF Ring, LONG64 Tail)
+/*++
+
+Routine Description:
+
+    Move Tail to Tail on behalf of a reader that consumed the entries in
+    place. Tail comes from user mode, so it is only taken if walking the
+    committed entries from the current Tail lands on it exactly: a value
+    inside an entry would leave the stream out of sync, and one past an
+    entry still being written would hand its space to the next producer
+    while the first one copies into it.
+
+    Nothing else moves Tail meanwhile: the mapping's owner is the only
+    reader, and a mapped ring never retires entries (InternalRetireOldest).
+    The walk is as long as what is released.
+
+Return Value:
+
+    FALSE if Tail is not the end of a committed entry, or the current Tail.
+
+--*/
+{
+    LONG64 tail = ReadNoFence64(&Ring->Header->Tail);
+    ULONG length;
+    ULONG64 timestamp;
+
+    if (Tail < tail || Tail > ReadAcquire64(&Ring->Header->Head))
+    {
+        return FALSE;
+    }
+
+    while (tail < Tail)
+    {
+        length = InternalPeek(Ring, tail, &timestamp);
+        if (length == 0)
+        {
+            return FALSE;
+        }
+
+        tail += (LONG64)RING_ENTRY_SIZE(length);
+    }
+
+    if (tail != Tail)
+    {
+        return FALSE;
+    }
+
+    WriteRelease64(&Ring->Header->Tail, Tail);
+
+    return TRUE;
+}
+
+
+//=========================================
+//  Private function
+//=========================================
+ULONG
+InternalPeek(PRING_BUF Ring, LONG64 Offset, PULONG64 Timestamp)
+{
+    RING_ENTRY_HEADER header;
+
+    if (Offset == ReadAcquire64(&Ring->Header->Head))
+    {
+        return 0;
+    }
+
+    // Reserved but still being written
+    if (ReadAcquire64((PLONG64)&(Ring->Buffer[Offset & Ring->Mask])) != RING_COMMIT_STAMP((ULONG64)Offset))
+    {
+        return 0;
+    }
+
+    InternalCopyOut(Ring, (ULONG64)Offset + FIELD_OFFSET(RING_ENTRY_HEADER, Timestamp),
+        (PUCHAR)&header.Timestamp, sizeof(RING_ENTRY_HEADER) - FIELD_OFFSET(RING_ENTRY_HEADER, Timestamp));
+
+    // Retired and overwritten since the stamp was checked
+    if (header.Length == 0 || header.Length > Ring->Size - sizeof(RING_ENTRY_HEADER))
+    {
+        return 0;
+    }
+
+    *Timestamp = header.Timestamp;
+    return header.Length;
+}
+
+BOOLEAN
+InternalRetireOldest(PRING_BUF Ring, LONG64 Tail)
+/*++
+
+Routine Description:
+
+    Full ring, overwrite-oldest policy: move Tail past the oldest entry, so
+    its space can be reserved again. Tail is where the caller saw it.
+
+    The entry must be committed, its length is not known otherwise. The
+    compare-exchange fails if the reader or another producer took it
+    first, which also covers a length read from an entry that was being
+    overwritten meanwhile: it cannot be, as long as Tail has not moved.
+
+Return Value:
+
+    TRUE if Tail moved, by this call or another one, so there may be room
+    now. FALSE if the new record has to be dropped.
+
+--*/
+{
+    RING_ENTRY_HEADER header;
+    size_t entrySize;
+
+    // A mapped ring is consumed in place, its entries must stay put
+    if (Ring->Policy != RING_OVERFLOW_OVERWRITE_OLDEST || ReadNoFence(&Ring->Mapped))
+    {
+        return FALSE;
+    }
+
+    // Oldest entry still being written
+    if (ReadAcquire64((PLONG64)&(Ring->Buffer[Tail & Ring->Mask])) != RING_COMMIT_STAMP((ULONG64)Tail))
+    {
+        return (ReadAcquire64(&Ring->Header->Tail) != Tail);
+    }
+
+    InternalCopyOut(Ring, (ULONG64)Tail + FIELD_OFFSET(RING_ENTRY_HEADER, Length),
+        (PUCHAR)&header.Length, sizeof(header.Length));
+    entrySize = RING_ENTRY_SIZE(header.Length);
+
+    if (InterlockedCompareExchange64(&Ring->Header->Tail, Tail + (LONG64)entrySize, Tail) == Tail)
+    {
+        InterlockedIncrement64(&Ring->Header->OverwrittenRecords);
+        InterlockedExchangeAdd64(&Ring->Header->OverwrittenBytes, header.Length);
+    }
+
+    return TRUE;
+}
+
+VOID
+InternalRaiseHighWater(PRING_BUF Ring, LONG64 Used)
+{
+    LONG64 highWater = ReadNoFence64(&Ring->Header->HighWater);
+
+    // Rarely taken once the ring has been through a busy period
+    while (Used > highWater)
+    {
+        LONG64 current = InterlockedCompareExchange64(&Ring->Header->HighWater, Used, highWater);
+        if (current == highWater)
+        {
+            break;
+        }
+        highWater = current;
+    }
+}
+
+VOID
+InternalCopyIn(PRING_BUF Ring, ULONG64 Offset, PUCHAR Data, size_t DataLength)
+{
+    size_t head = (size_t)(Offset & Ring->Mask);
+    size_t first = Ring->Size - head;
+
+    if (first > DataLength)
+    {
+        first = DataLength;
+    }
+
+    RtlCopyMemory(&(Ring->Buffer[head]), Data, first);
+    if (first < DataLength)
+    {
+        RtlCopyMemory(&(Ring->Buffer[0]), Data + first, DataLength - first);
+    }
+}
+
+VOID
+InternalCopyOut(PRING_BUF Ring, ULONG64 Offset, PUCHAR Data, size_t DataLength)
+{
+    size_t tail = (size_t)(Offset & Ring->Mask);
+    size_t first = Ring->Size - tail;
+
+    if (first > DataLength)
+    {
+        first = DataLength;
+    }
+
+    RtlCopyMemory(Data, &(Ring->Buffer[tail]), first);
+    if (first < DataLength)
+    {
+        RtlCopyMemory(Data + first, &(Ring->Buffer[0]), DataLength - first);
+    }
+}
@@ -1,19 +1,58 @@
-#pragma once
-
-VOID
-RingBufReset(void);
-
-BOOLEAN
-RingBufIsEmpty(void);
-
-BOOLEAN
-RingBufIsFull(void);
-
-VOID
-RingBufPut(UCHAR Data);
-
-BOOLEAN
-RingBufGet(UCHAR *pData);
-
-VOID
-RingBufPutEx(PUCHAR Data, UINT32 DataLength);
+#pragma once
+
+#include "RingLayout.h"
+
+typedef struct _RING_BUF RING_BUF, *PRING_BUF;
+
+//
+// What overflowing did to a ring, for sizing it
+//
+typedef struct _RING_BUF_STATS {
+    ULONG64 HighWater;
+    ULONG64 DroppedRecords;
+    ULONG64 DroppedBytes;
+    ULONG64 OverwrittenRecords;
+    ULONG64 OverwrittenBytes;
+} RING_BUF_STATS, *PRING_BUF_STATS;
+
+PRING_BUF
+RingBufCreate(size_t Size, ULONG Policy);
+
+VOID
+RingBufDelete(PRING_BUF Ring);
+
+VOID
+RingBufReset(PRING_BUF Ring);
+
+BOOLEAN
+RingBufIsEmpty(PRING_BUF Ring);
+
+BOOLEAN
+RingBufIsFull(PRING_BUF Ring);
+
+size_t
+RingBufGetEx(PRING_BUF Ring, PUCHAR Data, size_t DataLength, PULONG64 StreamOffset);
+
+ULONG
+RingBufPeek(PRING_BUF Ring, PULONG64 Timestamp);
+
+BOOLEAN
+RingBufPutEx(PRING_BUF Ring, ULONG64 Timestamp, PUCHAR Data, UINT32 DataLength);
+
+VOID
+RingBufGetStats(PRING_BUF Ring, PRING_BUF_STATS Stats);
+
+ULONG64
+RingBufCount(PRING_BUF Ring, PULONG64 Bytes);
+
+PVOID
+RingBufMapUser(PRING_BUF Ring, PMDL *Mdl);
+
+VOID
+RingBufUnmapUser(PRING_BUF Ring, PVOID Address, PMDL Mdl);
+
+BOOLEAN
+RingBufIsMapped(PRING_BUF Ring);
+
+BOOLEAN
+RingBufRelease(PRING_BUF Ring, LONG64 Tail);
@@ -0,0 +1,90 @@
+/*++
+
+Module Name:
+
+    RingLayout.h
+
+Abstract:
+
+    Memory layout of a trace ring, shared by the driver and the user
+    applications that map a ring with IOCTL_STORTRACE_MAP_RING.
+
+    A ring is one header page followed by the data area. The data area
+    holds entries back to back at free-running 64-bit stream offsets, the
+    position of an offset being (offset & (Size - 1)). Each entry is a
+    RING_ENTRY_HEADER followed by one trace record, and takes
+    RING_ENTRY_SIZE bytes.
+
+    Producers reserve an entry by moving Head, then publish it by writing
+    RING_COMMIT_STAMP(offset) into its Commit word, last. A consumer reads
+    entries from Tail while they carry the stamp of their own offset, then
+    hands the space back by moving Tail (through
+    IOCTL_STORTRACE_RELEASE_RING when mapped).
+
+    When the ring is full, the Policy of the ring decides: either the new
+    record is dropped, or the producer moves Tail past the oldest whole
+    entry (with a compare-exchange, so a reader that raced with it can
+    tell) and takes its space. Entries are only ever retired whole, so the
+    stream never loses sync. A mapped ring always drops the new record.
+
+Environment:
+
+    user and kernel
+
+--*/
+
+#pragma once
+
+#define RING_HEADER_MAGIC       0x474E4952  // "RING"
+#define RING_HEADER_VERSION     1
+#define RING_HEADER_SIZE        4096        // the data area starts here
+
+#define RING_OVERFLOW_DROP_NEWEST       0   // a full ring refuses new records (the default)
+#define RING_OVERFLOW_OVERWRITE_OLDEST  1   // a full ring retires its oldest records
+
+//
+// Cursors are in cache lines of their own: Head is written by the
+// producers, Tail by the consumer
+//
+typedef struct _RING_HEADER {
+    ULONG   Magic;
+    ULONG   Version;
+    ULONG64 Size;                       // of the data area, a power of two
+    ULONG   Policy;                     // RING_OVERFLOW_*
+    ULONG   Reserved;
+    UCHAR   Reserved0[40];
+
+    volatile LONG64 Head;               // offset 64
+    UCHAR   Reserved1[56];
+
+    volatile LONG64 Tail;               // offset 128
+    UCHAR   Reserved2[56];
+
+    volatile LONG64 DroppedRecords;     // offset 192, new records refused, ring full
+    volatile LONG64 DroppedBytes;
+    volatile LONG64 OverwrittenRecords; // oldest records retired, ring full
+    volatile LONG64 OverwrittenBytes;
+    volatile LONG64 HighWater;          // most bytes the ring ever held
+} RING_HEADER, *PRING_HEADER;
+
+typedef struct _RING_ENTRY_HEADER {
+    LONG64  Commit;
+    ULONG64 Timestamp;
+    ULONG   Length;     // of the record following the header
+    ULONG   Reserved;
+} RING_ENTRY_HEADER, *PRING_ENTRY_HEADER;
+
+//
+// Entries start on a RING_ENTRY_ALIGN boundary, so the commit stamp at the
+// start of an entry never wraps around the end of the data area. The rest
+// of the entry may wrap.
+//
+#define RING_ENTRY_ALIGN        sizeof(LONG64)
+#define RING_ENTRY_SIZE(len)    (((sizeof(RING_ENTRY_HEADER) + (len)) + RING_ENTRY_ALIGN - 1) & ~((size_t)RING_ENTRY_ALIGN - 1))
+
+//
+// An entry is committed when its header carries the stamp of its own
+// stream offset. Stale data left over from an earlier lap carries the stamp
+// of another offset, so it cannot be taken for a committed entry.
+//
+#define RING_COMMIT_STAMP(offset)   ((LONG64)((offset) ^ 0x5354525452414345ULL))
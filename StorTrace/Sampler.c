@@ -0,0 +1,257 @@
+/*++
+
+Module Name:
+
+    Sampler.c
+
+Abstract:
+
+    1-in-N and time budgeted sampling of the traced completions. Each
+    processor counts its own commands down to the next sample, so taking
+    a command or skipping it writes nothing shared. With a budget, one
+    processor per window adds up what was seen and sets the rate of the
+    next window.
+
+Environment:
+
+    Kernel-mode Driver Framework
+
+--*/
+
+#include "driver.h"
+
+#include "Sampler.h"
+
+
+//=========================================
+// Data Type Definition
+//=========================================
+
+//
+// Written by its processor only. A command completing at PASSIVE_LEVEL may
+// be preempted and lose a count to another one, which sampling tolerates.
+//
+typedef struct DECLSPEC_CACHEALIGN _SAMPLER_CPU {
+    ULONG   Countdown;      // commands to skip before the next sample
+    ULONG64 Seen;           // commands sampled from, counted with a budget
+} SAMPLER_CPU, *PSAMPLER_CPU;
+
+struct _SAMPLER {
+    volatile LONG   Rate;           // 1 in Rate, as set
+    volatile LONG   Budget;         // records per second, 0 for none
+    volatile LONG   EffectiveRate;  // Rate, raised to keep within Budget
+    ULONG           CpuCount;
+    ULONG64         WindowTicks;
+    volatile LONG64 WindowEnd;      // 0 until the first command after SamplerSet
+    ULONG64         WindowStart;
+    ULONG64         WindowSeen;     // Seen of all processors at WindowStart
+    SAMPLER_CPU     Cpus[ANYSIZE_ARRAY];
+};
+
+
+//=========================================
+// Function Declaration
+//=========================================
+static VOID
+InternalNextWindow(PSAMPLER Sampler, ULONG64 Now);
+
+
+//=========================================
+// Public Function
+//=========================================
+
+PSAMPLER
+SamplerCreate(ULONG64 Frequency)
+/*++
+
+Routine Description:
+
+    Allocate a sampler that takes every command. Frequency is that of
+    the timestamps given to SamplerTake, per second. Called at
+    PASSIVE_LEVEL.
+
+--*/
+{
+    PSAMPLER sampler;
+    ULONG cpuCount = KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+    size_t allocSize = FIELD_OFFSET(SAMPLER, Cpus) + cpuCount * sizeof(SAMPLER_CPU);
+
+    sampler = ExAllocatePoolWithTag(NonPagedPoolNxCacheAligned, allocSize, STORTRACE_POOL_TAG);
+    if (sampler == NULL)
+    {
+        return NULL;
+    }
+
+    RtlZeroMemory(sampler, allocSize);
+    sampler->Rate = 1;
+    sampler->EffectiveRate = 1;
+    sampler->CpuCount = cpuCount;
+    sampler->WindowTicks = Frequency * SAMPLER_WINDOW_MS / 1000;
+
+    return sampler;
+}
+
+VOID
+SamplerDelete(PSAMPLER Sampler)
+{
+    if (Sampler != NULL)
+    {
+        ExFreePoolWithTag(Sampler, STORTRACE_POOL_TAG);
+    }
+}
+
+VOID
+SamplerSet(PSAMPLER Sampler, ULONG Rate, ULONG Budget)
+/*++
+
+Routine Description:
+
+    Sample 1 in Rate commands (0 or 1 for all of them), and, with a
+    Budget, no more than Budget per second. Callable while commands are
+    being sampled.
+
+--*/
+{
+    LONG rate = (Rate > 1 && Rate <= MAXLONG) ? (LONG)Rate : (Rate > 1) ? MAXLONG : 1;
+
+    WriteNoFence(&Sampler->Rate, rate);
+    WriteNoFence(&Sampler->Budget, (Budget <= MAXLONG) ? (LONG)Budget : MAXLONG);
+    WriteNoFence(&Sampler->EffectiveRate, rate);
+
+    // A new budget counts from the next command on
+    WriteNoFence64(&Sampler->WindowEnd, 0);
+}
+
+ULONG
+SamplerGetRate(PSAMPLER Sampler)
+/*++
+
+Routine Description:
+
+    The rate commands are sampled at now, the budget taken into account.
+
+--*/
+{
+    return (ULONG)ReadNoFence(&Sampler->EffectiveRate);
+}
+
+ULONG
+SamplerTake(PSAMPLER Sampler, ULONG64 Now)
+/*++
+
+Routine Description:
+
+    Whether to trace a command that completed at Now. Callable at IRQL <=
+    DISPATCH_LEVEL from any number of processors.
+
+Return Value:
+
+    0 to skip the command, else the number of commands the record stands
+    for (1 when sampling is off).
+
+--*/
+{
+    PSAMPLER_CPU cpu;
+    LONG rate;
+
+    if (ReadNoFence(&Sampler->Budget) == 0 && ReadNoFence(&Sampler->Rate) == 1)
+    {
+        return 1;
+    }
+
+    cpu = &Sampler->Cpus[KeGetCurrentProcessorNumberEx(NULL) % Sampler->CpuCount];
+
+    if (ReadNoFence(&Sampler->Budget) != 0)
+    {
+        cpu->Seen++;
+
+        if ((LONG64)Now >= ReadNoFence64(&Sampler->WindowEnd))
+        {
+            InternalNextWindow(Sampler, Now);
+        }
+    }
+
+    rate = ReadNoFence(&Sampler->EffectiveRate);
+    if (rate <= 1)
+    {
+        return 1;
+    }
+
+    if (cpu->Countdown > 1)
+    {
+        cpu->Countdown--;
+        return 0;
+    }
+
+    cpu->Countdown = (ULONG)rate;
+    return (ULONG)rate;
+}
+
+
+//=========================================
+// Private Function
+//=========================================
+
+VOID
+InternalNextWindow(PSAMPLER Sampler, ULONG64 Now)
+/*++
+
+Routine Description:
+
+    Close the budget window, if no other processor is, and set the rate of
+    the next one from the commands seen during it: the budget's worth of
+    them over a window, at least 1 in Rate. The first window after
+    SamplerSet only lasts a millisecond, to size the load before sampling
+    at the rate as set for long.
+
+--*/
+{
+    LONG64 windowEnd = ReadNoFence64(&Sampler->WindowEnd);
+    ULONG64 nextEnd = Now + ((windowEnd == 0) ? Sampler->WindowTicks / SAMPLER_WINDOW_MS : Sampler->WindowTicks);
+    ULONG64 perWindow = (ULONG64)ReadNoFence(&Sampler->Budget) * SAMPLER_WINDOW_MS / 1000;
+    ULONG64 elapsed;
+    ULONG64 seen = 0;
+    ULONG64 needed;
+    LONG rate = ReadNoFence(&Sampler->Rate);
+
+    if (InterlockedCompareExchange64(&Sampler->WindowEnd, (LONG64)nextEnd, windowEnd) != windowEnd)
+    {
+        return;
+    }
+
+    for (ULONG i = 0; i < Sampler->CpuCount; i++)
+    {
+        seen += ReadNoFence64((volatile LONG64 *)&Sampler->Cpus[i].Seen);
+    }
+
+    seen -= Sampler->WindowSeen;
+    Sampler->WindowSeen += seen;
+    elapsed = Now - Sampler->WindowStart;
+    Sampler->WindowStart = Now;
+
+    // Nothing to go by yet
+    if (windowEnd == 0)
+    {
+        WriteNoFence(&Sampler->EffectiveRate, rate);
+        return;
+    }
+
+    // Per window, whether the last one was short or stayed idle for long
+    if (elapsed != 0)
+    {
+        seen = seen * Sampler->WindowTicks / elapsed;
+    }
+
+    if (perWindow == 0)
+    {
+        perWindow = 1;
+    }
+
+    needed = (seen + perWindow - 1) / perWindow;
+    if (needed > (ULONG64)rate)
+    {
+        rate = (needed < MAXLONG) ? (LONG)needed : MAXLONG;
+    }
+
+    WriteNoFence(&Sampler->EffectiveRate, rate);
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+//
+// Statistical sampling of the completions a device traces, for tracing
+// always on: 1 in Rate commands, and no more than Budget records per
+// second, the rate being raised as needed from one SAMPLER_WINDOW_MS to
+// the next. Each record says how many commands it stands for.
+//
+#define SAMPLER_WINDOW_MS           100
+
+//
+// Optional DWORDs under the service's Parameters key, the sampling of
+// all disks until IOCTL_STORTRACE_SET_SAMPLING changes it
+//
+#define SAMPLE_RATE_VALUE           L"SampleRate"
+#define SAMPLE_BUDGET_VALUE         L"SampleBudget"
+
+typedef struct _SAMPLER SAMPLER, *PSAMPLER;
+
+PSAMPLER
+SamplerCreate(ULONG64 Frequency);
+
+VOID
+SamplerDelete(PSAMPLER Sampler);
+
+VOID
+SamplerSet(PSAMPLER Sampler, ULONG Rate, ULONG Budget);
+
+ULONG
+SamplerGetRate(PSAMPLER Sampler);
+
+ULONG
+SamplerTake(PSAMPLER Sampler, ULONG64 Now);
@@ -0,0 +1,430 @@
+/*++
+
+Module Name:
+
+    TraceBuf.c
+
+Abstract:
+
+    Trace buffer made of one ring, or of one ring per logical processor.
+    Per-processor rings are read back merged in timestamp order.
+
+Environment:
+
+    Kernel-mode Driver Framework
+
+--*/
+
+#include "driver.h"
+
+#include "TraceBuf.h"
+
+
+//=========================================
+// Data Type Definition
+//=========================================
+
+//
+// Ring and the reader's view of its oldest record
+//
+typedef struct _TRACE_BUF_RING {
+    PRING_BUF   Ring;
+    ULONG64     Timestamp;
+    ULONG       Length;
+} TRACE_BUF_RING, *PTRACE_BUF_RING;
+
+struct _TRACE_BUF {
+    BOOLEAN         PerCpu;
+    ULONG           Policy;
+    ULONG           RingCount;
+    size_t          RingSize;
+    TRACE_BUF_RING  Rings[ANYSIZE_ARRAY];
+};
+
+
+//=========================================
+// Function Declaration
+//=========================================
+static size_t
+InternalMerge(PTRACE_BUF TraceBuf, PUCHAR Data, size_t DataLength);
+
+static VOID
+InternalPeekAll(PTRACE_BUF TraceBuf);
+
+static PTRACE_BUF_RING
+InternalOldest(PTRACE_BUF TraceBuf);
+
+
+//=========================================
+// Public Function
+//=========================================
+
+PTRACE_BUF
+TraceBufCreate(size_t Size, BOOLEAN PerCpu, ULONG Policy)
+/*++
+
+Routine Description:
+
+    Allocate a trace buffer of about Size bytes in total. With PerCpu, the
+    size is split between the processors, each ring rounded down to a power
+    of two but not less than TRACE_BUF_MIN_RING_SIZE. Size is capped at
+    TRACE_BUF_MAX_SIZE. Policy is the RING_OVERFLOW_* of the rings. Called
+    at PASSIVE_LEVEL.
+
+--*/
+{
+    PTRACE_BUF traceBuf;
+    ULONG ringCount = 1;
+    size_t ringSize;
+    size_t allocSize;
+
+    if (PerCpu)
+    {
+        ringCount = KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+    }
+
+    if (Size > TRACE_BUF_MAX_SIZE)
+    {
+        Size = TRACE_BUF_MAX_SIZE;
+    }
+
+    ringSize = TRACE_BUF_MIN_RING_SIZE;
+    while (ringSize * 2 <= Size / ringCount)
+    {
+        ringSize *= 2;
+    }
+
+    allocSize = FIELD_OFFSET(TRACE_BUF, Rings) + ringCount * sizeof(TRACE_BUF_RING);
+    traceBuf = ExAllocatePoolWithTag(NonPagedPoolNx, allocSize, STORTRACE_POOL_TAG);
+    if (traceBuf == NULL)
+    {
+        return NULL;
+    }
+
+    RtlZeroMemory(traceBuf, allocSize);
+    traceBuf->PerCpu = PerCpu;
+    traceBuf->Policy = Policy;
+    traceBuf->RingCount = ringCount;
+    traceBuf->RingSize = ringSize;
+
+    for (ULONG i = 0; i < ringCount; i++)
+    {
+        traceBuf->Rings[i].Ring = RingBufCreate(ringSize, Policy);
+        if (traceBuf->Rings[i].Ring == NULL)
+        {
+            TraceBufDelete(traceBuf);
+            return NULL;
+        }
+    }
+
+    DbgPrint("Trace buffer: %d ring(s) of 0x%Ix bytes, %s when full\n", ringCount, ringSize,
+        Policy == RING_OVERFLOW_OVERWRITE_OLDEST ? "overwrite oldest" : "drop newest");
+
+    return traceBuf;
+}
+
+VOID
+TraceBufDelete(PTRACE_BUF TraceBuf)
+{
+    if (TraceBuf == NULL)
+    {
+        return;
+    }
+
+    for (ULONG i = 0; i < TraceBuf->RingCount; i++)
+    {
+        RingBufDelete(TraceBuf->Rings[i].Ring);
+    }
+
+    ExFreePoolWithTag(TraceBuf, STORTRACE_POOL_TAG);
+}
+
+BOOLEAN
+TraceBufPut(PTRACE_BUF TraceBuf, ULONG64 Timestamp, PUCHAR Data, UINT32 DataLength)
+/*++
+
+Routine Description:
+
+    Put one record into the ring of the current processor. Callable at
+    IRQL <= DISPATCH_LEVEL; if the thread migrates to another processor
+    meanwhile it just shares that ring, which is still safe.
+
+    Timestamp is the performance counter value the record carries, per-
+    processor rings are merged back in that order.
+
+--*/
+{
+    ULONG index = 0;
+
+    if (TraceBuf->PerCpu)
+    {
+        index = KeGetCurrentProcessorNumberEx(NULL) % TraceBuf->RingCount;
+    }
+
+    return RingBufPutEx(TraceBuf->Rings[index].Ring, Timestamp, Data, DataLength);
+}
+
+size_t
+TraceBufGet(PTRACE_BUF TraceBuf, PUCHAR Data, size_t DataLength)
+/*++
+
+Routine Description:
+
+    Drain whole records into Data. Only one reader may call this at a time.
+
+Return Value:
+
+    Number of bytes copied.
+
+--*/
+{
+    if (!TraceBuf->PerCpu)
+    {
+        // A mapped ring is read by the process it is mapped into
+        if (TraceBufIsMapped(TraceBuf))
+        {
+            return 0;
+        }
+
+        return RingBufGetEx(TraceBuf->Rings[0].Ring, Data, DataLength, NULL);
+    }
+
+    return InternalMerge(TraceBuf, Data, DataLength);
+}
+
+VOID
+TraceBufGetStats(PTRACE_BUF TraceBuf, PRING_BUF_STATS Stats)
+/*++
+
+Routine Description:
+
+    Overflow counters summed over the rings. HighWater is the fullest any
+    single ring has been, to compare with TraceBufGetRingSize.
+
+--*/
+{
+    RtlZeroMemory(Stats, sizeof(RING_BUF_STATS));
+
+    for (ULONG i = 0; i < TraceBuf->RingCount; i++)
+    {
+        RING_BUF_STATS ring;
+
+        RingBufGetStats(TraceBuf->Rings[i].Ring, &ring);
+
+        if (ring.HighWater > Stats->HighWater)
+        {
+            Stats->HighWater = ring.HighWater;
+        }
+        Stats->DroppedRecords += ring.DroppedRecords;
+        Stats->DroppedBytes += ring.DroppedBytes;
+        Stats->OverwrittenRecords += ring.OverwrittenRecords;
+        Stats->OverwrittenBytes += ring.OverwrittenBytes;
+    }
+}
+
+ULONG64
+TraceBufCount(PTRACE_BUF TraceBuf, PULONG64 Bytes)
+/*++
+
+Routine Description:
+
+    Count the records the rings hold, see RingBufCount.
+
+Return Value:
+
+    Number of records, Bytes receives their length.
+
+--*/
+{
+    ULONG64 records = 0;
+
+    *Bytes = 0;
+
+    for (ULONG i = 0; i < TraceBuf->RingCount; i++)
+    {
+        ULONG64 bytes;
+
+        records += RingBufCount(TraceBuf->Rings[i].Ring, &bytes);
+        *Bytes += bytes;
+    }
+
+    return records;
+}
+
+size_t
+TraceBufGetSize(PTRACE_BUF TraceBuf)
+{
+    return TraceBuf->RingSize * TraceBuf->RingCount;
+}
+
+size_t
+TraceBufGetRingSize(PTRACE_BUF TraceBuf)
+{
+    return TraceBuf->RingSize;
+}
+
+ULONG
+TraceBufGetRingCount(PTRACE_BUF TraceBuf)
+{
+    return TraceBuf->RingCount;
+}
+
+ULONG
+TraceBufGetPolicy(PTRACE_BUF TraceBuf)
+{
+    return TraceBuf->Policy;
+}
+
+ULONG64
+TraceBufMigrate(PTRACE_BUF To, PTRACE_BUF From, PUCHAR Scratch, size_t ScratchLength, PULONG64 Bytes)
+/*++
+
+Routine Description:
+
+    Move the records of From into To, oldest first, for a resize. A record
+    goes to the ring of To with the index of the ring it was in, so per-
+    processor rings keep their share. Records To cannot hold are dropped or
+    overwrite older ones, as To's policy has it. Scratch must hold the
+    longest record. Nothing else may put into or get from either trace
+    buffer meanwhile.
+
+Return Value:
+
+    Number of records moved, Bytes (optional) receives their length.
+
+--*/
+{
+    PTRACE_BUF_RING oldest;
+    ULONG64 records = 0;
+    ULONG64 bytes = 0;
+
+    InternalPeekAll(From);
+
+    while ((oldest = InternalOldest(From)) != NULL)
+    {
+        size_t got = 0;
+
+        if (oldest->Length <= ScratchLength)
+        {
+            got = RingBufGetEx(oldest->Ring, Scratch, oldest->Length, NULL);
+        }
+
+        if (got == 0)
+        {
+            // Cannot be taken, leave the rest behind
+            break;
+        }
+
+        if (RingBufPutEx(To->Rings[(ULONG)(oldest - From->Rings) % To->RingCount].Ring, oldest->Timestamp, Scratch, (UINT32)got))
+        {
+            records++;
+            bytes += got;
+        }
+
+        oldest->Length = RingBufPeek(oldest->Ring, &oldest->Timestamp);
+    }
+
+    if (Bytes)
+    {
+        *Bytes = bytes;
+    }
+
+    return records;
+}
+
+PRING_BUF
+TraceBufGetRing(PTRACE_BUF TraceBuf)
+/*++
+
+Routine Description:
+
+    The ring a reader can consume in place, for RingBufMapUser.
+
+Return Value:
+
+    NULL if the trace buffer is made of per-processor rings, which are only
+    meaningful merged.
+
+--*/
+{
+    return TraceBuf->PerCpu ? NULL : TraceBuf->Rings[0].Ring;
+}
+
+BOOLEAN
+TraceBufIsMapped(PTRACE_BUF TraceBuf)
+{
+    return !TraceBuf->PerCpu && RingBufIsMapped(TraceBuf->Rings[0].Ring);
+}
+
+
+//=========================================
+//  Private function
+//=========================================
+size_t
+InternalMerge(PTRACE_BUF TraceBuf, PUCHAR Data, size_t DataLength)
+/*++
+
+Routine Description:
+
+    K-way merge of the per-processor rings by record timestamp. Each round
+    takes the oldest committed record over all rings; only the ring it was
+    taken from has to be looked at again for the next round.
+
+--*/
+{
+    size_t copied = 0;
+
+    InternalPeekAll(TraceBuf);
+
+    while (TRUE)
+    {
+        PTRACE_BUF_RING oldest = InternalOldest(TraceBuf);
+
+        if (oldest == NULL || copied + oldest->Length > DataLength)
+        {
+            break;
+        }
+
+        // Room for exactly this record, so exactly this record is taken
+        copied += RingBufGetEx(oldest->Ring, Data + copied, oldest->Length, NULL);
+
+        oldest->Length = RingBufPeek(oldest->Ring, &oldest->Timestamp);
+    }
+
+    return copied;
+}
+
+VOID
+InternalPeekAll(PTRACE_BUF TraceBuf)
+{
+    for (ULONG i = 0; i < TraceBuf->RingCount; i++)
+    {
+        PTRACE_BUF_RING ring = &TraceBuf->Rings[i];
+        ring->Length = RingBufPeek(ring->Ring, &ring->Timestamp);
+    }
+}
+
+PTRACE_BUF_RING
+InternalOldest(PTRACE_BUF TraceBuf)
+/*++
+
+Routine Description:
+
+    The ring whose oldest record, as last peeked, is the oldest of all.
+
+--*/
+{
+    PTRACE_BUF_RING oldest = NULL;
+
+    for (ULONG i = 0; i < TraceBuf->RingCount; i++)
+    {
+        PTRACE_BUF_RING ring = &TraceBuf->Rings[i];
+
+        if (ring->Length != 0 && (oldest == NULL || ring->Timestamp < oldest->Timestamp))
+        {
+            oldest = ring;
+        }
+    }
+
+    return oldest;
+}
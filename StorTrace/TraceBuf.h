@@ -0,0 +1,60 @@
+#pragma once
+
+#include "RingBuf.h"
+
+//
+// Trace buffer: the ring(s) capture records go to. Either one ring shared
+// by all processors, or one ring per logical processor so completions on
+// different processors never touch the same ring cursors.
+//
+#define TRACE_BUF_DEFAULT_SIZE      (16 * 1024 * 1024)
+#define TRACE_BUF_MIN_RING_SIZE     (64 * 1024)
+#define TRACE_BUF_MAX_SIZE          (1024 * 1024 * 1024)
+
+//
+// Optional DWORD, size of the trace buffers in bytes: under the service's
+// Parameters key for all disks, in a filtered disk's device key (Device
+// Parameters) for that one
+//
+#define TRACE_BUF_SIZE_VALUE        L"TraceBufferSize"
+
+typedef struct _TRACE_BUF TRACE_BUF, *PTRACE_BUF;
+
+PTRACE_BUF
+TraceBufCreate(size_t Size, BOOLEAN PerCpu, ULONG Policy);
+
+VOID
+TraceBufDelete(PTRACE_BUF TraceBuf);
+
+BOOLEAN
+TraceBufPut(PTRACE_BUF TraceBuf, ULONG64 Timestamp, PUCHAR Data, UINT32 DataLength);
+
+size_t
+TraceBufGet(PTRACE_BUF TraceBuf, PUCHAR Data, size_t DataLength);
+
+VOID
+TraceBufGetStats(PTRACE_BUF TraceBuf, PRING_BUF_STATS Stats);
+
+ULONG64
+TraceBufCount(PTRACE_BUF TraceBuf, PULONG64 Bytes);
+
+size_t
+TraceBufGetSize(PTRACE_BUF TraceBuf);
+
+size_t
+TraceBufGetRingSize(PTRACE_BUF TraceBuf);
+
+ULONG
+TraceBufGetRingCount(PTRACE_BUF TraceBuf);
+
+ULONG
+TraceBufGetPolicy(PTRACE_BUF TraceBuf);
+
+ULONG64
+TraceBufMigrate(PTRACE_BUF To, PTRACE_BUF From, PUCHAR Scratch, size_t ScratchLength, PULONG64 Bytes);
+
+PRING_BUF
+TraceBufGetRing(PTRACE_BUF TraceBuf);
+
+BOOLEAN
+TraceBufIsMapped(PTRACE_BUF TraceBuf);
@@ -0,0 +1,89 @@
+/*++
+
+Module Name:
+
+    TraceRecord.h
+
+Abstract:
+
+    Layout of the trace records returned by reads on the control device,
+    shared by the driver and user applications.
+
+    Records are returned back to back. Each one starts with a
+    TRACE_RECORD_HEADER, followed by the CDB and the sense data, and is
+    padded so that its Length is a multiple of TRACE_RECORD_ALIGN: headers
+    stay naturally aligned, and a reader skips a record by adding Length.
+
+    The header also holds what the driver decoded from the CDB (CdbDecode.h),
+    so readers need not parse it: the operation code, and for the block
+    commands (TRACE_RECORD_FLAG_DECODED) the LBA, the transfer length and
+    the FUA and DPO bits.
+
+    A record of a READ or WRITE request, rather than of a SCSI command, has
+    TRACE_RECORD_FLAG_REQUEST set and a TRACE_RECORD_REQUEST in place of
+    the CDB.
+
+Environment:
+
+    user and kernel
+
+--*/
+
+#pragma once
+
+#include "CdbDecode.h"
+
+#define TRACE_RECORD_MAGIC          0xAFDE  // bytes 0xDE 0xAF
+#define TRACE_RECORD_VERSION        5
+#define TRACE_RECORD_ALIGN          8
+
+typedef struct _TRACE_RECORD_HEADER {
+    USHORT  Magic;          // TRACE_RECORD_MAGIC
+    USHORT  Version;        // TRACE_RECORD_VERSION
+    ULONG   Length;         // of the whole record, header and padding included
+
+    ULONG64 Timestamp;      // performance counter at completion
+    ULONG64 IssueTimestamp; // performance counter when sent down, 0 if unknown
+    ULONG64 Latency;        // Timestamp - IssueTimestamp, in counter ticks
+    ULONG64 SequenceNumber; // per device, starting at 1, gaps are lost records
+
+    ULONG   DeviceId;       // see IOCTL_STORTRACE_LIST_DEVICES
+    LONG    NtStatus;
+    UCHAR   ScsiStatus;
+    UCHAR   CdbLength;
+    UCHAR   SenseLength;
+    UCHAR   Flags;          // TRACE_RECORD_FLAG_*
+    ULONG   SampleRate;     // commands the record stands for, 1 unless sampling
+
+    ULONG64 Lba;            // with TRACE_RECORD_FLAG_DECODED, else 0
+    ULONG   Blocks;         // transfer length, with TRACE_RECORD_FLAG_DECODED, else 0
+    UCHAR   Opcode;         // CDB byte 0, 0 for a request
+    UCHAR   CdbFlags;       // CDB_FLAG_*
+    USHORT  Reserved;
+} TRACE_RECORD_HEADER, *PTRACE_RECORD_HEADER;
+
+#define TRACE_RECORD_FLAG_REQUEST   0x01    // of a READ or WRITE request
+#define TRACE_RECORD_FLAG_DECODED   0x02    // Lba and Blocks are the CDB's
+
+//
+// What a request record holds instead of a CDB. Its header's CdbLength is
+// the size of this, SenseLength and ScsiStatus are 0.
+//
+#define TRACE_RECORD_REQUEST_READ   0x03    // IRP_MJ_READ
+#define TRACE_RECORD_REQUEST_WRITE  0x04    // IRP_MJ_WRITE
+
+typedef struct _TRACE_RECORD_REQUEST {
+    ULONG64 Offset;         // on the disk, in bytes
+    ULONG   Length;         // asked for, in bytes
+    ULONG   Information;    // transferred, in bytes
+    UCHAR   MajorFunction;  // TRACE_RECORD_REQUEST_*
+    UCHAR   Reserved[7];
+} TRACE_RECORD_REQUEST, *PTRACE_RECORD_REQUEST;
+
+#define TRACE_RECORD_SIZE(cdbLength, senseLength) \
+    ((sizeof(TRACE_RECORD_HEADER) + (cdbLength) + (senseLength) + TRACE_RECORD_ALIGN - 1) & ~(TRACE_RECORD_ALIGN - 1))
+
+#define TRACE_RECORD_MAX_SIZE       TRACE_RECORD_SIZE(255, 255)
+
+#define TRACE_RECORD_CDB(record)    ((PUCHAR)(record) + sizeof(TRACE_RECORD_HEADER))
+#define TRACE_RECORD_SENSE(record)  (TRACE_RECORD_CDB(record) + (record)->CdbLength)